@@ -21,6 +21,8 @@
 
 #include <kasmpasswd.h>
 #include <rfb/PixelBuffer.h>
+#include <rfb/Region.h>
+#include <rfb/ScaledBuffer.h>
 #include <stdint.h>
 #include <map>
 #include <string>
@@ -34,7 +36,9 @@ namespace network {
     GetAPIMessager(const char *passwdfile_);
 
     // from main thread
-    void mainUpdateScreen(rfb::PixelBuffer *pb);
+    // changed is the area damaged since the last successful call. Returns
+    // false if the screenshot is busy and the call should be repeated later.
+    bool mainUpdateScreen(rfb::PixelBuffer *pb, const rfb::Region &changed);
     void mainUpdateBottleneckStats(const char userid[], const char stats[]);
     void mainClearBottleneckStats(const char userid[]);
     void mainUpdateServerFrameStats(uint8_t changedPerc, uint32_t all,
@@ -45,6 +49,8 @@ namespace network {
                                     uint16_t w, uint16_t h);
     void mainUpdateClientFrameStats(const char userid[], uint32_t render, uint32_t all,
                                     uint32_t ping);
+    void mainUpdateEncCacheStats(uint64_t hits, uint64_t misses,
+                                 uint64_t evictions, uint64_t bytes);
     void mainUpdateUserInfo(const uint8_t ownerConn, const uint8_t numUsers);
 
     void mainUpdateSessionsInfo(std::string newSessionsInfo);
@@ -105,7 +111,14 @@ namespace network {
     pthread_mutex_t screenMutex;
     rfb::ManagedPixelBuffer screenPb;
     uint16_t screenW, screenH;
+    const rfb::PixelBuffer *screenSrc;
+    // Changes whenever the contents do, so that clients can tell if they
+    // already have the current image
     uint64_t screenHash;
+    uint64_t screenGen, screenSalt;
+
+    // For scaled screenshots, only redone where the screen changed
+    rfb::ScaledBuffer screenScaled;
 
     std::vector<uint8_t> cachedJpeg;
     uint16_t cachedW, cachedH;
@@ -135,6 +148,11 @@ namespace network {
       uint16_t h;
       uint8_t changedPerc;
 
+      uint64_t cachehits;
+      uint64_t cachemisses;
+      uint64_t cacheevictions;
+      uint64_t cachebytes;
+
       uint8_t inprogress;
     };
     std::map<std::string, clientFrameStats_t> clientFrameStats;
@@ -28,6 +28,8 @@
 #include <rfb/JpegCompressor.h>
 #include <rfb/xxhash.h>
 #include <stdio.h>
+#include <time.h>
+#include <unistd.h>
 #include <string>
 #include <utility>
 
@@ -55,7 +57,8 @@ static const struct TightJPEGConfiguration conf[10] = {
 };
 
 GetAPIMessager::GetAPIMessager(const char *passwdfile_): passwdfile(passwdfile_),
-					screenW(0), screenH(0), screenHash(0),
+					screenW(0), screenH(0), screenSrc(nullptr), screenHash(0),
+					screenGen(0),
 					cachedW(0), cachedH(0), cachedQ(0),
 					ownerConnected(0), activeUsers(0),
 					sessionsInfo( "{\"users\":[]}"){
@@ -67,41 +70,76 @@ GetAPIMessager::GetAPIMessager(const char *passwdfile_): passwdfile(passwdfile_)
 	pthread_mutex_init(&userInfoMutex, NULL);
 
 	serverFrameStats.inprogress = 0;
+	serverFrameStats.cachehits = serverFrameStats.cachemisses = 0;
+	serverFrameStats.cacheevictions = serverFrameStats.cachebytes = 0;
+
+	// Ids from a previous run must not match this one's
+	screenSalt = ((uint64_t) time(NULL) << 32) ^ getpid();
 }
 
 // from main thread
-void GetAPIMessager::mainUpdateScreen(rfb::PixelBuffer *pb) {
+bool GetAPIMessager::mainUpdateScreen(rfb::PixelBuffer *pb, const Region &changed) {
     if (!pb)
-        return;
+        return true;
 
     if (pthread_mutex_trylock(&screenMutex))
-        return;
+        return false;
 
-    int stride;
     TRACE_STOPWATCH(shotstart);
 
-    const rdr::U8 *const buf = pb->getBuffer(pb->getRect(), &stride);
+    const Rect full = pb->getRect();
+    bool resized = false;
 
     if (pb->width() != screenW || pb->height() != screenH) {
-        screenHash = 0;
         screenW = pb->width();
         screenH = pb->height();
         screenPb.setPF(pb->getPF());
         screenPb.setSize(screenW, screenH);
 
-        cachedW = cachedH = cachedQ = 0;
-        cachedJpeg.clear();
+        resized = true;
+    }
+
+    // Only the damaged area can differ, unless we're looking at a different
+    // buffer altogether (DLP blacking, a new framebuffer)
+    std::vector<Rect> rects;
+    if (resized || pb != screenSrc)
+        rects.push_back(full);
+    else
+        changed.intersect(full).get_rects(&rects);
+
+    Region dirty;
+    for (const Rect &r: rects) {
+        int srcstride, dststride;
+        const rdr::U8 *src = pb->getBuffer(r, &srcstride);
+        rdr::U8 *dst = screenPb.getBufferRW(r, &dststride);
+        const unsigned bytes = r.width() * 4;
+        bool differs = false;
+
+        for (int y = r.tl.y; y < r.br.y; y++) {
+            if (resized || memcmp(dst, src, bytes)) {
+                memcpy(dst, src, bytes);
+                differs = true;
+            }
+            src += srcstride * 4;
+            dst += dststride * 4;
+        }
+
+        screenPb.commitBufferRW(r);
+
+        if (differs)
+            dirty.assign_union(r);
     }
 
-    const uint64_t newHash = XXH64(buf, pb->area() * 4, 0);
-    if (newHash != screenHash) {
+    screenSrc = pb;
+
+    if (resized || !dirty.is_empty()) {
         cachedW = cachedH = cachedQ = 0;
         cachedJpeg.clear();
 
-        screenHash = newHash;
-        rdr::U8 *rw = screenPb.getBufferRW(screenPb.getRect(), &stride);
-        memcpy(rw, buf, screenW * screenH * 4);
-        screenPb.commitBufferRW(screenPb.getRect());
+        screenGen++;
+        screenHash = XXH64(&screenGen, sizeof(screenGen), screenSalt);
+
+        screenScaled.damage(dirty);
     }
 
     if (!pthread_mutex_lock(&frameStatMutex)) {
@@ -111,6 +149,8 @@ void GetAPIMessager::mainUpdateScreen(rfb::PixelBuffer *pb) {
 
     TRACE_STOPWATCH_PRINT_MS(vlog, shotstart);
     pthread_mutex_unlock(&screenMutex);
+
+    return true;
 }
 
 void GetAPIMessager::mainUpdateBottleneckStats(const char userid[], const char stats[]) {
@@ -158,6 +198,20 @@ void GetAPIMessager::mainUpdateServerFrameStats(uint8_t changedPerc,
 	pthread_mutex_unlock(&frameStatMutex);
 }
 
+void GetAPIMessager::mainUpdateEncCacheStats(uint64_t hits, uint64_t misses,
+	uint64_t evictions, uint64_t bytes) {
+
+	if (pthread_mutex_lock(&frameStatMutex))
+		return;
+
+	serverFrameStats.cachehits = hits;
+	serverFrameStats.cachemisses = misses;
+	serverFrameStats.cacheevictions = evictions;
+	serverFrameStats.cachebytes = bytes;
+
+	pthread_mutex_unlock(&frameStatMutex);
+}
+
 void GetAPIMessager::mainUpdateClientFrameStats(const char userid[], uint32_t render,
 	uint32_t all, uint32_t ping) {
 
@@ -221,9 +275,8 @@ uint8_t *GetAPIMessager::netGetScreenshot(uint16_t w, uint16_t h,
     if (w == cachedW && h == cachedH && q == cachedQ) {
 		if (dedup) {
 			// Return the hash of the unchanged image
-			sprintf((char *) staging, "%" PRIx64, screenHash);
+			len = sprintf((char *) staging, "%016" PRIx64, screenHash);
 			ret = staging;
-			len = 16;
 		} else {
 			// Return the cached image
 			len = cachedJpeg.size();
@@ -250,7 +303,8 @@ uint8_t *GetAPIMessager::netGetScreenshot(uint16_t w, uint16_t h,
 			const uint16_t neww = screenW * diff;
 			const uint16_t newh = screenH * diff;
 
-			const PixelBuffer *scaled = progressiveBilinearScale(&screenPb, neww, newh, diff);
+			const PixelBuffer *scaled = screenScaled.scale(&screenPb, neww, newh, diff,
+			                                               ScaledBuffer::Progressive);
             const rdr::U8 *const buf = scaled->getBuffer(scaled->getRect(), &stride);
 
 			jc.compress(buf, stride, scaled->getRect(),
@@ -259,7 +313,6 @@ uint8_t *GetAPIMessager::netGetScreenshot(uint16_t w, uint16_t h,
 			cachedJpeg.resize(jc.length());
 			memcpy(&cachedJpeg[0], jc.data(), jc.length());
 
-			delete scaled;
 
 			vlog.info("Returning scaled screenshot");
 		} else {
@@ -619,7 +672,8 @@ void GetAPIMessager::netGetFrameStats(char *buf, uint32_t len) {
 	"server_side" : [
 		{ "process_name": "Analysis", "time": 20 },
 		{ "process_name": "TightWEBPEncoder", "time": 20, "count": 64, "area": 12 },
-		{ "process_name": "TightJPEGEncoder", "time": 20, "count": 64, "area": 12 }
+		{ "process_name": "TightJPEGEncoder", "time": 20, "count": 64, "area": 12 },
+		{ "process_name": "EncCache", "hits": 120, "misses": 8, "evictions": 0, "bytes": 524288 }
 	],
 	"client_side" : [
 		{
@@ -670,7 +724,8 @@ void GetAPIMessager::netGetFrameStats(char *buf, uint32_t len) {
 	           "\t\t{ \"process_name\": \"Screenshot\", \"time\": %u },\n"
 	           "\t\t{ \"process_name\": \"Encoding_total\", \"time\": %u, \"videoscaling\": %u },\n"
 	           "\t\t{ \"process_name\": \"TightJPEGEncoder\", \"time\": %u, \"count\": %u, \"area\": %u },\n"
-	           "\t\t{ \"process_name\": \"TightWEBPEncoder\", \"time\": %u, \"count\": %u, \"area\": %u }\n"
+	           "\t\t{ \"process_name\": \"TightWEBPEncoder\", \"time\": %u, \"count\": %u, \"area\": %u },\n"
+	           "\t\t{ \"process_name\": \"EncCache\", \"hits\": %llu, \"misses\": %llu, \"evictions\": %llu, \"bytes\": %llu }\n"
 	           "\t],\n",
 	           serverFrameStats.analysis,
 	           serverFrameStats.shot,
@@ -681,7 +736,11 @@ void GetAPIMessager::netGetFrameStats(char *buf, uint32_t len) {
 	           serverFrameStats.jpegarea,
 	           serverFrameStats.webp,
 	           serverFrameStats.nwebp,
-	           serverFrameStats.webparea);
+	           serverFrameStats.webparea,
+	           (unsigned long long) serverFrameStats.cachehits,
+	           (unsigned long long) serverFrameStats.cachemisses,
+	           (unsigned long long) serverFrameStats.cacheevictions,
+	           (unsigned long long) serverFrameStats.cachebytes);
 
 	fprintf(f, "\t\"client_side\" : [\n");
 
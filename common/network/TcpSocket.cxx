@@ -126,18 +126,40 @@ int network::getSockPort(int sock)
   }
 }
 
-WebSocket::WebSocket(int sock) : Socket(sock)
-{
-}
-
-char* WebSocket::getPeerAddress() {
+// The websocket proxy names its end of the socket user@ip_time, with
+// WS_PREFRAMED_TAG added when it expects us to do the framing
+static char* getProxyName(int fd, bool *preframed) {
   struct sockaddr_un addr;
   socklen_t len = sizeof(struct sockaddr_un);
-  if (getpeername(getFd(), (struct sockaddr *) &addr, &len) != 0) {
+  if (getpeername(fd, (struct sockaddr *) &addr, &len) != 0) {
     vlog.error("unable to get peer name for socket");
+    *preframed = false;
     return rfb::strDup("websocket");
   }
-  return rfb::strDup(addr.sun_path + 1);
+
+  char *name = rfb::strDup(addr.sun_path + 1);
+  const size_t namelen = strlen(name);
+  const size_t taglen = strlen(WS_PREFRAMED_TAG);
+
+  *preframed = namelen > taglen && !strcmp(name + namelen - taglen, WS_PREFRAMED_TAG);
+  if (*preframed)
+    name[namelen - taglen] = '\0';
+
+  return name;
+}
+
+WebSocket::WebSocket(int sock) : Socket(sock)
+{
+  bool preframed;
+  rfb::CharArray name(getProxyName(sock, &preframed));
+
+  if (preframed)
+    outStream().setWebsocketFrames(true);
+}
+
+char* WebSocket::getPeerAddress() {
+  bool preframed;
+  return getProxyName(getFd(), &preframed);
 }
 
 char* WebSocket::getPeerEndpoint() {
@@ -41,6 +41,11 @@ static rfb::LogWriter vlog("WebUdp");
 static WuHost *host = NULL;
 
 rfb::IntParameter udpSize("udpSize", "UDP packet data size", 1296, 500, 1400);
+rfb::IntParameter udpPacingRate("udpPacingRate",
+				"Per-client UDP send rate in Mbit/s, bursts above it are spread out. "
+				"Needs the fq qdisc, 0 to send at once", 0, 0, 10000);
+rfb::IntParameter udpPacingBurst("udpPacingBurst",
+				"Datagrams sent back to back when pacing UDP", 16, 1, 64);
 
 extern settings_t settings;
 
@@ -94,61 +99,190 @@ void *udpserver(void *nport) {
 	return NULL;
 }
 
-// Send one packet, split into N UDP-sized pieces
-static uint8_t udpsend(WuClient *client, const uint8_t *data, unsigned len, uint32_t *id,
-			const uint32_t *frame) {
+UdpStream::UdpStream(): OutStream(), client(NULL), total_len(0), id(0), failed(false),
+	                frame(0), batched(0), corked(false), fec(false), fecGroup(16) {
+	ptr = data;
+	end = data + UDPSTREAM_BUFSIZE;
+
+	memset(&pacer, 0, sizeof(pacer));
+	memset(&fecStats, 0, sizeof(fecStats));
+
+	srand(time(NULL));
+}
+
+// Room for one datagram in the batch
+uint8_t *UdpStream::queue(unsigned len) {
+	if (batched == UDPSTREAM_BATCH)
+		submit();
+
+	batchPtrs[batched] = batch[batched];
+	batchLens[batched] = len;
+
+	return batch[batched++];
+}
+
+// Queue one packet, split into N UDP-sized pieces. A piece is
+//	id, index, pieces, hash, frame, data
+// and with FEC, after each group of data pieces comes its parity
+//	id, 0x80000000 | group, pieces, hash, frame, groupLen, lenXor, data
+// where data is the XOR of the group's pieces, zero padded to the first
+// one's length, and lenXor that of their lengths.
+void UdpStream::flush() {
 	const uint32_t DATA_MAX = udpSize;
+	const uint8_t *src = data;
+	unsigned len = ptr - data;
+	total_len += len;
+
+	ptr = data;
+
+	if (!client) {
+		vlog.error("Tried to send udp without a client");
+		return;
+	}
 
-	uint8_t buf[1400 + sizeof(uint32_t) * 5];
 	const uint32_t pieces = (len / DATA_MAX) + ((len % DATA_MAX) ? 1 : 0);
 
+	bool useFec;
+	unsigned maxGroup;
+	{
+		std::lock_guard<std::mutex> lock(fecLock);
+		useFec = fec;
+		maxGroup = fecGroup;
+	}
+
+	// Groups of equal size, no larger than the loss allows
+	const uint32_t groups = useFec && pieces > 1 ? (pieces + maxGroup - 1) / maxGroup : 0;
+	const uint32_t groupLen = groups ? (pieces + groups - 1) / groups : 0;
+	uint32_t parityLen = 0, lenXor = 0;
+	uint32_t parities = 0;
+
 	uint32_t i;
 
 	for (i = 0; i < pieces; i++) {
 		const unsigned curlen = len > DATA_MAX ? DATA_MAX : len;
-		const uint32_t hash = XXH64(data, curlen, 0);
+		const uint32_t hash = XXH64(src, curlen, 0);
+		uint8_t * const buf = queue(curlen + sizeof(uint32_t) * 5);
 
-		memcpy(buf, id, sizeof(uint32_t));
+		memcpy(buf, &id, sizeof(uint32_t));
 		memcpy(&buf[4], &i, sizeof(uint32_t));
 		memcpy(&buf[8], &pieces, sizeof(uint32_t));
 		memcpy(&buf[12], &hash, sizeof(uint32_t));
-		memcpy(&buf[16], frame, sizeof(uint32_t));
+		memcpy(&buf[16], &frame, sizeof(uint32_t));
+
+		memcpy(&buf[20], src, curlen);
+
+		if (groups) {
+			if (i % groupLen == 0) {
+				parityLen = curlen;
+				lenXor = 0;
+				memset(parity, 0, parityLen);
+			}
+
+			for (unsigned k = 0; k < curlen; k++)
+				parity[k] ^= src[k];
+			lenXor ^= curlen;
+
+			if (i % groupLen == groupLen - 1 || i == pieces - 1) {
+				const uint32_t group = 0x80000000 | (i / groupLen);
+				const uint32_t phash = XXH64(parity, parityLen, 0);
+				uint8_t * const pbuf = queue(parityLen + sizeof(uint32_t) * 7);
+
+				memcpy(pbuf, &id, sizeof(uint32_t));
+				memcpy(&pbuf[4], &group, sizeof(uint32_t));
+				memcpy(&pbuf[8], &pieces, sizeof(uint32_t));
+				memcpy(&pbuf[12], &phash, sizeof(uint32_t));
+				memcpy(&pbuf[16], &frame, sizeof(uint32_t));
+				memcpy(&pbuf[20], &groupLen, sizeof(uint32_t));
+				memcpy(&pbuf[24], &lenXor, sizeof(uint32_t));
+
+				memcpy(&pbuf[28], parity, parityLen);
+				parities++;
+			}
+		}
 
-		memcpy(&buf[20], data, curlen);
-		data += curlen;
+		src += curlen;
 		len -= curlen;
+	}
+
+	id++;
 
-		if (WuHostSendBinary(host, client, buf, curlen + sizeof(uint32_t) * 5) < 0)
-			return 1;
+	{
+		std::lock_guard<std::mutex> lock(fecLock);
+		fecStats.sent += pieces + parities;
+		fecStats.parity += parities;
 	}
 
-	(*id)++;
+	if (!corked)
+		submit();
+}
+
+void UdpStream::setFec(bool enable) {
+	std::lock_guard<std::mutex> lock(fecLock);
 
-	return 0;
+	fec = enable;
+	fecGroup = 16;
+	memset(&fecStats, 0, sizeof(fecStats));
 }
 
-UdpStream::UdpStream(): OutStream(), client(NULL), total_len(0), id(0), failed(false),
-	                frame(0) {
-	ptr = data;
-	end = data + UDPSTREAM_BUFSIZE;
+bool UdpStream::hasFec() const {
+	std::lock_guard<std::mutex> lock(fecLock);
 
-	srand(time(NULL));
+	return fec;
 }
 
-void UdpStream::flush() {
-	const unsigned len = ptr - data;
-	total_len += len;
+UdpStream::FecStats UdpStream::getFecStats() const {
+	std::lock_guard<std::mutex> lock(fecLock);
 
-	if (client) {
-		if (udpsend(client, data, len, &id, &frame)) {
-			vlog.error("Error sending udp, client gone?");
-			failed = true;
-		}
-	} else {
-		vlog.error("Tried to send udp without a client");
+	return fecStats;
+}
+
+void UdpStream::lossReport(uint32_t received, uint32_t lost,
+                           uint32_t recovered, uint32_t failed) {
+	std::lock_guard<std::mutex> lock(fecLock);
+
+	fecStats.received += received;
+	fecStats.lost += lost;
+	fecStats.recovered += recovered;
+	fecStats.failed += failed;
+
+	if (received + lost) {
+		const float loss = lost / (float) (received + lost);
+		fecStats.loss = fecStats.loss * 0.7f + loss * 0.3f;
 	}
 
-	ptr = data;
+	// Aim for under one loss per ten groups, a group can only
+	// recover one piece
+	const float group = fecStats.loss > 0 ? 0.1f / fecStats.loss : 32;
+
+	if (group < 4)
+		fecGroup = 4;
+	else if (group > 32)
+		fecGroup = 32;
+	else
+		fecGroup = group;
+}
+
+void UdpStream::cork(bool enable) {
+	corked = enable;
+
+	if (!corked)
+		submit();
+}
+
+void UdpStream::submit() {
+	if (!batched)
+		return;
+
+	pacer.rate = (uint32_t) udpPacingRate * 125000;
+	pacer.burst = udpPacingBurst;
+
+	if (client && WuHostSendBinaryBatch(host, client, batchPtrs, batchLens,
+	                                    batched, &pacer) < 0) {
+		vlog.error("Error sending udp, client gone?");
+		failed = true;
+	}
+
+	batched = 0;
 }
 
 void UdpStream::overrun(size_t needed) {
@@ -20,14 +20,17 @@
 #define __NETWORK_UDP_H__
 
 #include <stdint.h>
+#include <mutex>
 #include <rdr/OutStream.h>
+#include <network/webudp/WuHost.h>
 
 void *udpserver(void *unused);
-typedef struct WuClient WuClient;
 
 namespace network {
 
 	#define UDPSTREAM_BUFSIZE (1024 * 1024)
+	// Datagrams collected before they are handed to the host in one go
+	#define UDPSTREAM_BATCH 64
 
 	class UdpStream: public rdr::OutStream {
 		public:
@@ -44,15 +47,54 @@ namespace network {
 				frame = in;
 			}
 
+			// With FEC, each packet of two or more pieces also gets XOR
+			// parity pieces, one per group, so the client can rebuild a
+			// lost piece instead of dropping the whole rect. The groups are
+			// smaller the more loss the client reports.
+			void setFec(bool enable);
+			void lossReport(uint32_t received, uint32_t lost,
+			                uint32_t recovered, uint32_t failed);
+
+			struct FecStats {
+				uint64_t sent, parity;
+				uint64_t received, lost, recovered, failed;
+				float loss;
+			};
+
+			// Reports arrive on the main loop while updates may be
+			// written elsewhere, so this is a copy
+			FecStats getFecStats() const;
+			bool hasFec() const;
+
+			// While corked, flushed packets are only queued, and they all
+			// go out in one batch on uncorking. Done around each update, so
+			// a whole frame takes a handful of syscalls.
+			void cork(bool enable);
+
 			bool isFailed() const;
 			void clearFailed();
 		private:
+			void submit();
+			uint8_t *queue(unsigned len);
+
 			uint8_t data[UDPSTREAM_BUFSIZE];
 			WuClient *client;
 			size_t total_len;
 			uint32_t id;
 			bool failed;
 			uint32_t frame;
+			uint8_t batch[UDPSTREAM_BATCH][1400 + sizeof(uint32_t) * 7];
+			const uint8_t *batchPtrs[UDPSTREAM_BATCH];
+			int32_t batchLens[UDPSTREAM_BATCH];
+			unsigned batched;
+			bool corked;
+			WuPacer pacer;
+			bool fec;
+			unsigned fecGroup;
+			FecStats fecStats;
+			// Guards fec, fecStats and fecGroup
+			mutable std::mutex fecLock;
+			uint8_t parity[1400];
 	};
 }
 
@@ -0,0 +1,323 @@
+/* Copyright (C) 2026 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "assetcache.h"
+#include "websocket.h"
+
+extern settings_t settings;
+
+// Largest file kept in memory
+#define ASSET_MAX_FILE (4 * 1024 * 1024)
+// Memory budget for all kept files and their variants
+#define ASSET_MAX_BYTES (64 * 1024 * 1024)
+#define ASSET_BUCKETS 256
+
+static struct {
+    pthread_mutex_t lock;
+    struct asset_t *buckets[ASSET_BUCKETS];
+    size_t bytes;
+    uint64_t uses;
+} cache = { PTHREAD_MUTEX_INITIALIZER, { NULL }, 0, 0 };
+
+static unsigned pathhash(const char *path) {
+    unsigned h = 5381;
+    while (*path)
+        h = h * 33 + (unsigned char) *path++;
+    return h % ASSET_BUCKETS;
+}
+
+static size_t assetbytes(const struct asset_t *a) {
+    return (a->data ? a->size : 0) + a->gzlen + a->brlen;
+}
+
+static uint8_t samefile(const struct asset_t *a, const struct stat *st) {
+    return a->dev == st->st_dev && a->ino == st->st_ino &&
+           a->size == st->st_size &&
+           a->mtime.tv_sec == st->st_mtim.tv_sec &&
+           a->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static uint8_t compressible(const char *mime) {
+    return !strncmp(mime, "text/", 5) ||
+           !strcmp(mime, "application/javascript") ||
+           !strcmp(mime, "application/json") ||
+           !strcmp(mime, "image/svg+xml");
+}
+
+static void freeasset(struct asset_t *a) {
+    free(a->data);
+    free(a->gz);
+    free(a->br);
+    free(a);
+}
+
+static uint8_t *readall(const int fd, const size_t len) {
+    uint8_t *buf = malloc(len ? len : 1);
+    size_t done = 0;
+
+    if (!buf)
+        return NULL;
+
+    while (done < len) {
+        const ssize_t ret = read(fd, buf + done, len - done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            free(buf);
+            return NULL;
+        }
+        done += ret;
+    }
+
+    return buf;
+}
+
+// A variant prepared by the www build, e.g. index.html.br. Only used if it
+// is at least as new as the file itself, so a stale one is never served.
+static uint8_t *readvariant(const struct asset_t *a, const char *ext,
+                            size_t *len) {
+    char name[PATH_MAX];
+    struct stat st;
+    uint8_t *buf;
+    int fd;
+
+    if (snprintf(name, sizeof(name), "%s.%s", a->path, ext) >= (int) sizeof(name))
+        return NULL;
+
+    fd = open(name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    buf = NULL;
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size < a->size &&
+        (st.st_mtim.tv_sec > a->mtime.tv_sec ||
+         (st.st_mtim.tv_sec == a->mtime.tv_sec &&
+          st.st_mtim.tv_nsec >= a->mtime.tv_nsec))) {
+        buf = readall(fd, st.st_size);
+        if (buf)
+            *len = st.st_size;
+    }
+
+    close(fd);
+    return buf;
+}
+
+static uint8_t *gzip(const uint8_t *src, const size_t srclen, size_t *len) {
+    z_stream zs;
+    uint8_t *buf;
+
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, 9, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+
+    const size_t bound = deflateBound(&zs, srclen);
+    buf = malloc(bound);
+    if (!buf) {
+        deflateEnd(&zs);
+        return NULL;
+    }
+
+    zs.next_in = (Bytef *) src;
+    zs.avail_in = srclen;
+    zs.next_out = buf;
+    zs.avail_out = bound;
+
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&zs);
+        free(buf);
+        return NULL;
+    }
+
+    *len = zs.total_out;
+    deflateEnd(&zs);
+
+    return buf;
+}
+
+static struct asset_t *loadasset(const char path[], const char *mime,
+                                 const uint8_t keep) {
+    struct asset_t *a;
+    struct stat st;
+    struct tm tm;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+
+    a = calloc(1, sizeof(struct asset_t));
+    strcpy(a->path, path);
+    a->mime = mime;
+    a->dev = st.st_dev;
+    a->ino = st.st_ino;
+    a->size = st.st_size;
+    a->mtime = st.st_mtim;
+    a->refs = 1;
+
+    snprintf(a->etag, sizeof(a->etag), "\"%" PRIx64 "-%" PRIx64 "\"",
+             (uint64_t) st.st_size,
+             (uint64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec);
+    gmtime_r(&st.st_mtim.tv_sec, &tm);
+    strftime(a->lastmod, sizeof(a->lastmod), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+    if (keep && st.st_size <= ASSET_MAX_FILE) {
+        a->data = readall(fd, st.st_size);
+
+        if (a->data && compressible(mime) && st.st_size > 256) {
+            a->br = readvariant(a, "br", &a->brlen);
+            a->gz = readvariant(a, "gz", &a->gzlen);
+            if (!a->gz)
+                a->gz = gzip(a->data, st.st_size, &a->gzlen);
+
+            // Not worth the Content-Encoding if it barely shrinks
+            if (a->gz && a->gzlen > (size_t) st.st_size / 10 * 9) {
+                free(a->gz);
+                a->gz = NULL;
+                a->gzlen = 0;
+            }
+        }
+    }
+
+    close(fd);
+
+    handler_msg("asset cache loaded %s, %" PRIu64 " bytes, gzip %zu, brotli %zu%s\n",
+                path, (uint64_t) a->size, a->gzlen, a->brlen,
+                a->data ? "" : ", served from disk");
+
+    return a;
+}
+
+// Called with the lock held
+static void unref(struct asset_t *a) {
+    if (!--a->refs)
+        freeasset(a);
+}
+
+// Drop least recently used entries until extra bytes fit the budget
+static void evict(const size_t extra) {
+    while (cache.bytes + extra > ASSET_MAX_BYTES) {
+        struct asset_t **oldest = NULL, **prev, *a;
+        unsigned i;
+
+        for (i = 0; i < ASSET_BUCKETS; i++) {
+            for (prev = &cache.buckets[i]; (a = *prev); prev = &a->next) {
+                if (!oldest || a->lastuse < (*oldest)->lastuse)
+                    oldest = prev;
+            }
+        }
+
+        if (!oldest)
+            return;
+
+        a = *oldest;
+        *oldest = a->next;
+        cache.bytes -= assetbytes(a);
+        unref(a);
+    }
+}
+
+const struct asset_t *asset_get(const char path[], const char *mime,
+                                const uint8_t keep) {
+    struct asset_t **prev, *a, *fresh;
+    struct stat st;
+    const unsigned bucket = pathhash(path);
+
+    if (strlen(path) >= PATH_MAX)
+        return NULL;
+
+    // Only files held in memory are kept in the table, the rest is just a
+    // stat away anyway
+    if (keep && !stat(path, &st) && S_ISREG(st.st_mode)) {
+        pthread_mutex_lock(&cache.lock);
+        for (a = cache.buckets[bucket]; a; a = a->next) {
+            if (!strcmp(a->path, path) && samefile(a, &st)) {
+                a->refs++;
+                a->lastuse = ++cache.uses;
+                pthread_mutex_unlock(&cache.lock);
+                return a;
+            }
+        }
+        pthread_mutex_unlock(&cache.lock);
+    }
+
+    // Reading and compressing happens outside the lock, so a cold file
+    // doesn't hold up requests for the others
+    fresh = loadasset(path, mime, keep);
+    if (!fresh || !fresh->data || assetbytes(fresh) > ASSET_MAX_BYTES)
+        return fresh;
+
+    pthread_mutex_lock(&cache.lock);
+
+    // Replace whatever version we had, unless someone beat us to it
+    for (prev = &cache.buckets[bucket]; (a = *prev); prev = &a->next) {
+        if (strcmp(a->path, path))
+            continue;
+
+        if (a->dev == fresh->dev && a->ino == fresh->ino &&
+            a->size == fresh->size &&
+            a->mtime.tv_sec == fresh->mtime.tv_sec &&
+            a->mtime.tv_nsec == fresh->mtime.tv_nsec) {
+            a->refs++;
+            a->lastuse = ++cache.uses;
+            pthread_mutex_unlock(&cache.lock);
+            unref(fresh);
+            return a;
+        }
+
+        *prev = a->next;
+        cache.bytes -= assetbytes(a);
+        unref(a);
+        break;
+    }
+
+    evict(assetbytes(fresh));
+
+    fresh->refs++;
+    fresh->lastuse = ++cache.uses;
+    fresh->next = cache.buckets[bucket];
+    cache.buckets[bucket] = fresh;
+    cache.bytes += assetbytes(fresh);
+
+    pthread_mutex_unlock(&cache.lock);
+
+    return fresh;
+}
+
+void asset_release(const struct asset_t *asset) {
+    pthread_mutex_lock(&cache.lock);
+    unref((struct asset_t *) asset);
+    pthread_mutex_unlock(&cache.lock);
+}
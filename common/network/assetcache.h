@@ -0,0 +1,75 @@
+/* Copyright (C) 2026 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#ifndef __NETWORK_ASSET_CACHE_H__
+#define __NETWORK_ASSET_CACHE_H__
+
+#include <limits.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A file under the http dir, as last seen on disk. Small files are kept in
+ * memory together with their gzip and brotli variants, larger ones only
+ * have their metadata cached and are sent from disk.
+ *
+ * Entries are immutable once returned. A changed file gets a new entry;
+ * the old one lives on until its last user releases it.
+ */
+struct asset_t {
+    char path[PATH_MAX];
+    const char *mime;
+
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+
+    char etag[48];
+    char lastmod[32];
+
+    // NULL when not kept in memory
+    uint8_t *data;
+    // Compressed variants, NULL if none or not worth it
+    uint8_t *gz, *br;
+    size_t gzlen, brlen;
+
+    unsigned refs;
+    uint64_t lastuse;
+    struct asset_t *next;
+};
+
+/*
+ * Returns the current version of the regular file at path, loading it if
+ * needed, or NULL if there is no such readable file. With keep unset the
+ * contents are never held in memory. The result must be released.
+ */
+const struct asset_t *asset_get(const char path[], const char *mime,
+                                const uint8_t keep);
+void asset_release(const struct asset_t *asset);
+
+#ifdef __cplusplus
+} // extern C
+#endif
+
+#endif
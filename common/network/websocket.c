@@ -20,12 +20,15 @@
 #include <dirent.h>
 #include <inttypes.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <time.h>
 #include <fcntl.h>  // daemonizing
 #include <pwd.h>
 #include <grp.h>
@@ -36,6 +39,7 @@
 #include <openssl/md5.h> /* md5 hash */
 #include <openssl/sha.h> /* sha1 hash */
 #include "websocket.h"
+#include "assetcache.h"
 #include "jsonescape.h"
 #include <network/Blacklist.h>
 
@@ -44,7 +48,6 @@
  *
  *   Warning: not thread safe
  */
-int pipe_error = 0;
 settings_t settings;
 
 extern int wakeuppipe[2];
@@ -71,6 +74,8 @@ void fatal(char *msg)
 }
 
 #define WS_MAX_BUF_SIZE 4096
+// Time a kept-alive HTTP connection may wait for its next request
+#define WS_KEEPALIVE_TIMEOUT 15
 
 // 2022-05-18 19:51:26,810 [INFO] websocket 0: 71.62.44.0 172.12.15.5 - "GET /api/get_frame_stats?client=auto HTTP/1.1" 403 2
 static void weblog(const unsigned code, const unsigned websocket,
@@ -895,9 +900,120 @@ static void dirlisting(ws_ctx_t *ws_ctx, const char fullpath[], const char path[
     weblog(200, wsthread_handler_id, 0, origip, ip, user, 1, path, totallen);
 }
 
-static void servefile(ws_ctx_t *ws_ctx, const char *in, const char * const user,
-                      const char * const ip, const char * const origip) {
+// Copies the value of a request header into out, returns 0 if it's missing
+static uint8_t getheader(const char *req, const char *name, char *out,
+                         const unsigned outlen) {
+    const unsigned namelen = strlen(name);
+    const char *line = strstr(req, "\r\n");
+
+    while (line && line[2] != '\r') {
+        line += 2;
+        if (!strncasecmp(line, name, namelen) && line[namelen] == ':') {
+            const char *val = line + namelen + 1;
+            while (*val == ' ' || *val == '\t')
+                val++;
+            const char *end = strchr(val, '\r');
+            if (!end)
+                return 0;
+            unsigned len = end - val;
+            if (len >= outlen)
+                len = outlen - 1;
+            memcpy(out, val, len);
+            out[len] = '\0';
+            return 1;
+        }
+        line = strstr(line, "\r\n");
+    }
+
+    return 0;
+}
+
+// Whether a comma-separated header value lists token, and doesn't refuse it
+// with q=0
+static uint8_t hastoken(const char *list, const char *token) {
+    const unsigned toklen = strlen(token);
+
+    while (*list) {
+        while (*list == ' ' || *list == ',')
+            list++;
+
+        const char *end = strchr(list, ',');
+        if (!end)
+            end = list + strlen(list);
+
+        if (!strncasecmp(list, token, toklen) &&
+            (list + toklen == end || list[toklen] == ';' || list[toklen] == ' ')) {
+            const char *q = strstr(list + toklen, "q=");
+            if (q && q < end && strtod(q + 2, NULL) <= 0)
+                return 0;
+            return 1;
+        }
+
+        list = end;
+    }
+
+    return 0;
+}
+
+static uint8_t send_all(ws_ctx_t *ws_ctx, const void *buf, size_t len) {
+    const uint8_t *ptr = buf;
+
+    while (len) {
+        const ssize_t ret = ws_send(ws_ctx, ptr, len);
+        if (ret <= 0) {
+            if (ret < 0 && errno == EINTR && !ws_ctx->ssl)
+                continue;
+            return 0;
+        }
+        ptr += ret;
+        len -= ret;
+    }
+
+    return 1;
+}
+
+// Large files go straight from the page cache when there's no TLS in the way
+static uint8_t send_from_disk(ws_ctx_t *ws_ctx, const char path[], uint64_t len) {
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t ret;
+
+    if (fd < 0)
+        return 0;
+
+    while (len) {
+        if (ws_ctx->ssl) {
+            ret = read(fd, ws_ctx->cout_buf, len < BUFSIZE ? len : BUFSIZE);
+            if (ret > 0 && !send_all(ws_ctx, ws_ctx->cout_buf, ret))
+                ret = -1;
+        } else {
+            ret = sendfile(ws_ctx->sockfd, fd, NULL, len < (1 << 30) ? len : (1 << 30));
+        }
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        len -= ret;
+    }
+
+    close(fd);
+    return !len;
+}
+
+/*
+ * Serves a file from the http dir. The web client is the same few files on
+ * every connect, so they come from the asset cache, compressed when the
+ * browser takes it, and revalidated with a 304 when it already has them.
+ * Returns 1 if the connection may stay open for another request.
+ */
+static uint8_t servefile(ws_ctx_t *ws_ctx, const char *in, const char * const user,
+                         const char * const ip, const char * const origip,
+                         uint8_t keepalive) {
     char buf[WS_MAX_BUF_SIZE], path[PATH_MAX], fullpath[PATH_MAX];
+    char hdr[256];
+    const char *req = in;
+
+    path[0] = '\0';
 
     //fprintf(stderr, "http servefile input '%s'\n", in);
 
@@ -914,6 +1030,13 @@ static void servefile(ws_ctx_t *ws_ctx, const char *in, const char * const user,
         goto nope;
     }
 
+    // HTTP/1.1 keeps the connection by default, 1.0 only if asked to
+    if (getheader(req, "Connection", hdr, sizeof(hdr)))
+        keepalive = keepalive && !hastoken(hdr, "close") &&
+                    (strncmp(end, " HTTP/1.0", 9) || hastoken(hdr, "keep-alive"));
+    else
+        keepalive = keepalive && strncmp(end, " HTTP/1.0", 9);
+
     end = memchr(in, '?', len);
     if (end)
         len = end - in;
@@ -940,41 +1063,96 @@ static void servefile(ws_ctx_t *ws_ctx, const char *in, const char * const user,
     if (dir) {
         closedir(dir);
         dirlisting(ws_ctx, fullpath, buf, user, ip, origip);
-        return;
+        return 0;
     }
 
-    FILE *f = fopen(fullpath, "r");
-    if (!f) {
+    // User files under Downloads/ come and go, only the web client is
+    // worth keeping in memory
+    const struct asset_t *asset = asset_get(fullpath, name2mime(path),
+                                            !strcasestr(path, "Downloads/"));
+    if (!asset) {
         handler_msg("file not found or insufficient permissions\n");
         goto nope;
     }
 
-    fseeko(f, 0, SEEK_END);
-    const uint64_t filesize = ftello(f);
-    rewind(f);
+    const uint8_t *body = asset->data;
+    uint64_t bodylen = asset->size;
+    const char *encoding = NULL, *tagsuffix = "";
+
+    if (asset->br || asset->gz) {
+        if (!getheader(req, "Accept-Encoding", hdr, sizeof(hdr)))
+            hdr[0] = '\0';
+
+        if (asset->br && hastoken(hdr, "br")) {
+            body = asset->br;
+            bodylen = asset->brlen;
+            encoding = "br";
+            tagsuffix = "-br";
+        } else if (asset->gz && hastoken(hdr, "gzip")) {
+            body = asset->gz;
+            bodylen = asset->gzlen;
+            encoding = "gzip";
+            tagsuffix = "-gz";
+        }
+    }
 
-    sprintf(buf, "HTTP/1.1 200 OK\r\n"
+    // Each content-coding is a different representation, so it gets its
+    // own validator: the asset's tag with a suffix inside the quotes
+    char etag[sizeof(asset->etag) + 8];
+    sprintf(etag, "%.*s%s\"", (int) strlen(asset->etag) - 1, asset->etag,
+            tagsuffix);
+
+    uint8_t fresh = 0;
+    if (getheader(req, "If-None-Match", hdr, sizeof(hdr)))
+        fresh = !strcmp(hdr, "*") || strstr(hdr, etag);
+    else if (getheader(req, "If-Modified-Since", hdr, sizeof(hdr)))
+        fresh = !strcmp(hdr, asset->lastmod);
+
+    char alivehdr[32] = "", lenhdr[48] = "";
+    if (keepalive)
+        sprintf(alivehdr, "Keep-Alive: timeout=%u\r\n", WS_KEEPALIVE_TIMEOUT);
+    if (!fresh)
+        sprintf(lenhdr, "Content-length: %" PRIu64 "\r\n", bodylen);
+
+    sprintf(buf, "HTTP/1.1 %s\r\n"
                  "Server: KasmVNC/4.0\r\n"
-                 "Connection: close\r\n"
+                 "Connection: %s\r\n"
+                 "%s"
                  "Content-type: %s\r\n"
-                 "Content-length: %" PRIu64 "\r\n"
+                 "%s"
+                 "%s%s%s"
+                 "%s"
+                 "ETag: %s\r\n"
+                 "Last-Modified: %s\r\n"
+                 "Cache-Control: no-cache\r\n"
                  "%s"
                  "\r\n",
-                 name2mime(path), filesize, extra_headers ? extra_headers : "");
+                 fresh ? "304 Not Modified" : "200 OK",
+                 keepalive ? "keep-alive" : "close", alivehdr,
+                 asset->mime, lenhdr,
+                 encoding ? "Content-Encoding: " : "", encoding ? encoding : "",
+                 encoding ? "\r\n" : "",
+                 asset->br || asset->gz ? "Vary: Accept-Encoding\r\n" : "",
+                 etag, asset->lastmod,
+                 extra_headers ? extra_headers : "");
     const unsigned hdrlen = strlen(buf);
-    ws_send(ws_ctx, buf, hdrlen);
 
     //fprintf(stderr, "http servefile output '%s'\n", buf);
 
-    unsigned count;
-    while ((count = fread(buf, 1, WS_MAX_BUF_SIZE, f))) {
-        ws_send(ws_ctx, buf, count);
+    uint8_t sent = send_all(ws_ctx, buf, hdrlen);
+    if (sent && !fresh) {
+        if (body)
+            sent = send_all(ws_ctx, body, bodylen);
+        else
+            sent = send_from_disk(ws_ctx, fullpath, bodylen);
     }
-    fclose(f);
 
-    weblog(200, wsthread_handler_id, 0, origip, ip, user, 1, path, hdrlen + filesize);
+    asset_release(asset);
+
+    weblog(fresh ? 304 : 200, wsthread_handler_id, 0, origip, ip, user, 1, path,
+           hdrlen + (fresh ? 0 : bodylen));
 
-    return;
+    return sent && keepalive;
 nope:
     sprintf(buf, "HTTP/1.1 404 Not Found\r\n"
                  "Server: KasmVNC/4.0\r\n"
@@ -985,6 +1163,7 @@ nope:
                  "404", extra_headers ? extra_headers : "");
     ws_send(ws_ctx, buf, strlen(buf));
     weblog(404, wsthread_handler_id, 0, origip, ip, user, 1, path, strlen(buf));
+    return 0;
 }
 
 static uint8_t allUsersPresent(const struct kasmpasswd_t * const inset) {
@@ -1803,7 +1982,16 @@ timeout:
     return 1;
 }
 
-ws_ctx_t *do_handshake(int sock, char * const ip) {
+// Worker accounting for file and API requests, see the pool below
+static uint8_t http_begin(void);
+static void http_end(void);
+
+/*
+ * Reads and answers one request. A websocket upgrade returns the context
+ * for the proxy. A static file served on a keep-alive connection leaves the
+ * context in *kept, to be passed back in for the next request.
+ */
+ws_ctx_t *do_handshake(int sock, char * const ip, ws_ctx_t **kept) {
     char handshake[16 * 1024], response[4096], sha1[29], trailer[17];
     char *scheme, *pre;
     headers_t *headers;
@@ -1811,14 +1999,22 @@ ws_ctx_t *do_handshake(int sock, char * const ip) {
     ws_ctx_t * ws_ctx;
     char *response_protocol;
 
+    if (*kept) {
+        ws_ctx = *kept;
+        *kept = NULL;
+        scheme = ws_ctx->ssl ? "wss" : "ws";
+        goto request;
+    }
+
     // Peek, but don't read the data
     len = recv(sock, handshake, 1024, MSG_PEEK);
-    handshake[len] = 0;
-    if (len == 0) {
+    if (len <= 0) {
         handler_msg("ignoring empty handshake\n");
         return NULL;
-    } else if ((bcmp(handshake, "\x16", 1) == 0) ||
-               (bcmp(handshake, "\x80", 1) == 0)) {
+    }
+    handshake[len] = 0;
+    if ((bcmp(handshake, "\x16", 1) == 0) ||
+        (bcmp(handshake, "\x80", 1) == 0)) {
         // SSL
         if (!settings.cert) {
             handler_msg("SSL connection but no cert specified\n");
@@ -1843,6 +2039,8 @@ ws_ctx_t *do_handshake(int sock, char * const ip) {
         scheme = "ws";
         handler_msg("using plain (not SSL) socket\n");
     }
+
+request:
     offset = 0;
     for (i = 0; i < 10; i++) {
         /* (offset + 1): reserve one byte for the trailing '\0' */
@@ -2019,8 +2217,27 @@ ws_ctx_t *do_handshake(int sock, char * const ip) {
 
     //handler_msg("handshake: %s\n", handshake);
     if (!parse_handshake(ws_ctx, handshake)) {
+        uint8_t keep = 0;
+
         handler_emsg("Invalid WS request, maybe a HTTP one\n");
 
+        // These can take a while, and must leave workers for handshakes
+        if (!http_begin()) {
+            handler_emsg("All workers busy, refusing HTTP request\n");
+            sprintf(response, "HTTP/1.1 503 Service Unavailable\r\n"
+                    "Server: KasmVNC/4.0\r\n"
+                    "Connection: close\r\n"
+                    "Retry-After: 1\r\n"
+                    "Content-type: text/plain\r\n"
+                    "%s"
+                    "\r\n"
+                    "503 Service Unavailable", extra_headers ? extra_headers : "");
+            ws_send(ws_ctx, response, strlen(response));
+            weblog(503, wsthread_handler_id, 0, origip, ip, inuser, 1, url, strlen(response));
+            free_ws_ctx(ws_ctx);
+            return NULL;
+        }
+
         if (strstr(handshake, "/api/")) {
             handler_emsg("HTTP request under /api/\n");
 
@@ -2041,10 +2258,21 @@ ws_ctx_t *do_handshake(int sock, char * const ip) {
             }
         }
 
-        if (settings.httpdir && settings.httpdir[0])
-            servefile(ws_ctx, handshake, inuser, ip, origip);
+        // Pipelined requests aren't supported, so only keep the connection
+        // if nothing past this request was read
+        if (settings.httpdir && settings.httpdir[0] &&
+            servefile(ws_ctx, handshake, inuser, ip, origip,
+                      strstr(handshake, "\r\n\r\n") + 4 == handshake + offset))
+            keep = 1;
 
 done:
+        http_end();
+
+        if (keep) {
+            *kept = ws_ctx;
+            return NULL;
+        }
+
         free_ws_ctx(ws_ctx);
         return NULL;
     }
@@ -2085,34 +2313,110 @@ done:
     return ws_ctx;
 }
 
-void proxy_handler(ws_ctx_t *ws_ctx);
-
 __thread unsigned wsthread_handler_id;
 
-void *subthread(void *ptr) {
+/*
+ * Connection handling
+ *
+ * New connections wait in the accept thread's epoll set until the client
+ * sends something, so idle sockets don't tie up anything. The handshake,
+ * and any plain HTTP or API request, is then handled start to finish by
+ * one of a pool of workers. Websocket connections are finally handed
+ * over to the proxy reactor, while keep-alive HTTP connections go back to
+ * the accept thread to wait for their next request.
+ *
+ * File and API requests may be slow, so they never get the last
+ * WS_RESERVED_WORKERS workers: the pool grows to keep those free for
+ * handshakes, shrinking back once the extra workers go idle, and past
+ * WS_MAX_WORKERS such requests are refused instead.
+ */
+
+// Handshake and HTTP request workers
+#define WS_WORKERS 8
+// Workers always left for handshakes
+#define WS_RESERVED_WORKERS 2
+// The most the pool grows to
+#define WS_MAX_WORKERS 64
+// Time allowed for the handshake and HTTP requests on a worker
+#define WS_REQUEST_TIMEOUT 10
+// Time a new connection may stay silent
+#define WS_IDLE_TIMEOUT 30
+
+struct wsqueue_t {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct wspass_t *head, *tail;
+};
+
+static struct wsqueue_t wsqueue = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL
+};
+
+// Protected by the queue lock
+static struct {
+    unsigned total, http;
+} wsworkers;
+
+// Kept-alive connections on their way back to the accept thread
+static struct {
+    pthread_mutex_t lock;
+    struct wspass_t *head;
+} wsparked = { PTHREAD_MUTEX_INITIALIZER, NULL };
+
+static int wsepfd = -1;
+
+static void park_client(struct wspass_t * const pass) {
+    pass->since = time(NULL);
+    pass->ready = 0;
+
+    // Listed before it's watched, so the accept thread always finds it
+    pthread_mutex_lock(&wsparked.lock);
+    pass->next = wsparked.head;
+    wsparked.head = pass;
+    pthread_mutex_unlock(&wsparked.lock);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = pass;
+    epoll_ctl(wsepfd, EPOLL_CTL_ADD, pass->csock, &ev);
+}
 
-    struct wspass_t * const pass = ptr;
+// Returns 1 if the connection was parked for another request
+static uint8_t handle_client(struct wspass_t * const pass) {
 
     const int csock = pass->csock;
+    const struct timeval tout = { WS_REQUEST_TIMEOUT, 0 };
     wsthread_handler_id = pass->id;
 
     ws_ctx_t *ws_ctx;
+    char ip[64];
+
+    // A stalled client must not keep the worker forever
+    setsockopt(csock, SOL_SOCKET, SO_RCVTIMEO, &tout, sizeof(tout));
+    setsockopt(csock, SOL_SOCKET, SO_SNDTIMEO, &tout, sizeof(tout));
+
+    // Data already decrypted by OpenSSL won't wake up epoll
+    do {
+        memcpy(ip, pass->ip, sizeof(ip));
+        ws_ctx = do_handshake(csock, ip, &pass->ctx);
+    } while (!ws_ctx && pass->ctx && pass->ctx->ssl && SSL_pending(pass->ctx->ssl));
+
+    if (pass->ctx) {
+        park_client(pass);
+        return 1;
+    }
 
-    ws_ctx = do_handshake(csock, pass->ip);
     if (ws_ctx == NULL) {
         handler_msg("No connection after handshake\n");
-        goto out;   // Child process exits
+        goto out;
     }
 
-    memcpy(ws_ctx->ip, pass->ip, sizeof(pass->ip));
+    memcpy(ws_ctx->ip, ip, sizeof(ip));
 
-    proxy_handler(ws_ctx);
-    if (pipe_error) {
-        handler_emsg("Closing due to SIGPIPE\n");
-    }
-out:
-    free((void *) pass);
+    if (proxy_handler(ws_ctx))
+        return 0; // The proxy reactor owns it now
 
+out:
     if (ws_ctx) {
         ws_socket_free(ws_ctx);
         free_ws_ctx(ws_ctx);
@@ -2121,30 +2425,119 @@ out:
         close(csock);
     }
     handler_msg("handler exit\n");
+    return 0;
+}
+
+static void *worker(void *unused) {
+    struct wspass_t *pass;
+    struct timespec deadline;
+
+    while (1) {
+        pthread_mutex_lock(&wsqueue.lock);
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += WS_IDLE_TIMEOUT;
+        while (!wsqueue.head) {
+            if (pthread_cond_timedwait(&wsqueue.cond, &wsqueue.lock, &deadline) != ETIMEDOUT ||
+                wsqueue.head)
+                continue;
+
+            // Workers added for a burst of requests go away after it
+            if (wsworkers.total > WS_WORKERS &&
+                wsworkers.total - wsworkers.http > WS_RESERVED_WORKERS) {
+                wsworkers.total--;
+                pthread_mutex_unlock(&wsqueue.lock);
+                return NULL;
+            }
+
+            deadline.tv_sec += WS_IDLE_TIMEOUT;
+        }
+
+        pass = wsqueue.head;
+        wsqueue.head = pass->next;
+        if (!wsqueue.head)
+            wsqueue.tail = NULL;
+        pthread_mutex_unlock(&wsqueue.lock);
+
+        if (!handle_client(pass))
+            free(pass);
+    }
 
     return NULL;
 }
 
-void *start_server(void *unused) {
+// Called with the queue lock held
+static void start_worker(void) {
+    pthread_t tid;
+
+    if (pthread_create(&tid, NULL, worker, NULL)) {
+        wserr("Failed to start a worker\n");
+        return;
+    }
+
+    pthread_detach(tid);
+    wsworkers.total++;
+}
+
+// Returns 0 if a file or API request can't be served without eating into
+// the workers kept for handshakes
+static uint8_t http_begin(void) {
+    uint8_t ok = 1;
+
+    pthread_mutex_lock(&wsqueue.lock);
+
+    // This worker is one of those not serving a request yet
+    if (wsworkers.total - wsworkers.http - 1 < WS_RESERVED_WORKERS) {
+        if (wsworkers.total < WS_MAX_WORKERS)
+            start_worker();
+        if (wsworkers.total - wsworkers.http - 1 < WS_RESERVED_WORKERS)
+            ok = 0;
+    }
+
+    if (ok)
+        wsworkers.http++;
+
+    pthread_mutex_unlock(&wsqueue.lock);
+
+    return ok;
+}
+
+static void http_end(void) {
+    pthread_mutex_lock(&wsqueue.lock);
+    wsworkers.http--;
+    pthread_mutex_unlock(&wsqueue.lock);
+}
+
+static void queue_client(struct wspass_t * const pass) {
+    pass->next = NULL;
+
+    pthread_mutex_lock(&wsqueue.lock);
+    if (wsqueue.tail)
+        wsqueue.tail->next = pass;
+    else
+        wsqueue.head = pass;
+    wsqueue.tail = pass;
+    pthread_cond_signal(&wsqueue.cond);
+    pthread_mutex_unlock(&wsqueue.lock);
+}
+
+static void accept_clients(const int epfd, struct wspass_t **waiting) {
     int csock;
     struct sockaddr_in cli_addr;
     socklen_t clilen;
 
-//    printf("Waiting for connections on %s:%d\n",
-//            settings.listen_host, settings.listen_port);
-
     while (1) {
         clilen = sizeof(cli_addr);
-        pipe_error = 0;
-        do {
-            csock = accept(settings.listen_sock,
-                           (struct sockaddr *) &cli_addr,
-                           &clilen);
-        } while (csock == -1 && errno == EINTR);
+        csock = accept4(settings.listen_sock,
+                        (struct sockaddr *) &cli_addr,
+                        &clilen, SOCK_CLOEXEC);
 
         if (csock < 0) {
-            error("ERROR on accept");
-            continue;
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                error("ERROR on accept");
+            return;
         }
         struct wspass_t *pass = calloc(1, sizeof(struct wspass_t));
         inet_ntop(cli_addr.sin_family, &cli_addr.sin_addr, pass->ip, sizeof(pass->ip));
@@ -2155,19 +2548,118 @@ void *start_server(void *unused) {
                     pass->ip);
         fprintf(stderr, "%s%s", logbuf[0], logbuf[1]);
 
-        pthread_t tid;
         pass->id = settings.handler_id;
         pass->csock = csock;
+        pass->since = time(NULL);
+
+        settings.handler_id += 1;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.ptr = pass;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, csock, &ev)) {
+            error("ERROR adding client");
+            close(csock);
+            free(pass);
+            continue;
+        }
+
+        pass->next = *waiting;
+        *waiting = pass;
+    }
+}
+
+void *start_server(void *unused) {
+    struct epoll_event events[64];
+    struct wspass_t *waiting = NULL;
+    time_t lastcheck = time(NULL);
+    unsigned i;
+    int epfd, n;
 
-        pthread_attr_t attr;
-        pthread_attr_init(&attr);
-        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+//    printf("Waiting for connections on %s:%d\n",
+//            settings.listen_host, settings.listen_port);
 
-        pthread_create(&tid, &attr, subthread, pass);
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1)
+        cores = 1;
 
-        pthread_attr_destroy(&attr);
+    proxy_reactor_start(cores < 4 ? cores : 4);
 
-        settings.handler_id += 1;
+    pthread_mutex_lock(&wsqueue.lock);
+    for (i = 0; i < WS_WORKERS; i++)
+        start_worker();
+    pthread_mutex_unlock(&wsqueue.lock);
+
+    const int flags = fcntl(settings.listen_sock, F_GETFL, 0);
+    fcntl(settings.listen_sock, F_SETFL, flags | O_NONBLOCK);
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+        fatal("epoll_create1()");
+    wsepfd = epfd;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, settings.listen_sock, &ev);
+
+    while (1) {
+        do {
+            n = epoll_wait(epfd, events, 64, 1000);
+        } while (n == -1 && errno == EINTR);
+
+        struct wspass_t *pass;
+
+        for (i = 0; i < (unsigned) n; i++) {
+            pass = events[i].data.ptr;
+
+            if (!pass) {
+                accept_clients(epfd, &waiting);
+                continue;
+            }
+
+            // It has something to say, give it to a worker
+            epoll_ctl(epfd, EPOLL_CTL_DEL, pass->csock, NULL);
+            pass->ready = 1;
+        }
+
+        // Pick up the keep-alive connections the workers are done with
+        pthread_mutex_lock(&wsparked.lock);
+        while ((pass = wsparked.head)) {
+            wsparked.head = pass->next;
+            pass->next = waiting;
+            waiting = pass;
+        }
+        pthread_mutex_unlock(&wsparked.lock);
+
+        // Unlink the ones handed off above and drop the ones that never
+        // said anything
+        const time_t now = time(NULL);
+        const uint8_t check = now != lastcheck;
+        struct wspass_t **prev = &waiting;
+        lastcheck = now;
+
+        while ((pass = *prev)) {
+            if (pass->ready) {
+                *prev = pass->next;
+                queue_client(pass);
+            } else if (check && now - pass->since >
+                       (pass->ctx ? WS_KEEPALIVE_TIMEOUT : WS_IDLE_TIMEOUT)) {
+                *prev = pass->next;
+                wsthread_handler_id = pass->id;
+                handler_msg("client never sent a request, closing\n");
+                epoll_ctl(epfd, EPOLL_CTL_DEL, pass->csock, NULL);
+                if (pass->ctx) {
+                    ws_socket_free(pass->ctx);
+                    free_ws_ctx(pass->ctx);
+                } else {
+                    close(pass->csock);
+                }
+                free(pass);
+            } else {
+                prev = &pass->next;
+            }
+        }
     }
     handler_msg("websockify exit\n");
 
@@ -1,5 +1,6 @@
 #include <openssl/ssl.h>
 #include <stdint.h>
+#include <time.h>
 #include "GetAPIEnums.h"
 #include "datelog.h"
 #include "kasmpasswd.h"
@@ -33,6 +34,10 @@ Sec-WebSocket-Protocol: %s\r\n\
 #define OPCODE_TEXT    0x01
 #define OPCODE_BINARY  0x02
 
+// Tags the proxy's socket name when the VNC server writes the websocket
+// frames itself, which the proxy then passes through untouched
+#define WS_PREFRAMED_TAG "#ws"
+
 typedef struct {
     char path[1024+1];
     char host[1024+1];
@@ -66,6 +71,12 @@ struct wspass_t {
     int csock;
     unsigned id;
     char ip[64];
+
+    time_t since;
+    uint8_t ready;
+    // Set while a keep-alive connection waits for its next request
+    ws_ctx_t *ctx;
+    struct wspass_t *next;
 };
 
 struct kasmpasswd_entry_t;
@@ -116,8 +127,13 @@ typedef struct {
 extern "C" {
 #endif
 
+void fatal(char *msg);
+
 int resolve_host(struct in_addr *sin_addr, const char *hostname);
 
+void ws_socket_free(ws_ctx_t *ctx);
+void free_ws_ctx(ws_ctx_t *ctx);
+
 ssize_t ws_recv(ws_ctx_t *ctx, void *buf, size_t len);
 
 ssize_t ws_send(ws_ctx_t *ctx, const void *buf, size_t len);
@@ -164,6 +180,10 @@ int decode_hybi(unsigned char *src, size_t srclength,
 
 void *start_server(void *unused);
 
+/* websockify.c */
+void proxy_reactor_start(unsigned count);
+int proxy_handler(ws_ctx_t *ws_ctx);
+
 #ifdef __cplusplus
 } // extern C
 #endif
@@ -8,6 +8,7 @@
  * as taken from http://docs.python.org/dev/library/ssl.html#certificates
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <limits.h>
 #include <getopt.h>
@@ -16,12 +17,15 @@
 #include <sys/un.h>
 #include <netinet/in.h>
 #include <netdb.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <openssl/err.h>
 #include "websocket.h"
 
 /*
@@ -35,197 +39,500 @@ char USAGE[] = "Usage: [options] " \
                "  --ssl-only         disallow non-encrypted connections";
 */
 
-extern int pipe_error;
 extern settings_t settings;
 
-static void do_proxy(ws_ctx_t *ws_ctx, int target) {
-    fd_set rlist, wlist, elist;
-    struct timeval tv;
-    int maxfd, client = ws_ctx->sockfd;
-    unsigned int opcode, left, ret;
+/*
+ * Proxy reactor
+ *
+ * Once the handshake is done, a connection only shuffles data between the
+ * websocket and the VNC server's internal socket. Rather than keeping a
+ * thread blocked on each of them, they are spread over a few threads, each
+ * running its own epoll set. A connection stays on the same thread for its
+ * whole life, so its state needs no locking.
+ */
+
+#define REACTOR_MAX_EVENTS 64
+#define REACTOR_MAX_ROUNDS 8
+
+enum {
+    PROXY_CLIENT = 0,
+    PROXY_TARGET = 1,
+};
+
+// What the TLS layer needs before the last read or write can continue
+enum {
+    SSL_READ_WANTS_WRITE = 1,
+    SSL_WRITE_WANTS_READ = 2,
+};
+
+typedef struct proxy_conn_t proxy_conn_t;
+
+typedef struct {
+    proxy_conn_t *conn;
+    int side;
+    uint32_t events;
+} proxy_end_t;
+
+struct proxy_conn_t {
+    ws_ctx_t *ws_ctx;
+    int target;
+    unsigned id;
+
     unsigned int tout_start, tout_end, cout_start, cout_end;
     unsigned int tin_end;
-    ssize_t len, bytes;
 
-    tout_start = tout_end = cout_start = cout_end =
-    tin_end = 0;
-    maxfd = client > target ? client+1 : target+1;
+    uint8_t preframed;
+    uint8_t ssl_want;
+    uint8_t closing;
+    uint8_t again;
 
-    while (1) {
-        tv.tv_sec = 1;
-        tv.tv_usec = 0;
+    proxy_end_t ends[2];
+    proxy_conn_t *next;
+};
 
-        FD_ZERO(&rlist);
-        FD_ZERO(&wlist);
-        FD_ZERO(&elist);
+typedef struct {
+    int epfd;
+    int wakefd;
+    pthread_mutex_t lock;
+    proxy_conn_t *incoming;
+} reactor_t;
 
-        FD_SET(client, &elist);
-        FD_SET(target, &elist);
+static reactor_t *reactors;
+static unsigned num_reactors, next_reactor;
 
-        if (tout_end == tout_start) {
-            // Nothing queued for target, so read from client
-            FD_SET(client, &rlist);
-        } else {
-            // Data queued for target, so write to it
-            FD_SET(target, &wlist);
-        }
-        if (cout_end == cout_start) {
-            // Nothing queued for client, so read from target
-            FD_SET(target, &rlist);
-        } else {
-            // Data queued for client, so write to it
-            FD_SET(client, &wlist);
-        }
+static void set_nonblock(int fd) {
+    const int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
 
-        do {
-            ret = select(maxfd, &rlist, &wlist, &elist, &tv);
-        } while (ret == -1 && errno == EINTR);
-        if (pipe_error) { break; }
+// Returns the number of bytes, 0 on close, -1 on error and -2 if it would block
+static ssize_t client_recv(proxy_conn_t *c, void *buf, size_t len) {
+    ssize_t ret;
 
-        if (FD_ISSET(target, &elist)) {
-            handler_emsg("target exception\n");
-            break;
-        }
-        if (FD_ISSET(client, &elist)) {
-            handler_emsg("client exception\n");
-            break;
-        }
+    if (!c->ws_ctx->ssl) {
+        ret = recv(c->ws_ctx->sockfd, buf, len, 0);
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return -2;
+        return ret;
+    }
 
-        if (ret == -1) {
-            handler_emsg("select(): %s\n", strerror(errno));
-            break;
-        } else if (ret == 0) {
-            //handler_emsg("select timeout\n");
-            continue;
-        }
+    // Other connections on this thread may have left errors behind, which
+    // would confuse SSL_get_error()
+    ERR_clear_error();
+    c->ssl_want &= ~SSL_READ_WANTS_WRITE;
+    ret = SSL_read(c->ws_ctx->ssl, buf, len);
+    if (ret > 0)
+        return ret;
+
+    switch (SSL_get_error(c->ws_ctx->ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+            return -2;
+        case SSL_ERROR_WANT_WRITE:
+            c->ssl_want |= SSL_READ_WANTS_WRITE;
+            return -2;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+static ssize_t client_send(proxy_conn_t *c, const void *buf, size_t len) {
+    ssize_t ret;
+
+    if (!c->ws_ctx->ssl) {
+        ret = send(c->ws_ctx->sockfd, buf, len, MSG_NOSIGNAL);
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return -2;
+        return ret;
+    }
+
+    ERR_clear_error();
+    c->ssl_want &= ~SSL_WRITE_WANTS_READ;
+    ret = SSL_write(c->ws_ctx->ssl, buf, len);
+    if (ret > 0)
+        return ret;
+
+    switch (SSL_get_error(c->ws_ctx->ssl, ret)) {
+        case SSL_ERROR_WANT_WRITE:
+            return -2;
+        case SSL_ERROR_WANT_READ:
+            c->ssl_want |= SSL_WRITE_WANTS_READ;
+            return -2;
+        default:
+            return -1;
+    }
+}
+
+// Moves as much data as possible without blocking. Returns 0 when the
+// connection is done.
+static int proxy_pump(proxy_conn_t *c) {
+    ws_ctx_t *ws_ctx = c->ws_ctx;
+    unsigned int opcode = 0, left = 0;
+    unsigned rounds;
+    ssize_t len, bytes;
+    int progress = 1;
+
+    for (rounds = 0; progress && rounds < REACTOR_MAX_ROUNDS; rounds++) {
+        progress = 0;
 
-        if (FD_ISSET(target, &wlist)) {
-            len = tout_end-tout_start;
-            bytes = send(target, ws_ctx->tout_buf + tout_start, len, 0);
-            if (pipe_error) { break; }
-            if (bytes < 0) {
+        if (c->tout_end != c->tout_start) {
+            len = c->tout_end - c->tout_start;
+            bytes = send(c->target, ws_ctx->tout_buf + c->tout_start, len, MSG_NOSIGNAL);
+            if (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
                 handler_emsg("target connection error: %s\n",
                              strerror(errno));
-                break;
+                return 0;
             }
-            tout_start += bytes;
-            if (tout_start >= tout_end) {
-                tout_start = tout_end = 0;
-                traffic(">");
-            } else {
-                traffic(">.");
+            if (bytes > 0) {
+                c->tout_start += bytes;
+                if (c->tout_start >= c->tout_end) {
+                    c->tout_start = c->tout_end = 0;
+                    traffic(">");
+                } else {
+                    traffic(">.");
+                }
+                progress = 1;
             }
         }
 
-        if (FD_ISSET(client, &wlist)) {
-            len = cout_end-cout_start;
-            bytes = ws_send(ws_ctx, ws_ctx->cout_buf + cout_start, len);
-            if (pipe_error) { break; }
-            if (len < 3) {
-                handler_emsg("len: %d, bytes: %d: %d\n",
-                             (int) len, (int) bytes,
-                             (int) *(ws_ctx->cout_buf + cout_start));
+        if (c->cout_end != c->cout_start) {
+            len = c->cout_end - c->cout_start;
+            bytes = client_send(c, ws_ctx->cout_buf + c->cout_start, len);
+            if (bytes == -1) {
+                handler_emsg("client connection error: %s\n",
+                             strerror(errno));
+                return 0;
             }
-            cout_start += bytes;
-            if (cout_start >= cout_end) {
-                cout_start = cout_end = 0;
-                traffic("<");
-            } else {
-                traffic("<.");
+            if (bytes > 0) {
+                c->cout_start += bytes;
+                if (c->cout_start >= c->cout_end) {
+                    c->cout_start = c->cout_end = 0;
+                    traffic("<");
+                } else {
+                    traffic("<.");
+                }
+                progress = 1;
             }
         }
 
-        if (FD_ISSET(target, &rlist)) {
-            bytes = recv(target, ws_ctx->cin_buf, DBUFSIZE , 0);
-            if (pipe_error) { break; }
-            if (bytes <= 0) {
+        if (c->cout_end == c->cout_start && c->preframed) {
+            // Already framed by the VNC server, send it on as it is
+            bytes = recv(c->target, ws_ctx->cout_buf, BUFSIZE, 0);
+            if (bytes == 0 ||
+                (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
                 handler_emsg("target closed connection\n");
-                break;
+                return 0;
             }
-            cout_start = 0;
-            if (ws_ctx->hybi) {
-                cout_end = encode_hybi(ws_ctx->cin_buf, bytes,
-                                   ws_ctx->cout_buf, BUFSIZE, ws_ctx->opcode);
-            } else {
-                cout_end = encode_hixie(ws_ctx->cin_buf, bytes,
-                                    ws_ctx->cout_buf, BUFSIZE);
+            if (bytes > 0) {
+                c->cout_start = 0;
+                c->cout_end = bytes;
+                traffic("{");
+                progress = 1;
             }
-            /*
-            printf("encoded: ");
-            for (i=0; i< cout_end; i++) {
-                printf("%u,", (unsigned char) *(ws_ctx->cout_buf+i));
+        } else if (c->cout_end == c->cout_start) {
+            // Nothing queued for client, so read from target
+            bytes = recv(c->target, ws_ctx->cin_buf, DBUFSIZE, 0);
+            if (bytes == 0 ||
+                (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                handler_emsg("target closed connection\n");
+                return 0;
             }
-            printf("\n");
-            */
-            if (cout_end < 0) {
-                handler_emsg("encoding error\n");
-                break;
+            if (bytes > 0) {
+                int encoded;
+
+                if (ws_ctx->hybi) {
+                    encoded = encode_hybi((u_char *) ws_ctx->cin_buf, bytes,
+                                          ws_ctx->cout_buf, BUFSIZE, ws_ctx->opcode);
+                } else {
+                    encoded = encode_hixie((u_char *) ws_ctx->cin_buf, bytes,
+                                           ws_ctx->cout_buf, BUFSIZE);
+                }
+                if (encoded < 0) {
+                    handler_emsg("encoding error\n");
+                    return 0;
+                }
+                c->cout_start = 0;
+                c->cout_end = encoded;
+                traffic("{");
+                progress = 1;
             }
-            traffic("{");
         }
 
-        if (FD_ISSET(client, &rlist)) {
-            bytes = ws_recv(ws_ctx, ws_ctx->tin_buf + tin_end, BUFSIZE-1-tin_end);
-            if (pipe_error) { break; }
-            if (bytes <= 0) {
+        if (c->tout_end == c->tout_start) {
+            // Nothing queued for target, so read from client
+            bytes = client_recv(c, ws_ctx->tin_buf + c->tin_end, BUFSIZE-1-c->tin_end);
+            if (bytes == 0 || bytes == -1) {
                 handler_emsg("client closed connection\n");
-                break;
-            }
-            tin_end += bytes;
-            /*
-            printf("before decode: ");
-            for (i=0; i< bytes; i++) {
-                printf("%u,", (unsigned char) *(ws_ctx->tin_buf+i));
-            }
-            printf("\n");
-            */
-            if (ws_ctx->hybi) {
-                len = decode_hybi(ws_ctx->tin_buf,
-                                  tin_end,
-                                  ws_ctx->tout_buf, BUFSIZE-1,
-                                  &opcode, &left);
-            } else {
-                len = decode_hixie(ws_ctx->tin_buf,
-                                   tin_end,
-                                   ws_ctx->tout_buf, BUFSIZE-1,
-                                   &opcode, &left);
+                return 0;
             }
+            if (bytes > 0) {
+                c->tin_end += bytes;
+                if (ws_ctx->hybi) {
+                    len = decode_hybi((unsigned char *) ws_ctx->tin_buf,
+                                      c->tin_end,
+                                      (u_char *) ws_ctx->tout_buf, BUFSIZE-1,
+                                      &opcode, &left);
+                } else {
+                    len = decode_hixie(ws_ctx->tin_buf,
+                                       c->tin_end,
+                                       (u_char *) ws_ctx->tout_buf, BUFSIZE-1,
+                                       &opcode, &left);
+                }
 
-            if (opcode == 8) {
-                handler_msg("client sent orderly close frame\n");
-                break;
+                if (opcode == 8) {
+                    handler_msg("client sent orderly close frame\n");
+                    return 0;
+                }
+                if (len < 0) {
+                    handler_emsg("decoding error\n");
+                    return 0;
+                }
+                if (left) {
+                    const unsigned tin_start = c->tin_end - left;
+                    memmove(ws_ctx->tin_buf, ws_ctx->tin_buf + tin_start, left);
+                    c->tin_end = left;
+                } else {
+                    c->tin_end = 0;
+                }
+
+                traffic("}");
+                c->tout_start = 0;
+                c->tout_end = len;
+                progress = 1;
             }
+        }
+    }
+
+    // Gave up due to the round limit, or TLS has decrypted data buffered
+    // that epoll can't know about
+    c->again = progress ||
+               (ws_ctx->ssl && c->tout_end == c->tout_start &&
+                SSL_pending(ws_ctx->ssl) > 0);
+
+    return 1;
+}
+
+static int proxy_watch(reactor_t *r, proxy_conn_t *c) {
+    uint32_t want[2];
+    int i;
+
+    want[PROXY_CLIENT] = 0;
+    want[PROXY_TARGET] = 0;
 
-            /*
-            printf("decoded: ");
-            for (i=0; i< len; i++) {
-                printf("%u,", (unsigned char) *(ws_ctx->tout_buf+i));
+    if (c->tout_end == c->tout_start || (c->ssl_want & SSL_WRITE_WANTS_READ))
+        want[PROXY_CLIENT] |= EPOLLIN;
+    if (c->cout_end != c->cout_start || (c->ssl_want & SSL_READ_WANTS_WRITE))
+        want[PROXY_CLIENT] |= EPOLLOUT;
+
+    if (c->cout_end == c->cout_start)
+        want[PROXY_TARGET] |= EPOLLIN;
+    if (c->tout_end != c->tout_start)
+        want[PROXY_TARGET] |= EPOLLOUT;
+
+    for (i = 0; i < 2; i++) {
+        proxy_end_t *end = &c->ends[i];
+        struct epoll_event ev;
+
+        if (end->events == want[i])
+            continue;
+
+        ev.events = want[i];
+        ev.data.ptr = end;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_MOD,
+                      i == PROXY_CLIENT ? c->ws_ctx->sockfd : c->target, &ev)) {
+            handler_emsg("epoll_ctl(): %s\n", strerror(errno));
+            return 0;
+        }
+        end->events = want[i];
+    }
+
+    return 1;
+}
+
+static void proxy_close(reactor_t *r, proxy_conn_t *c) {
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, c->ws_ctx->sockfd, NULL);
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, c->target, NULL);
+
+    shutdown(c->target, SHUT_RDWR);
+    close(c->target);
+
+    ws_socket_free(c->ws_ctx);
+    free_ws_ctx(c->ws_ctx);
+
+    handler_msg("handler exit\n");
+    free(c);
+}
+
+static int proxy_register(reactor_t *r, proxy_conn_t *c) {
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        struct epoll_event ev;
+
+        c->ends[i].conn = c;
+        c->ends[i].side = i;
+        c->ends[i].events = EPOLLIN;
+
+        ev.events = c->ends[i].events;
+        ev.data.ptr = &c->ends[i];
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD,
+                      i == PROXY_CLIENT ? c->ws_ctx->sockfd : c->target, &ev)) {
+            handler_emsg("epoll_ctl(): %s\n", strerror(errno));
+            if (i)
+                epoll_ctl(r->epfd, EPOLL_CTL_DEL, c->ws_ctx->sockfd, NULL);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void *reactor_thread(void *ptr) {
+    reactor_t * const r = ptr;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    proxy_conn_t *active = NULL, *c, *next;
+    int n, i;
+
+    while (1) {
+        // Connections with work left over are pumped again without waiting
+        do {
+            n = epoll_wait(r->epfd, events, REACTOR_MAX_EVENTS, active ? 0 : -1);
+        } while (n == -1 && errno == EINTR);
+        if (n < 0) {
+            wserr("epoll_wait(): %s\n", strerror(errno));
+            continue;
+        }
+
+        for (i = 0; i < n; i++) {
+            proxy_end_t *end = events[i].data.ptr;
+
+            if (!end) {
+                // Woken up for new connections
+                uint64_t val;
+                if (read(r->wakefd, &val, sizeof(val)) < 0) {}
+
+                pthread_mutex_lock(&r->lock);
+                c = r->incoming;
+                r->incoming = NULL;
+                pthread_mutex_unlock(&r->lock);
+
+                for (; c; c = next) {
+                    next = c->next;
+                    wsthread_handler_id = c->id;
+
+                    if (!proxy_register(r, c)) {
+                        c->next = NULL;
+                        proxy_close(r, c);
+                        continue;
+                    }
+
+                    c->again = 1;
+                    c->next = active;
+                    active = c;
+                }
+                continue;
             }
-            printf("\n");
-            */
-            if (len < 0) {
-                handler_emsg("decoding error\n");
-                break;
+
+            c = end->conn;
+            if (c->again || c->closing)
+                continue;
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                wsthread_handler_id = c->id;
+                handler_emsg("%s exception\n",
+                             end->side == PROXY_CLIENT ? "client" : "target");
+                c->closing = 1;
             }
-            if (left) {
-                const unsigned tin_start = tin_end - left;
-                //handler_emsg("partial frame from client, %u left, start %u end %u, lens %lu %lu\n",
-                //             left, tin_start, tin_end, bytes, len);
-                memmove(ws_ctx->tin_buf, ws_ctx->tin_buf + tin_start, left);
-                tin_end = left;
-            } else {
-                //handler_emsg("handled %lu/%lu bytes\n", bytes, len);
-                tin_end = 0;
+
+            c->again = 1;
+            c->next = active;
+            active = c;
+        }
+
+        // Both ends of a connection may show up in one batch, so nothing is
+        // freed until all events have been looked at
+        c = active;
+        active = NULL;
+        for (; c; c = next) {
+            next = c->next;
+            wsthread_handler_id = c->id;
+
+            if (c->closing || !proxy_pump(c) || !proxy_watch(r, c)) {
+                proxy_close(r, c);
+                continue;
             }
 
-            traffic("}");
-            tout_start = 0;
-            tout_end = len;
+            if (c->again) {
+                c->next = active;
+                active = c;
+            }
         }
     }
+
+    return NULL;
+}
+
+void proxy_reactor_start(unsigned count) {
+    unsigned i;
+
+    reactors = calloc(count, sizeof(reactor_t));
+    num_reactors = count;
+
+    for (i = 0; i < count; i++) {
+        reactor_t *r = &reactors[i];
+        struct epoll_event ev;
+        pthread_t tid;
+
+        r->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (r->epfd < 0)
+            fatal("epoll_create1()");
+        pthread_mutex_init(&r->lock, NULL);
+
+        r->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (r->wakefd < 0)
+            fatal("eventfd()");
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wakefd, &ev);
+
+        pthread_create(&tid, NULL, reactor_thread, r);
+        pthread_detach(tid);
+    }
 }
 
-void proxy_handler(ws_ctx_t *ws_ctx) {
+static void proxy_add(ws_ctx_t *ws_ctx, int target, const uint8_t preframed) {
+    proxy_conn_t *c = calloc(1, sizeof(proxy_conn_t));
+    reactor_t *r;
+    const uint64_t one = 1;
+    unsigned idx;
+
+    c->ws_ctx = ws_ctx;
+    c->target = target;
+    c->id = wsthread_handler_id;
+    c->preframed = preframed;
+
+    set_nonblock(ws_ctx->sockfd);
+    set_nonblock(target);
+    if (ws_ctx->ssl)
+        SSL_set_mode(ws_ctx->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                                  SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    idx = __atomic_fetch_add(&next_reactor, 1, __ATOMIC_RELAXED) % num_reactors;
+    r = &reactors[idx];
+
+    pthread_mutex_lock(&r->lock);
+    c->next = r->incoming;
+    r->incoming = c;
+    pthread_mutex_unlock(&r->lock);
+
+    if (write(r->wakefd, &one, sizeof(one)) < 0) {}
+}
+
+// Connects the websocket to the VNC server. On success, the connection
+// belongs to the proxy reactor and 1 is returned.
+int proxy_handler(ws_ctx_t *ws_ctx) {
 
     char sockname[32];
     sprintf(sockname, ".KasmVNCSock%u", getpid());
@@ -238,13 +545,23 @@ void proxy_handler(ws_ctx_t *ws_ctx) {
     struct timeval tv;
     gettimeofday(&tv, NULL);
 
+    // Binary HyBi frames can be built by the VNC server directly in its
+    // output buffer, saving us a copy of everything it sends
+    uint8_t preframed = ws_ctx->hybi && ws_ctx->opcode == OPCODE_BINARY;
+
     struct sockaddr_un myaddr;
     myaddr.sun_family = AF_UNIX;
-    sprintf(myaddr.sun_path, ".%s@%s_%lu.%lu", ws_ctx->user, ws_ctx->ip,
-            tv.tv_sec, tv.tv_usec);
+    if (snprintf(myaddr.sun_path, sizeof(myaddr.sun_path), ".%s@%s_%lu.%lu%s",
+                 ws_ctx->user, ws_ctx->ip, tv.tv_sec, tv.tv_usec,
+                 preframed ? WS_PREFRAMED_TAG : "") >= (int) sizeof(myaddr.sun_path)) {
+        // The tag would be cut off, so the server wouldn't know
+        preframed = 0;
+        snprintf(myaddr.sun_path, sizeof(myaddr.sun_path), ".%s@%s_%lu.%lu",
+                 ws_ctx->user, ws_ctx->ip, tv.tv_sec, tv.tv_usec);
+    }
     myaddr.sun_path[0] = '\0';
 
-    int tsock = socket(AF_UNIX, SOCK_STREAM, 0);
+    int tsock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
     bind(tsock, (struct sockaddr *) &myaddr, sizeof(struct sockaddr_un));
 
     handler_msg("connecting to VNC target\n");
@@ -254,13 +571,13 @@ void proxy_handler(ws_ctx_t *ws_ctx) {
 
         handler_emsg("Could not connect to target: %s\n",
                      strerror(errno));
-        return;
+        close(tsock);
+        return 0;
     }
 
-    do_proxy(ws_ctx, tsock);
+    proxy_add(ws_ctx, tsock, preframed);
 
-    shutdown(tsock, SHUT_RDWR);
-    close(tsock);
+    return 1;
 }
 
 #if 0
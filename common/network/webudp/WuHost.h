@@ -8,6 +8,18 @@ extern "C" {
 
 typedef struct WuHost WuHost;
 
+/*
+ * Spreads a client's datagrams out in time. Every burst datagrams get a
+ * departure time (SO_TXTIME) at most rate bytes per second after the
+ * previous burst; the kernel holds them until then if the fq qdisc is in
+ * use, and ignores the times otherwise.
+ */
+typedef struct {
+  uint32_t rate;   // Bytes per second, 0 = unpaced
+  uint32_t burst;  // Datagrams sent back to back
+  uint64_t next;   // CLOCK_MONOTONIC ns the next burst may leave at
+} WuPacer;
+
 int32_t WuHostCreate(const char* hostAddr, uint16_t port, int32_t maxClients,
                      WuHost** host);
 void WuHostDestroy(WuHost* host);
@@ -24,6 +36,16 @@ int32_t WuHostSendText(WuHost* host, WuClient* client, const char* text,
                        int32_t length);
 int32_t WuHostSendBinary(WuHost* host, WuClient* client, const uint8_t* data,
                          int32_t length);
+/*
+ * Sends count binary messages as one batch. Each is still its own SCTP
+ * and DTLS record, but the datagrams are handed to the kernel together
+ * with sendmmsg, and runs of equal sized ones as single UDP GSO sends
+ * where the kernel supports it. pacer may be NULL.
+ */
+int32_t WuHostSendBinaryBatch(WuHost* host, WuClient* client,
+                              const uint8_t* const* data,
+                              const int32_t* lengths, int32_t count,
+                              WuPacer* pacer);
 void WuHostSetErrorCallback(WuHost* host, WuErrorFn callback);
 void WuHostSetDebugCallback(WuHost* host, WuErrorFn callback);
 WuClient* WuHostFindClient(const WuHost* host, WuAddress address);
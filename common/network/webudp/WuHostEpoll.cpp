@@ -1,6 +1,8 @@
 #include <errno.h>
 #include <netdb.h>
 #include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,7 +10,9 @@
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
+#include <linux/net_tstamp.h>
 #include "WuHost.h"
 #include "WuHttp.h"
 #include "WuMath.h"
@@ -17,8 +21,33 @@
 #include "WuRng.h"
 #include "WuString.h"
 
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+#ifndef SO_TXTIME
+#define SO_TXTIME 61
+#define SCM_TXTIME SO_TXTIME
+#endif
+
 static pthread_mutex_t wumutex = PTHREAD_MUTEX_INITIALIZER;
 
+// Datagrams collected by WuHostSendBinaryBatch before they go out
+const int32_t kMaxBatch = 128;
+// Kernel limits for one UDP GSO send
+const int32_t kMaxGsoSegments = 64;
+const size_t kMaxGsoBytes = 65000;
+// Paced datagrams are never held longer than this, so a client sent more
+// than its rate sees bunching rather than ever growing latency
+const uint64_t kMaxPacingDelayNs = 100000000;
+
+struct WuBatch {
+  int32_t count;
+  struct sockaddr_in addr;
+  size_t lengths[kMaxBatch];
+  uint8_t data[kMaxBatch][2048];
+};
+
 struct WuConnectionBuffer {
   size_t size = 0;
   int fd = -1;
@@ -35,6 +64,13 @@ struct WuHost {
   int32_t maxEvents;
   uint16_t port;
   char errBuf[512];
+
+  // Set while a batch is being sent, datagrams are queued instead
+  bool batching;
+  WuBatch* batch;
+  WuPacer* pacer;
+  bool gso;
+  int txtime;  // 0 untried, 1 enabled, -1 unsupported
 };
 
 static void HostReclaimBuffer(WuHost* host, WuConnectionBuffer* buffer) {
@@ -54,20 +90,200 @@ static void HandleErrno(WuHost* host, const char* description) {
   WuReportError(host->wu, host->errBuf);
 }
 
+static void HostFlushBatch(WuHost* host);
+
 static void WriteUDPData(const uint8_t* data, size_t length,
                          const WuClient* client, void* userData) {
   WuHost* host = (WuHost*)userData;
 
   WuAddress address = WuClientGetAddress(client);
   struct sockaddr_in netaddr;
+  memset(&netaddr, 0, sizeof(netaddr));
   netaddr.sin_family = AF_INET;
   netaddr.sin_port = htons(address.port);
   netaddr.sin_addr.s_addr = htonl(address.host);
 
+  if (host->batching && length <= sizeof(host->batch->data[0])) {
+    WuBatch* batch = host->batch;
+
+    if (batch->count == kMaxBatch ||
+        (batch->count &&
+         (batch->addr.sin_port != netaddr.sin_port ||
+          batch->addr.sin_addr.s_addr != netaddr.sin_addr.s_addr))) {
+      HostFlushBatch(host);
+    }
+
+    batch->addr = netaddr;
+    memcpy(batch->data[batch->count], data, length);
+    batch->lengths[batch->count] = length;
+    batch->count++;
+    return;
+  }
+
   sendto(host->udpfd, data, length, 0, (struct sockaddr*)&netaddr,
          sizeof(netaddr));
 }
 
+static uint64_t MonotonicNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static bool HostEnableTxTime(WuHost* host) {
+  if (!host->txtime) {
+    struct sock_txtime cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.clockid = CLOCK_MONOTONIC;
+
+    if (setsockopt(host->udpfd, SOL_SOCKET, SO_TXTIME, &cfg, sizeof(cfg))) {
+      HandleErrno(host, "SO_TXTIME unavailable, UDP is sent unpaced");
+      host->txtime = -1;
+    } else {
+      host->txtime = 1;
+    }
+  }
+
+  return host->txtime > 0;
+}
+
+// Hands the queued datagrams to the kernel, as few syscalls as possible
+static void HostFlushBatch(WuHost* host) {
+  WuBatch* batch = host->batch;
+  WuPacer* pacer = host->pacer;
+  const bool paced = pacer && pacer->rate && HostEnableTxTime(host);
+  const int32_t burst = paced && pacer->burst ? pacer->burst : kMaxGsoSegments;
+
+  struct mmsghdr msgs[kMaxBatch];
+  struct iovec iovs[kMaxBatch];
+  int32_t msgFirst[kMaxBatch];
+  union {
+    char buf[CMSG_SPACE(sizeof(uint16_t)) + CMSG_SPACE(sizeof(uint64_t))];
+    struct cmsghdr align;
+  } ctrl[kMaxBatch];
+
+  int32_t first = 0;
+
+  while (first < batch->count) {
+    int32_t numMsgs = 0, inBurst = 0;
+    uint64_t burstTime = 0;
+    size_t burstBytes = 0;
+
+    for (int32_t i = first; i < batch->count;) {
+      // A GSO send is cut into segments of the first datagram's size, so
+      // only the last one may be shorter. Sends don't cross bursts.
+      int32_t n = 1;
+      size_t bytes = batch->lengths[i];
+      while (host->gso && i + n < batch->count && inBurst + n < burst &&
+             n < kMaxGsoSegments &&
+             bytes + batch->lengths[i + n] <= kMaxGsoBytes &&
+             batch->lengths[i + n - 1] == batch->lengths[i] &&
+             batch->lengths[i + n] <= batch->lengths[i]) {
+        bytes += batch->lengths[i + n];
+        n++;
+      }
+
+      for (int32_t k = i; k < i + n; k++) {
+        iovs[k].iov_base = batch->data[k];
+        iovs[k].iov_len = batch->lengths[k];
+      }
+
+      struct msghdr* hdr = &msgs[numMsgs].msg_hdr;
+      memset(hdr, 0, sizeof(*hdr));
+      hdr->msg_name = &batch->addr;
+      hdr->msg_namelen = sizeof(batch->addr);
+      hdr->msg_iov = &iovs[i];
+      hdr->msg_iovlen = n;
+
+      if (paced && !inBurst) {
+        const uint64_t now = MonotonicNs();
+        burstTime = pacer->next > now ? pacer->next : now;
+        if (burstTime > now + kMaxPacingDelayNs)
+          burstTime = now + kMaxPacingDelayNs;
+        burstBytes = 0;
+      }
+
+      size_t ctrlLen = 0;
+      if (n > 1)
+        ctrlLen += CMSG_SPACE(sizeof(uint16_t));
+      if (paced)
+        ctrlLen += CMSG_SPACE(sizeof(uint64_t));
+
+      if (ctrlLen) {
+        memset(&ctrl[numMsgs], 0, sizeof(ctrl[numMsgs]));
+        hdr->msg_control = ctrl[numMsgs].buf;
+        hdr->msg_controllen = ctrlLen;
+
+        struct cmsghdr* cm = CMSG_FIRSTHDR(hdr);
+        if (n > 1) {
+          const uint16_t segment = batch->lengths[i];
+          cm->cmsg_level = SOL_UDP;
+          cm->cmsg_type = UDP_SEGMENT;
+          cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+          memcpy(CMSG_DATA(cm), &segment, sizeof(segment));
+          cm = CMSG_NXTHDR(hdr, cm);
+        }
+        if (paced) {
+          cm->cmsg_level = SOL_SOCKET;
+          cm->cmsg_type = SCM_TXTIME;
+          cm->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+          memcpy(CMSG_DATA(cm), &burstTime, sizeof(burstTime));
+        }
+      }
+
+      msgFirst[numMsgs++] = i;
+      i += n;
+
+      if (paced) {
+        inBurst += n;
+        burstBytes += bytes;
+        if (inBurst >= burst || i == batch->count) {
+          pacer->next = burstTime + burstBytes * 1000000000 / pacer->rate;
+          inBurst = 0;
+        }
+      }
+    }
+
+    int32_t sent = 0;
+    first = batch->count;
+
+    while (sent < numMsgs) {
+      const int r = sendmmsg(host->udpfd, msgs + sent, numMsgs - sent, 0);
+      if (r > 0) {
+        sent += r;
+        continue;
+      }
+
+      if (errno == EINTR)
+        continue;
+
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // Give the socket buffer a moment to drain, then drop the rest
+        // like a plain sendto would have
+        struct pollfd pfd;
+        pfd.fd = host->udpfd;
+        pfd.events = POLLOUT;
+        if (poll(&pfd, 1, 5) > 0)
+          continue;
+        break;
+      }
+
+      if (host->gso && msgs[sent].msg_hdr.msg_iovlen > 1) {
+        // No GSO support on this kernel or device, redo from here without
+        HandleErrno(host, "UDP GSO failed, disabling it");
+        host->gso = false;
+        first = msgFirst[sent];
+        break;
+      }
+
+      // The datagram is lost, the next one may well get through
+      sent++;
+    }
+  }
+
+  batch->count = 0;
+}
+
 int32_t WuHostServe(WuHost* host, WuEvent* evt, int timeout) {
   if (pthread_mutex_lock(&wumutex))
     abort();
@@ -148,6 +364,17 @@ int32_t WuHostCreate(const char* hostAddr, uint16_t port, int32_t maxClients, Wu
     return WU_ERROR;
   }
 
+  // Kernels from 4.18 on can send a train of datagrams as one
+  int gsoSize = 0;
+  socklen_t gsoLen = sizeof(gsoSize);
+  ctx->gso = getsockopt(ctx->udpfd, SOL_UDP, UDP_SEGMENT, &gsoSize, &gsoLen) == 0;
+
+  ctx->batch = (WuBatch*)calloc(1, sizeof(WuBatch));
+  if (!ctx->batch) {
+    WuHostDestroy(ctx);
+    return WU_OUT_OF_MEMORY;
+  }
+
   ctx->epfd = epoll_create(1024);
   if (ctx->epfd == -1) {
     WuHostDestroy(ctx);
@@ -209,6 +436,35 @@ int32_t WuHostSendBinary(WuHost* host, WuClient* client, const uint8_t* data,
   return ret;
 }
 
+int32_t WuHostSendBinaryBatch(WuHost* host, WuClient* client,
+                              const uint8_t* const* data,
+                              const int32_t* lengths, int32_t count,
+                              WuPacer* pacer) {
+  int32_t ret = 0;
+
+  if (pthread_mutex_lock(&wumutex))
+    abort();
+
+  host->batching = true;
+  host->pacer = pacer;
+
+  for (int32_t i = 0; i < count; i++) {
+    if (WuSendBinary(host->wu, client, data[i], lengths[i]) < 0) {
+      ret = -1;
+      break;
+    }
+  }
+
+  HostFlushBatch(host);
+
+  host->batching = false;
+  host->pacer = NULL;
+
+  pthread_mutex_unlock(&wumutex);
+
+  return ret;
+}
+
 void WuHostSetErrorCallback(WuHost* host, WuErrorFn callback) {
   WuSetErrorCallback(host->wu, callback);
 }
@@ -239,6 +495,8 @@ void WuHostDestroy(WuHost* host) {
   if (host->events) {
     free(host->events);
   }
+
+  free(host->batch);
 }
 
 WuClient* WuHostFindClient(const WuHost* host, WuAddress address) {
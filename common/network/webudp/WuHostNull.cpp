@@ -8,4 +8,8 @@ int32_t WuHostServe(WuHost*, WuEvent*, int) { return 0; }
 void WuHostRemoveClient(WuHost*, WuClient*) {}
 int32_t WuHostSendText(WuHost*, WuClient*, const char*, int32_t) { return 0; }
 int32_t WuHostSendBinary(WuHost*, WuClient*, const uint8_t*, int32_t) { return 0; }
+int32_t WuHostSendBinaryBatch(WuHost*, WuClient*, const uint8_t* const*,
+                              const int32_t*, int32_t, WuPacer*) {
+  return 0;
+}
 void WuHostSetErrorCallback(WuHost*, WuErrorFn) {}
@@ -0,0 +1,134 @@
+/* Copyright (C) 2026 Kasm Technologies Corp
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <rdr/Deflater.h>
+
+#include <zlib.h>
+
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+using namespace rdr;
+
+namespace {
+
+  class ZlibDeflater : public Deflater {
+  public:
+    const char* name() const override {
+#ifdef ZLIBNG_VERSION
+      return "zlib-ng";
+#else
+      return "zlib";
+#endif
+    }
+
+    size_t bound(size_t len) const override {
+      return compressBound(len);
+    }
+
+    size_t compress(U8* dst, size_t dstLen,
+                    const U8* src, size_t len, int level) const override {
+      uLongf outLen = dstLen;
+
+      if (compress2(dst, &outLen, src, len, level) != Z_OK)
+        return 0;
+
+      return outLen;
+    }
+  };
+
+#ifdef HAVE_LIBDEFLATE
+  class LibdeflateDeflater : public Deflater {
+  public:
+    const char* name() const override {
+      return "libdeflate";
+    }
+
+    size_t bound(size_t len) const override {
+      // A null compressor gives the bound for every level
+      return libdeflate_zlib_compress_bound(NULL, len);
+    }
+
+    size_t compress(U8* dst, size_t dstLen,
+                    const U8* src, size_t len, int level) const override {
+      libdeflate_compressor* c;
+
+      if (level < 0 || level > 9)
+        level = 6;
+
+      // Compressors can't be shared between threads, so every thread
+      // allocates its own for each level it uses
+      c = compressors.get(level);
+      if (!c)
+        return zlib.compress(dst, dstLen, src, len, level);
+
+      return libdeflate_zlib_compress(c, src, len, dst, dstLen);
+    }
+
+  private:
+    struct Compressors {
+      libdeflate_compressor* level[10] = {};
+
+      libdeflate_compressor* get(int l) {
+        if (!level[l])
+          level[l] = libdeflate_alloc_compressor(l);
+        return level[l];
+      }
+
+      ~Compressors() {
+        for (libdeflate_compressor* c : level) {
+          if (c)
+            libdeflate_free_compressor(c);
+        }
+      }
+    };
+
+    static thread_local Compressors compressors;
+    ZlibDeflater zlib;
+  };
+
+  thread_local LibdeflateDeflater::Compressors LibdeflateDeflater::compressors;
+#endif
+
+}
+
+const Deflater* Deflater::get()
+{
+  return all().front();
+}
+
+const std::vector<const Deflater*>& Deflater::all()
+{
+#ifdef HAVE_LIBDEFLATE
+  static const LibdeflateDeflater libdeflate;
+#endif
+  static const ZlibDeflater zlib;
+  static const std::vector<const Deflater*> backends = {
+#ifdef HAVE_LIBDEFLATE
+    &libdeflate,
+#endif
+    &zlib,
+  };
+
+  return backends;
+}
@@ -0,0 +1,64 @@
+/* Copyright (C) 2026 Kasm Technologies Corp
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+//
+// Deflater compresses whole buffers to complete zlib streams, for data
+// that is compressed in one go rather than streamed through a
+// ZlibOutStream.
+//
+// Which backends exist is decided at build time. zlib is always there,
+// and is zlib-ng when built against it in compat mode. libdeflate is
+// added when found, and is preferred as it is considerably faster for
+// this. Both pick their CPU specific code at runtime.
+//
+
+#ifndef __RDR_DEFLATER_H__
+#define __RDR_DEFLATER_H__
+
+#include <stddef.h>
+#include <vector>
+
+#include <rdr/types.h>
+
+namespace rdr {
+
+  class Deflater {
+  public:
+    virtual ~Deflater() {}
+
+    virtual const char* name() const = 0;
+
+    // bound() is the most compress() can produce from len bytes
+    virtual size_t bound(size_t len) const = 0;
+
+    // compress() writes src as a zlib stream at the given level (-1 for
+    // the default, otherwise 0-9). It returns the compressed length, or
+    // zero if dst is too small. It may be called from any thread.
+    virtual size_t compress(U8* dst, size_t dstLen,
+                            const U8* src, size_t len, int level) const = 0;
+
+    // The preferred backend
+    static const Deflater* get();
+
+    // All backends built in, preferred first
+    static const std::vector<const Deflater*>& all();
+  };
+
+}
+
+#endif
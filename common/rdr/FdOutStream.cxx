@@ -35,6 +35,7 @@
 #include <unistd.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #endif
@@ -52,7 +53,8 @@
 using namespace rdr;
 
 FdOutStream::FdOutStream(int fd_, bool blocking_, int timeoutms_)
-  : fd(fd_), blocking(blocking_), timeoutms(timeoutms_)
+  : fd(fd_), blocking(blocking_), timeoutms(timeoutms_),
+    wsFrames(false), headerLen(0), headerSent(0), frameLeft(0)
 {
   gettimeofday(&lastWrite, NULL);
 }
@@ -74,6 +76,10 @@ void FdOutStream::setBlocking(bool blocking_) {
   blocking = blocking_;
 }
 
+void FdOutStream::setWebsocketFrames(bool enable) {
+  wsFrames = enable;
+}
+
 unsigned FdOutStream::getIdleTime()
 {
   return rfb::msSince(&lastWrite);
@@ -81,9 +87,72 @@ unsigned FdOutStream::getIdleTime()
 
 bool FdOutStream::flushBuffer(bool wait)
 {
-  size_t n = writeWithTimeout((const void*) sentUpTo,
-                              ptr - sentUpTo,
-                              (blocking || wait)? timeoutms : 0);
+  size_t n;
+
+  if (wsFrames) {
+    struct iovec iov[2];
+    int iovcnt = 0;
+
+    // Start a new frame with everything that is buffered
+    if (frameLeft == 0) {
+      const size_t len = ptr - sentUpTo;
+
+      if (len == 0)
+        return true;
+
+      frameHeader[0] = 0x82; // FIN, binary
+      if (len <= 125) {
+        frameHeader[1] = len;
+        headerLen = 2;
+      } else if (len <= 65535) {
+        frameHeader[1] = 126;
+        frameHeader[2] = len >> 8;
+        frameHeader[3] = len;
+        headerLen = 4;
+      } else {
+        frameHeader[1] = 127;
+        for (int i = 0; i < 8; i++)
+          frameHeader[2 + i] = (U64) len >> (56 - i * 8);
+        headerLen = 10;
+      }
+
+      headerSent = 0;
+      frameLeft = len;
+    }
+
+    if (headerSent < headerLen) {
+      iov[iovcnt].iov_base = frameHeader + headerSent;
+      iov[iovcnt].iov_len = headerLen - headerSent;
+      iovcnt++;
+    }
+    iov[iovcnt].iov_base = (void*) sentUpTo;
+    iov[iovcnt].iov_len = frameLeft;
+    iovcnt++;
+
+    n = writeWithTimeout(iov, iovcnt, (blocking || wait)? timeoutms : 0);
+
+    if (n == 0) {
+      if (!blocking && !wait)
+        return false;
+
+      throw TimedOut();
+    }
+
+    if (headerSent < headerLen) {
+      const size_t hdr = n < headerLen - headerSent ? n : headerLen - headerSent;
+      headerSent += hdr;
+      n -= hdr;
+    }
+
+    sentUpTo += n;
+    frameLeft -= n;
+
+    return true;
+  }
+
+  n = writeWithTimeout((const void*) sentUpTo,
+                       ptr - sentUpTo,
+                       (blocking || wait)? timeoutms : 0);
 
   // Timeout?
   if (n == 0) {
@@ -111,7 +180,18 @@ bool FdOutStream::flushBuffer(bool wait)
 
 size_t FdOutStream::writeWithTimeout(const void* data, size_t length, int timeoutms)
 {
-  int n;
+  struct iovec iov;
+
+  iov.iov_base = (void*) data;
+  iov.iov_len = length;
+
+  return writeWithTimeout(&iov, 1, timeoutms);
+}
+
+size_t FdOutStream::writeWithTimeout(const struct iovec* iov, int iovcnt, int timeoutms)
+{
+  struct msghdr msg;
+  ssize_t n;
 
   do {
     fd_set fds;
@@ -136,14 +216,18 @@ size_t FdOutStream::writeWithTimeout(const void* data, size_t length, int timeou
   if (n == 0)
     return 0;
 
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = (struct iovec*) iov;
+  msg.msg_iovlen = iovcnt;
+
   do {
     // select only guarantees that you can write SO_SNDLOWAT without
     // blocking, which is normally 1. Use MSG_DONTWAIT to avoid
     // blocking, when possible.
 #ifndef MSG_DONTWAIT
-    n = ::send(fd, (const char*)data, length, 0);
+    n = ::sendmsg(fd, &msg, 0);
 #else
-    n = ::send(fd, (const char*)data, length, MSG_DONTWAIT);
+    n = ::sendmsg(fd, &msg, MSG_DONTWAIT);
 #endif
   } while (n < 0 && (errno == EINTR));
 
@@ -28,6 +28,8 @@
 
 #include <rdr/BufferedOutStream.h>
 
+struct iovec;
+
 namespace rdr {
 
   class FdOutStream : public BufferedOutStream {
@@ -41,15 +43,27 @@ namespace rdr {
     void setBlocking(bool blocking);
     int getFd() { return fd; }
 
+    // Wrap everything written from now on in binary websocket frames, for
+    // when the websocket proxy passes our output straight through to the
+    // client. The header is sent along with the buffered data, which is
+    // never copied.
+    void setWebsocketFrames(bool enable);
+
     unsigned getIdleTime();
 
   private:
     virtual bool flushBuffer(bool wait);
     size_t writeWithTimeout(const void* data, size_t length, int timeoutms);
+    size_t writeWithTimeout(const struct iovec* iov, int iovcnt, int timeoutms);
     int fd;
     bool blocking;
     int timeoutms;
     struct timeval lastWrite;
+
+    bool wsFrames;
+    U8 frameHeader[10];
+    size_t headerLen, headerSent;
+    size_t frameLeft;
   };
 
 }
@@ -27,10 +27,15 @@
 #include <rfb/LogWriter.h>
 #include <rfb/ServerCore.h>
 #include <rfb/ComparingUpdateTracker.h>
+#include <rfb/compare_simd.h>
+#include <rfb/cpuid.h>
 
 #include <rfb/adler32.h>
 #include <rfb/xxhash.h>
 
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+
 using namespace rfb;
 
 static LogWriter vlog("ComparingUpdateTracker");
@@ -62,6 +67,8 @@ static uint32_t pow2shift(const uint32_t in) {
 #define SCROLLBLOCK_SIZE 64
 #define NUM_TOTALS (1024 * 256)
 #define MAX_CHECKS 8
+// Rows per task when hashing the old frame
+#define HASH_BAND 32
 
 class scrollHasher_t {
 protected:
@@ -94,11 +101,19 @@ protected:
 
 	const uint8_t *olddata;
 	uint32_t *totals, *starts, *idxtable, *curs;
+
+	// olddata is a copy of the comparer's old frame, and the hashes are
+	// of olddata. Only the parts the comparer has written to since the
+	// last calcHashes() are copied and hashed again.
+	std::vector<uint8_t> dirty;
+
+	tbb::task_arena *arena;
 public:
-	scrollHasher_t(): w(0), h(0), d(0), lineBytes(0), blockBytes(0), hashtable(NULL),
+	scrollHasher_t(tbb::task_arena *arena_): w(0), h(0), d(0), lineBytes(0), blockBytes(0), hashtable(NULL),
 				hashw(0), hashAnd(0), hashShift(0),
 				lastOffX(0), lastOffY(0),
-				olddata(NULL), totals(NULL), starts(NULL), idxtable(NULL) {
+				olddata(NULL), totals(NULL), starts(NULL), idxtable(NULL),
+				arena(arena_) {
 
 		assert(sizeof(hashdata_t) == sizeof(uint32_t));
 	}
@@ -115,8 +130,15 @@ public:
 	virtual void calcHashes(const uint8_t *ptr,
 			const uint32_t w_, const uint32_t h_, const uint32_t d_) = 0;
 
+	// Same, but from the comparer's per-line block hashes instead of pixels
+	virtual void calcHashesFromLines(const uint64_t *lines, const uint32_t cols,
+			const uint32_t w_, const uint32_t h_, const uint32_t d_) {}
+
 	virtual void invalidate(const uint_fast32_t x, uint_fast32_t y, uint_fast32_t h) = 0;
 
+	// The comparer's old frame changed here
+	virtual void markDirty(const Rect &r) = 0;
+
 	virtual void findBestMatch(const uint8_t * const ptr, const uint_fast32_t maxLines,
 				const uint_fast32_t inx, const uint_fast32_t iny,
 				uint_fast32_t *outx,
@@ -131,61 +153,38 @@ public:
 };
 
 class scrollHasher_vert_t: public scrollHasher_t {
-public:
-	scrollHasher_vert_t(): scrollHasher_t() {
-
-		totals = (uint32_t *) malloc(sizeof(uint32_t) * NUM_TOTALS);
-		starts = (uint32_t *) malloc(sizeof(uint32_t) * NUM_TOTALS);
-		curs = (uint32_t *) malloc(sizeof(uint32_t) * NUM_TOTALS);
+protected:
+	// Full 64-bit line hashes of the old frame, used instead of olddata
+	// when the comparer doesn't keep pixels around
+	uint64_t *oldhashes;
+
+	void resize(const uint32_t w_, const uint32_t h_, const uint32_t d_) {
+		w = w_;
+		h = h_;
+		d = d_;
+		lineBytes = w * d;
+		blockBytes = SCROLLBLOCK_SIZE * d;
+
+		hashw = npow(w / SCROLLBLOCK_SIZE);
+		hashAnd = hashw - 1;
+		hashShift = pow2shift(hashw);
+
+		hashtable = (hashdata_t *) realloc(hashtable,
+							hashw * h * sizeof(uint32_t));
+		idxtable = (uint32_t *) realloc(idxtable,
+							hashw * h * sizeof(uint32_t));
 	}
 
-	void calcHashes(const uint8_t *ptr,
-			const uint32_t w_, const uint32_t h_, const uint32_t d_) {
+	// Is this block line the same as the one at x,y in the old frame?
+	bool sameLine(const uint8_t *ptr, const uint_fast32_t x, const uint_fast32_t y) const {
+		if (oldhashes)
+			return XXH64(ptr, blockBytes, 0) ==
+				oldhashes[(y << hashShift) + x / SCROLLBLOCK_SIZE];
 
-		if (w != w_ || h != h_) {
-			// Reallocate
-			w = w_;
-			h = h_;
-			d = d_;
-			lineBytes = w * d;
-			blockBytes = SCROLLBLOCK_SIZE * d;
-
-			hashw = npow(w / SCROLLBLOCK_SIZE);
-			hashAnd = hashw - 1;
-			hashShift = pow2shift(hashw);
-
-			hashtable = (hashdata_t *) realloc(hashtable,
-								hashw * h * sizeof(uint32_t));
-			idxtable = (uint32_t *) realloc(idxtable,
-								hashw * h * sizeof(uint32_t));
-
-			olddata = (const uint8_t *) realloc((void *) olddata, w * h * d);
-		}
-
-		// We need to make a copy, since the comparer incrementally updates its copy
-		memcpy((uint8_t *) olddata, ptr, w * h * d);
-
-		//memset(hashtable, 0, hashw * h * sizeof(uint32_t));
-		//memset(idxtable, 0, w * h * sizeof(uint32_t));
-		memset(totals, 0, NUM_TOTALS * sizeof(uint32_t));
-		//memset(starts, 0, NUM_TOTALS * sizeof(uint32_t));
-		//memset(curs, 0, NUM_TOTALS * sizeof(uint32_t));
-
-		for (uint_fast32_t y = 0; y < h; y++) {
-			const uint8_t *inptr0 = olddata;
-			inptr0 += y * lineBytes;
-			for (uint_fast32_t x = 0; x < w; x += SCROLLBLOCK_SIZE) {
-				if (w - x < SCROLLBLOCK_SIZE)
-					break;
-
-				const uint_fast32_t idx = (y << hashShift) + x / SCROLLBLOCK_SIZE;
-				hashtable[idx].hash = XXH64(inptr0, blockBytes, 0);
-				totals[hashtable[idx].hash % NUM_TOTALS]++;
-
-				inptr0 += blockBytes;
-			}
-		}
+		return memcmp(ptr, &olddata[y * lineBytes + x * d], blockBytes) == 0;
+	}
 
+	void buildIndex() {
 		// calculate number of unique 21-bit hashes
 		/*uint_fast32_t uniqHashes = 0;
 		for (uint_fast32_t i = 0; i < NUM_TOTALS; i++) {
@@ -225,16 +224,120 @@ public:
 
 		lastOffX = lastOffY = 0;
 	}
+public:
+	scrollHasher_vert_t(tbb::task_arena *arena_): scrollHasher_t(arena_), oldhashes(NULL) {
+
+		totals = (uint32_t *) malloc(sizeof(uint32_t) * NUM_TOTALS);
+		starts = (uint32_t *) malloc(sizeof(uint32_t) * NUM_TOTALS);
+		curs = (uint32_t *) malloc(sizeof(uint32_t) * NUM_TOTALS);
+	}
+
+	~scrollHasher_vert_t() {
+		free(oldhashes);
+	}
+
+	void calcHashes(const uint8_t *ptr,
+			const uint32_t w_, const uint32_t h_, const uint32_t d_) {
+
+		if (w != w_ || h != h_) {
+			// Reallocate
+			resize(w_, h_, d_);
+			olddata = (const uint8_t *) realloc((void *) olddata, w * h * d);
+			dirty.assign(hashw * h, 1);
+		}
+
+		const uint_fast32_t cols = w / SCROLLBLOCK_SIZE;
+
+		// We need to make a copy, since the comparer incrementally updates
+		// its copy. Block lines are independent, so bands of rows can be
+		// done in parallel.
+		auto band = [&](const tbb::blocked_range<uint_fast32_t> &rows) {
+			for (uint_fast32_t y = rows.begin(); y < rows.end(); y++) {
+				uint8_t * const flags = &dirty[y << hashShift];
+				for (uint_fast32_t x = 0; x < cols; x++) {
+					if (!flags[x])
+						continue;
+					flags[x] = 0;
+
+					const size_t off = y * lineBytes + x * blockBytes;
+					memcpy((uint8_t *) olddata + off, ptr + off, blockBytes);
+					hashtable[(y << hashShift) + x].hash =
+						XXH64(olddata + off, blockBytes, 0);
+				}
+			}
+		};
+
+		arena->execute([&] {
+			tbb::parallel_for(tbb::blocked_range<uint_fast32_t>(0, h, HASH_BAND), band);
+		});
+
+		memset(totals, 0, NUM_TOTALS * sizeof(uint32_t));
+
+		for (uint_fast32_t y = 0; y < h; y++) {
+			const hashdata_t *row = &hashtable[y << hashShift];
+			for (uint_fast32_t x = 0; x < cols; x++)
+				totals[row[x].hash % NUM_TOTALS]++;
+		}
+
+		buildIndex();
+	}
+
+	void calcHashesFromLines(const uint64_t *lines, const uint32_t cols,
+			const uint32_t w_, const uint32_t h_, const uint32_t d_) {
+
+		if (w != w_ || h != h_) {
+			resize(w_, h_, d_);
+			oldhashes = (uint64_t *) realloc(oldhashes,
+							hashw * h * sizeof(uint64_t));
+		}
+
+		memset(totals, 0, NUM_TOTALS * sizeof(uint32_t));
+
+		// The comparer hashes the same 64px block lines with the same
+		// function, so its table can be used as is
+		for (uint_fast32_t y = 0; y < h; y++) {
+			for (uint_fast32_t x = 0; x < w / SCROLLBLOCK_SIZE; x++) {
+				const uint_fast32_t idx = (y << hashShift) + x;
+				oldhashes[idx] = lines[y * cols + x];
+				hashtable[idx].hash = oldhashes[idx];
+				totals[hashtable[idx].hash % NUM_TOTALS]++;
+			}
+		}
+
+		buildIndex();
+	}
 
 	void invalidate(const uint_fast32_t x, uint_fast32_t y, uint_fast32_t h) {
 
+		// Needs hashing again next time too
+		const bool keep = !dirty.empty();
+
 		h += y;
 		for (; y < h; y++) {
-			memset(&hashtable[(y << hashShift) + x / SCROLLBLOCK_SIZE], 0,
-				sizeof(uint32_t));
+			const uint_fast32_t idx = (y << hashShift) + x / SCROLLBLOCK_SIZE;
+			memset(&hashtable[idx], 0, sizeof(uint32_t));
+			if (keep)
+				dirty[idx] = 1;
 		}
 	}
 
+	void markDirty(const Rect &r) {
+		if (dirty.empty())
+			return;
+
+		const uint_fast32_t cols = w / SCROLLBLOCK_SIZE;
+		const uint_fast32_t left = r.tl.x / SCROLLBLOCK_SIZE;
+		const uint_fast32_t right = __rfbmin((r.br.x + SCROLLBLOCK_SIZE - 1) / SCROLLBLOCK_SIZE,
+						     (int) cols);
+		const uint_fast32_t bottom = __rfbmin(r.br.y, (int) h);
+
+		if (left >= right)
+			return;
+
+		for (uint_fast32_t y = r.tl.y; y < bottom; y++)
+			memset(&dirty[(y << hashShift) + left], 1, right - left);
+	}
+
 	void findBestMatch(const uint8_t * const ptr, const uint_fast32_t maxLines,
 				const uint_fast32_t inx, const uint_fast32_t iny,
 				uint_fast32_t *outx,
@@ -271,8 +374,7 @@ public:
 
 			curidx = (tryY << hashShift) + tryX / SCROLLBLOCK_SIZE;
 			curhash = hashtable[curidx].hash;
-			if (curhash == starthash &&
-				memcmp(ptr, &olddata[tryY * lineBytes + tryX * d], blockBytes) == 0) {
+			if (curhash == starthash && sameLine(ptr, tryX, tryY)) {
 
 				matches[0].hash = curhash;
 				matches[0].idx = curidx;
@@ -294,7 +396,7 @@ public:
 			const uint_fast32_t oldy = curidx >> hashShift;
 			const uint_fast32_t oldx = curidx & hashAnd;
 
-			if (memcmp(ptr, &olddata[oldy * lineBytes + oldx * blockBytes], blockBytes))
+			if (!sameLine(ptr, oldx * SCROLLBLOCK_SIZE, oldy))
 				continue;
 
 			matches[found].hash = curhash;
@@ -327,9 +429,8 @@ public:
 					break;*/
 				if (!hashtable[matches[i].idx + (k << hashShift)].hash)
 					break; // Invalidated
-				if (memcmp(ptr + lineBytes * k,
-						&olddata[(oldy + k) * lineBytes + oldx * blockBytes],
-						blockBytes))
+				if (!sameLine(ptr + lineBytes * k,
+						oldx * SCROLLBLOCK_SIZE, oldy + k))
 					break;
 			}
 			if (k > bestmatches) {
@@ -403,9 +504,7 @@ public:
 		for (i = 0; i < lowest; i++) {
 			if (!hashtable[((tmpy - lowest + i) << hashShift) + inx / SCROLLBLOCK_SIZE].hash)
 				return; // Invalidated
-			if (memcmp(ptr + lineBytes * i,
-					&olddata[(tmpy - lowest + i) * lineBytes + tmpx * d],
-					blockBytes))
+			if (!sameLine(ptr + lineBytes * i, tmpx, tmpy - lowest + i))
 				return;
 		}
 
@@ -420,7 +519,7 @@ public:
 
 class scrollHasher_bothDir_t: public scrollHasher_t {
 public:
-	scrollHasher_bothDir_t(): scrollHasher_t() {
+	scrollHasher_bothDir_t(tbb::task_arena *arena_): scrollHasher_t(arena_) {
 
 		totals = (uint32_t *) malloc(sizeof(uint32_t) * NUM_TOTALS);
 		starts = (uint32_t *) malloc(sizeof(uint32_t) * NUM_TOTALS);
@@ -448,45 +547,59 @@ public:
 								w * h * sizeof(uint32_t));
 
 			olddata = (const uint8_t *) realloc((void *) olddata, w * h * d);
+			dirty.assign(h, 1);
 		}
 
-		// We need to make a copy, since the comparer incrementally updates its copy
-		memcpy((uint8_t *) olddata, ptr, w * h * d);
-
-		Adler32 rolling(blockBytes);
-
-		//memset(hashtable, 0, hashw * h * sizeof(uint32_t));
-		//memset(idxtable, 0, w * h * sizeof(uint32_t));
-		memset(totals, 0, NUM_TOTALS * sizeof(uint32_t));
-		//memset(starts, 0, NUM_TOTALS * sizeof(uint32_t));
-		//memset(curs, 0, NUM_TOTALS * sizeof(uint32_t));
-
-		const uint8_t *prevptr = NULL;
-		for (uint_fast32_t y = 0; y < h; y++) {
-			const uint8_t *inptr0 = olddata;
-			inptr0 += y * lineBytes;
-			for (uint_fast32_t x = 0; x < w - (SCROLLBLOCK_SIZE - 1); x++) {
-				if (!x) {
-					rolling.reset();
-					uint_fast32_t g;
-					for (g = 0; g < SCROLLBLOCK_SIZE; g++) {
+		// We need to make a copy, since the comparer incrementally updates
+		// its copy. The rolling hash runs along a row, so rows are the
+		// unit here: any change redoes the whole row, and bands of rows
+		// are done in parallel.
+		auto band = [&](const tbb::blocked_range<uint_fast32_t> &rows) {
+			Adler32 rolling(blockBytes);
+
+			for (uint_fast32_t y = rows.begin(); y < rows.end(); y++) {
+				if (!dirty[y])
+					continue;
+				dirty[y] = 0;
+
+				uint8_t * const row = (uint8_t *) olddata + y * lineBytes;
+				memcpy(row, ptr + y * lineBytes, lineBytes);
+
+				const uint8_t *inptr0 = row;
+				const uint8_t *prevptr = NULL;
+				for (uint_fast32_t x = 0; x < w - (SCROLLBLOCK_SIZE - 1); x++) {
+					if (!x) {
+						rolling.reset();
+						uint_fast32_t g;
+						for (g = 0; g < SCROLLBLOCK_SIZE; g++) {
+							for (uint_fast32_t di = 0; di < d; di++) {
+								rolling.eat(inptr0[g * d + di]);
+							}
+						}
+					} else {
 						for (uint_fast32_t di = 0; di < d; di++) {
-							rolling.eat(inptr0[g * d + di]);
+							rolling.update(prevptr[di],
+									inptr0[(SCROLLBLOCK_SIZE - 1) * d + di]);
 						}
 					}
-				} else {
-					for (uint_fast32_t di = 0; di < d; di++) {
-						rolling.update(prevptr[di],
-								inptr0[(SCROLLBLOCK_SIZE - 1) * d + di]);
-					}
-				}
-				const uint_fast32_t idx = (y << hashShift) + x;
-				hashtable[idx].hash = rolling.hash;
-				totals[rolling.hash % NUM_TOTALS]++;
+					hashtable[(y << hashShift) + x].hash = rolling.hash;
 
-				prevptr = inptr0;
-				inptr0 += d;
+					prevptr = inptr0;
+					inptr0 += d;
+				}
 			}
+		};
+
+		arena->execute([&] {
+			tbb::parallel_for(tbb::blocked_range<uint_fast32_t>(0, h, HASH_BAND), band);
+		});
+
+		memset(totals, 0, NUM_TOTALS * sizeof(uint32_t));
+
+		for (uint_fast32_t y = 0; y < h; y++) {
+			const hashdata_t *row = &hashtable[y << hashShift];
+			for (uint_fast32_t x = 0; x < w - (SCROLLBLOCK_SIZE - 1); x++)
+				totals[row[x].hash % NUM_TOTALS]++;
 		}
 
 		// calculate number of unique 21-bit hashes
@@ -537,9 +650,20 @@ public:
 		for (; y < h; y++) {
 			memset(&hashtable[(y << hashShift) + x - left], 0,
 				sizeof(uint32_t) * (nw + left + right));
+			if (!dirty.empty())
+				dirty[y] = 1;
 		}
 	}
 
+	void markDirty(const Rect &r) {
+		if (dirty.empty())
+			return;
+
+		const uint_fast32_t bottom = __rfbmin(r.br.y, (int) h);
+		for (uint_fast32_t y = r.tl.y; y < bottom; y++)
+			dirty[y] = 1;
+	}
+
 	void findBestMatch(const uint8_t * const ptr, const uint_fast32_t maxLines,
 				const uint_fast32_t inx, const uint_fast32_t iny,
 				uint_fast32_t *outx,
@@ -670,16 +794,45 @@ public:
 	}
 };
 
+static unsigned firstChangedRowC(const rdr::U8 *a, const unsigned astride,
+                                 const rdr::U8 *b, const unsigned bstride,
+                                 const unsigned lineBytes, const unsigned rows)
+{
+  unsigned y;
+
+  for (y = 0; y < rows; y++) {
+    if (memcmp(a, b, lineBytes) != 0)
+      break;
+
+    a += astride;
+    b += bstride;
+  }
+
+  return y;
+}
+
 ComparingUpdateTracker::ComparingUpdateTracker(PixelBuffer* buffer)
   : fb(buffer), oldFb(fb->getPF(), 0, 0), firstCompare(true),
     enabled(true), detectScroll(false), totalPixels(0), missedPixels(0),
-    scrollHasher(NULL)
+    scrollHasher(NULL), hashMode(Server::compareHashes), hashCols(0)
 {
     changed.assign_union(fb->getRect());
-    if (Server::detectHorizontal)
-      scrollHasher = new scrollHasher_bothDir_t;
+    if (Server::detectHorizontal && !hashMode)
+      scrollHasher = new scrollHasher_bothDir_t(&arena);
+    else
+      scrollHasher = new scrollHasher_vert_t(&arena);
+
+    if (Server::detectHorizontal && hashMode)
+      vlog.info("Horizontal scroll detection is not available with CompareHashes");
+
+    if (cpu_info::has_avx2)
+      firstChangedRow = AVX2_firstChangedRow;
+    else if (cpu_info::has_sse2)
+      firstChangedRow = SSE2_firstChangedRow;
     else
-      scrollHasher = new scrollHasher_vert_t;
+      firstChangedRow = firstChangedRowC;
+
+    arena.initialize(cpu_info::cores_count);
 }
 
 ComparingUpdateTracker::~ComparingUpdateTracker()
@@ -689,6 +842,8 @@ ComparingUpdateTracker::~ComparingUpdateTracker()
 
 
 #define BLOCK_SIZE 64
+// Below this many blocks, splitting the comparison costs more than it saves
+#define PARALLEL_MIN_BLOCKS 16
 
 bool ComparingUpdateTracker::compare(bool skipScrollDetection, const Region &skipCursorArea)
 {
@@ -703,13 +858,21 @@ bool ComparingUpdateTracker::compare(bool skipScrollDetection, const Region &ski
   if (firstCompare) {
     // NB: We leave the change region untouched on this iteration,
     // since in effect the entire framebuffer has changed.
-    oldFb.setSize(fb->width(), fb->height());
+    if (hashMode) {
+      hashCols = (fb->width() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+      lineHashes.resize(hashCols * fb->height());
+      hashLines(fb->getRect());
+    } else {
+      oldFb.setSize(fb->width(), fb->height());
+
+      for (int y=0; y<fb->height(); y+=BLOCK_SIZE) {
+        Rect pos(0, y, fb->width(), __rfbmin(fb->height(), y+BLOCK_SIZE));
+        int srcStride;
+        const rdr::U8* srcData = fb->getBuffer(pos, &srcStride);
+        oldFb.imageRect(pos, srcData, srcStride);
+      }
 
-    for (int y=0; y<fb->height(); y+=BLOCK_SIZE) {
-      Rect pos(0, y, fb->width(), __rfbmin(fb->height(), y+BLOCK_SIZE));
-      int srcStride;
-      const rdr::U8* srcData = fb->getBuffer(pos, &srcStride);
-      oldFb.imageRect(pos, srcData, srcStride);
+      scrollHasher->markDirty(fb->getRect());
     }
 
     firstCompare = false;
@@ -717,9 +880,15 @@ bool ComparingUpdateTracker::compare(bool skipScrollDetection, const Region &ski
     return false;
   }
 
-  copied.get_rects(&rects, copy_delta.x<=0, copy_delta.y<=0);
-  for (i = rects.begin(); i != rects.end(); i++)
-    oldFb.copyRect(*i, copy_delta);
+  if (hashMode) {
+    copyHashes();
+  } else {
+    copied.get_rects(&rects, copy_delta.x<=0, copy_delta.y<=0);
+    for (i = rects.begin(); i != rects.end(); i++) {
+      oldFb.copyRect(*i, copy_delta);
+      scrollHasher->markDirty(*i);
+    }
+  }
 
   changed.get_rects(&rects);
 
@@ -734,10 +903,15 @@ bool ComparingUpdateTracker::compare(bool skipScrollDetection, const Region &ski
   if (atLeast64 && Server::detectScrolling && !skipScrollDetection &&
       (changedArea * 100) / (fb->width() * fb->height()) > (unsigned) Server::scrollDetectLimit) {
     detectScroll = true;
-    Rect pos(0, 0, oldFb.width(), oldFb.height());
-    int unused;
-    scrollHasher->calcHashes(oldFb.getBuffer(pos, &unused), oldFb.width(), oldFb.height(),
-    				oldFb.getPF().bpp / 8);
+    if (hashMode) {
+      scrollHasher->calcHashesFromLines(lineHashes.data(), hashCols, fb->width(), fb->height(),
+                                        fb->getPF().bpp / 8);
+    } else {
+      Rect pos(0, 0, oldFb.width(), oldFb.height());
+      int unused;
+      scrollHasher->calcHashes(oldFb.getBuffer(pos, &unused), oldFb.width(), oldFb.height(),
+      				oldFb.getPF().bpp / 8);
+    }
     // Invalidating lossy areas is not needed, the lossy region tracking tracks copies too
   }
 
@@ -747,6 +921,13 @@ bool ComparingUpdateTracker::compare(bool skipScrollDetection, const Region &ski
   for (i = rects.begin(); i != rects.end(); i++)
     compareRect(*i, &newChanged, skipCursorArea);
 
+  // Only after the hashes were taken, compareRect() brought oldFb up to
+  // date in these
+  if (!hashMode) {
+    for (i = rects.begin(); i != rects.end(); i++)
+      scrollHasher->markDirty(*i);
+  }
+
   changed.get_rects(&rects);
   for (i = rects.begin(); i != rects.end(); i++)
     totalPixels += i->area();
@@ -767,6 +948,64 @@ bool ComparingUpdateTracker::compare(bool skipScrollDetection, const Region &ski
   return true;
 }
 
+void ComparingUpdateTracker::hashLines(const Rect& r)
+{
+  const int bytesPerPixel = fb->getPF().bpp/8;
+  const int firstCol = r.tl.x / BLOCK_SIZE;
+  const int lastCol = (r.br.x + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+  int stride;
+  const rdr::U8* data = fb->getBuffer(Rect(0, r.tl.y, fb->width(), r.br.y), &stride);
+  const int strideBytes = stride * bytesPerPixel;
+
+  auto hashLine = [&](const int y) {
+    const rdr::U8* line = data + (y - r.tl.y) * strideBytes;
+    uint64_t* hashes = &lineHashes[y * hashCols];
+
+    for (int col = firstCol; col < lastCol; col++) {
+      const int x = col * BLOCK_SIZE;
+      const int w = __rfbmin(BLOCK_SIZE, fb->width() - x);
+      hashes[col] = XXH64(line + x * bytesPerPixel, w * bytesPerPixel, 0);
+    }
+  };
+
+  if (r.area() >= PARALLEL_MIN_BLOCKS * BLOCK_SIZE * BLOCK_SIZE) {
+    arena.execute([&] {
+      tbb::parallel_for((int) r.tl.y, (int) r.br.y, hashLine);
+    });
+  } else {
+    for (int y = r.tl.y; y < r.br.y; y++)
+      hashLine(y);
+  }
+}
+
+void ComparingUpdateTracker::copyHashes()
+{
+  // The client fills the copied areas from the old frame. Unless they were
+  // also changed afterwards, they now hold what the framebuffer has, so
+  // the hashes can be taken from it. Block lines that were changed get an
+  // invalid hash so compareRect() picks them up.
+  std::vector<Rect> rects, dirty;
+  std::vector<Rect>::const_iterator i, j;
+
+  copied.get_rects(&rects);
+  for (i = rects.begin(); i != rects.end(); i++) {
+    const Rect cols(i->tl.x & ~(BLOCK_SIZE - 1), i->tl.y,
+                    __rfbmin((i->br.x + BLOCK_SIZE - 1) & ~(BLOCK_SIZE - 1), fb->width()),
+                    i->br.y);
+
+    hashLines(cols);
+
+    changed.intersect(cols).get_rects(&dirty);
+    for (j = dirty.begin(); j != dirty.end(); j++) {
+      for (int y = j->tl.y; y < j->br.y; y++) {
+        for (int col = j->tl.x / BLOCK_SIZE; col < (j->br.x + BLOCK_SIZE - 1) / BLOCK_SIZE; col++)
+          lineHashes[y * hashCols + col] = 0;
+      }
+    }
+  }
+}
+
 void ComparingUpdateTracker::enable()
 {
   enabled = true;
@@ -824,7 +1063,11 @@ void ComparingUpdateTracker::compareRect(const Rect& inr, Region* newChanged,
                                          const Region &skipCursorArea)
 {
     Rect r = inr;
-    if (detectScroll && !Server::detectHorizontal)
+    if (hashMode) {
+      // The hashes are kept for whole block columns
+      r.tl.x &= ~(BLOCK_SIZE - 1);
+      r.br.x = __rfbmin((r.br.x + BLOCK_SIZE - 1) & ~(BLOCK_SIZE - 1), fb->width());
+    } else if (detectScroll && !Server::detectHorizontal)
       r.tl.x &= ~(BLOCK_SIZE - 1);
 
   if (!r.enclosed_by(fb->getRect())) {
@@ -836,54 +1079,99 @@ void ComparingUpdateTracker::compareRect(const Rect& inr, Region* newChanged,
     return;
   }
 
-  int bytesPerPixel = fb->getPF().bpp/8;
-  int oldStride;
-  rdr::U8* oldData = oldFb.getBufferRW(r, &oldStride);
-  int oldStrideBytes = oldStride * bytesPerPixel;
+  const int bytesPerPixel = fb->getPF().bpp/8;
+  int oldStride = 0, fbStride;
+  rdr::U8* oldData = hashMode ? NULL : oldFb.getBufferRW(r, &oldStride);
+  const rdr::U8* newData = fb->getBuffer(r, &fbStride);
+  const int oldStrideBytes = oldStride * bytesPerPixel;
+  const int newStrideBytes = fbStride * bytesPerPixel;
+
+  const int blocksWide = (r.width() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  const int blocksHigh = (r.height() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  const int numBlocks = blocksWide * blocksHigh;
+
+  // First find the changed blocks, and bring oldFb up to date for them.
+  // The blocks don't overlap, so this part can run on all cores.
+  blockChanges.resize(numBlocks);
+
+  auto compareBlock = [&](const int i) {
+    const int blockLeft = r.tl.x + (i % blocksWide) * BLOCK_SIZE;
+    const int blockTop = r.tl.y + (i / blocksWide) * BLOCK_SIZE;
+    const int blockRight = __rfbmin(blockLeft+BLOCK_SIZE, r.br.x);
+    const int blockBottom = __rfbmin(blockTop+BLOCK_SIZE, r.br.y);
+    const int blockWidthInBytes = (blockRight-blockLeft) * bytesPerPixel;
+    const int rows = blockBottom - blockTop;
+    const int xoff = (blockLeft - r.tl.x) * bytesPerPixel;
+
+    const rdr::U8* newPtr = newData + (blockTop - r.tl.y) * newStrideBytes + xoff;
+
+    if (hashMode) {
+      // Every line has to be hashed to keep the table current
+      uint64_t* hash = &lineHashes[blockTop * hashCols + blockLeft / BLOCK_SIZE];
+      int y = rows;
+
+      for (int line = 0; line < rows; line++) {
+        const uint64_t lineHash = XXH64(newPtr, blockWidthInBytes, 0);
+        if (lineHash != *hash) {
+          *hash = lineHash;
+          if (y == rows)
+            y = line;
+        }
+
+        newPtr += newStrideBytes;
+        hash += hashCols;
+      }
+
+      blockChanges[i] = y == rows ? -1 : y;
+      return;
+    }
+
+    rdr::U8* oldPtr = oldData + (blockTop - r.tl.y) * oldStrideBytes + xoff;
+
+    const int y = firstChangedRow(oldPtr, oldStrideBytes, newPtr, newStrideBytes,
+                                  blockWidthInBytes, rows);
+    if (y == rows) {
+      blockChanges[i] = -1;
+      return;
+    }
+
+    // A block has changed - copy the remainder to the oldFb
+    blockChanges[i] = y;
+    newPtr += y * newStrideBytes;
+    oldPtr += y * oldStrideBytes;
+    for (int y2 = y; y2 < rows; y2++) {
+      memcpy(oldPtr, newPtr, blockWidthInBytes);
+      newPtr += newStrideBytes;
+      oldPtr += oldStrideBytes;
+    }
+  };
+
+  if (numBlocks >= PARALLEL_MIN_BLOCKS) {
+    arena.execute([&] {
+      tbb::parallel_for(0, numBlocks, compareBlock);
+    });
+  } else {
+    for (int i = 0; i < numBlocks; i++)
+      compareBlock(i);
+  }
 
+  // Then collect the results in order, trying to find the changed blocks
+  // elsewhere in the old frame if scroll detection is on
   std::vector<Rect> changedBlocks;
 
+  const int *blockChange = blockChanges.data();
   for (int blockTop = r.tl.y; blockTop < r.br.y; blockTop += BLOCK_SIZE)
   {
-    // Get a strip of the source buffer
-    Rect pos(r.tl.x, blockTop, r.br.x, __rfbmin(r.br.y, blockTop+BLOCK_SIZE));
-    int fbStride;
-    const rdr::U8* newBlockPtr = fb->getBuffer(pos, &fbStride);
-    int newStrideBytes = fbStride * bytesPerPixel;
-
-    rdr::U8* oldBlockPtr = oldData;
+    const rdr::U8* newBlockPtr = newData + (blockTop - r.tl.y) * newStrideBytes;
     int blockBottom = __rfbmin(blockTop+BLOCK_SIZE, r.br.y);
 
-    for (int blockLeft = r.tl.x; blockLeft < r.br.x; blockLeft += BLOCK_SIZE)
+    for (int blockLeft = r.tl.x; blockLeft < r.br.x; blockLeft += BLOCK_SIZE, blockChange++)
     {
-      const rdr::U8* newPtr = newBlockPtr;
-      rdr::U8* oldPtr = oldBlockPtr;
-
       int blockRight = __rfbmin(blockLeft+BLOCK_SIZE, r.br.x);
       int blockWidthInBytes = (blockRight-blockLeft) * bytesPerPixel;
-      bool changed = false;
-      int y;
-
-      for (y = blockTop; y < blockBottom; y++)
-      {
-        if (memcmp(oldPtr, newPtr, blockWidthInBytes) != 0)
-        {
-          // A block has changed - copy the remainder to the oldFb
-          changed = true;
-          const rdr::U8* savedPtr = newPtr;
-          for (int y2 = y; y2 < blockBottom; y2++)
-          {
-            memcpy(oldPtr, newPtr, blockWidthInBytes);
-            newPtr += newStrideBytes;
-            oldPtr += oldStrideBytes;
-          }
-          newPtr = savedPtr;
-          break;
-        }
-
-        newPtr += newStrideBytes;
-        oldPtr += oldStrideBytes;
-      }
+      const bool changed = *blockChange >= 0;
+      int y = blockTop + *blockChange;
+      const rdr::U8* newPtr = newBlockPtr + *blockChange * newStrideBytes;
 
       if (!changed || (changed && !detectScroll) ||
           (skipCursorArea.numRects() &&
@@ -892,7 +1180,6 @@ void ComparingUpdateTracker::compareRect(const Rect& inr, Region* newChanged,
           changedBlocks.push_back(Rect(blockLeft, blockTop,
                                        blockRight, blockBottom));
 
-        oldBlockPtr += blockWidthInBytes;
         newBlockPtr += blockWidthInBytes;
         continue;
       }
@@ -916,7 +1203,6 @@ void ComparingUpdateTracker::compareRect(const Rect& inr, Region* newChanged,
 
           scrollHasher->invalidate(blockLeft, blockTop, outlines);
 
-          oldBlockPtr += blockWidthInBytes;
           newBlockPtr += blockWidthInBytes;
           continue;
         }
@@ -948,14 +1234,12 @@ void ComparingUpdateTracker::compareRect(const Rect& inr, Region* newChanged,
         }
       }
 
-      oldBlockPtr += blockWidthInBytes;
       newBlockPtr += blockWidthInBytes;
     }
-
-    oldData += oldStrideBytes * BLOCK_SIZE;
   }
 
-  oldFb.commitBufferRW(r);
+  if (!hashMode)
+    oldFb.commitBufferRW(r);
 
   if (!changedBlocks.empty()) {
     Region temp;
@@ -19,7 +19,10 @@
 #ifndef __RFB_COMPARINGUPDATETRACKER_H__
 #define __RFB_COMPARINGUPDATETRACKER_H__
 
+#include <stdint.h>
+
 #include <rfb/UpdateTracker.h>
+#include <tbb/task_arena.h>
 
 class scrollHasher_t;
 
@@ -52,6 +55,8 @@ namespace rfb {
 
   private:
     void compareRect(const Rect& r, Region* newchanged, const Region &skipCursorArea);
+    void hashLines(const Rect& r);
+    void copyHashes();
     PixelBuffer* fb;
     ManagedPixelBuffer oldFb;
     bool firstCompare;
@@ -61,6 +66,19 @@ namespace rfb {
     rdr::U32 totalPixels, missedPixels;
     scrollHasher_t *scrollHasher;
     std::vector<CopyPassRect> copyPassRects;
+
+    // Index of the first changed line of each block, -1 if unchanged
+    std::vector<int> blockChanges;
+    unsigned (*firstChangedRow)(const rdr::U8 *a, const unsigned astride,
+                                const rdr::U8 *b, const unsigned bstride,
+                                const unsigned lineBytes, const unsigned rows);
+    tbb::task_arena arena;
+
+    // With CompareHashes, a hash of each line of every 64 pixel wide block
+    // column is kept instead of the previous frame in oldFb
+    bool hashMode;
+    int hashCols;
+    std::vector<uint64_t> lineHashes;
   };
 
 }
@@ -62,7 +62,7 @@ ConnParams::ConnParams()
     supportsSetDesktopSize(false), supportsFence(false),
     supportsContinuousUpdates(false), supportsExtendedClipboard(false),
     supportsDisconnectNotify(false),
-    supportsDirectMouse(false),
+    supportsDirectMouse(false), supportsWatermarkDelta(false),
     supportsUdp(false),
     compressLevel(2), qualityLevel(-1), fineQualityLevel(-1),
     subsampling(subsampleUndefined), name_(0), cursorPos_(0, 0), verStrPos(0),
@@ -153,6 +153,7 @@ void ConnParams::setEncodings(int nEncodings, const rdr::S32* encodings)
   supportsQOI = false;
   supportsDisconnectNotify = false;
   supportsDirectMouse = false;
+  supportsWatermarkDelta = false;
   compressLevel = -1;
   qualityLevel = -1;
   fineQualityLevel = -1;
@@ -230,6 +231,10 @@ void ConnParams::setEncodings(int nEncodings, const rdr::S32* encodings)
       supportsDirectMouse = true;
       clientparlog("directMouse", true);
       break;
+    case pseudoEncodingWatermarkDelta:
+      supportsWatermarkDelta = true;
+      clientparlog("watermarkDelta", true);
+      break;
     case pseudoEncodingFence:
       supportsFence = true;
       clientparlog("fence", true);
@@ -0,0 +1,479 @@
+/* Copyright (C) 2026 Kasm Technologies Corp
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <rdr/Deflater.h>
+#include <rdr/Exception.h>
+#include <rdr/MemInStream.h>
+#include <rfb/DamageTrace.h>
+#include <rfb/LogWriter.h>
+#include <rfb/PixelBuffer.h>
+#include <rfb/UpdateTracker.h>
+
+using namespace rfb;
+
+static LogWriter vlog("DamageTrace");
+
+static const char traceMagic[7] = { 'K', 'V', 'N', 'C', 'T', 'R', 'C' };
+static const uint8_t traceVersion = 1;
+
+static const size_t headerLen = sizeof(traceMagic) + 1;
+static const size_t recordHeaderLen = 5;
+
+enum {
+  recordKeyframe = 1,
+  recordFrame = 2,
+  recordCursor = 3,
+  recordCursorPos = 4,
+};
+
+// Cheapest setting, the recording runs inside the frame loop
+static const int traceZlibLevel = 1;
+
+DamageTraceWriter::DamageTraceWriter(const char *path)
+  : needKeyframe(true), start(std::chrono::steady_clock::now()),
+    os(1024 * 1024), bytes(0), frames(0)
+{
+  f = fopen(path, "we");
+  if (!f)
+    throw rdr::SystemException("Failed to create damage trace", errno);
+
+  if (fwrite(traceMagic, sizeof(traceMagic), 1, f) != 1 ||
+      fwrite(&traceVersion, 1, 1, f) != 1) {
+    fclose(f);
+    throw rdr::SystemException("Failed to write damage trace", errno);
+  }
+
+  bytes = headerLen;
+
+  vlog.info("Recording damage to %s", path);
+}
+
+DamageTraceWriter::~DamageTraceWriter()
+{
+  if (f) {
+    fclose(f);
+    vlog.info("Recorded %llu frames, %llu bytes",
+              (unsigned long long) frames, (unsigned long long) bytes);
+  }
+}
+
+uint32_t DamageTraceWriter::now() const
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+           std::chrono::steady_clock::now() - start).count();
+}
+
+void DamageTraceWriter::stop(const char *reason)
+{
+  vlog.error("Damage trace failed: %s, recording stopped", reason);
+  fclose(f);
+  f = NULL;
+}
+
+// Writes out what has been collected in os as one record. On errors the
+// recording stops, the session itself carries on.
+void DamageTraceWriter::record(uint8_t type)
+{
+  const size_t len = os.length();
+  const uint8_t header[recordHeaderLen] = {
+    type,
+    (uint8_t) (len >> 24), (uint8_t) (len >> 16),
+    (uint8_t) (len >> 8), (uint8_t) len,
+  };
+
+  if (fwrite(header, sizeof(header), 1, f) != 1 ||
+      (len && fwrite(os.data(), len, 1, f) != 1)) {
+    stop(strerror(errno));
+  } else {
+    bytes += sizeof(header) + len;
+  }
+
+  os.clear();
+}
+
+bool DamageTraceWriter::compress(const uint8_t *data, size_t len)
+{
+  const rdr::Deflater *deflater = rdr::Deflater::get();
+  size_t packedLen;
+
+  packed.resize(deflater->bound(len));
+  packedLen = deflater->compress(packed.data(), packed.size(), data, len,
+                                 traceZlibLevel);
+  if (!packedLen)
+    return false;
+
+  os.writeBytes(packed.data(), packedLen);
+  return true;
+}
+
+bool DamageTraceWriter::compressPixels(const PixelBuffer *pb,
+                                       const std::vector<Rect> &rects)
+{
+  const size_t bpp = pb->getPF().bpp / 8;
+
+  raw.clear();
+  for (const Rect &r : rects) {
+    int stride;
+    const rdr::U8 *data = pb->getBuffer(r, &stride);
+    const size_t rowBytes = r.width() * bpp;
+
+    for (int y = 0; y < r.height(); y++) {
+      raw.insert(raw.end(), data, data + rowBytes);
+      data += stride * bpp;
+    }
+  }
+
+  return compress(raw.data(), raw.size());
+}
+
+void DamageTraceWriter::frame(const PixelBuffer *pb, const UpdateInfo &ui)
+{
+  std::vector<Rect> rects;
+
+  if (!f)
+    return;
+
+  if (needKeyframe) {
+    // Covers whatever damage there was as well
+    os.writeU32(now());
+    os.writeU16(pb->width());
+    os.writeU16(pb->height());
+    pb->getPF().write(&os);
+    rects.push_back(pb->getRect());
+    if (!compressPixels(pb, rects)) {
+      os.clear();
+      stop("out of memory");
+      return;
+    }
+    record(recordKeyframe);
+
+    needKeyframe = false;
+    frames++;
+    return;
+  }
+
+  if (ui.changed.is_empty() && ui.copied.is_empty())
+    return;
+
+  os.writeU32(now());
+
+  // In the order they have to be applied in, like the CopyRect encoder
+  // sends them
+  ui.copied.get_rects(&rects, ui.copy_delta.x <= 0, ui.copy_delta.y <= 0);
+  os.writeS16(ui.copy_delta.x);
+  os.writeS16(ui.copy_delta.y);
+  os.writeU32(rects.size());
+  for (const Rect &r : rects) {
+    os.writeU16(r.tl.x);
+    os.writeU16(r.tl.y);
+    os.writeU16(r.width());
+    os.writeU16(r.height());
+  }
+
+  ui.changed.get_rects(&rects);
+  os.writeU32(rects.size());
+  for (const Rect &r : rects) {
+    os.writeU16(r.tl.x);
+    os.writeU16(r.tl.y);
+    os.writeU16(r.width());
+    os.writeU16(r.height());
+  }
+  if (!compressPixels(pb, rects)) {
+    os.clear();
+    stop("out of memory");
+    return;
+  }
+
+  record(recordFrame);
+  frames++;
+}
+
+void DamageTraceWriter::cursor(int width, int height, const Point &hotspot,
+                               const rdr::U8 *data)
+{
+  if (!f)
+    return;
+
+  os.writeU32(now());
+  os.writeU16(width);
+  os.writeU16(height);
+  os.writeS16(hotspot.x);
+  os.writeS16(hotspot.y);
+
+  if (!compress(data, (size_t) width * height * 4)) {
+    os.clear();
+    stop("out of memory");
+    return;
+  }
+
+  record(recordCursor);
+}
+
+void DamageTraceWriter::cursorPos(const Point &pos)
+{
+  if (!f)
+    return;
+
+  os.writeU32(now());
+  os.writeS16(pos.x);
+  os.writeS16(pos.y);
+  record(recordCursorPos);
+}
+
+DamageTraceReader::DamageTraceReader(const char *path)
+  : map(NULL), mapLen(0), pos(0), frameCount(0), width_(0), height_(0),
+    time_(0), cursor_(NULL), cursorChanged_(false)
+{
+  struct stat st;
+  int fd;
+
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    throw rdr::SystemException("Failed to open damage trace", errno);
+
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    throw rdr::SystemException("Failed to open damage trace", errno);
+  }
+
+  mapLen = st.st_size;
+  if (mapLen < headerLen) {
+    close(fd);
+    throw rdr::Exception("%s is not a damage trace", path);
+  }
+
+  void *p = mmap(NULL, mapLen, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    throw rdr::SystemException("Failed to map damage trace", errno);
+
+  map = (const uint8_t *) p;
+  madvise(p, mapLen, MADV_WILLNEED);
+
+  if (memcmp(map, traceMagic, sizeof(traceMagic)) ||
+      map[sizeof(traceMagic)] != traceVersion) {
+    munmap((void *) map, mapLen);
+    throw rdr::Exception("%s is not a version %d damage trace", path,
+                         traceVersion);
+  }
+
+  // Index the records once, replay then only walks the index
+  size_t offset = headerLen;
+  while (offset + recordHeaderLen <= mapLen) {
+    Entry e;
+    e.type = map[offset];
+    e.length = (size_t) map[offset + 1] << 24 | map[offset + 2] << 16 |
+               map[offset + 3] << 8 | map[offset + 4];
+    e.offset = offset + recordHeaderLen;
+
+    if (e.length > mapLen - e.offset) {
+      vlog.info("%s is cut off, replaying the first %u frames", path,
+                frameCount);
+      break;
+    }
+
+    if (e.type == recordKeyframe || e.type == recordFrame)
+      frameCount++;
+
+    entries.push_back(e);
+    offset = e.offset + e.length;
+  }
+
+  for (const Entry &e : entries) {
+    if (e.type == recordFrame)
+      break;
+    if (e.type != recordKeyframe)
+      continue;
+
+    rdr::MemInStream is(map + e.offset, e.length);
+    is.skip(4);
+    width_ = is.readU16();
+    height_ = is.readU16();
+    pf.read(&is);
+    break;
+  }
+
+  if (!width_ || !height_) {
+    munmap((void *) map, mapLen);
+    throw rdr::Exception("%s does not start with a keyframe", path);
+  }
+}
+
+DamageTraceReader::~DamageTraceReader()
+{
+  munmap((void *) map, mapLen);
+  delete cursor_;
+}
+
+void DamageTraceReader::unpack(const uint8_t *data, size_t len,
+                               size_t expected)
+{
+  uLongf out = expected;
+
+  raw.resize(expected);
+  if (uncompress(raw.data(), &out, data, len) != Z_OK || out != expected)
+    throw rdr::Exception("Corrupt pixel data in damage trace");
+}
+
+void DamageTraceReader::applyKeyframe(const uint8_t *data, size_t len,
+                                      ModifiablePixelBuffer *pb,
+                                      UpdateTracker *tracker)
+{
+  rdr::MemInStream is(data, len);
+
+  time_ = is.readU32();
+  const int w = is.readU16();
+  const int h = is.readU16();
+  pf.read(&is);
+
+  unpack(is.getptr(), is.avail(), (size_t) w * h * (pf.bpp / 8));
+
+  const Rect r = Rect(0, 0, w, h).intersect(pb->getRect());
+  if (!r.is_empty()) {
+    pb->imageRect(pf, r, raw.data(), w);
+    tracker->add_changed(r);
+  }
+}
+
+void DamageTraceReader::applyFrame(const uint8_t *data, size_t len,
+                                   ModifiablePixelBuffer *pb,
+                                   UpdateTracker *tracker)
+{
+  rdr::MemInStream is(data, len);
+  std::vector<Rect> rects;
+  Region copied;
+  size_t pixels;
+
+  time_ = is.readU32();
+
+  // Copies first, the changed pixels are what ended up on top
+  Point delta;
+  delta.x = is.readS16();
+  delta.y = is.readS16();
+  const Rect bounds = pb->getRect().intersect(pb->getRect().translate(delta));
+
+  for (uint32_t n = is.readU32(); n; n--) {
+    Rect r;
+    r.tl.x = is.readU16();
+    r.tl.y = is.readU16();
+    r.br.x = r.tl.x + is.readU16();
+    r.br.y = r.tl.y + is.readU16();
+
+    r = r.intersect(bounds);
+    if (r.is_empty())
+      continue;
+
+    pb->copyRect(r, delta);
+    copied.assign_union(r);
+  }
+
+  if (!copied.is_empty())
+    tracker->add_copied(copied, delta);
+
+  pixels = 0;
+  for (uint32_t n = is.readU32(); n; n--) {
+    Rect r;
+    r.tl.x = is.readU16();
+    r.tl.y = is.readU16();
+    r.br.x = r.tl.x + is.readU16();
+    r.br.y = r.tl.y + is.readU16();
+
+    rects.push_back(r);
+    pixels += r.area();
+  }
+
+  if (rects.empty())
+    return;
+
+  const size_t bpp = pf.bpp / 8;
+  unpack(is.getptr(), is.avail(), pixels * bpp);
+
+  const uint8_t *src = raw.data();
+  for (const Rect &r : rects) {
+    const Rect clipped = r.intersect(pb->getRect());
+
+    if (!clipped.is_empty()) {
+      const size_t skip = (clipped.tl.y - r.tl.y) * r.width() +
+                          clipped.tl.x - r.tl.x;
+      pb->imageRect(pf, clipped, src + skip * bpp, r.width());
+      tracker->add_changed(clipped);
+    }
+
+    src += r.area() * bpp;
+  }
+}
+
+void DamageTraceReader::applyCursor(const uint8_t *data, size_t len)
+{
+  rdr::MemInStream is(data, len);
+
+  is.skip(4);
+  const int w = is.readU16();
+  const int h = is.readU16();
+  Point hotspot;
+  hotspot.x = is.readS16();
+  hotspot.y = is.readS16();
+
+  unpack(is.getptr(), is.avail(), (size_t) w * h * 4);
+
+  delete cursor_;
+  cursor_ = new Cursor(w, h, hotspot, raw.data());
+  cursorChanged_ = true;
+}
+
+bool DamageTraceReader::next(ModifiablePixelBuffer *pb, UpdateTracker *tracker)
+{
+  cursorChanged_ = false;
+
+  while (pos < entries.size()) {
+    const Entry &e = entries[pos++];
+    const uint8_t *data = map + e.offset;
+
+    switch (e.type) {
+    case recordKeyframe:
+      applyKeyframe(data, e.length, pb, tracker);
+      return true;
+    case recordFrame:
+      applyFrame(data, e.length, pb, tracker);
+      return true;
+    case recordCursor:
+      applyCursor(data, e.length);
+      break;
+    case recordCursorPos: {
+      rdr::MemInStream is(data, e.length);
+      is.skip(4);
+      cursorPos_.x = is.readS16();
+      cursorPos_.y = is.readS16();
+      break;
+    }
+    default:
+      // Something newer, not needed to reproduce the frames
+      break;
+    }
+  }
+
+  return false;
+}
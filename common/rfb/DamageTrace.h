@@ -0,0 +1,150 @@
+/* Copyright (C) 2026 Kasm Technologies Corp
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+// -=- DamageTrace.h
+//
+// Recording of what a session's framebuffer went through, so that it can
+// be replayed offline against the encoders.
+//
+// A trace is a header followed by records. Each record is a type byte and
+// a U32 payload length, so readers can skip types they don't know, and
+// all integers are in network order like the rest of the protocol code.
+//
+//   KEYFRAME   the whole framebuffer, its pixel format and size
+//   FRAME      copied rects and delta, changed rects and their pixels
+//   CURSOR     cursor shape, RGBA
+//   CURSORPOS  pointer position
+//
+// Pixel payloads are zlib compressed per record, so a cut off trace is
+// still usable up to the last complete record.
+
+#ifndef __RFB_DAMAGETRACE_H__
+#define __RFB_DAMAGETRACE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <vector>
+
+#include <rdr/MemOutStream.h>
+#include <rfb/Cursor.h>
+#include <rfb/PixelFormat.h>
+#include <rfb/Region.h>
+
+namespace rfb {
+
+  class PixelBuffer;
+  class ModifiablePixelBuffer;
+  class UpdateTracker;
+  class UpdateInfo;
+
+  class DamageTraceWriter {
+  public:
+    // Throws rdr::SystemException if the file can't be created
+    explicit DamageTraceWriter(const char *path);
+    ~DamageTraceWriter();
+
+    // The next frame is written as a keyframe, e.g. after a resize
+    void invalidate() { needKeyframe = true; }
+
+    // Called once per update with the damage as reported by the desktop,
+    // after the changed areas have been grabbed into pb
+    void frame(const PixelBuffer *pb, const UpdateInfo &ui);
+    void cursor(int width, int height, const Point &hotspot,
+                const rdr::U8 *data);
+    void cursorPos(const Point &pos);
+
+  protected:
+    void record(uint8_t type);
+    void stop(const char *reason);
+    bool compress(const uint8_t *data, size_t len);
+    bool compressPixels(const PixelBuffer *pb, const std::vector<Rect> &rects);
+    uint32_t now() const;
+
+    FILE *f;
+    bool needKeyframe;
+    std::chrono::steady_clock::time_point start;
+    rdr::MemOutStream os;
+    std::vector<uint8_t> raw, packed;
+    uint64_t bytes, frames;
+  };
+
+  class DamageTraceReader {
+  public:
+    // Maps the trace and checks its structure. Throws rdr::Exception if
+    // it isn't a trace or doesn't begin with a keyframe.
+    explicit DamageTraceReader(const char *path);
+    ~DamageTraceReader();
+
+    // Size of the first keyframe, and the format the pixels were
+    // recorded in
+    int width() const { return width_; }
+    int height() const { return height_; }
+    const PixelFormat &getPF() const { return pf; }
+    unsigned frames() const { return frameCount; }
+
+    // Back to the first keyframe
+    void rewind() { pos = 0; }
+
+    // Applies records up to and including the next frame or keyframe to
+    // pb and reports the damage to tracker, the way the desktop would
+    // have. Later keyframes of another size are clipped to pb. Returns
+    // false at the end of the trace.
+    bool next(ModifiablePixelBuffer *pb, UpdateTracker *tracker);
+
+    // Milliseconds into the recording of the last frame returned
+    uint32_t time() const { return time_; }
+
+    // Latest cursor state, and whether it changed with the last frame
+    const Cursor *cursor() const { return cursor_; }
+    const Point &cursorPos() const { return cursorPos_; }
+    bool cursorChanged() const { return cursorChanged_; }
+
+  protected:
+    struct Entry {
+      uint8_t type;
+      size_t offset, length;
+    };
+
+    void unpack(const uint8_t *data, size_t len, size_t expected);
+    void applyKeyframe(const uint8_t *data, size_t len,
+                       ModifiablePixelBuffer *pb, UpdateTracker *tracker);
+    void applyFrame(const uint8_t *data, size_t len,
+                    ModifiablePixelBuffer *pb, UpdateTracker *tracker);
+    void applyCursor(const uint8_t *data, size_t len);
+
+    const uint8_t *map;
+    size_t mapLen;
+    std::vector<Entry> entries;
+    size_t pos;
+    unsigned frameCount;
+
+    int width_, height_;
+    PixelFormat pf;
+    uint32_t time_;
+    std::vector<uint8_t> raw;
+
+    Cursor *cursor_;
+    Point cursorPos_;
+    bool cursorChanged_;
+  };
+
+}
+
+#endif
@@ -18,55 +18,259 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
  * USA.
  */
+#include <algorithm>
+#include <utility>
+
 #include <rfb/EncCache.h>
+#include <rfb/LogWriter.h>
+#include <rfb/PixelBuffer.h>
+#include <rfb/util.h>
+#include <rfb/xxhash.h>
 
 using namespace rfb;
 
-EncCache::EncCache() {
-  enabled = false;
+static LogWriter vlog("EncCache");
+
+// Entries not used for this many frames are dropped
+static const uint32_t MaxIdleFrames = 120;
+// Starting table size, must be a power of two
+static const size_t InitialSlots = 1024;
+// Default budget, until the server configures one
+static const size_t DefaultMaxBytes = 64 * 1024 * 1024;
+
+uint64_t EncId::hash() const {
+  const uint64_t a = ((uint64_t) type << 56) | ((uint64_t) quality << 48) |
+                     ((uint64_t) lowQuality << 40) |
+                     ((uint64_t) scaledw << 16) | scaledh;
+  const uint64_t b = ((uint64_t) x << 48) | ((uint64_t) y << 32) |
+                     ((uint64_t) w << 16) | h;
+
+  // Cheap mixing, the content hash is already well distributed
+  uint64_t v = contentHash ^ (a * 0x9E3779B97F4A7C15ULL) ^ (b * 0xC2B2AE3D27D4EB4FULL);
+  v ^= v >> 31;
+  v *= 0x165667B19E3779F9ULL;
+  v ^= v >> 29;
+  return v;
+}
+
+EncCache::EncCache() : enabled(false), slots(InitialSlots), mask(InitialSlots - 1),
+  entries(0), bytes(0), maxBytes(DefaultMaxBytes), generation(0),
+  hits(0), misses(0), evictions(0) {
 }
 
 EncCache::~EncCache() {
 }
 
+uint64_t EncCache::hashRect(const PixelBuffer *pb, const Rect &rect) {
+  int stride;
+  const rdr::U8 *data = pb->getBuffer(rect, &stride);
+  const unsigned bpp = pb->getPF().bpp / 8;
+  const size_t lineBytes = rect.width() * bpp;
+
+  uint64_t hash = 0;
+  for (int y = 0; y < rect.height(); y++) {
+    hash = XXH64(data, lineBytes, hash);
+    data += stride * bpp;
+  }
+
+  return hash;
+}
+
 void EncCache::clear() {
-  std::map<EncId, const void *>::iterator it;
-  for (it = cache.begin(); it != cache.end(); it++)
-    free((void *) it->second);
+  std::lock_guard<std::mutex> lock(mutex);
+
+  slots.clear();
+  slots.resize(InitialSlots);
+  mask = InitialSlots - 1;
+  entries = 0;
+  bytes = 0;
+}
+
+void EncCache::nextFrame() {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::vector<EncId> stale;
+
+  generation++;
+
+  for (const Slot &slot : slots) {
+    if (slot.used && generation - slot.lastUse > MaxIdleFrames)
+      stale.push_back(slot.id);
+  }
+
+  for (const EncId &id : stale) {
+    remove(find(id, id.hash()));
+    evictions++;
+  }
+}
+
+void EncCache::setMaxBytes(size_t newMax) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  maxBytes = newMax;
+  if (bytes > maxBytes)
+    evict(maxBytes);
+}
+
+void EncCache::add(const EncId &id, std::vector<uint8_t> &&data) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  // Not worth throwing everything else out for
+  if (data.size() > maxBytes / 4)
+    return;
+
+  const uint64_t hash = id.hash();
+  size_t pos = find(id, hash);
+
+  if (slots[pos].used)
+    remove(pos);
+
+  // Free up a bit more than needed so that we don't end up here on
+  // every single insert
+  if (bytes + data.size() > maxBytes) {
+    evict(maxBytes * 3 / 4 > data.size() ? maxBytes * 3 / 4 - data.size() : 0);
+  }
 
-  cache.clear();
+  if ((entries + 1) * 2 > slots.size())
+    rehash(slots.size() * 2);
+
+  pos = find(id, hash);
+
+  Slot &slot = slots[pos];
+  slot.used = true;
+  slot.lastUse = generation;
+  slot.id = id;
+  bytes += data.size();
+  slot.data = std::move(data);
+  entries++;
 }
 
-void EncCache::add(uint8_t type, uint16_t x, uint16_t y, uint16_t w, uint16_t h,
-                   uint32_t len, const void *data) {
+bool EncCache::get(const EncId &id, std::vector<uint8_t> &out) {
+  std::lock_guard<std::mutex> lock(mutex);
 
-  EncId id;
+  Slot &slot = slots[find(id, id.hash())];
+  if (!slot.used) {
+    misses++;
+    return false;
+  }
 
-  id.type = type;
-  id.x = x;
-  id.y = y;
-  id.w = w;
-  id.h = h;
-  id.len = len;
+  slot.lastUse = generation;
+  out = slot.data;
+  hits++;
 
-  cache[id] = data;
+  return true;
 }
 
-const void *EncCache::get(uint8_t type, uint16_t x, uint16_t y, uint16_t w, uint16_t h,
-                          uint32_t &len) const {
+EncCache::Stats EncCache::getStats() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  Stats s;
+
+  s.hits = hits;
+  s.misses = misses;
+  s.evictions = evictions;
+  s.bytes = bytes;
+  s.entries = entries;
+
+  return s;
+}
+
+void EncCache::logStats() const {
+  const Stats s = getStats();
+  char a[1024];
+
+  if (!s.hits && !s.misses)
+    return;
+
+  vlog.info("Shared encodes: %llu hits, %llu misses (%.1f%% hit rate), %llu evictions",
+            (unsigned long long) s.hits, (unsigned long long) s.misses,
+            s.hits * 100.0 / (s.hits + s.misses),
+            (unsigned long long) s.evictions);
+  iecPrefix(s.bytes, "B", a, sizeof(a));
+  vlog.info("  %s in %u entries", a, (unsigned) s.entries);
+}
+
+// Linear probing. Returns the slot holding id, or the free slot where
+// it would be inserted.
+size_t EncCache::find(const EncId &id, const uint64_t hash) const {
+  size_t pos = hash & mask;
+
+  while (slots[pos].used && !(slots[pos].id == id))
+    pos = (pos + 1) & mask;
+
+  return pos;
+}
 
-  EncId id;
+// Backward shift deletion, so that no tombstones are needed
+void EncCache::remove(size_t pos) {
+  size_t next = pos;
+
+  bytes -= slots[pos].data.size();
+  slots[pos].used = false;
+  std::vector<uint8_t>().swap(slots[pos].data);
+  entries--;
+
+  while (true) {
+    next = (next + 1) & mask;
+    if (!slots[next].used)
+      break;
+
+    // Can the entry at next be moved to the hole at pos without
+    // ending up before its home slot?
+    const size_t home = slots[next].id.hash() & mask;
+    const bool stays = pos <= next ? (pos < home && home <= next)
+                                   : (pos < home || home <= next);
+    if (stays)
+      continue;
+
+    slots[pos] = std::move(slots[next]);
+    slots[next].used = false;
+    pos = next;
+  }
+}
+
+void EncCache::evict(size_t targetBytes) {
+  std::vector<std::pair<uint32_t, size_t> > ages;
+  std::vector<EncId> victims;
+  size_t freed = 0;
+
+  if (bytes <= targetBytes)
+    return;
+
+  for (size_t i = 0; i < slots.size(); i++) {
+    if (slots[i].used)
+      ages.push_back(std::make_pair(generation - slots[i].lastUse, i));
+  }
+
+  // Oldest first
+  std::sort(ages.begin(), ages.end(),
+            [](const std::pair<uint32_t, size_t> &a,
+               const std::pair<uint32_t, size_t> &b) {
+              return a.first > b.first;
+            });
+
+  for (const auto &age : ages) {
+    if (bytes - freed <= targetBytes)
+      break;
+    victims.push_back(slots[age.second].id);
+    freed += slots[age.second].data.size();
+  }
+
+  // Positions move around as we delete, so look each one up again
+  for (const EncId &id : victims) {
+    remove(find(id, id.hash()));
+    evictions++;
+  }
+}
 
-  id.type = type;
-  id.x = x;
-  id.y = y;
-  id.w = w;
-  id.h = h;
+void EncCache::rehash(size_t newSize) {
+  std::vector<Slot> old(newSize);
 
-  std::map<EncId, const void *>::const_iterator it = cache.find(id);
-  if (it == cache.end())
-    return NULL;
+  old.swap(slots);
+  mask = newSize - 1;
 
-  len = it->first.len;
-  return it->second;
+  for (Slot &slot : old) {
+    if (!slot.used)
+      continue;
+    Slot &dest = slots[find(slot.id, slot.id.hash())];
+    dest = std::move(slot);
+  }
 }
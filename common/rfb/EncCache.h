@@ -21,7 +21,8 @@
 #ifndef __RFB_ENCCACHE_H__
 #define __RFB_ENCCACHE_H__
 
-#include <map>
+#include <mutex>
+#include <vector>
 
 #include <rdr/types.h>
 
@@ -30,35 +31,92 @@
 
 namespace rfb {
 
+  class PixelBuffer;
+  struct Rect;
+
+  // Identifies one precompressed full-colour subrect. All the full-colour
+  // encoders work on the server's native pixel format, so the payload only
+  // depends on the encoder, the quality it was run at and the pixels it
+  // was given. The latter are identified by their area in the (possibly
+  // scaled) framebuffer and a hash of their contents.
   struct EncId {
     uint8_t type;
+    uint8_t quality;
+    bool lowQuality;
+    uint16_t scaledw, scaledh;
     uint16_t x, y, w, h;
-    uint32_t len;
-
-    bool operator <(const EncId &other) const {
-      return type < other.type ||
-             x < other.x ||
-             y < other.y ||
-             w < other.w ||
-             h < other.h;
+    uint64_t contentHash;
+
+    bool operator ==(const EncId &other) const {
+      return contentHash == other.contentHash &&
+             type == other.type && quality == other.quality &&
+             lowQuality == other.lowQuality &&
+             scaledw == other.scaledw && scaledh == other.scaledh &&
+             x == other.x && y == other.y && w == other.w && h == other.h;
     }
+
+    uint64_t hash() const;
   };
 
+  // Store of compressed rects shared by all connections. The first
+  // connection of each (encoder, quality) class does the encoding, the
+  // others splice the stored payload into their own stream. Entries are
+  // keyed on the source pixels, so they stay valid across frames; they are
+  // dropped when unused for a while or when the byte budget is exceeded,
+  // least recently used first.
+  //
+  // Lookups may come from several encoding threads at once.
   class EncCache {
   public:
     EncCache();
     ~EncCache();
 
+    // Hash of the pixels in rect, as used for EncId::contentHash
+    static uint64_t hashRect(const PixelBuffer *pb, const Rect &rect);
+
     void clear();
-    void add(uint8_t type, uint16_t x, uint16_t y, uint16_t w, uint16_t h,
-             uint32_t len, const void *data);
-    const void *get(uint8_t type, uint16_t x, uint16_t y, uint16_t w, uint16_t h,
-                    uint32_t &len) const;
+    void nextFrame();
+    void setMaxBytes(size_t bytes);
+
+    void add(const EncId &id, std::vector<uint8_t> &&data);
+    bool get(const EncId &id, std::vector<uint8_t> &out);
+
+    struct Stats {
+      uint64_t hits;
+      uint64_t misses;
+      uint64_t evictions;
+      size_t bytes;
+      size_t entries;
+    };
+
+    Stats getStats() const;
+    void logStats() const;
 
     bool enabled;
 
   protected:
-    std::map<EncId, const void *> cache;
+    struct Slot {
+      bool used;
+      uint32_t lastUse;
+      EncId id;
+      std::vector<uint8_t> data;
+    };
+
+    size_t find(const EncId &id, uint64_t hash) const;
+    void remove(size_t pos);
+    void evict(size_t targetBytes);
+    void rehash(size_t newSize);
+
+    std::vector<Slot> slots;
+    size_t mask;
+    size_t entries;
+    size_t bytes;
+    size_t maxBytes;
+    uint32_t generation;
+
+    uint64_t hits, misses, evictions;
+
+    mutable std::mutex mutex;
   };
 }
 
@@ -20,11 +20,13 @@
  */
 
 #include <cstdlib>
+#include <rfb/compare_simd.h>
 #include <rfb/cpuid.h>
 #include <rfb/EncCache.h>
 #include <rfb/EncodeManager.h>
 #include <rfb/Encoder.h>
 #include <rfb/Palette.h>
+#include <rfb/scale_avx2.h>
 #include <rfb/scale_sse2.h>
 #include <rfb/SConnection.h>
 #include <rfb/ServerCore.h>
@@ -35,6 +37,7 @@
 #include <rfb/Watermark.h>
 
 #include <execution>
+#include <memory>
 #include <rfb/HextileEncoder.h>
 #include <rfb/RREEncoder.h>
 #include <rfb/RawEncoder.h>
@@ -169,8 +172,8 @@ static void updateMaxVideoRes(uint16_t *x, uint16_t *y) {
 
 EncodeManager::EncodeManager(SConnection *conn_, EncCache *encCache_, const FFmpeg& ffmpeg_, const video_encoders::EncoderProbe &encoder_probe_) :
     conn(conn_), dynamicQualityMin(-1), dynamicQualityOff(-1), areaCur(0), videoDetected(false), videoTimer(this),
-    watermarkStats(0), maxEncodingTime(0), framesSinceEncPrint(0), ffmpeg(ffmpeg_), ffmpeg_available(ffmpeg.is_available()),
-    encoder_probe(encoder_probe_), encCache(encCache_)
+    watermarkStats(0), watermarkSent(0), maxEncodingTime(0), framesSinceEncPrint(0), ffmpeg(ffmpeg_), ffmpeg_available(ffmpeg.is_available()),
+    encoder_probe(encoder_probe_), encCache(encCache_), prefetchTasks(new tbb::task_group), prefetchPending(false)
 {
     encoders.resize(encoderClassMax, nullptr);
     activeEncoders.resize(encoderTypeMax, encoderRaw);
@@ -232,10 +235,18 @@ EncodeManager::EncodeManager(SConnection *conn_, EncCache *encCache_, const FFmp
 
     const auto num_cores = cpu_info::cores_count;
     arena.initialize(num_cores);
+
+    firstOther = bestFirstOtherPixel();
+
+    if (Server::pipelineEncoding)
+        prefetched.setMaxBytes((size_t) Server::encCacheSize * 1024 * 1024);
 }
 
 EncodeManager::~EncodeManager()
 {
+    waitPrefetch();
+    delete prefetchTasks;
+
     logStats();
 
     delete[] areaPercentages;
@@ -326,6 +337,14 @@ void EncodeManager::logStats()
     siPrefix(watermarkStats, "B", a, sizeof(a));
     vlog.info("  Watermark data sent: %s", a);
   }
+
+  if (Server::pipelineEncoding) {
+    const EncCache::Stats s = prefetched.getStats();
+
+    siPrefix(s.hits, "rects", a, sizeof(a));
+    siPrefix(s.misses, "rects", b, sizeof(b));
+    vlog.info("  Precompressed: %s used, %s missed", a, b);
+  }
 }
 
 bool EncodeManager::supported(int encoding)
@@ -356,14 +375,23 @@ void EncodeManager::writeUpdate(const UpdateInfo& ui, const ScreenSet &layout, c
                                 const RenderedCursor* renderedCursor, bool fullRefreshRequested,
                                 size_t maxUpdateSize)
 {
+    waitPrefetch();
+
     curMaxUpdateSize = maxUpdateSize;
     doUpdate(true, ui.changed, ui.copied, ui.copy_delta, ui.copypassed, layout, pb, renderedCursor, fullRefreshRequested);
+
+    // Whatever wasn't used by now is stale
+    dropPrefetch();
 }
 
 void EncodeManager::writeLosslessRefresh(const Region& req,  const ScreenSet &layout, const PixelBuffer* pb,
                                          const RenderedCursor* renderedCursor,
                                          size_t maxUpdateSize)
 {
+    // Never send a lossy precompressed rect as part of a lossless refresh
+    waitPrefetch();
+    dropPrefetch();
+
     if (videoDetected || video_mode_available)
         return;
 
@@ -405,6 +433,12 @@ void EncodeManager::doUpdate(bool allowLossy, const Region& changed_,
 
     changed = changed_;
 
+    // Keep the scaled copy for low resolution video in step
+    videoScaled.damage(changed_);
+    videoScaled.damage(copied);
+    for (const CopyPassRect &cp: copypassed)
+        videoScaled.damage(cp.rect);
+
     gettimeofday(&start, NULL);
     memset(&jpegstats, 0, sizeof(codecstats_t));
     memset(&webpstats, 0, sizeof(codecstats_t));
@@ -422,6 +456,21 @@ void EncodeManager::doUpdate(bool allowLossy, const Region& changed_,
         changed.assign_subtract(renderedCursor->getEffectiveRect());
     }
 
+    /*
+     * The client keeps the watermark mask, so it only needs what changed
+     * since the generation it has. Clients that can't take partial updates,
+     * or have missed one, get all of it.
+     */
+    const std::vector<watermarkRect_t> *watermarkRects = NULL;
+    bool watermarkAll = false;
+    if (watermarkData && watermarkGen &&
+        (conn->sendWatermark() || watermarkSent != watermarkGen)) {
+        if (!conn->sendWatermark() && conn->cp.supportsWatermarkDelta &&
+            watermarkSent + 1 == watermarkGen)
+            watermarkRects = watermarkDelta();
+        watermarkAll = !watermarkRects;
+    }
+
     if (conn->cp.supportsLastRect)
         nRects = 0xFFFF;
     else {
@@ -430,8 +479,10 @@ void EncodeManager::doUpdate(bool allowLossy, const Region& changed_,
         nRects += computeNumRects(changed);
         nRects += computeNumRects(cursorRegion);
 
-        if (watermarkData)
+        if (watermarkAll)
             nRects++;
+        else if (watermarkRects)
+            nRects += watermarkRects->size();
     }
 
     conn->writer()->writeFramebufferUpdateStart(nRects);
@@ -443,9 +494,17 @@ void EncodeManager::doUpdate(bool allowLossy, const Region& changed_,
 
     bool video_mode = video_mode_available && conn->cp.encoder_config.encoder != KasmVideoEncoders::Encoder::unavailable;
     if (video_mode) {
-        video_mode = updateVideo(changed, layout, pb, fullRefreshRequested);
+        // Everything that moved in pb, the encoders only convert that
+        Region damage(changed_);
+        damage.assign_union(copied);
+        for (const CopyPassRect &cp: copypassed)
+            damage.assign_union(cp.rect);
+
+        video_mode = updateVideo(changed, damage, layout, pb, fullRefreshRequested);
         if (!video_mode)
             conn->cp.encoder_config.encoder = KasmVideoEncoders::Encoder::unavailable;
+        else
+            videoScaled.invalidate();
     }
 
     if (!video_mode) {
@@ -461,22 +520,8 @@ void EncodeManager::doUpdate(bool allowLossy, const Region& changed_,
             writeRects(cursorRegion, renderedCursor);
     }
 
-    if (watermarkData && conn->sendWatermark()) {
-      beforeLength = conn->getOutStream(conn->cp.supportsUdp)->length();
-
-      const Rect rect(0, 0, pb->width(), pb->height());
-      TightEncoder *encoder = ((TightEncoder *) encoders[encoderTight]);
-
-      conn->writer()->startRect(rect, encoder->encoding);
-      encoder->writeWatermarkRect(watermarkData, watermarkDataLen,
-                                  watermarkInfo.r,
-                                  watermarkInfo.g,
-                                  watermarkInfo.b,
-                                  watermarkInfo.a);
-      conn->writer()->endRect();
-
-      watermarkStats += conn->getOutStream(conn->cp.supportsUdp)->length() - beforeLength;
-    }
+    if (watermarkAll || watermarkRects)
+      writeWatermark(watermarkRects, pb);
 
     updateQualities();
 
@@ -484,7 +529,8 @@ void EncodeManager::doUpdate(bool allowLossy, const Region& changed_,
     conn->writer()->writeFramebufferUpdateEnd();
 }
 
-bool EncodeManager::updateVideo(const Region &changed, const ScreenSet &layout, const PixelBuffer *pb, bool fullRefreshRequested) {
+bool EncodeManager::updateVideo(const Region &changed, const Region &damage, const ScreenSet &layout, const PixelBuffer *pb,
+                                bool fullRefreshRequested) {
     auto *screen_encoder_manager = dynamic_cast<ScreenEncoderManager<> *>(encoders[encoderKasmVideo]);
     if (!screen_encoder_manager)
         return false;
@@ -500,7 +546,7 @@ bool EncodeManager::updateVideo(const Region &changed, const ScreenSet &layout,
                 static_cast<uint8_t>(Server::videoQualityCRFCQP)});
     }
 
-    if (!screen_encoder_manager->sync_layout(layout, changed))
+    if (!screen_encoder_manager->sync_layout(layout, damage))
         return false;
 
     static const Palette palette;
@@ -820,6 +866,42 @@ void EncodeManager::writeCopyRects(const Region& copied, const Point& delta)
   lossyRegion.assign_union(lossyCopy);
 }
 
+void EncodeManager::writeWatermark(const std::vector<watermarkRect_t> *rects,
+                                   const PixelBuffer* pb)
+{
+  TightEncoder *encoder = ((TightEncoder *) encoders[encoderTight]);
+  std::vector<watermarkRect_t>::const_iterator i;
+
+  beforeLength = conn->getOutStream(conn->cp.supportsUdp)->length();
+
+  if (rects) {
+    for (i = rects->begin(); i != rects->end(); i++) {
+      conn->writer()->startRect(i->rect, encoder->encoding);
+      encoder->writeWatermarkRect(i->data.data(), i->data.size(),
+                                  watermarkInfo.r,
+                                  watermarkInfo.g,
+                                  watermarkInfo.b,
+                                  watermarkInfo.a);
+      conn->writer()->endRect();
+    }
+  } else {
+    const Rect rect(0, 0, pb->width(), pb->height());
+
+    watermarkPackFull();
+
+    conn->writer()->startRect(rect, encoder->encoding);
+    encoder->writeWatermarkRect(watermarkData, watermarkDataLen,
+                                watermarkInfo.r,
+                                watermarkInfo.g,
+                                watermarkInfo.b,
+                                watermarkInfo.a);
+    conn->writer()->endRect();
+  }
+
+  watermarkSent = watermarkGen;
+  watermarkStats += conn->getOutStream(conn->cp.supportsUdp)->length() - beforeLength;
+}
+
 void EncodeManager::writeSolidRects(Region *changed, const PixelBuffer* pb)
 {
   std::vector<Rect> rects;
@@ -939,6 +1021,8 @@ void EncodeManager::checkWebpFallback(const timeval *start) {
 bool EncodeManager::handleTimeout(Timer* t)
 {
   if (t == &videoTimer) {
+    waitPrefetch();
+
     videoDetected = false;
 
     unsigned videoTime = rfb::Server::videoTime;
@@ -990,56 +1074,56 @@ void EncodeManager::updateVideoStats(const std::vector<Rect> &rects, const Pixel
   }
 }
 
-PixelBuffer *rfb::nearestScale(const PixelBuffer *pb, const uint16_t w, const uint16_t h,
-                                 const float diff)
+void rfb::nearestScaleRect(const PixelBuffer *pb, ManagedPixelBuffer *newpb,
+                           const Rect &r, const float diff)
 {
-  ManagedPixelBuffer *newpb = new ManagedPixelBuffer(pb->getPF(), w, h);
   uint16_t x, y;
   int oldstride, newstride;
   const rdr::U8 *oldpxorig = pb->getBuffer(pb->getRect(), &oldstride);
   const rdr::U8 *oldpx;
-  rdr::U8 *newpx = newpb->getBufferRW(newpb->getRect(), &newstride);
+  rdr::U8 *newpx = newpb->getBufferRW(r, &newstride);
   const uint16_t bpp = pb->getPF().bpp / 8;
   const float rowstep = 1 / diff;
 
-  for (y = 0; y < h; y++) {
+  for (y = r.tl.y; y < r.br.y; y++) {
     const uint16_t ny = rowstep * y;
     oldpx = oldpxorig + oldstride * bpp * ny;
-    for (x = 0; x < w; x++) {
+    for (x = r.tl.x; x < r.br.x; x++) {
       const uint16_t newx = x / diff;
-      memcpy(&newpx[x * bpp], &oldpx[newx * bpp], bpp);
+      memcpy(&newpx[(x - r.tl.x) * bpp], &oldpx[newx * bpp], bpp);
     }
     newpx += newstride * bpp;
   }
 
-  return newpb;
+  newpb->commitBufferRW(r);
 }
 
-PixelBuffer *rfb::bilinearScale(const PixelBuffer *pb, const uint16_t w, const uint16_t h,
-                                 const float diff)
+void rfb::bilinearScaleRect(const PixelBuffer *pb, ManagedPixelBuffer *newpb,
+                            const Rect &r, const float diff)
 {
-  ManagedPixelBuffer *newpb = new ManagedPixelBuffer(pb->getPF(), w, h);
   uint16_t x, y;
   int oldstride, newstride;
   const rdr::U8 *oldpx = pb->getBuffer(pb->getRect(), &oldstride);
-  rdr::U8 *newpx = newpb->getBufferRW(newpb->getRect(), &newstride);
+  rdr::U8 *newpx = newpb->getBufferRW(r, &newstride);
   const uint16_t bpp = pb->getPF().bpp / 8;
   const float invdiff = 1 / diff;
+  const uint16_t lastx = pb->getRect().width() - 1;
+  const uint16_t lasty = pb->getRect().height() - 1;
 
-  for (y = 0; y < h; y++) {
+  for (y = r.tl.y; y < r.br.y; y++) {
     const float ny = y * invdiff;
     const uint16_t lowy = ny;
-    const uint16_t highy = lowy + 1;
+    const uint16_t highy = lowy < lasty ? lowy + 1 : lasty;
     const uint16_t bot = (ny - lowy) * 256;
     const uint16_t top = 256 - bot;
 
     const rdr::U8 *lowyptr = oldpx + oldstride * bpp * lowy;
     const rdr::U8 *highyptr = oldpx + oldstride * bpp * highy;
 
-    for (x = 0; x < w; x++) {
+    for (x = r.tl.x; x < r.br.x; x++) {
       const float nx = x * invdiff;
       const uint16_t lowx = nx;
-      const uint16_t highx = lowx + 1;
+      const uint16_t highx = lowx < lastx ? lowx + 1 : lastx;
       const uint16_t right = (nx - lowx) * 256;
       const uint16_t left = 256 - right;
 
@@ -1054,91 +1138,160 @@ PixelBuffer *rfb::bilinearScale(const PixelBuffer *pb, const uint16_t w, const u
         val2 += highyptr[highx * bpp + i] * right;
         val2 >>= 8;
 
-        newpx[x * bpp + i] = (val * top + val2 * bot) >> 8;
+        newpx[(x - r.tl.x) * bpp + i] = (val * top + val2 * bot) >> 8;
       }
     }
     newpx += newstride * bpp;
   }
 
-  return newpb;
+  newpb->commitBufferRW(r);
 }
 
-PixelBuffer *rfb::progressiveBilinearScale(const PixelBuffer *pb,
-                                 const uint16_t tgtw, const uint16_t tgth,
-                                 const float tgtdiff)
+rfb::FirstOtherPixelFn rfb::bestFirstOtherPixel()
+{
+  const auto &cpu = cpu_info::CpuFeatures::get();
+
+  if (cpu.has_avx512f())
+    return AVX512_firstOtherPixel;
+  if (cpu.has_avx2())
+    return AVX2_firstOtherPixel;
+  if (cpu.has_sse2())
+    return SSE2_firstOtherPixel;
+  return firstOtherPixel;
+}
+
+bool rfb::analysePixels(const rdr::U32 *buffer, int width, int height, int stride,
+                        Palette *palette, int *rleRuns, int maxColours,
+                        FirstOtherPixelFn firstOther)
 {
-  if (cpu_info::has_sse2) {
-    if (tgtdiff >= 0.5f) {
-      ManagedPixelBuffer *newpb = new ManagedPixelBuffer(pb->getPF(), tgtw, tgth);
+  rdr::U32 colour;
+  int count;
+
+  *rleRuns = 0;
+  palette->clear();
+
+  // For efficiency, we only update the palette on changes in colour
+  colour = buffer[0];
+  count = 0;
+  while (height--) {
+    int x = 0;
+    while (x < width) {
+      if (buffer[x] != colour) {
+        if (!palette->insert(colour, count))
+          return false;
+        if (palette->size() > maxColours)
+          return false;
+
+        // FIXME: This doesn't account for switching lines
+        (*rleRuns)++;
+
+        colour = buffer[x];
+        count = 0;
+      }
 
-      int oldstride, newstride;
-      const rdr::U8 *oldpx = pb->getBuffer(pb->getRect(), &oldstride);
-      rdr::U8 *newpx = newpb->getBufferRW(newpb->getRect(), &newstride);
+      // Single pixel runs are common in photos, so only hand over to the
+      // vector code once the run is seen to continue
+      int end = x + 1;
+      if (end < width && buffer[end] == colour)
+        end += firstOther(buffer + end, width - end, colour);
 
-      SSE2_scale(oldpx, tgtw, tgth, newpx, oldstride, newstride, tgtdiff);
-      return newpb;
+      count += end - x;
+      x = end;
     }
+    buffer += stride;
+  }
 
-    PixelBuffer *newpb;
-    uint16_t neww, newh, oldw, oldh;
-    bool del = false;
+  // Make sure the final pixels also get counted
+  if (!palette->insert(colour, count))
+    return false;
+  if (palette->size() > maxColours)
+    return false;
 
-    do {
-      oldw = pb->getRect().width();
-      oldh = pb->getRect().height();
-      neww = oldw / 2;
-      newh = oldh / 2;
+  return true;
+}
 
-      newpb = new ManagedPixelBuffer(pb->getPF(), neww, newh);
+void rfb::halveRect(const PixelBuffer *pb, ManagedPixelBuffer *newpb, const Rect &r)
+{
+  if (!cpu_info::has_sse2) {
+    bilinearScaleRect(pb, newpb, r, 0.5f);
+    return;
+  }
 
-      int oldstride, newstride;
-      const rdr::U8 *oldpx = pb->getBuffer(pb->getRect(), &oldstride);
-      rdr::U8 *newpx = ((ManagedPixelBuffer *) newpb)->getBufferRW(newpb->getRect(),
-                                                                   &newstride);
+  int oldstride, newstride;
+  const Rect oldr(r.tl.x * 2, r.tl.y * 2, r.br.x * 2, r.br.y * 2);
+  const rdr::U8 *oldpx = pb->getBuffer(oldr, &oldstride);
+  rdr::U8 *newpx = newpb->getBufferRW(r, &newstride);
 
-      SSE2_halve(oldpx, neww, newh, newpx, oldstride, newstride);
+  if (cpu_info::has_avx2)
+    AVX2_halve(oldpx, r.width(), r.height(), newpx, oldstride, newstride);
+  else
+    SSE2_halve(oldpx, r.width(), r.height(), newpx, oldstride, newstride);
 
-      if (del)
-        delete pb;
-      del = true;
+  newpb->commitBufferRW(r);
+}
 
-      pb = newpb;
-    } while (tgtw * 2 < neww);
+void rfb::scaleStepRect(const PixelBuffer *pb, ManagedPixelBuffer *newpb,
+                        const Rect &r, const float diff)
+{
+  if (!cpu_info::has_sse2) {
+    bilinearScaleRect(pb, newpb, r, diff);
+    return;
+  }
 
-    // Final, non-halving step
-    if (tgtw != neww || tgth != newh) {
-      oldw = pb->getRect().width();
-      oldh = pb->getRect().height();
+  int oldstride, newstride;
+  const rdr::U8 *oldpx = pb->getBuffer(pb->getRect(), &oldstride);
+  rdr::U8 *newpx = newpb->getBufferRW(newpb->getRect(), &newstride);
+  const uint16_t w = newpb->getRect().width();
+  const uint16_t h = newpb->getRect().height();
 
-      newpb = new ManagedPixelBuffer(pb->getPF(), tgtw, tgth);
+  if (cpu_info::has_avx2)
+    AVX2_scaleRect(oldpx, w, h, newpx, oldstride, newstride, diff,
+                   r.tl.x, r.tl.y, r.br.x, r.br.y);
+  else
+    SSE2_scaleRect(oldpx, w, h, newpx, oldstride, newstride, diff,
+                   r.tl.x, r.tl.y, r.br.x, r.br.y);
 
-      int oldstride, newstride;
-      const rdr::U8 *oldpx = pb->getBuffer(pb->getRect(), &oldstride);
-      rdr::U8 *newpx = ((ManagedPixelBuffer *) newpb)->getBufferRW(newpb->getRect(),
-                                                                   &newstride);
+  newpb->commitBufferRW(newpb->getRect());
+}
 
-      SSE2_scale(oldpx, tgtw, tgth, newpx, oldstride, newstride, tgtw / (float) oldw);
-      if (del)
-        delete pb;
-    }
+PixelBuffer *rfb::nearestScale(const PixelBuffer *pb, const uint16_t w, const uint16_t h,
+                                 const float diff)
+{
+  ManagedPixelBuffer *newpb = new ManagedPixelBuffer(pb->getPF(), w, h);
+  nearestScaleRect(pb, newpb, newpb->getRect(), diff);
+  return newpb;
+}
 
-    return newpb;
-  } // SSE2
+PixelBuffer *rfb::bilinearScale(const PixelBuffer *pb, const uint16_t w, const uint16_t h,
+                                 const float diff)
+{
+  ManagedPixelBuffer *newpb = new ManagedPixelBuffer(pb->getPF(), w, h);
+  bilinearScaleRect(pb, newpb, newpb->getRect(), diff);
+  return newpb;
+}
 
-  if (tgtdiff >= 0.5f)
-    return bilinearScale(pb, tgtw, tgth, tgtdiff);
+PixelBuffer *rfb::progressiveBilinearScale(const PixelBuffer *pb,
+                                 const uint16_t tgtw, const uint16_t tgth,
+                                 const float tgtdiff)
+{
+  ManagedPixelBuffer *newpb;
 
-  PixelBuffer *newpb;
-  uint16_t neww, newh, oldw, oldh;
+  if (tgtdiff >= 0.5f) {
+    newpb = new ManagedPixelBuffer(pb->getPF(), tgtw, tgth);
+    scaleStepRect(pb, newpb, newpb->getRect(), tgtdiff);
+    return newpb;
+  }
+
+  uint16_t neww, newh, oldw;
   bool del = false;
 
   do {
-    oldw = pb->getRect().width();
-    oldh = pb->getRect().height();
-    neww = oldw / 2;
-    newh = oldh / 2;
+    neww = pb->getRect().width() / 2;
+    newh = pb->getRect().height() / 2;
+
+    newpb = new ManagedPixelBuffer(pb->getPF(), neww, newh);
+    halveRect(pb, newpb, newpb->getRect());
 
-    newpb = bilinearScale(pb, neww, newh, 0.5f);
     if (del)
       delete pb;
     del = true;
@@ -1149,16 +1302,134 @@ PixelBuffer *rfb::progressiveBilinearScale(const PixelBuffer *pb,
   // Final, non-halving step
   if (tgtw != neww || tgth != newh) {
     oldw = pb->getRect().width();
-    oldh = pb->getRect().height();
 
-    newpb = bilinearScale(pb, tgtw, tgth, tgtw / (float) oldw);
-    if (del)
-      delete pb;
+    newpb = new ManagedPixelBuffer(pb->getPF(), tgtw, tgth);
+    scaleStepRect(pb, newpb, newpb->getRect(), tgtw / (float) oldw);
+    delete pb;
   }
 
   return newpb;
 }
 
+void EncodeManager::splitRect(const Rect& rect, std::vector<Rect>& subrects) const
+{
+  int sw, sh;
+  Rect sr;
+
+  const auto w = rect.width();
+  const auto h = rect.height();
+
+  // No split necessary?
+  if ((((w*h) < SubRectMaxArea) && (w < SubRectMaxWidth)) ||
+      (videoDetected && !video_mode_available && !encoders[encoderTightWEBP]->isSupported())) {
+    subrects.push_back(rect);
+    return;
+  }
+
+  if (w <= SubRectMaxWidth)
+    sw = w;
+  else
+    sw = SubRectMaxWidth;
+
+  sh = SubRectMaxArea / sw;
+
+  for (sr.tl.y = rect.tl.y; sr.tl.y < rect.br.y; sr.tl.y += sh) {
+    sr.br.y = sr.tl.y + sh;
+    if (sr.br.y > rect.br.y)
+      sr.br.y = rect.br.y;
+
+    for (sr.tl.x = rect.tl.x; sr.tl.x < rect.br.x; sr.tl.x += sw) {
+      sr.br.x = sr.tl.x + sw;
+      if (sr.br.x > rect.br.x)
+        sr.br.x = rect.br.x;
+
+      subrects.push_back(sr);
+    }
+  }
+}
+
+void EncodeManager::prefetchUpdate(const Region& changed, const PixelBuffer* pb)
+{
+  std::vector<Rect> rects;
+
+  // One batch at a time, and only for the plain lossy path
+  if (prefetchPending || videoDetected || video_mode_available)
+    return;
+  if (activeEncoders[encoderFullColour] != encoderTightJPEG &&
+      activeEncoders[encoderFullColour] != encoderTightWEBP &&
+      activeEncoders[encoderFullColour] != encoderTightQOI)
+    return;
+
+  changed.get_rects(&rects);
+  if (rects.empty())
+    return;
+
+  // The snapshots are taken here, on the main thread, as the workers
+  // must not touch the real framebuffer
+  struct job_t {
+    const SnapshotPixelBuffer *pb;
+    Rect rect;
+  };
+  auto jobs = std::make_shared<std::vector<job_t> >();
+  std::vector<Rect> subrects;
+
+  for (const auto& rect : rects) {
+    snapshots.push_back(new SnapshotPixelBuffer(pb, rect));
+
+    subrects.clear();
+    splitRect(rect, subrects);
+    for (const auto& sr : subrects)
+      jobs->push_back({snapshots.back(), sr});
+  }
+
+  prefetchPending = true;
+
+  arena.execute([&] {
+    prefetchTasks->run([this, jobs] {
+      tbb::parallel_for(static_cast<size_t>(0), jobs->size(), [&](size_t i) {
+        const job_t &job = (*jobs)[i];
+        std::vector<uint8_t> compressed;
+        Palette pal;
+        uint8_t isWebp, fromCache;
+        uint32_t ms;
+        EncId id;
+
+        // Only full colour rects are worth it, the rest is cheap enough
+        // to redo when the update is written
+        if (getEncoderType(job.rect, job.pb, &pal, compressed, &isWebp,
+                           &fromCache, &id, NULL, Rect(), ms) != encoderFullColour ||
+            compressed.empty() || fromCache)
+          return;
+
+        prefetched.add(id, std::move(compressed));
+      });
+    });
+  });
+}
+
+void EncodeManager::waitPrefetch()
+{
+  if (snapshots.empty())
+    return;
+
+  arena.execute([&] {
+    prefetchTasks->wait();
+  });
+
+  for (auto it = snapshots.begin(); it != snapshots.end(); ++it)
+    delete *it;
+  snapshots.clear();
+}
+
+void EncodeManager::dropPrefetch()
+{
+  if (!prefetchPending)
+    return;
+
+  prefetched.clear();
+  prefetchPending = false;
+}
+
 void EncodeManager::writeRects(const Region& changed, const PixelBuffer* pb,
                                const struct timeval *start,
                                const bool mainScreen)
@@ -1166,6 +1437,7 @@ void EncodeManager::writeRects(const Region& changed, const PixelBuffer* pb,
   std::vector<Rect> rects, subrects, scaledrects;
   std::vector<uint8_t> encoderTypes;
   std::vector<uint8_t> isWebp, fromCache;
+  std::vector<EncId> cacheIds;
   std::vector<Palette> palettes;
   std::vector<std::vector<uint8_t> > compresseds;
   std::vector<uint32_t> ms;
@@ -1186,41 +1458,12 @@ void EncodeManager::writeRects(const Region& changed, const PixelBuffer* pb,
   subrects.reserve(rects.size() * 1.5f);
 
   for (const auto& rect : rects) {
-    int sw, sh;
-    Rect sr;
+    const size_t first = subrects.size();
 
-    const auto w = rect.width();
-    const auto h = rect.height();
+    splitRect(rect, subrects);
 
-    // No split necessary?
-    if ((((w*h) < SubRectMaxArea) && (w < SubRectMaxWidth)) ||
-        (videoDetected && !video_mode_available && !encoders[encoderTightWEBP]->isSupported())) {
-      subrects.push_back(rect);
-      trackRectQuality(rect);
-      continue;
-    }
-
-    if (w <= SubRectMaxWidth)
-      sw = w;
-    else
-      sw = SubRectMaxWidth;
-
-    sh = SubRectMaxArea / sw;
-
-    for (sr.tl.y = rect.tl.y; sr.tl.y < rect.br.y; sr.tl.y += sh) {
-      sr.br.y = sr.tl.y + sh;
-      if (sr.br.y > rect.br.y)
-        sr.br.y = rect.br.y;
-
-      for (sr.tl.x = rect.tl.x; sr.tl.x < rect.br.x; sr.tl.x += sw) {
-        sr.br.x = sr.tl.x + sw;
-        if (sr.br.x > rect.br.x)
-          sr.br.x = rect.br.x;
-
-        subrects.push_back(sr);
-        trackRectQuality(sr);
-      }
-    }
+    for (size_t i = first; i < subrects.size(); i++)
+      trackRectQuality(subrects[i]);
   }
 
   const size_t subrects_size = subrects.size();
@@ -1228,6 +1471,7 @@ void EncodeManager::writeRects(const Region& changed, const PixelBuffer* pb,
   encoderTypes.resize(subrects_size);
   isWebp.resize(subrects_size);
   fromCache.resize(subrects_size);
+  cacheIds.resize(subrects_size);
   palettes.resize(subrects_size);
   compresseds.resize(subrects_size);
   scaledrects.resize(subrects_size);
@@ -1248,20 +1492,15 @@ void EncodeManager::writeRects(const Region& changed, const PixelBuffer* pb,
 
     const uint16_t neww = pb->getRect().width() * diff;
     const uint16_t newh = pb->getRect().height() * diff;
-    switch (Server::videoScaling) {
-      case 0:
-        scaledpb = nearestScale(pb, neww, newh,
-                      diff);
-      break;
-      case 1:
-        scaledpb = bilinearScale(pb, neww, newh,
-                      diff);
-      break;
-      case 2:
-        scaledpb = progressiveBilinearScale(pb, neww, newh,
-                      diff);
-      break;
-    }
+    // Only what changed since the last frame gets scaled again. The
+    // cursor has its own buffer so as not to throw away the screen's.
+    ScaledBuffer &scaled = mainScreen ? videoScaled : cursorScaled;
+    if (!mainScreen)
+      cursorScaled.invalidate();
+
+    arena.execute([&] {
+      scaledpb = scaled.scale(pb, neww, newh, diff, Server::videoScaling);
+    });
 
     for (uint32_t i = 0; i < subrects_size; ++i) {
       const Rect old = scaledrects[i] = subrects[i];
@@ -1285,14 +1524,27 @@ void EncodeManager::writeRects(const Region& changed, const PixelBuffer* pb,
           scaledrects[i].tl.y--;
       }
     }
+  } else if (mainScreen) {
+    videoScaled.invalidate();
   }
   scalingTime = msSince(&scalestart);
 
+  // Lossless Tight rects can be compressed alongside the lossy ones if
+  // each gets fresh zlib streams. UDP clients have that already.
+  const bool zlibInParallel = (Server::parallelZlib || conn->cp.supportsUdp) &&
+                              !scaledpb;
+  if (zlibInParallel) {
+    ((TightEncoder *) encoders[encoderTight])->resetZlib();
+  }
+
     arena.execute([&] {
         tbb::parallel_for(static_cast<size_t>(0), subrects_size, [&](size_t i) {
             encoderTypes[i] = getEncoderType(subrects[i], pb, &palettes[i], compresseds[i],
                         &isWebp[i], &fromCache[i],
+                        mainScreen ? &cacheIds[i] : nullptr,
                         scaledpb, scaledrects[i], ms[i]);
+            if (zlibInParallel && compresseds[i].empty())
+                compressLossless(subrects[i], pb, encoderTypes[i], palettes[i], compresseds[i]);
             checkWebpFallback(start);
         });
     });
@@ -1328,25 +1580,20 @@ void EncodeManager::writeRects(const Region& changed, const PixelBuffer* pb,
     activeEncoders[encoderFullColour] = encoderTightJPEG;
 
   for (uint32_t i = 0; i < subrects_size; ++i) {
-    if (encCache->enabled && !compresseds[i].empty() && !fromCache[i] &&
-    !encoders[encoderTightQOI]->isSupported()) {
-      void *tmp = malloc(compresseds[i].size());
-      memcpy(tmp, &compresseds[i][0], compresseds[i].size());
-      encCache->add(isWebp[i] ? encoderTightWEBP : encoderTightJPEG,
-                    subrects[i].tl.x, subrects[i].tl.y, subrects[i].width(), subrects[i].height(),
-                    compresseds[i].size(), tmp);
-    }
-
     writeSubRect(subrects[i], pb, encoderTypes[i], palettes[i], compresseds[i], isWebp[i]);
-  }
 
-  if (scaledpb)
-    delete scaledpb;
+    // Hand our payload over to the other connections of this frame. The
+    // rendered cursor area is never shared, it is specific to us.
+    if (mainScreen && encCache->enabled && !compresseds[i].empty() && !fromCache[i] &&
+        activeEncoders[encoderTypes[i]] != encoderTight)
+      encCache->add(cacheIds[i], std::move(compresseds[i]));
+  }
 }
 
 uint8_t EncodeManager::getEncoderType(const Rect& rect, const PixelBuffer *pb,
                                       Palette *pal, std::vector<uint8_t> &compressed,
                                       uint8_t *isWebp, uint8_t *fromCache,
+                                      EncId *cacheId,
                                       const PixelBuffer *scaledpb, const Rect& scaledrect,
                                       uint32_t &ms) const
 {
@@ -1402,21 +1649,47 @@ uint8_t EncodeManager::getEncoderType(const Rect& rect, const PixelBuffer *pb,
   *fromCache = 0;
   ms = 0;
   if (type == encoderFullColour) {
-    uint32_t len;
-    const void *data;
+    bool cached = false;
     struct timeval start;
     gettimeofday(&start, NULL);
 
+    const uint8_t quality = scaledQuality(rect);
+
+    // Which encoder will really run, taking the WEBP fallback into account.
+    // The flag is read once, other threads may set it meanwhile.
+    uint8_t klass = activeEncoders[encoderFullColour];
+    if (klass == encoderTightWEBP && webpTookTooLong.load(std::memory_order_relaxed))
+      klass = encoderTightJPEG;
+
+    if (cacheId && !video_mode_available && (encCache->enabled || prefetchPending)) {
+      cacheId->type = klass;
+      cacheId->quality = quality;
+      cacheId->lowQuality = videoDetected;
+      cacheId->scaledw = scaledpb ? scaledpb->width() : 0;
+      cacheId->scaledh = scaledpb ? scaledpb->height() : 0;
+      cacheId->x = rect.tl.x;
+      cacheId->y = rect.tl.y;
+      cacheId->w = rect.width();
+      cacheId->h = rect.height();
+      cacheId->contentHash = scaledpb ? EncCache::hashRect(scaledpb, scaledrect) :
+                                        EncCache::hashRect(pb, rect);
+
+      if (encCache->enabled)
+        cached = encCache->get(*cacheId, compressed);
+
+      // A rect compressed ahead of time is only used if the quality
+      // hasn't moved since, it would otherwise undo what dynamic quality
+      // just decided
+      if (!cached && prefetchPending)
+        cached = prefetched.get(*cacheId, compressed);
+    }
+
     if (encCache && video_mode_available) {
       // nop, send this as a skip rect
-    } else if (encCache->enabled &&
-        (data = encCache->get(activeEncoders[encoderFullColour],
-                              rect.tl.x, rect.tl.y, rect.width(), rect.height(),
-                              len))) {
-      compressed.resize(len);
-      memcpy(&compressed[0], data, len);
+    } else if (cached) {
+      *isWebp = klass == encoderTightWEBP;
       *fromCache = 1;
-    } else if (activeEncoders[encoderFullColour] == encoderTightWEBP && !webpTookTooLong) {
+    } else if (klass == encoderTightWEBP) {
       if (scaledpb) {
         delete ppb;
         ppb = preparePixelBuffer(scaledrect, scaledpb,
@@ -1428,11 +1701,11 @@ uint8_t EncodeManager::getEncoderType(const Rect& rect, const PixelBuffer *pb,
       }
 
       ((TightWEBPEncoder *) encoders[encoderTightWEBP])->compressOnly(ppb,
-                                                                      scaledQuality(rect),
+                                                                      quality,
                                                                       compressed,
                                                                       videoDetected);
       *isWebp = 1;
-    } else if (activeEncoders[encoderFullColour] == encoderTightQOI) {
+    } else if (klass == encoderTightQOI) {
       if (scaledpb) {
         delete ppb;
         ppb = preparePixelBuffer(scaledrect, scaledpb,
@@ -1444,10 +1717,10 @@ uint8_t EncodeManager::getEncoderType(const Rect& rect, const PixelBuffer *pb,
       }
 
       ((TightQOIEncoder *) encoders[encoderTightQOI])->compressOnly(ppb,
-                                                                      scaledQuality(rect),
+                                                                      quality,
                                                                       compressed,
                                                                       videoDetected);
-    } else if (activeEncoders[encoderFullColour] == encoderTightJPEG || webpTookTooLong) {
+    } else if (klass == encoderTightJPEG) {
       if (scaledpb) {
         delete ppb;
         ppb = preparePixelBuffer(scaledrect, scaledpb,
@@ -1459,7 +1732,7 @@ uint8_t EncodeManager::getEncoderType(const Rect& rect, const PixelBuffer *pb,
       }
 
       ((TightJPEGEncoder *) encoders[encoderTightJPEG])->compressOnly(ppb,
-                                                                      scaledQuality(rect),
+                                                                      quality,
                                                                       compressed,
                                                                       videoDetected);
     }
@@ -1472,6 +1745,28 @@ uint8_t EncodeManager::getEncoderType(const Rect& rect, const PixelBuffer *pb,
   return type;
 }
 
+void EncodeManager::compressLossless(const Rect& rect, const PixelBuffer *pb,
+                                     const uint8_t type, const Palette &pal,
+                                     std::vector<uint8_t> &compressed) const
+{
+  PixelBuffer *ppb;
+  const Encoder *encoder;
+
+  if (type == encoderSolid || pal.size() == 1 || activeEncoders[type] != encoderTight)
+    return;
+
+  // Full colour rects without data are skip rects in video mode
+  if (type == encoderFullColour && video_mode_available)
+    return;
+
+  encoder = encoders[encoderTight];
+  ppb = preparePixelBuffer(rect, pb, !(encoder->flags & EncoderUseNativePF));
+
+  ((const TightEncoder *) encoder)->compressOnly(ppb, pal, compressed);
+
+  delete ppb;
+}
+
 void EncodeManager::writeSubRect(const Rect& rect, const PixelBuffer *pb,
                                  const uint8_t type, const Palette &pal,
                                  const std::vector<uint8_t> &compressed,
@@ -1479,10 +1774,15 @@ void EncodeManager::writeSubRect(const Rect& rect, const PixelBuffer *pb,
 {
   PixelBuffer *ppb;
   Encoder *encoder;
+  const bool lossless = compressed.size() && !isWebp &&
+                        activeEncoders[type] == encoderTight;
 
-  encoder = startRect(rect, type, compressed.size() == 0, isWebp ? STARTRECT_OVERRIDE_WEBP : STARTRECT_NO_OVERRIDE);
+  encoder = startRect(rect, type, compressed.size() == 0 || lossless,
+                      isWebp ? STARTRECT_OVERRIDE_WEBP : STARTRECT_NO_OVERRIDE);
 
-  if (compressed.size()) {
+  if (lossless) {
+    ((TightEncoder *) encoder)->writeOnly(compressed);
+  } else if (compressed.size()) {
     if (isWebp) {
       ((TightWEBPEncoder *) encoder)->writeOnly(compressed);
       webpstats.area += rect.area();
@@ -1695,6 +1995,20 @@ rdr::U8* EncodeManager::OffsetPixelBuffer::getBufferRW(const Rect& r, int* strid
   throw rfb::Exception("Invalid write attempt to OffsetPixelBuffer");
 }
 
+EncodeManager::SnapshotPixelBuffer::SnapshotPixelBuffer(const PixelBuffer* pb,
+                                                        const Rect& area_)
+  : ManagedPixelBuffer(pb->getPF(), area_.width(), area_.height()),
+    area(area_)
+{
+  pb->getImage(data, area, stride);
+}
+
+const rdr::U8* EncodeManager::SnapshotPixelBuffer::getBuffer(const Rect& r,
+                                                             int* stride_) const
+{
+  return ManagedPixelBuffer::getBuffer(r.translate(area.tl.negate()), stride_);
+}
+
 // Preprocessor generated, optimised methods
 
 #define BPP 8
@@ -25,14 +25,17 @@
 #include <list>
 
 #include <rdr/types.h>
+#include <rfb/EncCache.h>
 #include <rfb/PixelBuffer.h>
 #include <rfb/Region.h>
+#include <rfb/ScaledBuffer.h>
 #include <rfb/Timer.h>
 #include <rfb/UpdateTracker.h>
 
 #include <atomic>
 #include <sys/time.h>
 #include <tbb/task_arena.h>
+#include <tbb/task_group.h>
 
 #include "ScreenSet.h"
 #include "ffmpeg.h"
@@ -44,6 +47,8 @@ enum startRectOverride {
   STARTRECT_OVERRIDE_KASMVIDEO,
 };
 
+struct watermarkRect_t;
+
 namespace rfb {
   class SConnection;
   class Encoder;
@@ -51,12 +56,15 @@ namespace rfb {
   class Palette;
   class PixelBuffer;
   class RenderedCursor;
-  class EncCache;
   struct Rect;
 
   struct RectInfo;
   struct QualityInfo;
 
+  // Finds the end of a run of one colour, see compare_simd.h
+  typedef unsigned (*FirstOtherPixelFn)(const uint32_t *px, const unsigned n,
+                                        const uint32_t colour);
+
   class EncodeManager: public Timer::Callback {
   public:
     EncodeManager(SConnection* conn, EncCache *encCache, const FFmpeg& ffmpeg, const video_encoders::EncoderProbe &encoder_probe_);
@@ -78,6 +86,13 @@ namespace rfb {
                               const RenderedCursor* renderedCursor,
                               size_t maxUpdateSize);
 
+    // Start compressing the given changes in the background, while the
+    // previous update is still being sent. The next writeUpdate() reuses
+    // whatever matches. waitPrefetch() must be called before anything the
+    // encoders depend on (pixel format, encodings) is changed.
+    void prefetchUpdate(const Region& changed, const PixelBuffer* pb);
+    void waitPrefetch();
+
     void clearEncodingTime() {
         encodingTime = 0;
     };
@@ -108,7 +123,8 @@ namespace rfb {
                   const RenderedCursor* renderedCursor,
                   bool fullRefreshRequested = false);
 
-    bool updateVideo(const Region& changed, const ScreenSet &layout, const PixelBuffer* pb, bool fullRefreshRequested);
+    bool updateVideo(const Region& changed, const Region& damage, const ScreenSet &layout, const PixelBuffer* pb,
+                     bool fullRefreshRequested);
 
     void prepareEncoders(bool allowLossy);
 
@@ -123,7 +139,11 @@ namespace rfb {
     void writeCopyRects(const Region& copied, const Point& delta);
     void writeCopyPassRects(const std::vector<CopyPassRect>& copypassed);
     void writeSolidRects(Region *changed, const PixelBuffer* pb);
+    void writeWatermark(const std::vector<watermarkRect_t> *rects,
+                        const PixelBuffer* pb);
     void findSolidRect(const Rect& rect, Region *changed, const PixelBuffer* pb);
+    void splitRect(const Rect& rect, std::vector<Rect>& subrects) const;
+    void dropPrefetch();
     void writeRects(const Region& changed, const PixelBuffer* pb,
                     const struct timeval *start = nullptr,
                     bool mainScreen = false);
@@ -136,9 +156,11 @@ namespace rfb {
 
     uint8_t getEncoderType(const Rect& rect, const PixelBuffer *pb, Palette *pal,
                            std::vector<uint8_t> &compressed, uint8_t *isWebp,
-                           uint8_t *fromCache,
+                           uint8_t *fromCache, EncId *cacheId,
                            const PixelBuffer *scaledpb, const Rect& scaledrect,
                            uint32_t &ms) const;
+    void compressLossless(const Rect& rect, const PixelBuffer *pb, uint8_t type,
+                          const Palette& pal, std::vector<uint8_t> &compressed) const;
 
     bool handleTimeout(Timer* t) override;
 
@@ -183,6 +205,7 @@ namespace rfb {
   protected:
     SConnection *conn;
     tbb::task_arena arena;
+    FirstOtherPixelFn firstOther;
 
     std::vector<Encoder*> encoders;
     std::vector<int> activeEncoders;
@@ -211,6 +234,7 @@ namespace rfb {
     EncoderStats copyStats;
     StatsVector stats;
     unsigned long long watermarkStats;
+    rdr::U32 watermarkSent;
     int activeType;
     int beforeLength;
     size_t curMaxUpdateSize;
@@ -220,6 +244,11 @@ namespace rfb {
     unsigned encodingTime;
     unsigned maxEncodingTime, framesSinceEncPrint;
     unsigned scalingTime;
+    // The framebuffer at the max video resolution, while video is detected
+    ScaledBuffer videoScaled;
+    // The rendered cursor at the same scale. It changes with whatever is
+    // under it, so it's scaled whole each time.
+    ScaledBuffer cursorScaled;
 
     const FFmpeg &ffmpeg;
     bool ffmpeg_available;
@@ -228,6 +257,11 @@ namespace rfb {
 
     EncCache *encCache;
 
+    // Speculative encodes of the next update, at the quality of the time
+    mutable EncCache prefetched;
+    tbb::task_group *prefetchTasks;
+    bool prefetchPending;
+
     class OffsetPixelBuffer : public FullFramePixelBuffer {
     public:
       OffsetPixelBuffer() = default;
@@ -239,8 +273,47 @@ namespace rfb {
     private:
       rdr::U8* getBufferRW(const Rect& r, int* stride) override;
     };
+
+    // Private copy of one area of the framebuffer, addressed in
+    // framebuffer coordinates. The real one may be replaced at any time.
+    class SnapshotPixelBuffer : public ManagedPixelBuffer {
+    public:
+      SnapshotPixelBuffer(const PixelBuffer* pb, const Rect& area);
+
+      const rdr::U8* getBuffer(const Rect& r, int* stride) const override;
+
+    private:
+      Rect area;
+    };
+
+    std::vector<SnapshotPixelBuffer*> snapshots;
   };
 
+  // Fill the part r of newpb, which is pb scaled by diff. Every target
+  // pixel only depends on the source pixels around it, so any part can be
+  // redone on its own. The SIMD paths work on pixel pairs, so scaleStepRect
+  // only matches a full scale if r's left and right edges are even or at
+  // the right edge of newpb.
+  void nearestScaleRect(const PixelBuffer *pb, ManagedPixelBuffer *newpb,
+                        const Rect &r, const float diff);
+  void bilinearScaleRect(const PixelBuffer *pb, ManagedPixelBuffer *newpb,
+                         const Rect &r, const float diff);
+  // The two kinds of steps of progressiveBilinearScale, halving and a final
+  // one between 0.5 and 1.0
+  void halveRect(const PixelBuffer *pb, ManagedPixelBuffer *newpb, const Rect &r);
+  void scaleStepRect(const PixelBuffer *pb, ManagedPixelBuffer *newpb,
+                     const Rect &r, const float diff);
+
+  // The fastest run finder this cpu supports
+  FirstOtherPixelFn bestFirstOtherPixel();
+
+  // Palette and RLE run estimate of a 32bpp area, giving up once there are
+  // more than maxColours colours. Whole runs are skipped with firstOther,
+  // so the palette sees one insert per run rather than per pixel.
+  bool analysePixels(const rdr::U32 *buffer, int width, int height, int stride,
+                     Palette *palette, int *rleRuns, int maxColours,
+                     FirstOtherPixelFn firstOther);
+
   PixelBuffer *nearestScale(const PixelBuffer *pb, const uint16_t w, const uint16_t h,
                             const float diff);
   PixelBuffer *bilinearScale(const PixelBuffer *pb, const uint16_t w, const uint16_t h,
@@ -35,6 +35,19 @@ inline bool EncodeManager::checkSolidTile(const Rect& r,
   h = r.height();
 
   buffer = (const rdr::UBPP*)pb->getBuffer(r, &stride);
+
+#if BPP == 32
+  if (w >= 8) {
+    while (h--) {
+      if (firstOther(buffer, w, colourValue) != (unsigned) w)
+        return false;
+      buffer += stride;
+    }
+
+    return true;
+  }
+#endif
+
   pad = stride - w;
 
   while (h--) {
@@ -54,6 +67,10 @@ inline bool EncodeManager::analyseRect(int width, int height,
                                        const rdr::UBPP* buffer, int stride,
                                        struct RectInfo *info, int maxColours) const
 {
+#if BPP == 32
+  return analysePixels(buffer, width, height, stride, info->palette,
+                       &info->rleRuns, maxColours, firstOther);
+#else
   int pad;
 
   rdr::UBPP colour;
@@ -95,4 +112,5 @@ inline bool EncodeManager::analyseRect(int width, int height,
     return false;
 
   return true;
+#endif
 }
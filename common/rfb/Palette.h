@@ -28,12 +28,18 @@
 namespace rfb {
   class Palette {
   public:
-    Palette() { clear(); }
+    Palette() : numColours(0) { memset(table, 0xff, sizeof(table)); }
     ~Palette() {}
 
     int size() const { return numColours; }
 
-    void clear() { numColours = 0; memset(hash, 0, sizeof(hash)); }
+    // Only the slots in use need resetting, which is a lot cheaper than
+    // wiping the table for the small palettes most rects have
+    void clear() {
+      for (int i = 0; i < numColours; i++)
+        table[entry[i].slot].idx = -1;
+      numColours = 0;
+    }
 
     inline bool insert(rdr::U32 colour, int numPixels);
     inline unsigned char lookup(rdr::U32 colour) const;
@@ -41,26 +47,27 @@ namespace rfb {
     inline int getCount(unsigned char index) const;
 
   protected:
-    inline unsigned char genHash(rdr::U32 colour) const;
+    inline unsigned genHash(rdr::U32 colour) const;
 
   protected:
     int numColours;
 
-    struct PaletteListNode {
-      PaletteListNode *next;
-      unsigned char idx;
+    // Open addressing with linear probing. There are twice as many slots
+    // as colours, so probe sequences stay short and always end.
+    enum { tableSize = 512 };
+
+    struct PaletteSlot {
       rdr::U32 colour;
+      short idx; // -1 when empty
     };
 
     struct PaletteEntry {
-      PaletteListNode *listNode;
+      rdr::U32 colour;
       int numPixels;
+      unsigned short slot;
     };
 
-    // This is the raw list of colours, allocated from 0 and up
-    PaletteListNode list[256];
-    // Hash table for quick lookup into the list above
-    PaletteListNode *hash[256];
+    PaletteSlot table[tableSize];
     // Occurances of each colour, where the 0:th entry is the most common.
     // Indices also refer to this array.
     PaletteEntry entry[256];
@@ -69,21 +76,17 @@ namespace rfb {
 
 inline bool rfb::Palette::insert(rdr::U32 colour, int numPixels)
 {
-  PaletteListNode* pnode;
-  PaletteListNode* prev_pnode;
-  unsigned char hash_key, idx;
+  unsigned slot;
+  int idx;
 
-  hash_key = genHash(colour);
-
-  pnode = hash[hash_key];
-  prev_pnode = NULL;
+  slot = genHash(colour);
 
   // Do we already have an entry for this colour?
-  while (pnode != NULL) {
-    if (pnode->colour == colour) {
+  while (table[slot].idx >= 0) {
+    if (table[slot].colour == colour) {
       // Yup
 
-      idx = pnode->idx;
+      idx = table[slot].idx;
       numPixels = entry[idx].numPixels + numPixels;
 
       // The extra pixels might mean we have to adjust the sort list
@@ -91,54 +94,41 @@ inline bool rfb::Palette::insert(rdr::U32 colour, int numPixels)
         if (entry[idx-1].numPixels >= numPixels)
           break;
         entry[idx] = entry[idx-1];
-        entry[idx].listNode->idx = idx;
+        table[entry[idx].slot].idx = idx;
         idx--;
       }
 
-      if (idx != pnode->idx) {
-        entry[idx].listNode = pnode;
-        pnode->idx = idx;
-      }
-
+      entry[idx].colour = colour;
       entry[idx].numPixels = numPixels;
+      entry[idx].slot = slot;
+      table[slot].idx = idx;
 
       return true;
     }
 
-    prev_pnode = pnode;
-    pnode = pnode->next;
+    slot = (slot + 1) & (tableSize - 1);
   }
 
   // Check if palette is full.
   if (numColours == 256)
     return false;
 
-  // Create a new colour entry
-  pnode = &list[numColours];
-  pnode->next = NULL;
-  pnode->idx = 0;
-  pnode->colour = colour;
-
-  // Add it to the hash table
-  if (prev_pnode != NULL)
-    prev_pnode->next = pnode;
-  else
-    hash[hash_key] = pnode;
-
   // Move palette entries with lesser pixel counts.
   idx = numColours;
   while (idx > 0) {
     if (entry[idx-1].numPixels >= numPixels)
       break;
     entry[idx] = entry[idx-1];
-    entry[idx].listNode->idx = idx;
+    table[entry[idx].slot].idx = idx;
     idx--;
   }
 
   // And add it into the freed slot.
-  pnode->idx = idx;
-  entry[idx].listNode = pnode;
+  entry[idx].colour = colour;
   entry[idx].numPixels = numPixels;
+  entry[idx].slot = slot;
+  table[slot].colour = colour;
+  table[slot].idx = idx;
 
   numColours++;
 
@@ -147,16 +137,14 @@ inline bool rfb::Palette::insert(rdr::U32 colour, int numPixels)
 
 inline unsigned char rfb::Palette::lookup(rdr::U32 colour) const
 {
-  unsigned char hash_key;
-  PaletteListNode* pnode;
+  unsigned slot;
 
-  hash_key = genHash(colour);
-  pnode = hash[hash_key];
+  slot = genHash(colour);
 
-  while (pnode != NULL) {
-    if (pnode->colour == colour)
-      return pnode->idx;
-    pnode = pnode->next;
+  while (table[slot].idx >= 0) {
+    if (table[slot].colour == colour)
+      return table[slot].idx;
+    slot = (slot + 1) & (tableSize - 1);
   }
 
   // We are being fed a bad colour
@@ -167,7 +155,7 @@ inline unsigned char rfb::Palette::lookup(rdr::U32 colour) const
 
 inline rdr::U32 rfb::Palette::getColour(unsigned char index) const
 {
-  return entry[index].listNode->colour;
+  return entry[index].colour;
 }
 
 inline int rfb::Palette::getCount(unsigned char index) const
@@ -175,16 +163,10 @@ inline int rfb::Palette::getCount(unsigned char index) const
   return entry[index].numPixels;
 }
 
-inline unsigned char rfb::Palette::genHash(rdr::U32 colour) const
+inline unsigned rfb::Palette::genHash(rdr::U32 colour) const
 {
-  unsigned char hash_key;
-
-  // djb2 hash function
-  hash_key = 5; // 5381 & 0xff
-  for (int i = 0; i < 32; i += 8)
-    hash_key = ((hash_key << 5) + hash_key) ^ (colour >> i);
-
-  return hash_key;
+  // Fibonacci hashing, the top bits mix in all of the colour
+  return (colour * 0x9E3779B1u) >> 23;
 }
 
 #endif
@@ -119,3 +119,7 @@ void SMsgHandler::setDesktopSize(int fb_width, int fb_height,
 void SMsgHandler::keepAlive()
 {
 }
+
+void SMsgHandler::udpLossReport(rdr::U32, rdr::U32, rdr::U32, rdr::U32)
+{
+}
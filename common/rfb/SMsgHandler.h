@@ -103,8 +103,12 @@ namespace rfb {
     // client supports the direct mouse extension
     virtual void supportsDirectMouse();
 
-    virtual void udpUpgrade(const char *resp) = 0;
+    virtual void udpUpgrade(const char *resp, const bool fec) = 0;
     virtual void udpDowngrade(const bool) = 0;
+    // Datagrams received and lost since the last report, and how many
+    // packets FEC did and didn't save
+    virtual void udpLossReport(rdr::U32 received, rdr::U32 lost,
+                               rdr::U32 recovered, rdr::U32 failed);
 
     virtual void subscribeUnixRelay(const char *name) = 0;
     virtual void unixRelay(const char *name, const rdr::U8 *buf, const unsigned len) = 0;
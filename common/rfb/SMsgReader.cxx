@@ -111,6 +111,9 @@ void SMsgReader::readMsg()
   case msgTypeDirectMouseEvent:
     readDirectMouseEvent();
     break;
+  case msgTypeUdpLoss:
+    readUdpLoss();
+    break;
   default:
     fprintf(stderr, "unknown message type %d\n", msgType);
     throw Exception("unknown message type");
@@ -374,7 +377,27 @@ void SMsgReader::readUpgradeToUdp()
 
   wuGotHttp(buf, len, resp);
 
-  handler->udpUpgrade(resp);
+  // The client asks for FEC with an extra attribute in its offer, and
+  // learns that we agreed from an extra field in the JSON answer
+  bool fec = false;
+  const size_t resplen = strlen(resp);
+  if (Server::udpFec && resp[0] == '{' && strstr(buf, "a=x-kasm-fec") &&
+      resplen + 16 < sizeof(resp)) {
+    strcpy(&resp[resplen - 1], ",\"kasmFec\":1}");
+    fec = true;
+  }
+
+  handler->udpUpgrade(resp, fec);
+}
+
+void SMsgReader::readUdpLoss()
+{
+  is->skip(3);
+  rdr::U32 received = is->readU32();
+  rdr::U32 lost = is->readU32();
+  rdr::U32 recovered = is->readU32();
+  rdr::U32 failed = is->readU32();
+  handler->udpLossReport(received, lost, recovered, failed);
 }
 
 void SMsgReader::readSubscribeUnixRelay()
@@ -65,6 +65,7 @@ namespace rfb {
     void readQEMUKeyEvent();
 
     void readUpgradeToUdp();
+    void readUdpLoss();
 
     void readSubscribeUnixRelay();
     void readUnixRelay();
@@ -0,0 +1,200 @@
+/* Copyright (C) 2021 Kasm Web
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#include <math.h>
+
+#include <rfb/EncodeManager.h>
+#include <rfb/ScaledBuffer.h>
+#include <tbb/parallel_for.h>
+
+using namespace rfb;
+
+// Rows per parallel task are picked so each covers about this many pixels
+static const int bandPixels = 64 * 1024;
+
+// Run fn over the area, split into bands of rows so the big rects spread
+// over all cores
+template<class F>
+static void forEachBand(const Region &area, F fn)
+{
+  std::vector<Rect> rects, bands;
+
+  area.get_rects(&rects);
+  for (const Rect &r: rects) {
+    const int rows = std::max(8, bandPixels / r.width());
+    for (int y = r.tl.y; y < r.br.y; y += rows)
+      bands.push_back(Rect(r.tl.x, y, r.br.x, std::min(y + rows, (int) r.br.y)));
+  }
+
+  if (bands.size() == 1) {
+    fn(bands[0]);
+    return;
+  }
+
+  tbb::parallel_for(static_cast<size_t>(0), bands.size(), [&](size_t i) {
+    fn(bands[i]);
+  });
+}
+
+// The part of a level that source rect r feeds, shift being how many times
+// it was halved
+static Rect levelRect(const Rect &r, const unsigned shift)
+{
+  const int round = (1 << shift) - 1;
+
+  return Rect(r.tl.x >> shift, r.tl.y >> shift,
+              (r.br.x + round) >> shift, (r.br.y + round) >> shift);
+}
+
+ScaledBuffer::ScaledBuffer() : source(NULL), outLevel(0), outDiff(0),
+                               outMethod(-1)
+{
+}
+
+ScaledBuffer::~ScaledBuffer()
+{
+  invalidate();
+}
+
+void ScaledBuffer::damage(const Region &changed)
+{
+  if (!source)
+    return;
+
+  outDirty.assign_union(changed);
+  for (Region &dirty: levelDirty)
+    dirty.assign_union(changed);
+}
+
+void ScaledBuffer::invalidate()
+{
+  for (ManagedPixelBuffer *level: levels)
+    delete level;
+  levels.clear();
+  levelDirty.clear();
+
+  outDirty.clear();
+  outMethod = -1;
+  source = NULL;
+}
+
+const PixelBuffer *ScaledBuffer::scale(const PixelBuffer *src, const uint16_t w,
+                                       const uint16_t h, const float diff,
+                                       const int method)
+{
+  std::vector<Rect> rects;
+
+  if (src != source || !src->getRect().equals(sourceRect)) {
+    invalidate();
+    source = src;
+    sourceRect = src->getRect();
+  }
+
+  // Halve as many times as progressiveBilinearScale would
+  unsigned nlevels = 0;
+  if (method == Progressive && diff < 0.5f) {
+    uint16_t levelw = sourceRect.width();
+    do {
+      levelw /= 2;
+      nlevels++;
+    } while (w * 2 < levelw);
+  }
+
+  while (levels.size() < nlevels) {
+    const PixelBuffer *prev = levels.empty() ? src : levels.back();
+    levels.push_back(new ManagedPixelBuffer(src->getPF(), prev->width() / 2,
+                                            prev->height() / 2));
+    levelDirty.push_back(Region(sourceRect));
+  }
+
+  for (unsigned i = 0; i < nlevels; i++) {
+    if (levelDirty[i].is_empty())
+      continue;
+
+    const PixelBuffer *from = i ? levels[i - 1] : src;
+    ManagedPixelBuffer *to = levels[i];
+    Region area;
+
+    rects.clear();
+    levelDirty[i].get_rects(&rects);
+    for (const Rect &r: rects)
+      area.assign_union(levelRect(r, i + 1).intersect(to->getRect()));
+
+    forEachBand(area, [&](const Rect &r) {
+      halveRect(from, to, r);
+    });
+
+    levelDirty[i].clear();
+  }
+
+  const PixelBuffer *from = nlevels ? levels[nlevels - 1] : src;
+
+  // An exact halving needs no final step
+  if (nlevels && w == from->width() && h == from->height())
+    return from;
+
+  const float stepDiff = nlevels ? w / (float) from->width() : diff;
+
+  if (w != out.width() || h != out.height() || nlevels != outLevel ||
+      stepDiff != outDiff || method != outMethod) {
+    out.setPF(src->getPF());
+    out.setSize(w, h);
+    outLevel = nlevels;
+    outDiff = stepDiff;
+    outMethod = method;
+    outDirty.reset(sourceRect);
+  }
+
+  if (!outDirty.is_empty()) {
+    Region area;
+
+    // Everything that may read a changed pixel, with a pixel to spare for
+    // float rounding. The SIMD final step works on pairs, so keep the
+    // edges even.
+    rects.clear();
+    outDirty.get_rects(&rects);
+    for (const Rect &r: rects) {
+      const Rect lr = levelRect(r, nlevels);
+      Rect sr((int) floorf((lr.tl.x - 1) * stepDiff) - 1,
+              (int) floorf((lr.tl.y - 1) * stepDiff) - 1,
+              (int) ceilf(lr.br.x * stepDiff) + 1,
+              (int) ceilf(lr.br.y * stepDiff) + 1);
+
+      sr.tl.x &= ~1;
+      sr.br.x += sr.br.x & 1;
+      area.assign_union(sr.intersect(out.getRect()));
+    }
+
+    forEachBand(area, [&](const Rect &r) {
+      switch (method) {
+        case Nearest:
+          nearestScaleRect(from, &out, r, stepDiff);
+        break;
+        case Bilinear:
+          bilinearScaleRect(from, &out, r, stepDiff);
+        break;
+        default:
+          scaleStepRect(from, &out, r, stepDiff);
+      }
+    });
+
+    outDirty.clear();
+  }
+
+  return &out;
+}
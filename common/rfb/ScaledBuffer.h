@@ -0,0 +1,76 @@
+/* Copyright (C) 2021 Kasm Web
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#ifndef __RFB_SCALEDBUFFER_H__
+#define __RFB_SCALEDBUFFER_H__
+
+#include <vector>
+
+#include <rfb/PixelBuffer.h>
+#include <rfb/Region.h>
+
+namespace rfb {
+
+  // A scaled down copy of a framebuffer that is kept from one use to the
+  // next, so that only what lies below a change needs scaling again. The
+  // pixels are the same as nearestScale, bilinearScale or
+  // progressiveBilinearScale would give; the halvings of the latter are
+  // kept as well.
+  //
+  // The scaling runs in parallel, in whatever task arena it's called from.
+  class ScaledBuffer {
+  public:
+    // In the order of the VideoScaling parameter
+    enum Method { Nearest, Bilinear, Progressive };
+
+    ScaledBuffer();
+    ~ScaledBuffer();
+
+    // The source changed in this area, in its own coordinates. Ignored
+    // while there is nothing to keep up to date.
+    void damage(const Region &changed);
+    // Forget everything, the next scale() starts over
+    void invalidate();
+
+    // Returns src scaled by diff to w x h. The result belongs to us and
+    // stays valid until the next call. A different source than last time
+    // means a full scale.
+    const PixelBuffer *scale(const PixelBuffer *src, const uint16_t w,
+                             const uint16_t h, const float diff,
+                             const int method);
+
+  protected:
+    const PixelBuffer *source;
+    Rect sourceRect;
+
+    // levels[i] is the source halved i + 1 times
+    std::vector<ManagedPixelBuffer *> levels;
+    // What changed since each level was last brought up to date, in
+    // source coordinates
+    std::vector<Region> levelDirty;
+
+    ManagedPixelBuffer out;
+    Region outDirty;
+    unsigned outLevel;
+    float outDiff;
+    int outMethod;
+  };
+
+}
+
+#endif
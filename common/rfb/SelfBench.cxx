@@ -16,9 +16,12 @@
  * USA.
  */
 
+#include <rfb/compare_simd.h>
 #include <rfb/ComparingUpdateTracker.h>
 #include <rfb/EncodeManager.h>
+#include <rfb/ScaledBuffer.h>
 #include <rfb/LogWriter.h>
+#include <rfb/Palette.h>
 #include <rfb/SConnection.h>
 #include <rfb/ServerCore.h>
 #include <rfb/PixelBuffer.h>
@@ -41,6 +44,113 @@ static constexpr uint32_t RUNS = 64;
 static constexpr uint32_t WIDTH = 1600;
 static constexpr uint32_t HEIGHT = 1200;
 
+// The palette as it was before the open addressing one, linked hash
+// buckets, along with the per-pixel analysis loop that fed it. Kept as the
+// baseline for the palette cases below.
+class OldPalette {
+public:
+	OldPalette() { clear(); }
+
+	int size() const { return numColours; }
+
+	void clear() { numColours = 0; memset(hash, 0, sizeof(hash)); }
+
+	bool insert(rdr::U32 colour, int numPixels) {
+		ListNode *pnode, *prev = NULL;
+		unsigned char hashKey = 5, idx;
+		int i;
+
+		for (i = 0; i < 32; i += 8)
+			hashKey = ((hashKey << 5) + hashKey) ^ (colour >> i);
+
+		for (pnode = hash[hashKey]; pnode; prev = pnode, pnode = pnode->next) {
+			if (pnode->colour != colour)
+				continue;
+
+			idx = pnode->idx;
+			numPixels += entry[idx].numPixels;
+			while (idx > 0 && entry[idx - 1].numPixels < numPixels) {
+				entry[idx] = entry[idx - 1];
+				entry[idx].listNode->idx = idx;
+				idx--;
+			}
+
+			pnode->idx = idx;
+			entry[idx].listNode = pnode;
+			entry[idx].numPixels = numPixels;
+			return true;
+		}
+
+		if (numColours == 256)
+			return false;
+
+		pnode = &list[numColours];
+		pnode->next = NULL;
+		pnode->colour = colour;
+		if (prev)
+			prev->next = pnode;
+		else
+			hash[hashKey] = pnode;
+
+		idx = numColours;
+		while (idx > 0 && entry[idx - 1].numPixels < numPixels) {
+			entry[idx] = entry[idx - 1];
+			entry[idx].listNode->idx = idx;
+			idx--;
+		}
+
+		pnode->idx = idx;
+		entry[idx].listNode = pnode;
+		entry[idx].numPixels = numPixels;
+		numColours++;
+
+		return true;
+	}
+
+private:
+	struct ListNode {
+		ListNode *next;
+		unsigned char idx;
+		rdr::U32 colour;
+	};
+
+	struct Entry {
+		ListNode *listNode;
+		int numPixels;
+	};
+
+	int numColours;
+	ListNode list[256];
+	ListNode *hash[256];
+	Entry entry[256];
+};
+
+static bool oldAnalysePixels(const rdr::U32 *buffer, int width, int height, int stride,
+                             OldPalette *palette, int *rleRuns, int maxColours) {
+	rdr::U32 colour = buffer[0];
+	int count = 0;
+
+	*rleRuns = 0;
+	palette->clear();
+
+	while (height--) {
+		for (int x = 0; x < width; x++, count++) {
+			if (buffer[x] == colour)
+				continue;
+
+			if (!palette->insert(colour, count) || palette->size() > maxColours)
+				return false;
+
+			(*rleRuns)++;
+			colour = buffer[x];
+			count = 0;
+		}
+		buffer += stride;
+	}
+
+	return palette->insert(colour, count) && palette->size() <= maxColours;
+}
+
 void SelfBench() {
 	tinyxml2::XMLDocument doc;
 
@@ -84,14 +194,8 @@ void SelfBench() {
 	uint32_t test_cases {};
 	uint64_t total_time {};
 
-	auto benchmark = [&doc, &test_suit, &test_cases, &total_time](const char *name, uint32_t runs, auto func) {
-		auto now = std::chrono::high_resolution_clock::now();
-		for (uint32_t i = 0; i < runs; i++) {
-			func(i);
-		}
-
+	auto addCase = [&doc, &test_suit, &test_cases, &total_time](const char *name, uint32_t runs, uint64_t value) {
 		++test_cases;
-		auto value = elapsedMs(now);
 		double junit_value = value / 1000.;
 		total_time += value;
 
@@ -102,6 +206,17 @@ void SelfBench() {
 		test_case->SetAttribute("runs", runs);
 		test_case->SetAttribute("classname", "KasmVNC");
 		test_suit->InsertEndChild(test_case);
+
+		return test_case;
+	};
+
+	auto benchmark = [&addCase](const char *name, uint32_t runs, auto func) {
+		auto now = std::chrono::high_resolution_clock::now();
+		for (uint32_t i = 0; i < runs; i++) {
+			func(i);
+		}
+
+		addCase(name, runs, elapsedMs(now));
 	};
 
 	benchmark("Jpeg compression at quality 8", RUNS, [&jpeg, &vec, &f1](uint32_t) {
@@ -153,6 +268,94 @@ void SelfBench() {
 		delete pb;
 	});
 
+	// A video playing in a tenth of the screen, the rest kept from before
+	ScaledBuffer scaled;
+	const Region videoArea(Rect(WIDTH / 4, HEIGHT / 4,
+	                            WIDTH / 4 + WIDTH / 3, HEIGHT / 4 + HEIGHT / 3));
+
+	scaled.scale(&f1, WIDTH * 0.4, HEIGHT * 0.4, 0.4, ScaledBuffer::Progressive);
+	benchmark("Incremental progressive scaling to 40%, 10% changed", RUNS,
+	          [&f1, &scaled, &videoArea](uint32_t) {
+		scaled.damage(videoArea);
+		scaled.scale(&f1, WIDTH * 0.4, HEIGHT * 0.4, 0.4, ScaledBuffer::Progressive);
+	});
+
+	// Solid and palette analysis, the plain C run finder against the best
+	// one this cpu has, with the old palette as a baseline. Rects are
+	// looked at in 64x64 tiles, as the encoder would for its subrects.
+	ManagedPixelBuffer content(pfRGBX, WIDTH, HEIGHT);
+	rdr::U32 * const contentptr = (rdr::U32 *) content.getBufferRW(content.getRect(), &stride);
+	const FirstOtherPixelFn bestFirstOther = bestFirstOtherPixel();
+	Palette palette;
+
+	auto tileBench = [&benchmark, contentptr, &stride](const char *name, auto func) {
+		benchmark(name, RUNS, [contentptr, &stride, &func](uint32_t) {
+			for (uint32_t y = 0; y < HEIGHT; y += 64) {
+				for (uint32_t x = 0; x < WIDTH; x += 64)
+					func(contentptr + y * stride + x, 64, 64);
+			}
+		});
+	};
+
+	auto solidBench = [&tileBench, &stride](const char *name, FirstOtherPixelFn firstOther) {
+		tileBench(name, [&stride, firstOther](const rdr::U32 *px, int w, int h) {
+			for (int y = 0; y < h; y++, px += stride) {
+				if (firstOther(px, w, px[0]) != (unsigned) w)
+					break;
+			}
+		});
+	};
+
+	auto paletteBench = [&tileBench, &stride, &palette](const char *name, FirstOtherPixelFn firstOther) {
+		tileBench(name, [&stride, &palette, firstOther](const rdr::U32 *px, int w, int h) {
+			int runs;
+			analysePixels(px, w, h, stride, &palette, &runs, 256, firstOther);
+		});
+	};
+
+	OldPalette oldPalette;
+	auto oldPaletteBench = [&tileBench, &stride, &oldPalette](const char *name) {
+		tileBench(name, [&stride, &oldPalette](const rdr::U32 *px, int w, int h) {
+			int runs;
+			oldAnalysePixels(px, w, h, stride, &oldPalette, &runs, 256);
+		});
+	};
+
+	// UI: flat panels with the odd border
+	for (uint32_t y = 0; y < HEIGHT; y++) {
+		for (uint32_t x = 0; x < WIDTH; x++) {
+			const bool border = x % 200 == 0 || y % 150 == 0;
+			contentptr[y * stride + x] = border ? 0x404040 : 0xe0e0e0 + (x / 200 + y / 150) % 4;
+		}
+	}
+
+	solidBench("Solid tile check, C", firstOtherPixel);
+	solidBench("Solid tile check, SIMD", bestFirstOther);
+	oldPaletteBench("Palette analysis of UI, old palette");
+	paletteBench("Palette analysis of UI, C", firstOtherPixel);
+	paletteBench("Palette analysis of UI, SIMD", bestFirstOther);
+
+	// Text: dark glyph strokes with antialiased edges on white
+	for (uint32_t y = 0; y < HEIGHT; y++) {
+		for (uint32_t x = 0; x < WIDTH; x++) {
+			const uint32_t cell = (x / 8 * 7 + y / 16 * 13) % 5;
+			const bool ink = y % 16 < 12 && (x % 8 == cell || x % 8 == cell + 1);
+			const bool edge = y % 16 < 12 && x % 8 == cell + 2;
+			contentptr[y * stride + x] = ink ? 0x202020 : edge ? 0x909090 : 0xffffff;
+		}
+	}
+
+	oldPaletteBench("Palette analysis of text, old palette");
+	paletteBench("Palette analysis of text, C", firstOtherPixel);
+	paletteBench("Palette analysis of text, SIMD", bestFirstOther);
+
+	// Photo: every pixel differs, the palette bails out early
+	memcpy(contentptr, f1orig, WIDTH * HEIGHT * 4);
+
+	oldPaletteBench("Palette analysis of photo, old palette");
+	paletteBench("Palette analysis of photo, C", firstOtherPixel);
+	paletteBench("Palette analysis of photo, SIMD", bestFirstOther);
+
 	// Analysis
 	auto *comparer = new ComparingUpdateTracker(&screen);
 	Region cursorReg;
@@ -184,6 +387,54 @@ void SelfBench() {
 		          comparer->compare(false, cursorReg);
 	          });
 
+	// Raw compare throughput. Only the compare() call is timed, the
+	// frame is prepared outside the measured section.
+	Server::detectScrolling.setParam(false);
+	Server::detectHorizontal.setParam(false);
+	delete comparer;
+	comparer = new ComparingUpdateTracker(&screen);
+
+	auto compareBench = [&addCase, &comparer, &cursorReg, &screen](const char *name, uint32_t runs,
+	                                                              auto prepare) {
+		uint64_t us = 0;
+		for (uint32_t i = 0; i < runs; i++) {
+			prepare(i);
+			comparer->add_changed(screen.getRect());
+
+			auto now = std::chrono::high_resolution_clock::now();
+			comparer->compare(true, cursorReg);
+			us += std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::high_resolution_clock::now() - now).count();
+
+			comparer->clear();
+		}
+
+		const double gbps = (double) WIDTH * HEIGHT * 4 * runs / (us ? us : 1) / 1000.;
+		auto *test_case = addCase(name, runs, us / 1000);
+		test_case->SetAttribute("gbps", gbps);
+		vlog.info("%s: %.2f GB/s", name, gbps);
+	};
+
+	memcpy(screenptr, f1orig, WIDTH * HEIGHT * 4);
+	comparer->compare(true, cursorReg);
+
+	compareBench("Compare, no change", RUNS, [](uint32_t) {});
+
+	compareBench("Compare, sparse change", RUNS, [&screenptr](uint32_t i) {
+		// One pixel in every 16th block
+		for (uint32_t y = i % 64; y < HEIGHT; y += 64) {
+			for (uint32_t x = (y / 64 % 4) * 64; x < WIDTH; x += 64 * 4)
+				screenptr[(y * WIDTH + x) * 4] ^= 0xff;
+		}
+	});
+
+	compareBench("Compare, full change", RUNS,
+	             [&screenptr, f1orig, f2orig](uint32_t i) {
+		memcpy(screenptr, i % 2 ? f1orig : f2orig, WIDTH * HEIGHT * 4);
+	});
+
+	delete comparer;
+
 	test_suit->SetAttribute("tests", test_cases);
 	test_suit->SetAttribute("failures", 0);
 	test_suit->SetAttribute("time", total_time);
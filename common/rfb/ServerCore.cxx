@@ -52,6 +52,11 @@ rfb::IntParameter rfb::Server::compareFB
  "Perform pixel comparison on framebuffer to reduce unnecessary updates "
  "(0: never, 1: always, 2: auto)",
  2);
+rfb::BoolParameter rfb::Server::compareHashes
+("CompareHashes",
+ "Compare the framebuffer using per-line block hashes instead of a copy "
+ "of the previous frame. Saves memory, disables horizontal scroll detection.",
+ false);
 rfb::IntParameter rfb::Server::frameRate
 ("FrameRate",
  "The maximum number of updates per second sent to each client",
@@ -132,6 +137,21 @@ rfb::StringParameter rfb::Server::benchmarkResults(
     "The file to save becnhmark results to.",
     "Benchmark.xml");
 
+rfb::IntParameter rfb::Server::benchmarkClients(
+    "BenchmarkClients",
+    "Run the multi-client benchmark with up to this many clients and exit.",
+    0, 0, 64);
+
+rfb::StringParameter rfb::Server::benchmarkTrace(
+    "BenchmarkTrace",
+    "Run the multi-client benchmark on this damage trace instead of the built-in scenes.",
+    "");
+
+rfb::StringParameter rfb::Server::damageTrace(
+    "DamageTrace",
+    "Record framebuffer damage, copies and cursor changes to this file, for replay with BenchmarkTrace.",
+    "");
+
 rfb::IntParameter rfb::Server::dynamicQualityMin
 ("DynamicQualityMin",
  "The minimum dynamic JPEG quality, 0 = low, 9 = high",
@@ -303,6 +323,11 @@ rfb::IntParameter rfb::Server::udpPort
  "Which port to use for UDP. Default same as websocket",
  0, 0, 65535);
 
+rfb::BoolParameter rfb::Server::udpFec
+("udpFec",
+ "Send forward error correction to UDP clients that support it",
+ true);
+
 rfb::StringParameter rfb::Server::videoCodec
 ("videoCodec",
  "If set, use this codec to send a video stream for WebCodecs. Supported options: auto, h264, h264_vaapi, h265, h265_vaapi, av1, av1_vaapi",
@@ -323,3 +348,26 @@ rfb::IntParameter rfb::Server::webpEncodingTime
 ("webpEncodingTime",
  "Percentage of time allotted for encoding a frame, that can be used for encoding rects in webp.",
  30, 0, 100);
+
+rfb::IntParameter rfb::Server::encCacheSize
+("encCacheSize",
+ "Memory in MB used to share encoded rectangles between clients viewing the same session.",
+ 64, 1, 4096);
+
+rfb::BoolParameter rfb::Server::pipelineEncoding
+("PipelineEncoding",
+ "While a client's previous update is still being sent, start compressing the "
+ "next one in the background.",
+ false);
+
+rfb::BoolParameter rfb::Server::parallelZlib
+("ParallelZlib",
+ "Compress lossless Tight rectangles on all cores. Each rectangle then starts "
+ "a new zlib stream, which costs some compression.",
+ false);
+
+rfb::BoolParameter rfb::Server::concurrentUpdates
+("ConcurrentUpdates",
+ "When several clients are connected, produce their updates in parallel "
+ "instead of one after the other.",
+ false);
@@ -36,6 +36,7 @@ namespace rfb {
         static IntParameter maxIdleTime;
         static IntParameter clientWaitTimeMillis;
         static IntParameter compareFB;
+        static BoolParameter compareHashes;
         static IntParameter frameRate;
         static IntParameter dynamicQualityMin;
         static IntParameter dynamicQualityMax;
@@ -73,6 +74,7 @@ namespace rfb {
         static StringParameter driNode;
         static IntParameter udpFullFrameFrequency;
         static IntParameter udpPort;
+        static BoolParameter udpFec;
         static StringParameter kasmPasswordFile;
         static StringParameter publicIP;
         static StringParameter stunServer;
@@ -95,8 +97,15 @@ namespace rfb {
         static BoolParameter selfBench;
         static StringParameter benchmark;
         static StringParameter benchmarkResults;
+        static IntParameter benchmarkClients;
+        static StringParameter benchmarkTrace;
+        static StringParameter damageTrace;
         static PresetParameter preferBandwidth;
         static IntParameter webpEncodingTime;
+        static IntParameter encCacheSize;
+        static BoolParameter pipelineEncoding;
+        static BoolParameter parallelZlib;
+        static BoolParameter concurrentUpdates;
     };
 };
 
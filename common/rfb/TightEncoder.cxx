@@ -78,19 +78,74 @@ void TightEncoder::setCompressLevel(int level)
 }
 
 void TightEncoder::writeRect(const PixelBuffer* pb, const Palette& palette)
+{
+  if (palette.size() == 1) {
+    Encoder::writeSolidRect(pb, palette);
+    return;
+  }
+
+  Output out = connOutput();
+  writeRect(pb, palette, out);
+}
+
+void TightEncoder::compressOnly(const PixelBuffer* pb, const Palette& palette,
+                                std::vector<uint8_t> &out) const
+{
+  // deflateInit() is expensive, so every thread keeps its streams and
+  // resets them for each rect. One per stream id, as each uses its own
+  // level and changing it costs an extra flush.
+  static thread_local rdr::ZlibOutStream zlib[4];
+  rdr::MemOutStream os, mem;
+  Output o;
+
+  assert(zlibNeedsReset);
+  assert(palette.size() != 1);
+
+  o.os = &os;
+  for (int i = 0; i < 4; i++)
+    o.zlib[i] = &zlib[i];
+  o.mem = &mem;
+  o.reset = true;
+
+  writeRect(pb, palette, o);
+
+  out.assign((const uint8_t *) os.data(),
+             (const uint8_t *) os.data() + os.length());
+}
+
+void TightEncoder::writeOnly(const std::vector<uint8_t> &out) const
+{
+  rdr::OutStream* os;
+
+  os = conn->getOutStream(conn->cp.supportsUdp);
+  os->writeBytes(&out[0], out.size());
+}
+
+TightEncoder::Output TightEncoder::connOutput()
+{
+  Output out;
+
+  out.os = conn->getOutStream(conn->cp.supportsUdp);
+  for (int i = 0; i < 4; i++)
+    out.zlib[i] = &zlibStreams[i];
+  out.mem = &memStream;
+  out.reset = conn->cp.supportsUdp || zlibNeedsReset;
+
+  return out;
+}
+
+void TightEncoder::writeRect(const PixelBuffer* pb, const Palette& palette,
+                             Output& out) const
 {
   switch (palette.size()) {
   case 0:
-    writeFullColourRect(pb, palette);
-    break;
-  case 1:
-    Encoder::writeSolidRect(pb, palette);
+    writeFullColourRect(pb, palette, out);
     break;
   case 2:
-    writeMonoRect(pb, palette);
+    writeMonoRect(pb, palette, out);
     break;
   default:
-    writeIndexedRect(pb, palette);
+    writeIndexedRect(pb, palette, out);
   }
 }
 
@@ -106,7 +161,8 @@ void TightEncoder::writeSolidRect(int width, int height,
   writePixels(colour, pf, 1, os);
 }
 
-void TightEncoder::writeMonoRect(const PixelBuffer* pb, const Palette& palette)
+void TightEncoder::writeMonoRect(const PixelBuffer* pb, const Palette& palette,
+                                 Output& out) const
 {
   const rdr::U8* buffer;
   int stride;
@@ -116,19 +172,20 @@ void TightEncoder::writeMonoRect(const PixelBuffer* pb, const Palette& palette)
   switch (pb->getPF().bpp) {
   case 32:
     writeMonoRect(pb->width(), pb->height(), (rdr::U32*)buffer, stride,
-                  pb->getPF(), palette);
+                  pb->getPF(), palette, out);
     break;
   case 16:
     writeMonoRect(pb->width(), pb->height(), (rdr::U16*)buffer, stride,
-                  pb->getPF(), palette);
+                  pb->getPF(), palette, out);
     break;
   default:
     writeMonoRect(pb->width(), pb->height(), (rdr::U8*)buffer, stride,
-                  pb->getPF(), palette);
+                  pb->getPF(), palette, out);
   }
 }
 
-void TightEncoder::writeIndexedRect(const PixelBuffer* pb, const Palette& palette)
+void TightEncoder::writeIndexedRect(const PixelBuffer* pb, const Palette& palette,
+                                    Output& out) const
 {
   const rdr::U8* buffer;
   int stride;
@@ -138,19 +195,20 @@ void TightEncoder::writeIndexedRect(const PixelBuffer* pb, const Palette& palett
   switch (pb->getPF().bpp) {
   case 32:
     writeIndexedRect(pb->width(), pb->height(), (rdr::U32*)buffer, stride,
-                     pb->getPF(), palette);
+                     pb->getPF(), palette, out);
     break;
   case 16:
     writeIndexedRect(pb->width(), pb->height(), (rdr::U16*)buffer, stride,
-                     pb->getPF(), palette);
+                     pb->getPF(), palette, out);
     break;
   default:
     // It's more efficient to just do raw pixels
-    writeFullColourRect(pb, palette);
+    writeFullColourRect(pb, palette, out);
   }
 }
 
-void TightEncoder::writeFullColourRect(const PixelBuffer* pb, const Palette& palette)
+void TightEncoder::writeFullColourRect(const PixelBuffer* pb, const Palette& palette,
+                                       Output& out) const
 {
   const int streamId = 0;
 
@@ -161,8 +219,8 @@ void TightEncoder::writeFullColourRect(const PixelBuffer* pb, const Palette& pal
   const rdr::U8* buffer;
   int stride, h;
 
-  os = conn->getOutStream(conn->cp.supportsUdp);
-  if (conn->cp.supportsUdp || zlibNeedsReset)
+  os = out.os;
+  if (out.reset)
     os->writeU8((streamId << 4) | (1 << streamId));
   else
     os->writeU8(streamId << 4);
@@ -173,7 +231,7 @@ void TightEncoder::writeFullColourRect(const PixelBuffer* pb, const Palette& pal
   else
     length = pb->getRect().area() * 3;
 
-  zos = getZlibOutStream(streamId, rawZlibLevel, length);
+  zos = getZlibOutStream(out, streamId, rawZlibLevel, length);
 
   // And then just dump all the raw pixels
   buffer = pb->getBuffer(pb->getRect(), &stride);
@@ -185,11 +243,11 @@ void TightEncoder::writeFullColourRect(const PixelBuffer* pb, const Palette& pal
   }
 
   // Finish the zlib stream
-  flushZlibOutStream(zos);
+  flushZlibOutStream(out, zos);
 }
 
 void TightEncoder::writePixels(const rdr::U8* buffer, const PixelFormat& pf,
-                               unsigned int count, rdr::OutStream* os)
+                               unsigned int count, rdr::OutStream* os) const
 {
   rdr::U8 rgb[2048];
 
@@ -213,7 +271,7 @@ void TightEncoder::writePixels(const rdr::U8* buffer, const PixelFormat& pf,
   }
 }
 
-void TightEncoder::writeCompact(rdr::OutStream* os, rdr::U32 value)
+void TightEncoder::writeCompact(rdr::OutStream* os, rdr::U32 value) const
 {
   rdr::U8 b;
   b = value & 0x7F;
@@ -231,27 +289,30 @@ void TightEncoder::writeCompact(rdr::OutStream* os, rdr::U32 value)
   }
 }
 
-rdr::OutStream* TightEncoder::getZlibOutStream(int streamId, int level, size_t length)
+rdr::OutStream* TightEncoder::getZlibOutStream(Output& out, int streamId,
+                                               int level, size_t length) const
 {
+  rdr::ZlibOutStream* zos;
+
   // Minimum amount of data to be compressed. This value should not be
   // changed, doing so will break compatibility with existing clients.
   if (length < 12)
-    return conn->getOutStream(conn->cp.supportsUdp);
+    return out.os;
 
   assert(streamId >= 0);
   assert(streamId < 4);
 
-  zlibStreams[streamId].setUnderlying(&memStream);
-  zlibStreams[streamId].setCompressionLevel(level);
-  if (conn->cp.supportsUdp || zlibNeedsReset)
-    zlibStreams[streamId].resetDeflate();
+  zos = out.zlib[streamId];
+  zos->setUnderlying(out.mem);
+  zos->setCompressionLevel(level);
+  if (out.reset)
+    zos->resetDeflate();
 
-  return &zlibStreams[streamId];
+  return zos;
 }
 
-void TightEncoder::flushZlibOutStream(rdr::OutStream* os_)
+void TightEncoder::flushZlibOutStream(Output& out, rdr::OutStream* os_) const
 {
-  rdr::OutStream* os;
   rdr::ZlibOutStream* zos;
 
   zos = dynamic_cast<rdr::ZlibOutStream*>(os_);
@@ -261,11 +322,9 @@ void TightEncoder::flushZlibOutStream(rdr::OutStream* os_)
   zos->flush();
   zos->setUnderlying(NULL);
 
-  os = conn->getOutStream(conn->cp.supportsUdp);
-
-  writeCompact(os, memStream.length());
-  os->writeBytes(memStream.data(), memStream.length());
-  memStream.clear();
+  writeCompact(out.os, out.mem->length());
+  out.os->writeBytes(out.mem->data(), out.mem->length());
+  out.mem->clear();
 }
 
 void TightEncoder::resetZlib()
@@ -20,6 +20,8 @@
 #ifndef __RFB_TIGHTENCODER_H__
 #define __RFB_TIGHTENCODER_H__
 
+#include <vector>
+
 #include <rdr/MemOutStream.h>
 #include <rdr/ZlibOutStream.h>
 #include <rfb/Encoder.h>
@@ -46,37 +48,67 @@ namespace rfb {
                             const rdr::U8 a);
     void resetZlib();
 
+    // Encodes a rect on its own, with fresh zlib streams, so that it can
+    // be done on any thread and written later with writeOnly(). Only
+    // valid once resetZlib() has been called, as the client's streams
+    // would otherwise go out of step with ours.
+    void compressOnly(const PixelBuffer* pb, const Palette& palette,
+                      std::vector<uint8_t> &out) const;
+    void writeOnly(const std::vector<uint8_t> &out) const;
+
   protected:
-    void writeMonoRect(const PixelBuffer* pb, const Palette& palette);
-    void writeIndexedRect(const PixelBuffer* pb, const Palette& palette);
-    void writeFullColourRect(const PixelBuffer* pb, const Palette& palette);
+    // Where a rect is being written: the connection with our persistent
+    // zlib streams, or a buffer with a stream of the calling thread
+    struct Output {
+      rdr::OutStream* os;
+      rdr::ZlibOutStream* zlib[4];
+      rdr::MemOutStream* mem;
+      bool reset;
+    };
+
+    Output connOutput();
+
+    void writeRect(const PixelBuffer* pb, const Palette& palette,
+                   Output& out) const;
+    void writeMonoRect(const PixelBuffer* pb, const Palette& palette,
+                       Output& out) const;
+    void writeIndexedRect(const PixelBuffer* pb, const Palette& palette,
+                          Output& out) const;
+    void writeFullColourRect(const PixelBuffer* pb, const Palette& palette,
+                             Output& out) const;
 
     void writePixels(const rdr::U8* buffer, const PixelFormat& pf,
-                     unsigned int count, rdr::OutStream* os);
+                     unsigned int count, rdr::OutStream* os) const;
 
-    void writeCompact(rdr::OutStream* os, rdr::U32 value);
+    void writeCompact(rdr::OutStream* os, rdr::U32 value) const;
 
-    rdr::OutStream* getZlibOutStream(int streamId, int level, size_t length);
-    void flushZlibOutStream(rdr::OutStream* os);
+    rdr::OutStream* getZlibOutStream(Output& out, int streamId, int level,
+                                     size_t length) const;
+    void flushZlibOutStream(Output& out, rdr::OutStream* os) const;
 
   protected:
     // Preprocessor generated, optimised methods
     void writeMonoRect(int width, int height,
                        const rdr::U8* buffer, int stride,
-                       const PixelFormat& pf, const Palette& palette);
+                       const PixelFormat& pf, const Palette& palette,
+                       Output& out) const;
     void writeMonoRect(int width, int height,
                        const rdr::U16* buffer, int stride,
-                       const PixelFormat& pf, const Palette& palette);
+                       const PixelFormat& pf, const Palette& palette,
+                       Output& out) const;
     void writeMonoRect(int width, int height,
                        const rdr::U32* buffer, int stride,
-                       const PixelFormat& pf, const Palette& palette);
+                       const PixelFormat& pf, const Palette& palette,
+                       Output& out) const;
 
     void writeIndexedRect(int width, int height,
                           const rdr::U16* buffer, int stride,
-                          const PixelFormat& pf, const Palette& palette);
+                          const PixelFormat& pf, const Palette& palette,
+                          Output& out) const;
     void writeIndexedRect(int width, int height,
                           const rdr::U32* buffer, int stride,
-                          const PixelFormat& pf, const Palette& palette);
+                          const PixelFormat& pf, const Palette& palette,
+                          Output& out) const;
 
     rdr::ZlibOutStream zlibStreams[4];
     rdr::MemOutStream memStream;
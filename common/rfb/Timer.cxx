@@ -22,6 +22,8 @@
 #include <stdio.h>
 #include <sys/time.h>
 
+#include <mutex>
+
 #include <rfb/Timer.h>
 #include <rfb/util.h>
 #include <rfb/LogWriter.h>
@@ -53,8 +55,14 @@ inline static int diffTimeMillis(timeval later, timeval earlier) {
 
 std::list<Timer*> Timer::pending;
 
+// Timers are started and stopped by client updates, which may run on
+// worker threads. The callbacks are run unlocked, as they usually restart
+// their timer.
+static std::mutex pendingLock;
+
 int Timer::checkTimeouts() {
   timeval start;
+  std::unique_lock<std::mutex> lock(pendingLock);
 
   if (pending.empty())
     return 0;
@@ -63,12 +71,16 @@ int Timer::checkTimeouts() {
   while (pending.front()->isBefore(start)) {
     Timer* timer;
     timeval before;
+    bool again;
 
     timer = pending.front();
     pending.pop_front();
 
     gettimeofday(&before, 0);
-    if (timer->cb->handleTimeout(timer)) {
+    lock.unlock();
+    again = timer->cb->handleTimeout(timer);
+    lock.lock();
+    if (again) {
       timeval now;
 
       gettimeofday(&now, 0);
@@ -88,10 +100,15 @@ int Timer::checkTimeouts() {
       return 0;
     }
   }
-  return getNextTimeout();
+  return nextTimeout();
 }
 
 int Timer::getNextTimeout() {
+  std::lock_guard<std::mutex> lock(pendingLock);
+  return nextTimeout();
+}
+
+int Timer::nextTimeout() {
   timeval now;
   gettimeofday(&now, 0);
   int toWait = __rfbmax(1, pending.front()->getRemainingMs());
@@ -121,8 +138,9 @@ void Timer::insertTimer(Timer* t) {
 
 void Timer::start(int timeoutMs_) {
   timeval now;
+  std::lock_guard<std::mutex> lock(pendingLock);
   gettimeofday(&now, 0);
-  stop();
+  pending.remove(this);
   timeoutMs = timeoutMs_;
   // The rest of the code assumes non-zero timeout
   if (timeoutMs <= 0)
@@ -132,10 +150,12 @@ void Timer::start(int timeoutMs_) {
 }
 
 void Timer::stop() {
+  std::lock_guard<std::mutex> lock(pendingLock);
   pending.remove(this);
 }
 
 bool Timer::isStarted() {
+  std::lock_guard<std::mutex> lock(pendingLock);
   std::list<Timer*>::iterator i;
   for (i=pending.begin(); i!=pending.end(); i++) {
     if (*i == this)
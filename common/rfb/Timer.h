@@ -99,6 +99,7 @@ namespace rfb {
     Callback* cb;
 
     static void insertTimer(Timer* t);
+    static int nextTimeout();
     // The list of currently active Timers, ordered by time left until timeout.
     static std::list<Timer*> pending;
   };
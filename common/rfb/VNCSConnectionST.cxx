@@ -39,6 +39,7 @@
 #include <cctype>
 #include <cstdlib>
 #include <cstdint>
+#include <cinttypes>
 #include <wordexp.h>
 
 #include "encoders/EncoderProbe.h"
@@ -222,6 +223,10 @@ void VNCSConnectionST::processMessages()
 {
   if (state() == RFBSTATE_CLOSING) return;
   try {
+    // Messages may change the pixel format or encodings, which the
+    // background encoding depends on
+    encodeManager.waitPrefetch();
+
     // - Now set appropriate socket timeouts and process data
     setSocketTimeouts();
 
@@ -335,6 +340,54 @@ void VNCSConnectionST::writeFramebufferUpdateOrClose()
   }
 }
 
+void VNCSConnectionST::writeFramebufferUpdateDeferClose()
+{
+  try {
+    writeFramebufferUpdate();
+  } catch(rdr::Exception &e) {
+    updateFailure = e.str();
+  }
+}
+
+bool VNCSConnectionST::closeIfUpdateFailed()
+{
+  if (updateFailure.empty())
+    return false;
+
+  close(updateFailure.c_str());
+  updateFailure.clear();
+  return true;
+}
+
+bool VNCSConnectionST::updatePermsOrClose()
+{
+  if (!needsPermCheck)
+    return true;
+
+  needsPermCheck = false;
+
+  bool read, write, owner, ret;
+  ret = getPerms(read, write, owner);
+  if (!ret) {
+    close("User was deleted");
+    return false;
+  }
+
+  if (!write) {
+    accessRights &= ~WRITER_PERMS;
+  } else {
+    accessRights |= WRITER_PERMS;
+  }
+
+  if (!read) {
+    accessRights &= ~AccessView;
+  } else {
+    accessRights |= AccessView;
+  }
+
+  return true;
+}
+
 void VNCSConnectionST::screenLayoutChangeOrClose(rdr::U16 reason)
 {
   try {
@@ -1349,33 +1402,16 @@ void VNCSConnectionST::writeFramebufferUpdate()
     return;
 
   // Check that we actually have some space on the link and retry in a
-  // bit if things are congested.
-  if (isCongested())
+  // bit if things are congested. Meanwhile, get a head start on
+  // compressing what will be sent once it clears.
+  if (isCongested()) {
+    prefetchUpdate();
     return;
+  }
 
   // Check for permission changes?
-  if (needsPermCheck) {
-    needsPermCheck = false;
-
-    bool read, write, owner, ret;
-    ret = getPerms(read, write, owner);
-    if (!ret) {
-      close("User was deleted");
-      return;
-    }
-
-    if (!write) {
-      accessRights &= ~WRITER_PERMS;
-    } else {
-      accessRights |= WRITER_PERMS;
-    }
-
-    if (!read) {
-      accessRights &= ~AccessView;
-    } else {
-      accessRights |= AccessView;
-    }
-  }
+  if (!updatePermsOrClose())
+    return;
 
   if (!(accessRights & AccessView)) {
     if (!complainedAboutNoViewRights) {
@@ -1391,6 +1427,8 @@ void VNCSConnectionST::writeFramebufferUpdate()
   // need to aggregate these in order to not clog up TCP's congestion
   // window.
   sock->cork(true);
+  if (cp.supportsUdp)
+    ((network::UdpStream *) getOutStream(true))->cork(true);
 
   if (frameTracking)
     writer()->writeRequestFrameStats();
@@ -1402,6 +1440,8 @@ void VNCSConnectionST::writeFramebufferUpdate()
   // Then real data (if possible)
   writeDataUpdate();
 
+  if (cp.supportsUdp)
+    ((network::UdpStream *) getOutStream(true))->cork(false);
   sock->cork(false);
 
   congestion.updatePosition(sock->outStream().length());
@@ -1412,6 +1452,36 @@ void VNCSConnectionST::writeFramebufferUpdate()
   bstats_total[BS_FRAME]++;
 }
 
+void VNCSConnectionST::prefetchUpdate()
+{
+  Region req, changed;
+  UpdateInfo ui;
+
+  if (!Server::pipelineEncoding || !(accessRights & AccessView))
+    return;
+
+  if (continuousUpdates)
+    req = cuRegion.union_(requested);
+  else
+    req = requested;
+
+  // Queued changes mean the framebuffer is not consistent yet
+  if (req.is_empty() || !server->getPendingRegion().is_empty())
+    return;
+
+  updates.getUpdateInfo(&ui, req);
+  changed = ui.changed;
+
+  // The rendered cursor is encoded separately
+  if (needRenderedCursor())
+    changed.assign_subtract(server->getRenderedCursor()->getEffectiveRect());
+
+  if (changed.is_empty())
+    return;
+
+  encodeManager.prefetchUpdate(changed, server->getPixelBuffer());
+}
+
 void VNCSConnectionST::writeNoDataUpdate()
 {
   if (!writer()->needNoDataUpdate())
@@ -1684,9 +1754,21 @@ void VNCSConnectionST::sendStats(const bool toClient) {
 
   #define ten(x) (10 - x * 10.0f)
 
-  sprintf(buf, "[ %.1f, %.1f, %.1f, %.1f ]",
-               ten(cpu_recent), ten(cpu_total),
-               ten(net_recent), ten(net_total));
+  const network::UdpStream *udps = (network::UdpStream *) getOutStream(true);
+
+  // UDP clients with FEC also get their loss percentage, and how many
+  // packets FEC did and didn't save
+  if (cp.supportsUdp && udps->hasFec()) {
+    const network::UdpStream::FecStats fec = udps->getFecStats();
+    sprintf(buf, "[ %.1f, %.1f, %.1f, %.1f, %.1f, %" PRIu64 ", %" PRIu64 " ]",
+                 ten(cpu_recent), ten(cpu_total),
+                 ten(net_recent), ten(net_total),
+                 fec.loss * 100, fec.recovered, fec.failed);
+  } else {
+    sprintf(buf, "[ %.1f, %.1f, %.1f, %.1f ]",
+                 ten(cpu_recent), ten(cpu_total),
+                 ten(net_recent), ten(net_total));
+  }
 
   #undef ten
 
@@ -1843,17 +1925,26 @@ bool VNCSConnectionST::checkOwnerConn() const
   return false;
 }
 
-void VNCSConnectionST::udpUpgrade(const char *resp)
+void VNCSConnectionST::udpUpgrade(const char *resp, const bool fec)
 {
   if (resp[0] == 'H') {
     vlog.info("Client %s requested upgrade to udp, but WebUdp refused", sock->getPeerAddress());
   } else {
-    vlog.info("Client %s requesting upgrade to udp", sock->getPeerAddress());
+    vlog.info("Client %s requesting upgrade to udp%s", sock->getPeerAddress(),
+              fec ? " with FEC" : "");
     upgradingToUdp = true;
+    ((network::UdpStream *) getOutStream(true))->setFec(fec);
   }
   writer()->writeUdpUpgrade(resp);
 }
 
+void VNCSConnectionST::udpLossReport(rdr::U32 received, rdr::U32 lost,
+                                     rdr::U32 recovered, rdr::U32 failed)
+{
+  ((network::UdpStream *) getOutStream(true))->lossReport(received, lost,
+                                                           recovered, failed);
+}
+
 void VNCSConnectionST::udpDowngrade(const bool byServer)
 {
   cp.supportsUdp = false;
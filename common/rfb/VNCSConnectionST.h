@@ -74,8 +74,23 @@ namespace rfb {
     // Called when the underlying pixelbuffer is resized or replaced.
     void pixelBufferChange();
 
+    // Waits for updates being compressed in the background
+    void waitPrefetch() { encodeManager.waitPrefetch(); }
+
     // Wrappers to make these methods "safe" for VNCServerST.
     void writeFramebufferUpdateOrClose();
+
+    // For updating several clients at once. close() notifies the other
+    // clients, so a failure is only recorded here, and the caller closes
+    // the connection with closeIfUpdateFailed() once all updates are done.
+    // Returns true if the connection was closed.
+    void writeFramebufferUpdateDeferClose();
+    bool closeIfUpdateFailed();
+
+    // updatePermsOrClose() applies a pending permission recheck. Returns
+    // false if the user is gone and the connection has been closed.
+    bool updatePermsOrClose();
+
     void screenLayoutChangeOrClose(rdr::U16 reason);
     void setCursorOrClose();
     void bellOrClose();
@@ -257,7 +272,9 @@ namespace rfb {
                                          int x, int y, int w, int h);
     virtual void handleClipboardAnnounce(bool available);
     virtual void handleClipboardAnnounceBinary(const unsigned num, const char mimes[][32]);
-    virtual void udpUpgrade(const char *resp);
+    virtual void udpUpgrade(const char *resp, const bool fec);
+    virtual void udpLossReport(rdr::U32 received, rdr::U32 lost,
+                               rdr::U32 recovered, rdr::U32 failed);
     virtual void subscribeUnixRelay(const char *name);
     virtual void unixRelay(const char *name, const rdr::U8 *buf, const unsigned len);
       void videoEncodersRequest(std::vector<int32_t> const &encoders) override;
@@ -293,6 +310,7 @@ namespace rfb {
     void writeFramebufferUpdate();
     void writeNoDataUpdate();
     void writeDataUpdate();
+    void prefetchUpdate();
 
     void writeBinaryClipboard();
 
@@ -346,6 +364,7 @@ namespace rfb {
     char user[USERNAME_LEN];
     char kasmpasswdpath[4096];
     bool needsPermCheck;
+    std::string updateFailure;
 
     time_t lastEventTime;
     time_t pointerEventTime;
@@ -48,6 +48,7 @@
 // otherwise blacklisted connections might be "forgotten".
 
 
+#include <algorithm>
 #include <cassert>
 #include <cstdlib>
 
@@ -56,6 +57,7 @@
 
 #include <rfb/cpuid.h>
 #include <rfb/ComparingUpdateTracker.h>
+#include <rfb/DamageTrace.h>
 #include <rfb/KeyRemapper.h>
 #include <rfb/ListConnInfo.h>
 #include <rfb/Security.h>
@@ -78,6 +80,7 @@
 #include <wordexp.h>
 
 #include <fmt/core.h>
+#include <tbb/task_group.h>
 #include "encoders/KasmVideoConstants.h"
 #include "encoders/EncoderProbe.h"
 
@@ -91,6 +94,8 @@ void SelfBench();
 
 void benchmark(std::string_view, std::string_view);
 
+void multiClientBenchmark(unsigned, std::string_view, std::string_view);
+
 //
 // -=- VNCServerST Implementation
 //
@@ -139,7 +144,7 @@ VNCServerST::VNCServerST(const char* name_, SDesktop* desktop_, const video_enco
   : blHosts(&blacklist), desktop(desktop_), desktopStarted(false),
     blockCounter(0), pb(nullptr), blackedpb(nullptr), ledState(ledUnknown),
     name(strDup(name_)), pointerClient(nullptr), clipboardClient(nullptr),
-    comparer(nullptr), cursor(new Cursor(0, 0, Point(), nullptr)),
+    comparer(nullptr), damageTrace(nullptr), cursor(new Cursor(0, 0, Point(), nullptr)),
     renderedCursorInvalid(false),
     queryConnectionHandler(nullptr), keyRemapper(&KeyRemapper::defInstance),
     lastConnectionTime(0), disableclients(false),
@@ -264,6 +269,14 @@ VNCServerST::VNCServerST(const char* name_, SDesktop* desktop_, const video_enco
         benchmark(file_name, Server::benchmarkResults.getValueStr());
     }
 
+    if (Server::benchmarkClients > 0 || Server::benchmarkTrace[0])
+        multiClientBenchmark(std::max<int>(Server::benchmarkClients, 1),
+                             Server::benchmarkResults.getValueStr(),
+                             Server::benchmarkTrace.getValueStr());
+
+    if (Server::damageTrace[0])
+        damageTrace = new DamageTraceWriter(Server::damageTrace);
+
     screenshotTimer.start(FIRST_SCREENSHOT_INTERVAL_MS);
 }
 
@@ -290,6 +303,10 @@ VNCServerST::~VNCServerST()
     comparer->logStats();
   delete comparer;
 
+  encCache.logStats();
+
+  delete damageTrace;
+  delete blackedpb;
   delete cursor;
 }
 
@@ -319,9 +336,6 @@ void VNCServerST::addSocket(network::Socket* sock, bool outgoing)
 
   VNCSConnectionST* client = new VNCSConnectionST(this, sock, encoder_probe, outgoing);
   client->init();
-
-  if (watermarkData)
-    sendWatermark = true;
 }
 
 void VNCServerST::removeSocket(network::Socket* sock) {
@@ -507,6 +521,12 @@ void VNCServerST::setPixelBuffer(PixelBuffer* pb_, const ScreenSet& layout)
   // that tracks its contents
   comparer = new ComparingUpdateTracker(pb);
   renderedCursorInvalid = true;
+  if (damageTrace)
+    damageTrace->invalidate();
+
+  // Before the clients below refresh from it
+  if (DLPRegion.enabled)
+    blackOut(pb->getRect());
   add_changed(pb->getRect());
 
   // Make sure that we have at least one screen
@@ -660,6 +680,9 @@ void VNCServerST::setCursor(int width, int height, const Point& newHotspot,
 
   renderedCursorInvalid = true;
 
+  if (damageTrace)
+    damageTrace->cursor(width, height, newHotspot, data);
+
   // If an app has an animated cursor on the resized edge, X internals
   // will call for it to be rendered. Unlucky for us, the VNC screen
   // is currently pointing to freed memory, and a cursor change
@@ -680,6 +703,8 @@ void VNCServerST::setCursorPos(const Point& pos, bool warped)
   if (!cursorPos.equals(pos)) {
     cursorPos = pos;
     renderedCursorInvalid = true;
+    if (damageTrace)
+      damageTrace->cursorPos(pos);
     std::list<VNCSConnectionST*>::iterator ci;
     for (ci = clients.begin(); ci != clients.end(); ci++) {
       (*ci)->renderedCursorChange();
@@ -728,6 +753,13 @@ void VNCServerST::closeClients(const char* reason, network::Socket* except)
   }
 }
 
+void VNCServerST::waitPrefetch()
+{
+  std::list<VNCSConnectionST*>::iterator ci;
+  for (ci = clients.begin(); ci != clients.end(); ci++)
+    (*ci)->waitPrefetch();
+}
+
 void VNCServerST::getSockets(std::list<network::Socket*>* sockets)
 {
   sockets->clear();
@@ -769,9 +801,9 @@ bool VNCServerST::handleTimeout(Timer* t)
   }
 
     if (t == &screenshotTimer) {
-        if (apimessager) {
-            apimessager->mainUpdateScreen(getPixelBuffer());
-        }
+        if (apimessager &&
+            apimessager->mainUpdateScreen(getPixelBuffer(), screenshotDirty))
+            screenshotDirty.clear();
 
         if (screenshotTimer.getTimeoutMs() < SCREENSHOT_INTERVAL_MS) {
             screenshotTimer.start(SCREENSHOT_INTERVAL_MS);
@@ -1018,39 +1050,81 @@ void VNCServerST::getDLPRegionSkipFlags(const Point& pos,
   }
 }
 
-void VNCServerST::blackOut()
+void VNCServerST::updateWatermark()
+{
+  watermarkUpdate(pb->width(), pb->height());
+}
+
+// blackedpb is what the clients get to see with DLP_Region: the visible
+// part of the framebuffer, black elsewhere. It is kept from frame to frame
+// and only the damaged parts are brought up to date.
+void VNCServerST::blackOut(const Region& damage)
 {
   // Compute the region, since the resolution may have changed
   rdr::U16 x1, y1, x2, y2;
 
   translateDLPRegion(x1, y1, x2, y2);
 
-  if (blackedpb)
-    delete blackedpb;
-  blackedpb = new ManagedPixelBuffer(pb->getPF(), pb->getRect().width(), pb->getRect().height());
-
-  int stride;
-  const rdr::U8 *src = pb->getBuffer(pb->getRect(), &stride);
-  rdr::U8 *data = blackedpb->getBufferRW(pb->getRect(), &stride);
-  stride *= 4;
+  // The last row is inclusive, the last column is not
+  const Rect visible = Rect(x1, y1, x2, y2 + 1).intersect(pb->getRect());
 
-  memcpy(data, src, stride * pb->getRect().height());
+  Region toCopy = damage;
 
-  rdr::U16 y;
-  const rdr::U16 w = pb->getRect().width();
-  const rdr::U16 h = pb->getRect().height();
-  for (y = 0; y < h; y++) {
-    if (y < y1 || y > y2) {
-      memset(data, 0, stride);
+  if (!blackedpb || blackedpb->width() != pb->width() ||
+      blackedpb->height() != pb->height() ||
+      !blackedpb->getPF().equal(pb->getPF()) ||
+      !visible.equals(DLPVisible)) {
+    if (!blackedpb || !blackedpb->getPF().equal(pb->getPF())) {
+      delete blackedpb;
+      blackedpb = new ManagedPixelBuffer(pb->getPF(), pb->width(), pb->height());
     } else {
-      if (x1)
-        memset(data, 0, x1 * 4);
-      if (x2)
-        memset(&data[x2 * 4], 0, (w - x2) * 4);
+      blackedpb->setSize(pb->width(), pb->height());
     }
 
-    data += stride;
+    const rdr::U8 black[4] = { 0 };
+    blackedpb->fillRect(blackedpb->getRect(), black);
+
+    DLPVisible = visible;
+    toCopy = pb->getRect();
+  }
+
+  std::vector<Rect> rects;
+  toCopy.intersect(DLPVisible).get_rects(&rects);
+  for (const Rect& r : rects) {
+    int stride;
+    const rdr::U8* data = pb->getBuffer(r, &stride);
+    blackedpb->imageRect(r, data, stride);
+  }
+}
+
+// Clients only ever see the visible part, so a copy must come from and go
+// to there. Anything else is sent as changed pixels, and changes in the
+// blacked out area are not sent at all, it stays black.
+void VNCServerST::clipToDLPRegion(UpdateInfo& ui) const
+{
+  const Region visible(DLPVisible);
+
+  Region copyable = visible;
+  copyable.translate(ui.copy_delta);
+  copyable.assign_intersect(visible);
+
+  const Region keep = ui.copied.intersect(copyable);
+  ui.changed.assign_union(ui.copied.subtract(keep));
+  ui.copied = keep;
+
+  std::vector<CopyPassRect> copypassed;
+  for (const CopyPassRect& cp : ui.copypassed) {
+    const Rect src(cp.src_x, cp.src_y,
+                   cp.src_x + cp.rect.width(), cp.src_y + cp.rect.height());
+
+    if (cp.rect.enclosed_by(DLPVisible) && src.enclosed_by(DLPVisible))
+      copypassed.push_back(cp);
+    else
+      ui.changed.assign_union(cp.rect);
   }
+  ui.copypassed.swap(copypassed);
+
+  ui.changed.assign_intersect(visible);
 }
 
 // writeUpdate() is called on a regular interval in order to see what
@@ -1069,15 +1143,9 @@ void VNCServerST::writeUpdate()
 
   TRACE_STOPWATCH(start);
 
-  if (DLPRegion.enabled) {
-    comparer->enable_copyrect(false);
-    blackOut();
-  }
-
-  if (watermarkData && Server::DLP_WatermarkText[0] && watermarkTextNeedsUpdate(true)) {
-    // The text may have changed
-    sendWatermark = true;
-  }
+  // Fix the time for this frame, updateWatermark() picks up text changes
+  if (watermarkData && Server::DLP_WatermarkText[0])
+    watermarkTextNeedsUpdate(true);
 
   bool video_streaming_enabled = true;
   for (auto client : clients) {
@@ -1100,6 +1168,17 @@ void VNCServerST::writeUpdate()
 
   pb->grabRegion(toCheck);
 
+  // What the desktop reported, before the comparer trims it
+  if (damageTrace)
+    damageTrace->frame(pb, ui);
+
+  if (DLPRegion.enabled)
+    blackOut(toCheck);
+
+  // Only now are these pixels in the buffer the screenshot copies from
+  if (apimessager)
+    screenshotDirty.assign_union(toCheck);
+
   if (getComparerState())
     comparer->enable();
   else
@@ -1113,11 +1192,23 @@ void VNCServerST::writeUpdate()
     comparer->getUpdateInfo(&ui, pb->getRect());
 
   comparer->clear();
+
+  if (DLPRegion.enabled)
+    clipToDLPRegion(ui);
+
   DEBUG_STOPWATCH_PRINT_US(slog, comparer_timer);
   TRACE_STOPWATCH_END_MS(beforeAnalysis, analysisMs);
 
-  encCache.clear();
+  // Full-colour rects are encoded once per quality class and shared
+  // between the clients. Entries are keyed on the pixel contents, so they
+  // stay valid across frames until they age out.
   encCache.enabled = clients.size() > 1;
+  if (encCache.enabled) {
+    encCache.setMaxBytes((size_t) Server::encCacheSize * 1024 * 1024);
+    encCache.nextFrame();
+  } else {
+    encCache.clear();
+  }
 
   // Check if the password file was updated
   DEBUG_STOPWATCH(perm_check);
@@ -1144,8 +1235,9 @@ void VNCServerST::writeUpdate()
 
   DEBUG_STOPWATCH_PRINT_US(slog, perm_check);
   if (apimessager) {
-      if (updateScreenshot) {
-          apimessager->mainUpdateScreen(pb);
+      if (updateScreenshot &&
+          apimessager->mainUpdateScreen(pb, pb->getRect())) {
+          screenshotDirty.clear();
           updateScreenshot = false;
       }
     trackingFrameStats = 0;
@@ -1159,6 +1251,19 @@ void VNCServerST::writeUpdate()
   if (watermarkData)
       updateWatermark();
 
+  // With several clients, each one's update is produced on a worker so
+  // that they don't queue up behind each other. The workers only touch
+  // their own connection; everything shared is settled here first
+  // (permissions, the rendered cursor), and failed connections are closed
+  // once all of them are done, as closing notifies the others.
+  const bool concurrent = Server::concurrentUpdates && clients.size() > 1;
+  std::vector<VNCSConnectionST*> updating;
+
+  if (concurrent) {
+    getRenderedCursor();
+    updating.reserve(clients.size());
+  }
+
   for (auto client : clients) {
     if (permcheck)
       client->recheckPerms();
@@ -1179,8 +1284,24 @@ void VNCServerST::writeUpdate()
     client->add_copied(ui.copied, ui.copy_delta);
     client->add_copypassed(ui.copypassed);
     client->add_changed(ui.changed);
-    client->writeFramebufferUpdateOrClose();
 
+    if (!concurrent)
+      client->writeFramebufferUpdateOrClose();
+    else if (client->updatePermsOrClose())
+      updating.push_back(client);
+  }
+
+  if (!updating.empty()) {
+    tbb::task_group tasks;
+    for (auto client : updating)
+      tasks.run([client] { client->writeFramebufferUpdateDeferClose(); });
+    tasks.wait();
+
+    for (auto client : updating)
+      client->closeIfUpdateFailed();
+  }
+
+  for (auto client : clients) {
     if (((network::UdpStream *)client->getOutStream(true))->isFailed()) {
       ((network::UdpStream *)client->getOutStream(true))->clearFailed();
       client->udpDowngrade(true);
@@ -1219,6 +1340,12 @@ void VNCServerST::writeUpdate()
                                                 enctime, scaletime,
                                                 pb->getRect().width(),
                                                 pb->getRect().height());
+
+      if (apimessager) {
+        const EncCache::Stats cs = encCache.getStats();
+        apimessager->mainUpdateEncCacheStats(cs.hits, cs.misses, cs.evictions,
+                                             cs.bytes);
+      }
     } else {
       // Zero encoding time means this was a no-data frame; restore the stats request
       if (apimessager && pthread_mutex_lock(&apimessager->userMutex) == 0) {
@@ -43,6 +43,7 @@ namespace rfb {
 
   class VNCSConnectionST;
   class ComparingUpdateTracker;
+  class DamageTraceWriter;
   class ListConnInfo;
   class PixelBuffer;
   class KeyRemapper;
@@ -125,6 +126,10 @@ namespace rfb {
     // any), and logs the specified reason for closure.
     void closeClients(const char* reason, network::Socket* sock);
 
+    // waitPrefetch() waits for any background encoding to finish, for
+    // when the framebuffer memory is about to go away under it.
+    void waitPrefetch();
+
     // getSConnection() gets the SConnection for a particular Socket.  If
     // the Socket is not recognised then null is returned.
 
@@ -248,6 +253,7 @@ namespace rfb {
     static EncCache encCache;
 
     ComparingUpdateTracker* comparer;
+    DamageTraceWriter* damageTrace;
 
     Point cursorPos;
     Cursor* cursor;
@@ -262,7 +268,8 @@ namespace rfb {
     void stopFrameClock();
     int msToNextUpdate();
     void writeUpdate();
-    void blackOut();
+    void blackOut(const Region& damage);
+    void clipToDLPRegion(UpdateInfo& ui) const;
     Region getPendingRegion();
     const RenderedCursor* getRenderedCursor();
 
@@ -304,13 +311,19 @@ namespace rfb {
 
     void translateDLPRegion(rdr::U16 &x1, rdr::U16 &y1, rdr::U16 &x2, rdr::U16 &y2) const;
 
+    // The part of blackedpb that isn't blacked out
+    Rect DLPVisible;
+
     rdr::U32 clipboardId;
 
     void checkAPIMessages(network::GetAPIMessager *apimessager,
                           rdr::U8 &trackingFrameStats, char trackingClient[]);
 
+    // Makes every client get the whole watermark mask again
     bool sendWatermark;
     bool updateScreenshot{false};
+    // Damage since the screenshot copy was last refreshed
+    Region screenshotDirty;
     const video_encoders::EncoderProbe &encoder_probe;
   };
 
@@ -17,15 +17,15 @@
  */
 
 #include <math.h>
+#include <mutex>
 #include <png.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
-#include <zlib.h>
+#include <rdr/Deflater.h>
 #include <rfb/LogWriter.h>
 #include <rfb/ServerCore.h>
-#include <rfb/VNCServerST.h>
 #include "font.h"
 #include <ft2build.h>
 #include FT_FREETYPE_H
@@ -41,9 +41,20 @@ watermarkInfo_t watermarkInfo;
 
 uint8_t *watermarkData, *watermarkUnpacked, *watermarkTmp;
 uint32_t watermarkDataLen;
+uint32_t watermarkGen;
 static uint16_t rw, rh;
 static time_t lastUpdate;
 
+// What changed in the current generation, empty if all of it did
+static Region dirty;
+static bool fullChange;
+
+// watermarkData and the delta are packed on demand, once per generation
+static std::mutex packLock;
+static uint32_t packedGen, deltaGen;
+static std::vector<watermarkRect_t> delta;
+static bool deltaValid;
+
 static FT_Library ft = NULL;
 static FT_Face face;
 
@@ -357,7 +368,6 @@ static bool drawtext(const char fmt[], const int16_t utcOff, const char fontpath
 	if (!len)
 		return false;
 
-	free(watermarkInfo.src);
 	if (Server::DLP_WatermarkTextAngle) {
 		uint32_t w, h, recw, recy = fontsize;
 		bool invx, invy;
@@ -443,77 +453,130 @@ bool watermarkInit() {
 	return true;
 }
 
-static void packWatermark() {
-	// Take the expanded 4-bit data, filter it by the changed rects, pack
-	// to shared bytes, and compress with zlib
-
+// Packs the 4-bit pixels of r in order, two per byte
+static uint8_t *packRect(const Rect &r, uint8_t *dst) {
 	uint16_t x, y;
 	uint8_t pix[2], cur = 0;
-	uint8_t *dst = watermarkTmp;
 
-	for (y = 0; y < rh; y++) {
-		for (x = 0; x < rw; x++) {
-			pix[cur] = watermarkUnpacked[y * rw + x];
-			if (cur || (y == rh - 1 && x == rw - 1))
+	for (y = r.tl.y; y < r.br.y; y++) {
+		const uint8_t *src = &watermarkUnpacked[y * rw];
+		for (x = r.tl.x; x < r.br.x; x++) {
+			pix[cur] = src[x];
+			if (cur)
 				*dst++ = pix[0] | (pix[1] << 4);
 
 			cur ^= 1;
 		}
 	}
 
-	uLong destLen = MAXW * MAXH / 2;
-	if (compress2(watermarkData, &destLen, watermarkTmp, rw * rh / 2 + 1, 1) != Z_OK)
+	if (cur)
+		*dst++ = pix[0];
+
+	return dst;
+}
+
+void watermarkPackFull() {
+	// Take the expanded 4-bit data, pack to shared bytes, and compress
+	// with zlib
+
+	std::lock_guard<std::mutex> lock(packLock);
+	if (packedGen == watermarkGen)
+		return;
+
+	// With an even width every row starts on a byte, and when repeating
+	// the rows come in bands of the tile's height plus spacing. Only the
+	// first band needs packing, the rest is copies of it.
+	const uint16_t band = watermarkInfo.repeat ?
+				watermarkInfo.h + watermarkInfo.repeat : rh;
+	if (!(rw & 1) && band < rh) {
+		const uint32_t bandBytes = band * rw / 2;
+		uint32_t done;
+
+		packRect(Rect(0, 0, rw, band), watermarkTmp);
+		for (done = bandBytes; done < rh * rw / 2; done += bandBytes)
+			memcpy(&watermarkTmp[done], watermarkTmp,
+				__rfbmin(bandBytes, rh * rw / 2 - done));
+	} else {
+		packRect(Rect(0, 0, rw, rh), watermarkTmp);
+	}
+
+	const size_t destLen = rdr::Deflater::get()->compress(watermarkData, MAXW * MAXH / 2,
+							      watermarkTmp, rw * rh / 2 + 1, 1);
+	if (!destLen)
 		vlog.error("Zlib compression error");
 
 	watermarkDataLen = destLen;
+	packedGen = watermarkGen;
 }
 
-// update the screen-size rendered watermark whenever the screen is resized
-// or if using text, every frame
-void VNCServerST::updateWatermark() {
-	if (rw == pb->width() &&
-		rh == pb->height()) {
-
-		if (Server::DLP_WatermarkImage[0])
-			return;
-		if (!watermarkTextNeedsUpdate(false))
-			return;
-	}
+// Above this many rects a delta isn't worth it
+#define MAX_DELTA_RECTS 1024
 
-	if (Server::DLP_WatermarkText[0] && watermarkTextNeedsUpdate(false)) {
-		drawtext(Server::DLP_WatermarkText,
-				Server::DLP_WatermarkTimeOffset * 60 + Server::DLP_WatermarkTimeOffsetMinutes,
-				Server::DLP_WatermarkFont, Server::DLP_WatermarkFontSize);
+const std::vector<watermarkRect_t> *watermarkDelta() {
+	const rdr::Deflater *deflater = rdr::Deflater::get();
+
+	std::lock_guard<std::mutex> lock(packLock);
+	if (deltaGen == watermarkGen)
+		return deltaValid ? &delta : NULL;
+
+	deltaGen = watermarkGen;
+	delta.clear();
+	deltaValid = !fullChange && dirty.numRects() <= MAX_DELTA_RECTS;
+	if (!deltaValid)
+		return NULL;
+
+	std::vector<Rect> rects;
+	std::vector<Rect>::const_iterator i;
+	dirty.get_rects(&rects);
+
+	delta.resize(rects.size());
+	for (i = rects.begin(); i != rects.end(); i++) {
+		watermarkRect_t &out = delta[i - rects.begin()];
+		const uint32_t len = packRect(*i, watermarkTmp) - watermarkTmp;
+
+		out.rect = *i;
+		out.data.resize(deflater->bound(len));
+
+		const size_t outLen = deflater->compress(out.data.data(), out.data.size(),
+							 watermarkTmp, len, 1);
+		if (!outLen) {
+			vlog.error("Zlib compression error");
+			deltaValid = false;
+			return NULL;
+		}
+
+		out.data.resize(outLen);
 	}
 
-	rw = pb->width();
-	rh = pb->height();
+	return &delta;
+}
+
+// Copies the part r of the source to the screen-sized mask, with the
+// source's corner at x, y
+static void blit(const Rect &r, const int x, const int y, Region *changed) {
+	const Rect dst = r.translate(Point(x, y)).intersect(Rect(0, 0, rw, rh));
+	int row;
 
-	memset(watermarkUnpacked, 0, rw * rh);
+	if (dst.is_empty())
+		return;
 
-	uint16_t x, y, srcy;
+	for (row = dst.tl.y; row < dst.br.y; row++)
+		memcpy(&watermarkUnpacked[row * rw + dst.tl.x],
+			&watermarkInfo.src[(row - y) * watermarkInfo.w + dst.tl.x - x],
+			dst.width());
 
+	if (changed)
+		changed->assign_union(Region(dst));
+}
+
+// Places the part r of the source everywhere it appears on screen
+static void render(const Rect &r, Region *changed) {
 	if (watermarkInfo.repeat) {
-		for (y = 0, srcy = 0; y < rh; y++) {
-			for (x = 0; x < rw;) {
-				if (x + watermarkInfo.w < rw)
-					memcpy(&watermarkUnpacked[y * rw + x],
-						&watermarkInfo.src[srcy * watermarkInfo.w],
-						watermarkInfo.w);
-				else
-					memcpy(&watermarkUnpacked[y * rw + x],
-						&watermarkInfo.src[srcy * watermarkInfo.w],
-						rw - x);
-
-				x += watermarkInfo.w + watermarkInfo.repeat;
-			}
+		int x, y;
 
-			srcy++;
-			if (srcy == watermarkInfo.h) {
-				srcy = 0;
-				y += watermarkInfo.repeat;
-			}
-		}
+		for (y = 0; y < rh; y += watermarkInfo.h + watermarkInfo.repeat)
+			for (x = 0; x < rw; x += watermarkInfo.w + watermarkInfo.repeat)
+				blit(r, x, y, changed);
 	} else {
 		int16_t sx, sy;
 
@@ -537,21 +600,80 @@ void VNCServerST::updateWatermark() {
 		if (sy < 0)
 			sy = 0;
 
-		for (y = 0; y < watermarkInfo.h; y++) {
-			if (sx + watermarkInfo.w < rw)
-				memcpy(&watermarkUnpacked[(sy + y) * rw + sx],
-					&watermarkInfo.src[y * watermarkInfo.w],
-					watermarkInfo.w);
+		blit(r, sx, sy, changed);
+	}
+}
+
+// The bounding box of the pixels that differ between two sources of the
+// same size
+static Rect diffSource(const uint8_t *a, const uint8_t *b,
+			const uint16_t w, const uint16_t h) {
+	int x, y, x1 = w, y1 = h, x2 = 0, y2 = 0;
+
+	for (y = 0; y < h; y++) {
+		const uint8_t *ra = &a[y * w], *rb = &b[y * w];
+		if (!memcmp(ra, rb, w))
+			continue;
+
+		for (x = 0; x < x1 && ra[x] == rb[x]; x++);
+		x1 = x;
+		for (x = w; x > x2 && ra[x - 1] == rb[x - 1]; x--);
+		x2 = x;
+
+		if (y1 == h)
+			y1 = y;
+		y2 = y + 1;
+	}
+
+	if (y1 == h)
+		return Rect();
+
+	return Rect(x1, y1, x2, y2);
+}
+
+// update the screen-size rendered watermark whenever the screen is resized
+// or if using text, whenever the text changes. Only the changed parts of
+// the text are re-rendered to the screen.
+void watermarkUpdate(const uint16_t width, const uint16_t height) {
+	bool full = rw != width || rh != height;
+	Rect changed;
+
+	if (!full && !watermarkTextNeedsUpdate(false))
+		return;
+
+	if (Server::DLP_WatermarkText[0] && watermarkTextNeedsUpdate(false)) {
+		uint8_t * const oldsrc = watermarkInfo.src;
+		const uint16_t oldw = watermarkInfo.w, oldh = watermarkInfo.h;
+
+		if (drawtext(Server::DLP_WatermarkText,
+				Server::DLP_WatermarkTimeOffset * 60 + Server::DLP_WatermarkTimeOffsetMinutes,
+				Server::DLP_WatermarkFont, Server::DLP_WatermarkFontSize)) {
+			if (oldw != watermarkInfo.w || oldh != watermarkInfo.h)
+				full = true;
 			else
-				memcpy(&watermarkUnpacked[(sy + y) * rw + sx],
-					&watermarkInfo.src[y * watermarkInfo.w],
-					rw - sx);
+				changed = diffSource(oldsrc, watermarkInfo.src, oldw, oldh);
+
+			free(oldsrc);
 		}
 	}
 
-	packWatermark();
+	if (!full && changed.is_empty())
+		return;
+
+	dirty.clear();
+	fullChange = full;
+
+	if (full) {
+		rw = width;
+		rh = height;
+
+		memset(watermarkUnpacked, 0, rw * rh);
+		render(Rect(0, 0, watermarkInfo.w, watermarkInfo.h), NULL);
+	} else {
+		render(changed, &dirty);
+	}
 
-	sendWatermark = true;
+	watermarkGen++;
 }
 
 // Limit changes to once per second
@@ -20,6 +20,7 @@
 #define WATERMARK_H
 
 #include <stdint.h>
+#include <vector>
 #include <rfb/Region.h>
 
 struct watermarkInfo_t {
@@ -37,7 +38,29 @@ extern watermarkInfo_t watermarkInfo;
 bool watermarkInit();
 bool watermarkTextNeedsUpdate(const bool early);
 
+// Brings the screen-sized mask up to date with the screen size and the
+// text, bumping watermarkGen if anything changed
+void watermarkUpdate(const uint16_t width, const uint16_t height);
+
+// The compressed mask for the whole screen, see watermarkPackFull()
 extern uint8_t *watermarkData;
 extern uint32_t watermarkDataLen;
 
+// Bumped whenever the screen-sized mask changes
+extern uint32_t watermarkGen;
+
+// A compressed part of the mask, in screen coordinates
+struct watermarkRect_t {
+	rfb::Rect rect;
+	std::vector<uint8_t> data;
+};
+
+// Packs and compresses the whole mask into watermarkData, if it's not
+// current already
+void watermarkPackFull();
+
+// The parts of the mask that changed from the previous generation, or NULL
+// if all of it has to be sent
+const std::vector<watermarkRect_t> *watermarkDelta();
+
 #endif
@@ -0,0 +1,322 @@
+/* Copyright (C) 2026 Kasm Technologies Corp
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#include "DamageScenes.h"
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <rfb/DamageTrace.h>
+
+namespace benchmarking {
+    using namespace rfb;
+
+    static constexpr int GLYPH_W = 8;
+    static constexpr int LINE_H = 18;
+
+    void DamageScene::fill(ModifiablePixelBuffer *pb, const Rect &r, rdr::U8 red, rdr::U8 green, rdr::U8 blue) {
+        rdr::U8 pix[4];
+        pb->getPF().bufferFromPixel(pix, pb->getPF().pixelFromRGB(red, green, blue));
+        pb->fillRect(r.intersect(pb->getRect()), pix);
+    }
+
+    void DamageScene::text(ModifiablePixelBuffer *pb, const Rect &r_, rdr::U8 shade) {
+        const Rect r = r_.intersect(pb->getRect());
+        if (r.is_empty())
+            return;
+
+        const auto &pf = pb->getPF();
+        const int bpp = pf.bpp / 8;
+        rdr::U8 pix[4];
+        pf.bufferFromPixel(pix, pf.pixelFromRGB(shade, shade, shade));
+
+        int stride;
+        auto *buf = pb->getBufferRW(r, &stride);
+
+        for (int x = 0; x + GLYPH_W <= r.width(); x += GLYPH_W) {
+            // Roughly one word in six ends here
+            if (rng() % 6 == 0)
+                continue;
+
+            const auto bits = rng();
+            for (int y = 3; y < std::min(13, r.height()); y++) {
+                for (int gx = 1; gx < GLYPH_W - 1; gx++) {
+                    if (bits >> ((y * 5 + gx) % 32) & 1)
+                        memcpy(buf + (y * stride + x + gx) * bpp, pix, bpp);
+                }
+            }
+        }
+
+        pb->commitBufferRW(r);
+    }
+
+    // A couple of windows, someone typing into one of them, menus coming
+    // and going, buttons lighting up under the pointer
+    class DesktopScene final : public DamageScene {
+        Rect editor{200, 120, 1100, 840};
+        Rect other{1000, 300, 1760, 900};
+        Point caret;
+        Rect menu;
+
+        void window(ModifiablePixelBuffer *pb, const Rect &r) {
+            fill(pb, Rect(r.tl.x, r.tl.y, r.br.x, r.tl.y + 30), 48, 48, 56);
+            fill(pb, Rect(r.tl.x, r.tl.y + 30, r.br.x, r.br.y), 250, 250, 250);
+        }
+
+        void body(ModifiablePixelBuffer *pb, const Rect &r) {
+            for (int y = r.tl.y + 40; y + LINE_H <= r.br.y - 10; y += LINE_H)
+                text(pb, Rect(r.tl.x + 10, y, r.br.x - 10, y + LINE_H), 20);
+        }
+
+    public:
+        [[nodiscard]] const char *name() const override {
+            return "desktop";
+        }
+
+        void reset(ModifiablePixelBuffer *pb) override {
+            rng.seed(1);
+            fill(pb, pb->getRect(), 58, 110, 165);
+            fill(pb, Rect(0, pb->height() - 40, pb->width(), pb->height()), 30, 30, 34);
+
+            window(pb, other);
+            body(pb, other);
+            window(pb, editor);
+
+            caret = Point(editor.tl.x + 10, editor.tl.y + 40);
+            menu = Rect();
+        }
+
+        void step(ModifiablePixelBuffer *pb, UpdateTracker *tracker, unsigned frame) override {
+            // A word every other frame, about what a fast typist manages
+            if (frame % 2 == 0) {
+                const int len = (3 + rng() % 6) * GLYPH_W;
+                if (caret.x + len > editor.br.x - 10) {
+                    caret = Point(editor.tl.x + 10, caret.y + LINE_H);
+                    if (caret.y + LINE_H > editor.br.y - 10) {
+                        const Rect page(editor.tl.x, editor.tl.y + 30, editor.br.x, editor.br.y);
+                        fill(pb, page, 250, 250, 250);
+                        tracker->add_changed(page);
+                        caret = Point(editor.tl.x + 10, editor.tl.y + 40);
+                    }
+                }
+
+                const Rect word(caret.x, caret.y, caret.x + len, caret.y + LINE_H);
+                text(pb, word, 20);
+                tracker->add_changed(word);
+                caret.x += len + GLYPH_W;
+            }
+
+            // A menu opens, and closes again over the other window
+            if (frame % 90 == 0) {
+                menu = Rect(0, 0, 220, 300).translate(Point(other.tl.x + rng() % 400, other.tl.y + 40));
+                fill(pb, menu, 236, 236, 240);
+                for (int y = menu.tl.y + 6; y + LINE_H <= menu.br.y; y += LINE_H + 6)
+                    text(pb, Rect(menu.tl.x + 12, y, menu.tl.x + 140, y + LINE_H), 40);
+                tracker->add_changed(menu);
+            } else if (frame % 90 == 45 && !menu.is_empty()) {
+                fill(pb, menu, 250, 250, 250);
+                for (int y = menu.tl.y; y + LINE_H <= menu.br.y; y += LINE_H)
+                    text(pb, Rect(menu.tl.x, y, menu.br.x, y + LINE_H), 20);
+                tracker->add_changed(menu);
+                menu = Rect();
+            }
+
+            // Hover highlights on the taskbar
+            if (rng() % 8 == 0) {
+                const Rect button = Rect(0, 0, 120, 32).translate(Point(8 + 128 * (rng() % 12), pb->height() - 36));
+                const rdr::U8 shade = rng() % 2 ? 70 : 30;
+                fill(pb, button, shade, shade, shade + 4);
+                tracker->add_changed(button);
+            }
+        }
+    };
+
+    // A long document scrolled through steadily, so mostly copies and a
+    // new strip of text at the bottom
+    class ScrollScene final : public DamageScene {
+        Rect pane{360, 90, 1560, 990};
+        static constexpr int SCROLL = LINE_H * 2;
+
+    public:
+        [[nodiscard]] const char *name() const override {
+            return "scroll";
+        }
+
+        void reset(ModifiablePixelBuffer *pb) override {
+            rng.seed(1);
+            fill(pb, pb->getRect(), 210, 210, 214);
+            fill(pb, pane, 255, 255, 255);
+            for (int y = pane.tl.y; y + LINE_H <= pane.br.y; y += LINE_H)
+                text(pb, Rect(pane.tl.x + 40, y, pane.br.x - 60, y + LINE_H), 10);
+        }
+
+        void step(ModifiablePixelBuffer *pb, UpdateTracker *tracker, unsigned frame) override {
+            const Rect moved(pane.tl.x, pane.tl.y, pane.br.x, pane.br.y - SCROLL);
+            const Point delta(0, -SCROLL);
+            pb->copyRect(moved, delta);
+            tracker->add_copied(moved, delta);
+
+            const Rect strip(pane.tl.x, pane.br.y - SCROLL, pane.br.x, pane.br.y);
+            fill(pb, strip, 255, 255, 255);
+            for (int y = strip.tl.y; y + LINE_H <= strip.br.y; y += LINE_H)
+                text(pb, Rect(strip.tl.x + 40, y, strip.br.x - 60, y + LINE_H), 10);
+            tracker->add_changed(strip);
+
+            // The scrollbar thumb follows along
+            const Rect bar(pane.br.x - 14, pane.tl.y, pane.br.x, pane.br.y);
+            const int thumb = bar.tl.y + (frame * 3) % (bar.height() - 80);
+            fill(pb, bar, 240, 240, 240);
+            fill(pb, Rect(bar.tl.x + 2, thumb, bar.br.x - 2, thumb + 80), 150, 150, 150);
+            tracker->add_changed(bar);
+        }
+    };
+
+    // 720p video playing in a browser, with a progress bar under it
+    class VideoScene final : public DamageScene {
+        Rect video{320, 160, 1600, 880};
+
+    public:
+        [[nodiscard]] const char *name() const override {
+            return "video";
+        }
+
+        void reset(ModifiablePixelBuffer *pb) override {
+            rng.seed(1);
+            fill(pb, pb->getRect(), 24, 24, 24);
+        }
+
+        void step(ModifiablePixelBuffer *pb, UpdateTracker *tracker, unsigned frame) override {
+            const auto &pf = pb->getPF();
+            int stride;
+            auto *buf = pb->getBufferRW(video, &stride);
+
+            // Smooth moving gradients with some grain, which is about as
+            // hard on the encoders as real footage
+            for (int y = 0; y < video.height(); y++) {
+                auto *row = buf + y * stride * (pf.bpp / 8);
+                for (int x = 0; x < video.width(); x++) {
+                    const unsigned noise = rng() & 15;
+                    const rdr::U8 r = (x + frame * 3) / 5 + noise;
+                    const rdr::U8 g = (y + frame * 2) / 3 + noise;
+                    const rdr::U8 b = ((x + y) / 4 + frame) ^ (noise << 2);
+                    pf.bufferFromPixel(row + x * (pf.bpp / 8), pf.pixelFromRGB(r, g, b));
+                }
+            }
+
+            pb->commitBufferRW(video);
+            tracker->add_changed(video);
+
+            if (frame % 30 == 0) {
+                const Rect bar(video.tl.x, video.br.y + 12, video.br.x, video.br.y + 18);
+                fill(pb, bar, 80, 80, 80);
+                fill(pb, Rect(bar.tl.x, bar.tl.y, bar.tl.x + (frame / 30 * 8) % bar.width(), bar.br.y), 230, 30, 30);
+                tracker->add_changed(bar);
+            }
+        }
+    };
+
+    // Nobody at the keyboard, just a caret blinking and a clock ticking
+    class IdleScene final : public DamageScene {
+        Rect term{400, 200, 1500, 860};
+        Rect caret{412, 244, 420, 262};
+        bool caretOn{};
+
+    public:
+        [[nodiscard]] const char *name() const override {
+            return "idle";
+        }
+
+        void reset(ModifiablePixelBuffer *pb) override {
+            rng.seed(1);
+            caretOn = false;
+            fill(pb, pb->getRect(), 58, 110, 165);
+            fill(pb, Rect(0, pb->height() - 40, pb->width(), pb->height()), 30, 30, 34);
+            fill(pb, term, 16, 16, 16);
+            text(pb, Rect(term.tl.x + 12, term.tl.y + 20, term.br.x - 200, term.tl.y + 20 + LINE_H), 200);
+        }
+
+        void step(ModifiablePixelBuffer *pb, UpdateTracker *tracker, unsigned frame) override {
+            if (frame % 30 == 0) {
+                caretOn = !caretOn;
+                const rdr::U8 shade = caretOn ? 200 : 16;
+                fill(pb, caret, shade, shade, shade);
+                tracker->add_changed(caret);
+            }
+
+            if (frame % 60 == 0) {
+                const Rect clock(pb->width() - 80, pb->height() - 30, pb->width() - 16, pb->height() - 12);
+                fill(pb, clock, 30, 30, 34);
+                text(pb, clock, 220);
+                tracker->add_changed(clock);
+            }
+        }
+    };
+
+    // Someone's actual session. The first keyframe is the starting point,
+    // every recorded update after it is one step, and it starts over when
+    // a run is longer than the trace.
+    class TraceScene final : public DamageScene {
+        DamageTraceReader trace;
+        std::string label;
+
+    public:
+        explicit TraceScene(const char *path) : trace(path), label(std::string("trace ") + path) {}
+
+        [[nodiscard]] const char *name() const override {
+            return label.c_str();
+        }
+
+        [[nodiscard]] int width() const override {
+            return trace.width();
+        }
+
+        [[nodiscard]] int height() const override {
+            return trace.height();
+        }
+
+        [[nodiscard]] unsigned frames() const override {
+            return std::max(trace.frames(), 2u) - 1;
+        }
+
+        void reset(ModifiablePixelBuffer *pb) override {
+            SimpleUpdateTracker discard;
+            trace.rewind();
+            trace.next(pb, &discard);
+        }
+
+        void step(ModifiablePixelBuffer *pb, UpdateTracker *tracker, unsigned) override {
+            if (!trace.next(pb, tracker)) {
+                trace.rewind();
+                trace.next(pb, tracker);
+            }
+        }
+    };
+
+    std::unique_ptr<DamageScene> trace_scene(const char *path) {
+        return std::make_unique<TraceScene>(path);
+    }
+
+    std::vector<std::unique_ptr<DamageScene>> synthetic_scenes() {
+        std::vector<std::unique_ptr<DamageScene>> scenes;
+        scenes.push_back(std::make_unique<DesktopScene>());
+        scenes.push_back(std::make_unique<ScrollScene>());
+        scenes.push_back(std::make_unique<VideoScene>());
+        scenes.push_back(std::make_unique<IdleScene>());
+
+        return scenes;
+    }
+} // namespace benchmarking
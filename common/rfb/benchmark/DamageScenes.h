@@ -0,0 +1,60 @@
+/* Copyright (C) 2026 Kasm Technologies Corp
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#pragma once
+
+#include <memory>
+#include <random>
+#include <vector>
+#include <rfb/PixelBuffer.h>
+#include <rfb/UpdateTracker.h>
+
+namespace benchmarking {
+    // A workload for the server side of a session. Each step draws the
+    // next frame into the framebuffer and reports what it touched to the
+    // tracker, the way the X server reports damage.
+    class DamageScene {
+    public:
+        virtual ~DamageScene() = default;
+
+        [[nodiscard]] virtual const char *name() const = 0;
+        // Framebuffer size, and how many steps make up a run
+        [[nodiscard]] virtual int width() const { return 1920; }
+        [[nodiscard]] virtual int height() const { return 1080; }
+        [[nodiscard]] virtual unsigned frames() const { return 240; }
+        // Draws the first frame. Scenes are deterministic, every reset
+        // starts the same sequence again.
+        virtual void reset(rfb::ModifiablePixelBuffer *pb) = 0;
+        virtual void step(rfb::ModifiablePixelBuffer *pb, rfb::UpdateTracker *tracker, unsigned frame) = 0;
+
+    protected:
+        std::mt19937 rng{1};
+
+        void fill(rfb::ModifiablePixelBuffer *pb, const rfb::Rect &r, rdr::U8 red, rdr::U8 green, rdr::U8 blue);
+        // A line of glyph-like blobs, close enough to text for the encoders
+        void text(rfb::ModifiablePixelBuffer *pb, const rfb::Rect &r, rdr::U8 shade);
+    };
+
+    // Office desktop, scrolling a document, a playing video and an idle
+    // screen with a blinking caret
+    std::vector<std::unique_ptr<DamageScene>> synthetic_scenes();
+
+    // Replays a trace recorded with -DamageTrace, at the size it was
+    // recorded at. Throws rdr::Exception if it can't be read.
+    std::unique_ptr<DamageScene> trace_scene(const char *path);
+} // namespace benchmarking
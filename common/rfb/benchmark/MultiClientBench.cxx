@@ -0,0 +1,307 @@
+/* Copyright (C) 2026 Kasm Technologies Corp
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+// Several clients with different settings on one framebuffer, driven the
+// way VNCServerST::writeUpdate() drives them: one comparer, one shared
+// encoding cache, then each client in turn, or all of them on workers with
+// ConcurrentUpdates. Each client count is run both ways.
+
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <string_view>
+#include <tbb/task_group.h>
+#include <tinyxml2.h>
+#include <rdr/Exception.h>
+#include <rfb/ComparingUpdateTracker.h>
+#include <rfb/ServerCore.h>
+#include <rfb/screenTypes.h>
+#include "DamageScenes.h"
+#include "benchmark.h"
+
+namespace benchmarking {
+    static const PixelFormat pf32{32, 24, false, true, 0xFF, 0xFF, 0xFF, 0, 8, 16};
+    static const PixelFormat pf16{16, 16, false, true, 0x1F, 0x3F, 0x1F, 11, 5, 0};
+
+    struct profile_t {
+        const char *name;
+        const PixelFormat *pf;
+        std::vector<rdr::S32> encodings;
+    };
+
+    // What a mix of browser and native clients asks for
+    static const profile_t profiles[] = {
+        {"tight webp", &pf32, {std::begin(default_encodings), std::end(default_encodings)}},
+        {"tight jpeg q8", &pf32,
+         {encodingTight, pseudoEncodingQualityLevel0 + 8, pseudoEncodingCompressLevel0 + 2, pseudoEncodingLastRect}},
+        {"tight lossless", &pf32, {encodingTight, pseudoEncodingCompressLevel0 + 1, pseudoEncodingLastRect}},
+        {"zrle 16bpp", &pf16, {encodingZRLE, pseudoEncodingLastRect}},
+        {"hextile", &pf32, {encodingHextile}},
+    };
+
+    struct client_t {
+        const profile_t *profile;
+        std::unique_ptr<MockSConnection> conn;
+        uint64_t cpu_ns{};
+        uint64_t bytes{};
+    };
+
+    struct run_t {
+        unsigned clients{};
+        bool concurrent{};
+        unsigned frames{};
+        double p50_ms{};
+        double p99_ms{};
+        double fps{};
+        // All clients together, over all frames
+        double cpu_ms{};
+        // Per client, over all frames. The CPU time is only known when the
+        // clients take turns.
+        std::vector<double> client_cpu_ms;
+        std::vector<double> bytes;
+        std::vector<const char *> profiles;
+    };
+
+    static uint64_t cpu_now_ns() {
+        timespec ts{};
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+
+    static double percentile(std::vector<uint64_t> v, double p) {
+        if (v.empty())
+            return 0;
+
+        std::sort(v.begin(), v.end());
+        return static_cast<double>(v[std::min(v.size() - 1, static_cast<size_t>(v.size() * p))]);
+    }
+
+    static run_t run(DamageScene &scene, unsigned nclients) {
+        const int width = scene.width();
+        const int height = scene.height();
+        const unsigned frames = scene.frames();
+
+        ManagedPixelBuffer pb{pf32, width, height};
+        scene.reset(&pb);
+
+        ComparingUpdateTracker comparer{&pb};
+        comparer.enable();
+
+        ScreenSet layout;
+        layout.add_screen(Screen(0, 0, 0, width, height, 0));
+
+        EncCache cache;
+        std::vector<client_t> clients(nclients);
+        // As the server decides it
+        const bool concurrent = Server::concurrentUpdates && nclients > 1;
+        for (unsigned i = 0; i < nclients; i++) {
+            auto &c = clients[i];
+            c.profile = &profiles[i % std::size(profiles)];
+            c.conn = std::make_unique<MockSConnection>(&cache);
+            c.conn->cp.width = width;
+            c.conn->cp.height = height;
+            c.conn->cp.screenLayout = layout;
+            c.conn->cp.setPF(*c.profile->pf);
+            c.conn->setEncodings(c.profile->encodings.size(), c.profile->encodings.data());
+        }
+
+        // Everyone starts with the whole screen, as a new client does.
+        // That is not what's being measured.
+        {
+            UpdateInfo ui;
+            comparer.add_changed(pb.getRect());
+            comparer.compare(true, Region());
+            comparer.getUpdateInfo(&ui, pb.getRect());
+            comparer.clear();
+            for (auto &c: clients)
+                c.conn->writeUpdate(ui, layout, &pb);
+            for (auto &c: clients)
+                c.bytes = c.conn->bytes();
+        }
+
+        std::vector<uint64_t> frame_us;
+        frame_us.reserve(frames);
+
+        uint64_t cpu_ns = 0;
+        const auto begin = std::chrono::steady_clock::now();
+
+        for (unsigned frame = 0; frame < frames; frame++) {
+            scene.step(&pb, &comparer, frame);
+
+            const auto start = std::chrono::steady_clock::now();
+
+            UpdateInfo ui;
+            comparer.compare(false, Region());
+            comparer.getUpdateInfo(&ui, pb.getRect());
+            comparer.clear();
+
+            cache.enabled = nclients > 1;
+            if (cache.enabled) {
+                cache.setMaxBytes(static_cast<size_t>(Server::encCacheSize) * 1024 * 1024);
+                cache.nextFrame();
+            } else {
+                cache.clear();
+            }
+
+            const auto frame_cpu = cpu_now_ns();
+
+            if (ui.is_empty()) {
+                // Nothing to send
+            } else if (concurrent) {
+                tbb::task_group tasks;
+                for (auto &c: clients)
+                    tasks.run([&c, &ui, &layout, &pb] { c.conn->writeUpdate(ui, layout, &pb); });
+                tasks.wait();
+            } else {
+                for (auto &c: clients) {
+                    const auto cpu = cpu_now_ns();
+                    c.conn->writeUpdate(ui, layout, &pb);
+                    c.cpu_ns += cpu_now_ns() - cpu;
+                }
+            }
+
+            cpu_ns += cpu_now_ns() - frame_cpu;
+
+            frame_us.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+                                   std::chrono::steady_clock::now() - start)
+                                   .count());
+        }
+
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+        run_t r;
+        r.clients = nclients;
+        r.concurrent = concurrent;
+        r.cpu_ms = cpu_ns / 1e6;
+        r.p50_ms = percentile(frame_us, 0.5) / 1000.;
+        r.p99_ms = percentile(frame_us, 0.99) / 1000.;
+        r.frames = frames;
+        r.fps = seconds > 0 ? frames / seconds : 0;
+
+        for (auto &c: clients) {
+            r.client_cpu_ms.push_back(c.cpu_ns / 1e6);
+            r.bytes.push_back(static_cast<double>(c.conn->bytes() - c.bytes));
+            r.profiles.push_back(c.profile->name);
+        }
+
+        return r;
+    }
+
+    static std::vector<unsigned> client_counts(unsigned max) {
+        std::vector<unsigned> counts;
+        for (unsigned n = 1; n < max; n *= 2)
+            counts.push_back(n);
+        counts.push_back(max);
+
+        return counts;
+    }
+} // namespace benchmarking
+
+void multiClientBenchmark(unsigned maxClients, const std::string_view results_file, const std::string_view trace_file) {
+    using namespace benchmarking;
+
+    try {
+        tinyxml2::XMLDocument doc;
+        auto *suites = doc.NewElement("testsuites");
+        suites->SetAttribute("name", "MultiClientBenchmark");
+        doc.InsertFirstChild(suites);
+
+        std::vector<std::unique_ptr<DamageScene>> scenes;
+        if (trace_file.empty())
+            scenes = synthetic_scenes();
+        else
+            scenes.push_back(trace_scene(trace_file.data()));
+
+        for (const auto &scene: scenes) {
+            auto *suite = doc.NewElement("testsuite");
+            suite->SetAttribute("name", scene->name());
+            suites->InsertEndChild(suite);
+            auto total_tests{0};
+
+            // Same layout as the single client report: times go in "time",
+            // everything else in "file"
+            auto add_item = [&doc, suite, &total_tests](const std::string &name, auto time_value, auto other_value) {
+                auto *test_case = doc.NewElement("testcase");
+                test_case->SetAttribute("name", name.c_str());
+                test_case->SetAttribute("file", other_value);
+                test_case->SetAttribute("time", time_value);
+                test_case->SetAttribute("runs", 1);
+                test_case->SetAttribute("classname", "KasmVNC");
+
+                suite->InsertEndChild(test_case);
+
+                ++total_tests;
+            };
+
+            for (const auto n: client_counts(maxClients)) {
+                for (const bool concurrent: {false, true}) {
+                    // One client is never handed to a worker
+                    if (concurrent && n == 1)
+                        continue;
+
+                    Server::concurrentUpdates.setParam(concurrent);
+
+                    vlog.info("Scene %s with %u clients%s...", scene->name(), n, concurrent ? ", concurrent" : "");
+                    const auto r = run(*scene, n);
+
+                    const double cpu = r.cpu_ms / n / r.frames;
+                    const double bytes = std::accumulate(r.bytes.begin(), r.bytes.end(), 0.) / n / r.frames;
+
+                    vlog.info("Scene %s, %u clients%s: frame p50 %.2f ms, p99 %.2f ms, %.1f fps, "
+                              "per client %.2f ms CPU and %.0f bytes a frame",
+                              scene->name(), n, r.concurrent ? " concurrent" : "",
+                              r.p50_ms, r.p99_ms, r.fps, cpu, bytes);
+
+                    const auto prefix = std::to_string(n) + (n == 1 ? " client, " : " clients, ") +
+                                        (r.concurrent ? "concurrent, " : "");
+                    constexpr auto mult = 1 / 1000.;
+                    add_item(prefix + "frame time p50, ms", r.p50_ms * mult, "");
+                    add_item(prefix + "frame time p99, ms", r.p99_ms * mult, "");
+                    add_item(prefix + "frames per second", 0, r.fps);
+                    add_item(prefix + "CPU per client per frame, ms", cpu * mult, "");
+                    add_item(prefix + "bytes per client per frame", 0, bytes);
+
+                    if (n != maxClients)
+                        continue;
+
+                    for (unsigned i = 0; i < n; i++) {
+                        const auto client = prefix + "client " + std::to_string(i) + " (" + r.profiles[i] + "), ";
+                        if (!r.concurrent)
+                            add_item(client + "CPU per frame, ms", r.client_cpu_ms[i] / r.frames * mult, "");
+                        add_item(client + "bytes per frame", 0, r.bytes[i] / r.frames);
+                    }
+                }
+            }
+
+            suite->SetAttribute("tests", total_tests);
+        }
+
+        doc.SaveFile(results_file.data());
+
+        exit(0);
+    } catch (rdr::Exception &e) {
+        vlog.error("Benchmarking failed: %s", e.str());
+        exit(1);
+    } catch (std::exception &e) {
+        vlog.error("Benchmarking failed: %s", e.what());
+        exit(1);
+    }
+}
@@ -43,108 +43,6 @@ namespace benchmarking {
         }
     };
 
-    class MockStream final : public rdr::OutStream {
-    public:
-        MockStream() {
-            offset = 0;
-            ptr = buf;
-            end = buf + sizeof(buf);
-        }
-
-    private:
-        void overrun(size_t needed) override {
-            assert(end >= ptr);
-            if (needed > static_cast<size_t>(end - ptr))
-                flush();
-        }
-
-    public:
-        size_t length() override {
-            flush();
-            return offset;
-        }
-
-        void flush() override {
-            offset += ptr - buf;
-            ptr = buf;
-        }
-
-    private:
-        ptrdiff_t offset;
-        rdr::U8 buf[8192]{};
-    };
-
-    class MockSConnection final : public rfb::SConnection {
-    public:
-        MockSConnection() {
-            setStreams(nullptr, &out);
-
-            setWriter(new rfb::SMsgWriter(&cp, &out, &udps));
-        }
-
-        ~MockSConnection() override = default;
-
-        void writeUpdate(const rfb::UpdateInfo &ui, const ScreenSet &layout, const rfb::PixelBuffer *pb) {
-            cache.clear();
-
-            manager.clearEncodingTime();
-            if (!ui.is_empty()) {
-                manager.writeUpdate(ui, layout, pb, nullptr, false);
-            } else {
-                rfb::Region region{pb->getRect()};
-                manager.writeLosslessRefresh(region, layout, pb, nullptr, 2000);
-            }
-        }
-
-        void setDesktopSize(int fb_width, int fb_height, const rfb::ScreenSet &layout) override {
-            cp.width = fb_width;
-            cp.height = fb_height;
-            cp.screenLayout = layout;
-
-            writer()->writeExtendedDesktopSize(rfb::reasonServer, 0, cp.width, cp.height, cp.screenLayout);
-        }
-
-        void sendStats(const bool toClient) override {}
-
-        [[nodiscard]] bool canChangeKasmSettings() const override {
-            return true;
-        }
-
-        void udpUpgrade(const char *resp) override {}
-
-        void udpDowngrade(const bool) override {}
-
-        void subscribeUnixRelay(const char *name) override {}
-
-        void unixRelay(const char *name, const rdr::U8 *buf, const unsigned len) override {}
-
-        void videoEncodersRequest(const std::vector<int32_t> &encoders) override {}
-
-        void handleFrameStats(rdr::U32 all, rdr::U32 render) override {}
-
-        [[nodiscard]] auto getJpegStats() const {
-            return manager.jpegstats;
-        }
-
-        [[nodiscard]] auto getWebPStats() const {
-            return manager.webpstats;
-        }
-
-        [[nodiscard]] auto bytes() {
-            return out.length();
-        }
-        [[nodiscard]] auto udp_bytes() {
-            return udps.length();
-        }
-
-    protected:
-        MockStream out{};
-        MockStream udps{};
-
-        EncCache cache{};
-        EncodeManager manager{this, &cache, FFmpeg::get(), video_encoders::EncoderProbe::get(FFmpeg::get(), {}, nullptr)};
-    };
-
     class MockCConnection final : public MockTestConnection {
     public:
         explicit MockCConnection(const std::vector<rdr::S32> &encodings, rfb::ManagedPixelBuffer *pb) {
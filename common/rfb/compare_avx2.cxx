@@ -0,0 +1,118 @@
+/* Copyright (C) 2021 Kasm Web
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#include <immintrin.h>
+#include <string.h>
+
+#include <rfb/compare_simd.h>
+
+namespace rfb {
+
+static inline bool lineEqual(const uint8_t *a, const uint8_t *b,
+				const unsigned lineBytes) {
+
+	if (lineBytes < 32)
+		return memcmp(a, b, lineBytes) == 0;
+
+	__m256i diff = _mm256_setzero_si256();
+	unsigned x;
+
+	for (x = 0; x + 64 <= lineBytes; x += 64) {
+		const __m256i a0 = _mm256_loadu_si256((const __m256i *) (a + x));
+		const __m256i a1 = _mm256_loadu_si256((const __m256i *) (a + x + 32));
+		const __m256i b0 = _mm256_loadu_si256((const __m256i *) (b + x));
+		const __m256i b1 = _mm256_loadu_si256((const __m256i *) (b + x + 32));
+
+		diff = _mm256_or_si256(diff, _mm256_xor_si256(a0, b0));
+		diff = _mm256_or_si256(diff, _mm256_xor_si256(a1, b1));
+	}
+
+	if (x + 32 <= lineBytes) {
+		diff = _mm256_or_si256(diff, _mm256_xor_si256(
+				_mm256_loadu_si256((const __m256i *) (a + x)),
+				_mm256_loadu_si256((const __m256i *) (b + x))));
+		x += 32;
+	}
+
+	// Overlapping load for the tail
+	if (x < lineBytes) {
+		x = lineBytes - 32;
+		diff = _mm256_or_si256(diff, _mm256_xor_si256(
+				_mm256_loadu_si256((const __m256i *) (a + x)),
+				_mm256_loadu_si256((const __m256i *) (b + x))));
+	}
+
+	return _mm256_testz_si256(diff, diff);
+}
+
+unsigned AVX2_firstChangedRow(const uint8_t *a, const unsigned astride,
+				const uint8_t *b, const unsigned bstride,
+				const unsigned lineBytes, const unsigned rows) {
+	unsigned y;
+
+	for (y = 0; y < rows; y++) {
+		if (!lineEqual(a, b, lineBytes))
+			break;
+
+		a += astride;
+		b += bstride;
+	}
+
+	// Leave the upper halves clean for any SSE code that follows
+	_mm256_zeroupper();
+
+	return y;
+}
+
+unsigned AVX2_firstOtherPixel(const uint32_t *px, const unsigned n,
+				const uint32_t colour) {
+	const __m256i c = _mm256_set1_epi32(colour);
+	unsigned i, ret = n;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		const __m256i a = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *) (px + i)), c);
+		const __m256i b = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *) (px + i + 8)), c);
+
+		if (_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_and_si256(a, b))) != 0xff) {
+			const int ma = _mm256_movemask_ps(_mm256_castsi256_ps(a));
+			if (ma != 0xff)
+				ret = i + __builtin_ctz(~ma);
+			else
+				ret = i + 8 + __builtin_ctz(~_mm256_movemask_ps(_mm256_castsi256_ps(b)));
+			break;
+		}
+	}
+
+	if (ret == n && i + 8 <= n) {
+		const int m = _mm256_movemask_ps(_mm256_castsi256_ps(
+				_mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *) (px + i)), c)));
+		if (m != 0xff)
+			ret = i + __builtin_ctz(~m);
+		else
+			i += 8;
+	}
+
+	_mm256_zeroupper();
+
+	if (ret == n)
+		ret = i + firstOtherPixel(px + i, n - i, colour);
+
+	return ret;
+}
+
+}; // namespace rfb
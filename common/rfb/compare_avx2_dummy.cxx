@@ -0,0 +1,48 @@
+/* Copyright (C) 2021 Kasm Web
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#include <string.h>
+
+#include <rfb/compare_simd.h>
+
+namespace rfb {
+
+// The compiler can't target AVX2, fall back to plain memcmp in case the
+// cpu reports it anyway
+unsigned AVX2_firstChangedRow(const uint8_t *a, const unsigned astride,
+				const uint8_t *b, const unsigned bstride,
+				const unsigned lineBytes, const unsigned rows) {
+	unsigned y;
+
+	for (y = 0; y < rows; y++) {
+		if (memcmp(a, b, lineBytes))
+			break;
+
+		a += astride;
+		b += bstride;
+	}
+
+	return y;
+}
+
+unsigned AVX2_firstOtherPixel(const uint32_t *px, const unsigned n,
+				const uint32_t colour) {
+	return firstOtherPixel(px, n, colour);
+}
+
+}; // namespace rfb
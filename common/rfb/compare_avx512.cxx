@@ -0,0 +1,47 @@
+/* Copyright (C) 2021 Kasm Web
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#include <immintrin.h>
+
+#include <rfb/compare_simd.h>
+
+namespace rfb {
+
+unsigned AVX512_firstOtherPixel(const uint32_t *px, const unsigned n,
+				const uint32_t colour) {
+	const __m512i c = _mm512_set1_epi32(colour);
+	unsigned i, ret = n;
+
+	for (i = 0; i < n; i += 16) {
+		// The tail is a masked load, so there is no scalar remainder
+		const __mmask16 valid = n - i >= 16 ? 0xffff : (1 << (n - i)) - 1;
+		const __m512i v = _mm512_maskz_loadu_epi32(valid, px + i);
+		const __mmask16 other = _mm512_mask_cmpneq_epi32_mask(valid, v, c);
+
+		if (other) {
+			ret = i + __builtin_ctz(other);
+			break;
+		}
+	}
+
+	_mm256_zeroupper();
+
+	return ret;
+}
+
+}; // namespace rfb
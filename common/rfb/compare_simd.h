@@ -0,0 +1,63 @@
+/* Copyright (C) 2021 Kasm Web
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#ifndef __RFB_COMPARE_SIMD_H__
+#define __RFB_COMPARE_SIMD_H__
+
+#include <stdint.h>
+
+namespace rfb {
+
+	// Compare rows lines of lineBytes each, returning the index of the
+	// first line that differs, or rows if the areas are identical.
+	// Strides are in bytes.
+
+	unsigned SSE2_firstChangedRow(const uint8_t *a, const unsigned astride,
+				const uint8_t *b, const unsigned bstride,
+				const unsigned lineBytes, const unsigned rows);
+
+	unsigned AVX2_firstChangedRow(const uint8_t *a, const unsigned astride,
+				const uint8_t *b, const unsigned bstride,
+				const unsigned lineBytes, const unsigned rows);
+
+	// Index of the first of n pixels that isn't colour, or n if they all
+	// are. This finds the end of each run in solid and palette analysis.
+
+	static inline unsigned firstOtherPixel(const uint32_t *px, const unsigned n,
+				const uint32_t colour) {
+		unsigned i;
+
+		for (i = 0; i < n; i++) {
+			if (px[i] != colour)
+				break;
+		}
+
+		return i;
+	}
+
+	unsigned SSE2_firstOtherPixel(const uint32_t *px, const unsigned n,
+				const uint32_t colour);
+
+	unsigned AVX2_firstOtherPixel(const uint32_t *px, const unsigned n,
+				const uint32_t colour);
+
+	unsigned AVX512_firstOtherPixel(const uint32_t *px, const unsigned n,
+				const uint32_t colour);
+};
+
+#endif
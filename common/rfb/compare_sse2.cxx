@@ -0,0 +1,108 @@
+/* Copyright (C) 2021 Kasm Web
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#include <emmintrin.h>
+#include <string.h>
+
+#include <rfb/compare_simd.h>
+
+namespace rfb {
+
+static inline bool lineEqual(const uint8_t *a, const uint8_t *b,
+				const unsigned lineBytes) {
+
+	if (lineBytes < 16)
+		return memcmp(a, b, lineBytes) == 0;
+
+	__m128i diff = _mm_setzero_si128();
+	unsigned x;
+
+	// Two vectors per iteration, the usual 64px block line is 256 bytes
+	for (x = 0; x + 32 <= lineBytes; x += 32) {
+		const __m128i a0 = _mm_loadu_si128((const __m128i *) (a + x));
+		const __m128i a1 = _mm_loadu_si128((const __m128i *) (a + x + 16));
+		const __m128i b0 = _mm_loadu_si128((const __m128i *) (b + x));
+		const __m128i b1 = _mm_loadu_si128((const __m128i *) (b + x + 16));
+
+		diff = _mm_or_si128(diff, _mm_xor_si128(a0, b0));
+		diff = _mm_or_si128(diff, _mm_xor_si128(a1, b1));
+	}
+
+	if (x + 16 <= lineBytes) {
+		diff = _mm_or_si128(diff, _mm_xor_si128(
+				_mm_loadu_si128((const __m128i *) (a + x)),
+				_mm_loadu_si128((const __m128i *) (b + x))));
+		x += 16;
+	}
+
+	// Overlapping load for the tail
+	if (x < lineBytes) {
+		x = lineBytes - 16;
+		diff = _mm_or_si128(diff, _mm_xor_si128(
+				_mm_loadu_si128((const __m128i *) (a + x)),
+				_mm_loadu_si128((const __m128i *) (b + x))));
+	}
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) == 0xffff;
+}
+
+unsigned SSE2_firstChangedRow(const uint8_t *a, const unsigned astride,
+				const uint8_t *b, const unsigned bstride,
+				const unsigned lineBytes, const unsigned rows) {
+	unsigned y;
+
+	for (y = 0; y < rows; y++) {
+		if (!lineEqual(a, b, lineBytes))
+			break;
+
+		a += astride;
+		b += bstride;
+	}
+
+	return y;
+}
+
+unsigned SSE2_firstOtherPixel(const uint32_t *px, const unsigned n,
+				const uint32_t colour) {
+	const __m128i c = _mm_set1_epi32(colour);
+	unsigned i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		const __m128i a = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *) (px + i)), c);
+		const __m128i b = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *) (px + i + 4)), c);
+
+		if (_mm_movemask_ps(_mm_castsi128_ps(_mm_and_si128(a, b))) != 0xf) {
+			const int ma = _mm_movemask_ps(_mm_castsi128_ps(a));
+			if (ma != 0xf)
+				return i + __builtin_ctz(~ma);
+			return i + 4 + __builtin_ctz(~_mm_movemask_ps(_mm_castsi128_ps(b)));
+		}
+	}
+
+	if (i + 4 <= n) {
+		const int m = _mm_movemask_ps(_mm_castsi128_ps(
+				_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *) (px + i)), c)));
+		if (m != 0xf)
+			return i + __builtin_ctz(~m);
+		i += 4;
+	}
+
+	return i + firstOtherPixel(px + i, n - i, colour);
+}
+
+}; // namespace rfb
@@ -27,7 +27,6 @@
 #include "KasmVideoConstants.h"
 #include "rfb/encodings.h"
 #include <rfb/encoders/utils.h>
-#include <libyuv.h>
 
 static rfb::LogWriter vlog("FFMPEGHWEncoder");
 
@@ -261,7 +260,7 @@ namespace rfb {
     }
 
     template<AVHWDeviceType HWDeviceType, AVPixelFormat AVPixFmt>
-    bool FFMPEGHWEncoder<HWDeviceType, AVPixFmt>::render(const PixelBuffer *pb, bool forceKeyFrame) {
+    bool FFMPEGHWEncoder<HWDeviceType, AVPixFmt>::render(const PixelBuffer *pb, const Region &damage, bool forceKeyFrame) {
         // compress
         int stride;
         const auto rect = layout.dimensions;
@@ -290,6 +289,10 @@ namespace rfb {
                   dst_width, dst_height, static_cast<uint8_t>(Server::frameRate), (int)Server::frameRate,
                   static_cast<uint8_t>(Server::groupOfPicture), static_cast<uint8_t>(Server::videoQualityCRFCQP));
 
+        // The frame keeps the last picture, only the changed blocks are
+        // converted again
+        bool whole = forceKeyFrame;
+
         if (current_params != params) {
             bpp = pb->getPF().bpp >> 3;
             if (!init(width, height, params)) {
@@ -298,6 +301,7 @@ namespace rfb {
             }
 
             frame = sw_frame_guard.get();
+            whole = true;
         } else {
             frame->pict_type = AV_PICTURE_TYPE_NONE;
         }
@@ -305,6 +309,11 @@ namespace rfb {
         if (forceKeyFrame)
             frame->pict_type = AV_PICTURE_TYPE_I;
 
+        if (!encoders::damaged_blocks(damage, rect, dst_width, dst_height, blocks) || whole) {
+            whole = true;
+            blocks.clear();
+        }
+
         const int src_stride_bytes = stride * bpp;
 
         DEBUG_LOG(vlog, "render(): width=%d, height=%d, dst_width=%d, dst_height=%d, stride=%d pixels, stride_bytes=%d, bpp=%d",
@@ -315,8 +324,20 @@ namespace rfb {
         DEBUG_LOG(vlog, "Converting ARGB to NV12: src_stride=%d, dst_linesize[0]=%d, dst_linesize[1]=%d, dst_width=%d, dst_height=%d",
                    src_stride_bytes, frame->linesize[0], frame->linesize[1], dst_width, dst_height);
 
-        if (err = libyuv::ARGBToNV12(buffer, src_stride_bytes, frame->data[0], frame->linesize[0],
-            frame->data[1], frame->linesize[1], dst_width, dst_height); err != 0) {
+        if (whole) {
+            err = encoders::argb_to_nv12(buffer, src_stride_bytes, frame->data, frame->linesize, dst_width, dst_height);
+        } else {
+            for (const auto &r: blocks) {
+                uint8_t *const dst[] = {frame->data[0] + r.tl.y * frame->linesize[0] + r.tl.x,
+                    frame->data[1] + r.tl.y / 2 * frame->linesize[1] + r.tl.x};
+                err = encoders::argb_to_nv12(buffer + r.tl.y * src_stride_bytes + r.tl.x * bpp, src_stride_bytes, dst,
+                    frame->linesize, r.width(), r.height());
+                if (err != 0)
+                    break;
+            }
+        }
+
+        if (err != 0) {
             vlog.error("libyuv::ARGBToNV12 failed with code: %d", err);
             return false;
         }
@@ -337,6 +358,7 @@ namespace rfb {
 
         hw_frame->pts = frame->pts;
         hw_frame->pict_type = frame->pict_type;
+        encoders::mark_regions(ffmpeg, hw_frame, blocks);
 
         DEBUG_LOG(vlog, "HW frame before send: format=%d, width=%d, height=%d, linesize[0]=%d, linesize[1]=%d, pts=%ld",
                    hw_frame->format, hw_frame->width, hw_frame->height, hw_frame->linesize[0], hw_frame->linesize[1], hw_frame->pts);
@@ -16,10 +16,12 @@
  * USA.
  */
 #include "ScreenEncoderManager.h"
+#include <algorithm>
 #include <cassert>
 #include <rfb/LogWriter.h>
 #include <rfb/Region.h>
 #include <rfb/SMsgWriter.h>
+#include <rfb/cpuid.h>
 #include <rfb/encodings.h>
 #include <sys/stat.h>
 #include <tbb/parallel_for_each.h>
@@ -38,7 +40,7 @@ namespace rfb {
         base_video_encoder(encoder),
         available_encoders(encoders) {
         screens_to_refresh.reserve(T);
-        arena.initialize(MAX_SCREENS);
+        arena.initialize(cpu_info::cores_count);
     }
 
     template<uint8_t T>
@@ -86,7 +88,7 @@ namespace rfb {
 
     template<uint8_t T>
     bool ScreenEncoderManager<T>::add_screen(uint8_t index, const Screen &layout) {
-        screens[index] = {layout, nullptr, true};
+        screens[index] = {layout, nullptr, true, layout.dimensions};
         screens[index].layout.id = index;
         screens[index].encoder = add_encoder(screens[index].layout);
 
@@ -143,6 +145,30 @@ namespace rfb {
         }
     }
 
+    template<uint8_t T>
+    void ScreenEncoderManager<T>::damage_all() {
+        // What the encoders hold can't be trusted after a failed frame, the
+        // updates in between go out by other means
+        for (auto &screen: screens)
+            screen.damage = screen.layout.dimensions;
+    }
+
+    template<uint8_t T>
+    void ScreenEncoderManager<T>::share_threads() {
+        if (!count)
+            return;
+
+        const auto threads = static_cast<uint8_t>(std::clamp<int>(cpu_info::cores_count / count, 1, MAX_CODEC_THREADS));
+
+        mask_t remaining_mask = mask;
+        while (remaining_mask) {
+            const auto pos = __builtin_ctzll(remaining_mask);
+            if (auto *encoder = screens[pos].encoder; encoder)
+                encoder->set_threads(threads);
+            remaining_mask &= remaining_mask - 1;
+        }
+    }
+
     template<uint8_t T>
     ScreenEncoderManager<T>::stats_t ScreenEncoderManager<T>::get_stats() const {
         return stats;
@@ -150,8 +176,6 @@ namespace rfb {
 
     template<uint8_t T>
     bool ScreenEncoderManager<T>::sync_layout(const ScreenSet &layout, const Region &region) {
-        const auto bounds = region.get_bounding_rect();
-
         const auto old_mask = mask;
         mask_t new_mask = 0;
 
@@ -169,8 +193,9 @@ namespace rfb {
                 remove_screen(id);
                 if (!add_screen(id, screen))
                     return false;
-            } else if (screen.dimensions.overlaps(bounds)) {
+            } else if (const auto part = region.intersect(screen.dimensions); !part.is_empty()) {
                 screens[id].dirty = true;
+                screens[id].damage.assign_union(part);
             }
         }
 
@@ -178,6 +203,8 @@ namespace rfb {
             clear_screens(stale_screens);
         }
 
+        share_threads();
+
         //if (old_mask != mask || (mask > 0 && screens_to_refresh.empty()))
             rebuild_screens_to_refresh();
 
@@ -223,6 +250,7 @@ namespace rfb {
             conn->writer()->endRect();
 
             screen.dirty = false;
+            screen.damage.clear();
 
             const auto after = out_conn->length();
             stats.bytes += after - before;
@@ -240,15 +268,17 @@ namespace rfb {
 
                         auto &screen = screens[index];
                         if (auto *encoder = screen.encoder; encoder) {
-                            screen.dirty = encoder->render(pb, forceKeyFrame);
+                            screen.dirty = encoder->render(pb, screen.damage, forceKeyFrame);
                             if (!screen.dirty)
                                 ctx.cancel_group_execution();
                         }
                     });
             });
 
-            if (ctx.is_group_execution_cancelled())
+            if (ctx.is_group_execution_cancelled()) {
+                damage_all();
                 return false;
+            }
 
             for (auto index: screens_to_refresh) {
                 auto &screen = screens[index];
@@ -259,10 +289,18 @@ namespace rfb {
         } else {
             const auto index = screens_to_refresh[0];
             if (auto encoder = screens[index].encoder; encoder) {
-                if (encoder->render(pb, forceKeyFrame))
+                bool rendered{};
+                // In the arena too, for the row-parallel conversion
+                arena.execute([&] {
+                    rendered = encoder->render(pb, screens[index].damage, forceKeyFrame);
+                });
+
+                if (rendered)
                     send_frame(screens[index]);
-                else
+                else {
+                    damage_all();
                     return false;
+                }
             }
         }
 
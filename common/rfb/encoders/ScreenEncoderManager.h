@@ -21,9 +21,12 @@
 #include "KasmVideoConstants.h"
 #include "VideoEncoder.h"
 #include "rfb/Encoder.h"
+#include "rfb/Region.h"
 #include "rfb/ffmpeg.h"
 
 inline constexpr uint8_t MAX_SCREENS = 8;
+// Slice threading stops paying off past this
+inline constexpr uint8_t MAX_CODEC_THREADS = 16;
 
 namespace rfb {
     template<uint8_t T = MAX_SCREENS>
@@ -35,6 +38,8 @@ namespace rfb {
             Screen layout{};
             VideoEncoder *encoder{};
             bool dirty{};
+            // Changed since the encoder last rendered
+            Region damage;
         };
 
         uint8_t count{};
@@ -55,6 +60,8 @@ namespace rfb {
         void remove_screen(uint8_t index);
         void rebuild_screens_to_refresh();
         void clear_screens(mask_t clear_mask);
+        void share_threads();
+        void damage_all();
 
     public:
         struct stats_t {
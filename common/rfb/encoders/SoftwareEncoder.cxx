@@ -24,7 +24,6 @@
 #include <rfb/ffmpeg.h>
 #include <fmt/format.h>
 #include <rfb/encoders/utils.h>
-#include <libyuv.h>
 #include "EncoderConfiguration.h"
 
 static rfb::LogWriter vlog("SoftwareEncoder");
@@ -57,7 +56,7 @@ namespace rfb {
         return conn->cp.supportsEncoding(encodingKasmVideo);
     }
 
-    bool SoftwareEncoder::render(const PixelBuffer *pb, bool forceKeyFrame) {
+    bool SoftwareEncoder::render(const PixelBuffer *pb, const Region &damage, bool forceKeyFrame) {
         // compress
         int stride;
 
@@ -81,7 +80,12 @@ namespace rfb {
                                   dst_height,
                                   static_cast<uint8_t>(Server::frameRate),
                                   static_cast<uint8_t>(Server::groupOfPicture),
-                                  static_cast<uint8_t>(Server::videoQualityCRFCQP)};
+                                  static_cast<uint8_t>(Server::videoQualityCRFCQP),
+                                  threads};
+
+        // The frame keeps the last picture, only the changed blocks are
+        // converted again
+        bool whole = forceKeyFrame;
 
         if (current_params != params) {
             bpp = pb->getPF().bpp >> 3;
@@ -91,6 +95,7 @@ namespace rfb {
             }
 
             frame = frame_guard.get();
+            whole = true;
         } else {
             frame->pict_type = AV_PICTURE_TYPE_NONE;
         }
@@ -98,17 +103,31 @@ namespace rfb {
         if (forceKeyFrame)
             frame->pict_type = AV_PICTURE_TYPE_I;
 
+        // The codec may still hold on to it, this copies it if so
+        if (ffmpeg.av_frame_make_writable(frame) < 0) {
+            vlog.error("Could not make frame writable");
+            return false;
+        }
+
+        if (!encoders::damaged_blocks(damage, rect, dst_width, dst_height, blocks))
+            whole = true;
+
         const int src_stride_bytes = stride * bpp;
-        int err = libyuv::ARGBToI420(buffer,
-            src_stride_bytes,
-            frame->data[0],
-            frame->linesize[0],
-            frame->data[1],
-            frame->linesize[1],
-            frame->data[2],
-            frame->linesize[2],
-            dst_width,
-            dst_height);
+        int err{};
+        if (whole) {
+            err = encoders::argb_to_i420(buffer, src_stride_bytes, frame->data, frame->linesize, dst_width, dst_height);
+        } else {
+            for (const auto &r: blocks) {
+                uint8_t *const dst[] = {frame->data[0] + r.tl.y * frame->linesize[0] + r.tl.x,
+                    frame->data[1] + r.tl.y / 2 * frame->linesize[1] + r.tl.x / 2,
+                    frame->data[2] + r.tl.y / 2 * frame->linesize[2] + r.tl.x / 2};
+                err = encoders::argb_to_i420(buffer + r.tl.y * src_stride_bytes + r.tl.x * bpp, src_stride_bytes, dst,
+                    frame->linesize, r.width(), r.height());
+                if (err != 0)
+                    break;
+            }
+        }
+
         if (err != 0) {
             vlog.error("libyuv::ARGBToI420 failed with code: %d", err);
             return false;
@@ -189,6 +208,9 @@ namespace rfb {
         ctx->pix_fmt = AV_PIX_FMT_YUV420P;
         ctx->max_b_frames = 0; // No B-frames for immediate output
         ctx->profile = EncoderConfiguration::get_configuration(encoder).profile;
+        // Slices, as frame threading delays output by a frame per thread
+        ctx->thread_type = FF_THREAD_SLICE;
+        ctx->thread_count = current_params.threads;
 
         // HIGH
         // if (ffmpeg.av_opt_set(ctx->priv_data, "tune", "zerolatency,stillimage", 0) != 0)
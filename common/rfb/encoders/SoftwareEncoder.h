@@ -17,6 +17,7 @@
  */
 #pragma once
 
+#include <vector>
 #include "KasmVideoConstants.h"
 #include "rdr/OutStream.h"
 #include "rfb/Encoder.h"
@@ -40,6 +41,7 @@ namespace rfb {
 
         int64_t pts{};
         int bpp{};
+        std::vector<Rect> blocks;
         [[nodiscard]] bool init(int width, int height, VideoEncoderParams params);
 
         template<typename T>
@@ -50,7 +52,7 @@ namespace rfb {
         bool isSupported() const override;
         void writeRect(const PixelBuffer *pb, const Palette &palette) override;
         void writeSolidRect(int width, int height, const PixelFormat &pf, const rdr::U8 *colour) override;
-        bool render(const PixelBuffer *pb, bool forceKeyFrame = false) override;
+        bool render(const PixelBuffer *pb, const Region &damage, bool forceKeyFrame = false) override;
         void writeSkipRect() override;
     };
 } // namespace rfb
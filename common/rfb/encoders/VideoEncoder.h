@@ -18,6 +18,7 @@
 #pragma once
 
 #include <rfb/PixelBuffer.h>
+#include <rfb/Region.h>
 #include "rfb/Encoder.h"
 
 namespace rfb {
@@ -27,10 +28,11 @@ namespace rfb {
         uint8_t frame_rate{};
         uint8_t group_of_picture{};
         uint8_t quality{};
+        uint8_t threads{};
 
         bool operator==(const VideoEncoderParams &rhs) const noexcept {
             return width == rhs.width && height == rhs.height && frame_rate == rhs.frame_rate && group_of_picture == rhs.group_of_picture &&
-                   quality == rhs.quality;
+                   quality == rhs.quality && threads == rhs.threads;
         }
         bool operator!=(const VideoEncoderParams &rhs) const noexcept {
             return !(*this == rhs);
@@ -41,8 +43,20 @@ namespace rfb {
     public:
         VideoEncoder(Id id, SConnection *conn) :
             Encoder(id, conn, encodingKasmVideo, static_cast<EncoderFlags>(EncoderUseNativePF | EncoderLossy), -1) {}
-        virtual bool render(const PixelBuffer *pb, bool forceKeyFrame = false) = 0;
+        // damage is what changed in pb since the last render, only that part
+        // of the screen needs converting
+        virtual bool render(const PixelBuffer *pb, const Region &damage, bool forceKeyFrame = false) = 0;
         virtual void writeSkipRect() = 0;
         ~VideoEncoder() override = default;
+
+        // Codec threads this encoder may use, the cores are shared out
+        // between the screens. Encoders that care pick it up on the next
+        // render.
+        void set_threads(uint8_t n) {
+            threads = n;
+        }
+
+    protected:
+        uint8_t threads{1};
     };
 } // namespace rfb
@@ -1,4 +1,8 @@
 #include "utils.h"
+#include <algorithm>
+#include <atomic>
+#include <libyuv.h>
+#include <tbb/parallel_for.h>
 
 namespace rfb::encoders {
     void write_compact(rdr::OutStream *os, int value) {
@@ -16,4 +20,100 @@ namespace rfb::encoders {
             }
         }
     }
+
+    static constexpr int MACROBLOCK = 16;
+    // Past this, the bounding box of the changes is most of the frame anyway
+    static constexpr size_t MAX_REGIONS = 32;
+
+    // Below this, splitting costs more than it saves
+    static constexpr int PARALLEL_CONVERT_PIXELS = 1280 * 720;
+    // Even, so the chroma rows of a band are its own
+    static constexpr int CONVERT_BAND_ROWS = 64;
+
+    template<typename Convert>
+    static int convert_bands(int width, int height, const Convert &convert) {
+        if (width * height < PARALLEL_CONVERT_PIXELS)
+            return convert(0, height);
+
+        std::atomic<int> err{0};
+        const int bands = (height + CONVERT_BAND_ROWS - 1) / CONVERT_BAND_ROWS;
+
+        tbb::parallel_for(0, bands, [&](int band) {
+            const int y = band * CONVERT_BAND_ROWS;
+            if (const int ret = convert(y, std::min(CONVERT_BAND_ROWS, height - y)); ret != 0)
+                err = ret;
+        });
+
+        return err;
+    }
+
+    int argb_to_i420(const uint8_t *src, int src_stride, uint8_t *const dst[], const int dst_stride[], int width,
+        int height) {
+        return convert_bands(width, height, [&](int y, int rows) {
+            return libyuv::ARGBToI420(src + y * src_stride, src_stride,
+                dst[0] + y * dst_stride[0], dst_stride[0],
+                dst[1] + y / 2 * dst_stride[1], dst_stride[1],
+                dst[2] + y / 2 * dst_stride[2], dst_stride[2],
+                width, rows);
+        });
+    }
+
+    int argb_to_nv12(const uint8_t *src, int src_stride, uint8_t *const dst[], const int dst_stride[], int width,
+        int height) {
+        return convert_bands(width, height, [&](int y, int rows) {
+            return libyuv::ARGBToNV12(src + y * src_stride, src_stride,
+                dst[0] + y * dst_stride[0], dst_stride[0],
+                dst[1] + y / 2 * dst_stride[1], dst_stride[1],
+                width, rows);
+        });
+    }
+
+    bool damaged_blocks(const Region &damage, const Rect &rect, int width, int height, std::vector<Rect> &blocks) {
+        std::vector<Rect> rects;
+        Region aligned;
+
+        damage.intersect(rect).get_rects(&rects);
+        for (auto r: rects) {
+            r = r.translate(rect.tl.negate());
+            r.tl.x &= ~(MACROBLOCK - 1);
+            r.tl.y &= ~(MACROBLOCK - 1);
+            r.br.x = std::min((r.br.x + MACROBLOCK - 1) & ~(MACROBLOCK - 1), width);
+            r.br.y = std::min((r.br.y + MACROBLOCK - 1) & ~(MACROBLOCK - 1), height);
+            if (!r.is_empty())
+                aligned.assign_union(r);
+        }
+
+        blocks.clear();
+        aligned.get_rects(&blocks);
+
+        int area = 0;
+        for (const auto &r: blocks)
+            area += r.area();
+
+        return area * 2 <= width * height;
+    }
+
+    void mark_regions(const FFmpeg &ffmpeg, AVFrame *frame, const std::vector<Rect> &blocks) {
+        ffmpeg.av_frame_remove_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+
+        if (blocks.empty() || blocks.size() > MAX_REGIONS)
+            return;
+
+        auto *sd = ffmpeg.av_frame_new_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST,
+            blocks.size() * sizeof(AVRegionOfInterest));
+        if (!sd)
+            return;
+
+        auto *roi = reinterpret_cast<AVRegionOfInterest *>(sd->data);
+        for (const auto &r: blocks) {
+            roi->self_size = sizeof(AVRegionOfInterest);
+            roi->top = r.tl.y;
+            roi->bottom = r.br.y;
+            roi->left = r.tl.x;
+            roi->right = r.br.x;
+            // Slightly finer, typed text should not smear
+            roi->qoffset = {-1, 10};
+            ++roi;
+        }
+    }
 } // namespace rfb::encoders
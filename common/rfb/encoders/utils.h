@@ -1,6 +1,10 @@
 #pragma once
 
+#include <cstdint>
+#include <vector>
 #include "rdr/OutStream.h"
+#include "rfb/Region.h"
+#include "rfb/ffmpeg.h"
 
 namespace rfb::encoders {
 
@@ -12,4 +16,21 @@ namespace rfb::encoders {
 #endif
 
     void write_compact(rdr::OutStream *os, int value);
+
+    // ARGB to the encoders' input formats. Large frames are converted in
+    // bands of rows in parallel on the current task arena. Both return
+    // libyuv's error code.
+    int argb_to_i420(const uint8_t *src, int src_stride, uint8_t *const dst[], const int dst_stride[], int width,
+        int height);
+    int argb_to_nv12(const uint8_t *src, int src_stride, uint8_t *const dst[], const int dst_stride[], int width,
+        int height);
+
+    // The parts of damage inside rect, relative to it, grown to whole
+    // macroblocks and clipped to width x height. Returns false when they
+    // cover enough of it that converting the whole frame is as cheap.
+    bool damaged_blocks(const Region &damage, const Rect &rect, int width, int height, std::vector<Rect> &blocks);
+
+    // Hands the blocks to codecs that take regions of interest, so their
+    // bits go where things changed. None, or too many, clears them.
+    void mark_regions(const FFmpeg &ffmpeg, AVFrame *frame, const std::vector<Rect> &blocks);
 } // namespace rfb::encoders
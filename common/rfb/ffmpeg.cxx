@@ -78,6 +78,9 @@ FFmpeg::FFmpeg() {
         av_frame_alloc_f = D_LOOKUP_SYM(handle, av_frame_alloc);
         av_frame_unref_f = D_LOOKUP_SYM(handle, av_frame_unref);
         av_frame_get_buffer_f = D_LOOKUP_SYM(handle, av_frame_get_buffer);
+        av_frame_make_writable_f = D_LOOKUP_SYM(handle, av_frame_make_writable);
+        av_frame_new_side_data_f = D_LOOKUP_SYM(handle, av_frame_new_side_data);
+        av_frame_remove_side_data_f = D_LOOKUP_SYM(handle, av_frame_remove_side_data);
         av_opt_next_f = D_LOOKUP_SYM(handle, av_opt_next);
         av_opt_set_f = D_LOOKUP_SYM(handle, av_opt_set);
         av_opt_set_int_f = D_LOOKUP_SYM(handle, av_opt_set_int);
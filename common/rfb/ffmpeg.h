@@ -95,6 +95,9 @@ class FFmpeg final {
     using av_frame_alloc_func = AVFrame *(*) ();
     using av_frame_get_buffer_func = int (*)(AVFrame *frame, int align);
     using av_frame_unref_func = void (*)(AVFrame *frame);
+    using av_frame_make_writable_func = int (*)(AVFrame *frame);
+    using av_frame_new_side_data_func = AVFrameSideData *(*) (AVFrame *frame, AVFrameSideDataType type, size_t size);
+    using av_frame_remove_side_data_func = void (*)(AVFrame *frame, AVFrameSideDataType type);
     using av_opt_next_func = const AVOption *(*) (const void *obj, const AVOption *prev);
     using av_opt_set_func = int (*)(void *obj, const char *name, const char *val, int search_flags);
     using av_opt_set_int_func = int (*)(void *obj, const char *name, int64_t val, int search_flags);
@@ -163,6 +166,9 @@ class FFmpeg final {
     av_frame_alloc_func av_frame_alloc_f{};
     av_frame_get_buffer_func av_frame_get_buffer_f{};
     av_frame_unref_func av_frame_unref_f{};
+    av_frame_make_writable_func av_frame_make_writable_f{};
+    av_frame_new_side_data_func av_frame_new_side_data_f{};
+    av_frame_remove_side_data_func av_frame_remove_side_data_f{};
     av_opt_next_func av_opt_next_f{};
     av_opt_set_func av_opt_set_f{};
     av_opt_set_int_func av_opt_set_int_f{};
@@ -266,6 +272,18 @@ public:
         av_frame_unref_f(frame);
     }
 
+    [[nodiscard]] int av_frame_make_writable(AVFrame *frame) const {
+        return av_frame_make_writable_f(frame);
+    }
+
+    [[nodiscard]] AVFrameSideData *av_frame_new_side_data(AVFrame *frame, AVFrameSideDataType type, size_t size) const {
+        return av_frame_new_side_data_f(frame, type, size);
+    }
+
+    void av_frame_remove_side_data(AVFrame *frame, AVFrameSideDataType type) const {
+        av_frame_remove_side_data_f(frame, type);
+    }
+
     [[nodiscard]] const AVOption *av_opt_next(const void *obj, const AVOption *prev) {
         return av_opt_next_f(obj, prev);
     }
@@ -69,6 +69,7 @@ namespace rfb {
   //constexpr int msgTypeServerDisconnect = 186;
 
   constexpr int msgTypeDirectMouseEvent = 188;
+  constexpr int msgTypeUdpLoss = 189;
 
   constexpr int msgTypeClientFence = 248;
 
@@ -0,0 +1,263 @@
+/* Copyright (C) 2021 Kasm Web
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#include <immintrin.h>
+
+#include <rfb/scale_avx2.h>
+
+namespace rfb {
+
+void AVX2_halve(const uint8_t *oldpx,
+			const uint16_t tgtw, const uint16_t tgth,
+			uint8_t *newpx,
+			const unsigned oldstride, const unsigned newstride) {
+	uint16_t x, y;
+	const uint16_t srcw = tgtw * 2, srch = tgth * 2;
+
+	for (y = 0; y < srch; y += 2) {
+		const uint8_t * const row0 = oldpx + oldstride * y * 4;
+		const uint8_t * const row1 = oldpx + oldstride * (y + 1) * 4;
+
+		uint8_t * const dst = newpx + newstride * (y / 2) * 4;
+
+		for (x = 0; x + 7 < srcw; x += 8) {
+			// Vertical sums of eight pixels, as four and four
+			const __m256i a = _mm256_add_epi16(
+				_mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) &row0[x * 4])),
+				_mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) &row1[x * 4])));
+			const __m256i b = _mm256_add_epi16(
+				_mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) &row0[x * 4 + 16])),
+				_mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) &row1[x * 4 + 16])));
+
+			// Pixels 0 2 | 1 3, so the lanes add up to the horizontal sums
+			const __m256i ap = _mm256_permute4x64_epi64(a, 0xd8);
+			const __m256i bp = _mm256_permute4x64_epi64(b, 0xd8);
+
+			__m128i lo = _mm_add_epi16(_mm256_castsi256_si128(ap),
+						_mm256_extracti128_si256(ap, 1));
+			__m128i hi = _mm_add_epi16(_mm256_castsi256_si128(bp),
+						_mm256_extracti128_si256(bp, 1));
+
+			lo = _mm_srli_epi16(lo, 2);
+			hi = _mm_srli_epi16(hi, 2);
+
+			_mm_storeu_si128((__m128i *) &dst[(x / 2) * 4],
+					_mm_packus_epi16(lo, hi));
+		}
+
+		for (; x < srcw; x += 2) {
+			// Remainder in C
+			uint8_t i;
+			for (i = 0; i < 4; i++) {
+				dst[(x / 2) * 4 + i] =
+					(row0[x * 4 + i] +
+					row0[(x + 1) * 4 + i] +
+					row1[x * 4 + i] +
+					row1[(x + 1) * 4 + i]) / 4;
+			}
+		}
+	}
+}
+
+// Horizontal, then vertical, as SSE2_scale does near the edges
+static inline void edgePixel(const uint8_t *brow0, const uint8_t *brow1,
+				uint8_t *dst, const uint16_t x, const float invdiff,
+				const uint16_t srcw, const uint16_t top, const uint16_t bot) {
+	const float nx = x * invdiff;
+	const uint16_t lowx = nx;
+	const uint16_t highx = (lowx + 1 < srcw) ? lowx + 1 : lowx;
+	const uint16_t right = (nx - lowx) * 256;
+	const uint16_t left = 256 - right;
+
+	uint8_t i;
+	uint32_t val, val2;
+	for (i = 0; i < 4; i++) {
+		val = brow0[lowx * 4 + i] * left;
+		val += brow0[highx * 4 + i] * right;
+		val >>= 8;
+
+		val2 = brow1[lowx * 4 + i] * left;
+		val2 += brow1[highx * 4 + i] * right;
+		val2 >>= 8;
+
+		dst[x * 4 + i] = (val * top + val2 * bot) >> 8;
+	}
+}
+
+// Vertical, then horizontal, as SSE2_scale's vector path does
+static inline void innerPixel(const uint8_t *brow0, const uint8_t *brow1,
+				uint8_t *dst, const uint16_t x, const float invdiff,
+				const uint16_t top, const uint16_t bot) {
+	const float nx = x * invdiff;
+	const uint16_t lowx = nx;
+	const uint16_t highx = lowx + 1;
+	const uint16_t right = (nx - lowx) * 256;
+	const uint16_t left = 256 - right;
+
+	uint8_t i;
+	for (i = 0; i < 4; i++) {
+		const uint32_t l = (brow0[lowx * 4 + i] * top + brow1[lowx * 4 + i] * bot) >> 8;
+		const uint32_t h = (brow0[highx * 4 + i] * top + brow1[highx * 4 + i] * bot) >> 8;
+
+		dst[x * 4 + i] = (l * left + h * right) >> 8;
+	}
+}
+
+void AVX2_scaleRect(const uint8_t *oldpx,
+		const uint16_t tgtw, const uint16_t tgth,
+		uint8_t *newpx,
+		const unsigned oldstride, const unsigned newstride,
+		const float tgtdiff,
+		const uint16_t x0, const uint16_t y0,
+		const uint16_t x1, const uint16_t y1) {
+
+	uint16_t x, y;
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i low = _mm256_set_epi32(0, 0, 0xffffffff, 0xffffffff,
+						0, 0, 0xffffffff, 0xffffffff);
+	const __m256i high = _mm256_set_epi32(0xffffffff, 0xffffffff, 0, 0,
+						0xffffffff, 0xffffffff, 0, 0);
+	const float invdiff = 1 / tgtdiff;
+
+	const uint16_t srcw = (uint16_t)(tgtw * invdiff);
+	const uint16_t srch = (uint16_t)(tgth * invdiff);
+
+	for (y = y0; y < y1; y++) {
+		const float ny = y * invdiff;
+		const uint16_t lowy = ny;
+		const uint16_t highy = lowy + 1;
+
+		uint8_t * const dst = newpx + newstride * y * 4;
+
+		if (highy >= srch) {
+			// Bottom edge, only the last valid row
+			const uint16_t safe_lowy = (lowy < srch) ? lowy : srch - 1;
+			const uint8_t * const brow0 = oldpx + oldstride * safe_lowy * 4;
+
+			for (x = x0; x < x1; x++)
+				edgePixel(brow0, brow0, dst, x, invdiff, srcw, 256, 0);
+			continue;
+		}
+
+		const uint16_t bot = (ny - lowy) * 256;
+		const uint16_t top = 256 - bot;
+		const uint32_t * const row0 = (uint32_t *) (oldpx + oldstride * lowy * 4);
+		const uint32_t * const row1 = (uint32_t *) (oldpx + oldstride * highy * 4);
+		const uint8_t * const brow0 = (uint8_t *) row0;
+		const uint8_t * const brow1 = (uint8_t *) row1;
+
+		const __m256i vertmul = _mm256_set1_epi16(top);
+		const __m256i vertmul2 = _mm256_set1_epi16(bot);
+
+		x = x0;
+		while (x + 1 < x1) {
+			if (x + 3 < x1) {
+				float nx[4];
+				uint16_t lowx[4], highx[4], right[4], left[4];
+				uint8_t i;
+
+				for (i = 0; i < 4; i++) {
+					nx[i] = (x + i) * invdiff;
+					lowx[i] = nx[i];
+					highx[i] = lowx[i] + 1;
+					right[i] = (nx[i] - lowx[i]) * 256;
+					left[i] = 256 - right[i];
+				}
+
+				if (highx[3] < srcw) {
+					// Pixels 0 and 2 in a, 1 and 3 in b, one of each per lane
+					const __m256i horzmul = _mm256_set_epi16(
+						right[2], right[2], right[2], right[2],
+						left[2], left[2], left[2], left[2],
+						right[0], right[0], right[0], right[0],
+						left[0], left[0], left[0], left[0]);
+					const __m256i horzmul2 = _mm256_set_epi16(
+						right[3], right[3], right[3], right[3],
+						left[3], left[3], left[3], left[3],
+						right[1], right[1], right[1], right[1],
+						left[1], left[1], left[1], left[1]);
+
+					__m256i lo, hi, a, b, c, d;
+
+					lo = _mm256_setr_epi32(row0[lowx[0]], row0[highx[0]],
+								row0[lowx[1]], row0[highx[1]],
+								row0[lowx[2]], row0[highx[2]],
+								row0[lowx[3]], row0[highx[3]]);
+					hi = _mm256_setr_epi32(row1[lowx[0]], row1[highx[0]],
+								row1[lowx[1]], row1[highx[1]],
+								row1[lowx[2]], row1[highx[2]],
+								row1[lowx[3]], row1[highx[3]]);
+
+					a = _mm256_unpacklo_epi8(lo, zero);
+					b = _mm256_unpackhi_epi8(lo, zero);
+					c = _mm256_unpacklo_epi8(hi, zero);
+					d = _mm256_unpackhi_epi8(hi, zero);
+
+					a = _mm256_mullo_epi16(a, vertmul);
+					b = _mm256_mullo_epi16(b, vertmul);
+					c = _mm256_mullo_epi16(c, vertmul2);
+					d = _mm256_mullo_epi16(d, vertmul2);
+
+					a = _mm256_add_epi16(a, c);
+					a = _mm256_srli_epi16(a, 8);
+					b = _mm256_add_epi16(b, d);
+					b = _mm256_srli_epi16(b, 8);
+
+					a = _mm256_mullo_epi16(a, horzmul);
+					b = _mm256_mullo_epi16(b, horzmul2);
+
+					lo = _mm256_srli_si256(a, 8);
+					a = _mm256_and_si256(a, low);
+					a = _mm256_add_epi16(a, lo);
+
+					hi = _mm256_slli_si256(b, 8);
+					b = _mm256_and_si256(b, high);
+					b = _mm256_add_epi16(b, hi);
+
+					a = _mm256_add_epi16(a, b);
+					a = _mm256_srli_epi16(a, 8);
+
+					a = _mm256_packus_epi16(a, zero);
+					a = _mm256_permute4x64_epi64(a, 0x08);
+
+					_mm_storeu_si128((__m128i *) &dst[x * 4],
+							_mm256_castsi256_si128(a));
+
+					x += 4;
+					continue;
+				}
+			}
+
+			// A single pair, done like SSE2_scale does it
+			const uint16_t highx1 = (uint16_t) ((x + 1) * invdiff) + 1;
+			if (highx1 >= srcw) {
+				edgePixel(brow0, brow1, dst, x, invdiff, srcw, top, bot);
+				edgePixel(brow0, brow1, dst, x + 1, invdiff, srcw, top, bot);
+			} else {
+				innerPixel(brow0, brow1, dst, x, invdiff, top, bot);
+				innerPixel(brow0, brow1, dst, x + 1, invdiff, top, bot);
+			}
+			x += 2;
+		}
+
+		for (; x < x1; x++)
+			edgePixel(brow0, brow1, dst, x, invdiff, srcw, top, bot);
+	}
+}
+
+}; // namespace rfb
@@ -34,4 +34,13 @@ void SSE2_scale(const uint8_t *oldpx,
 		const float tgtdiff) {
 }
 
+void SSE2_scaleRect(const uint8_t *oldpx,
+		const uint16_t tgtw, const uint16_t tgth,
+		uint8_t *newpx,
+		const unsigned oldstride, const unsigned newstride,
+		const float tgtdiff,
+		const uint16_t x0, const uint16_t y0,
+		const uint16_t x1, const uint16_t y1) {
+}
+
 }; // namespace rfb
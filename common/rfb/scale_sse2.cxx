@@ -118,6 +118,17 @@ void SSE2_scale(const uint8_t *oldpx,
 		uint8_t *newpx,
 		const unsigned oldstride, const unsigned newstride,
 		const float tgtdiff) {
+	SSE2_scaleRect(oldpx, tgtw, tgth, newpx, oldstride, newstride, tgtdiff,
+			0, 0, tgtw, tgth);
+}
+
+void SSE2_scaleRect(const uint8_t *oldpx,
+		const uint16_t tgtw, const uint16_t tgth,
+		uint8_t *newpx,
+		const unsigned oldstride, const unsigned newstride,
+		const float tgtdiff,
+		const uint16_t x0, const uint16_t y0,
+		const uint16_t x1, const uint16_t y1) {
 
 	uint16_t x, y;
 	const __m128i zero = _mm_setzero_si128();
@@ -129,7 +140,7 @@ void SSE2_scale(const uint8_t *oldpx,
 	const uint16_t srcw = (uint16_t)(tgtw * invdiff);
 	const uint16_t srch = (uint16_t)(tgth * invdiff);
 
-	for (y = 0; y < tgth; y++) {
+	for (y = y0; y < y1; y++) {
 		const float ny = y * invdiff;
 		const uint16_t lowy = ny;
 		const uint16_t highy = lowy + 1;
@@ -144,7 +155,7 @@ void SSE2_scale(const uint8_t *oldpx,
 			uint8_t * const dst = newpx + newstride * y * 4;
 
 			// Process entire row with C fallback (no vertical interpolation needed)
-			for (x = 0; x < tgtw; x++) {
+			for (x = x0; x < x1; x++) {
 				const float nx = x * invdiff;
 				const uint16_t lowx = nx;
 				const uint16_t highx = (lowx + 1 < srcw) ? lowx + 1 : lowx;
@@ -175,7 +186,7 @@ void SSE2_scale(const uint8_t *oldpx,
 		const __m128i vertmul = _mm_set1_epi16(top);
 		const __m128i vertmul2 = _mm_set1_epi16(bot);
 
-		for (x = 0; x < tgtw - 1; x += 2) {
+		for (x = x0; x < x1 - 1; x += 2) {
 			const float nx[2] = {
 				x * invdiff,
 				(x + 1) * invdiff,
@@ -213,7 +224,6 @@ void SSE2_scale(const uint8_t *oldpx,
 						dst[(x + i) * 4 + j] = (val * top + val2 * bot) >> 8;
 					}
 				}
-				x++; // Skip the second pixel since we processed both
 				continue;
 			}
 
@@ -293,7 +303,7 @@ void SSE2_scale(const uint8_t *oldpx,
 			_mm_storel_epi64((__m128i *) &dst[x * 4], a);
 		}
 
-		for (; x < tgtw; x++) {
+		for (; x < x1; x++) {
 			// Remainder in C with bounds checking
 			const float nx = x * invdiff;
 			const uint16_t lowx = nx;
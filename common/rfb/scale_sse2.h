@@ -33,6 +33,17 @@ namespace rfb {
 			uint8_t *newpx,
 			const unsigned oldstride, const unsigned newstride,
 			const float tgtdiff);
+
+	// Only the part x0,y0 - x1,y1 of the target. Every target pixel is
+	// computed exactly as in the full scale, as long as x0 and x1 are even
+	// (or x1 is tgtw), since pixels are done in pairs.
+	void SSE2_scaleRect(const uint8_t *oldpx,
+			const uint16_t tgtw, const uint16_t tgth,
+			uint8_t *newpx,
+			const unsigned oldstride, const unsigned newstride,
+			const float tgtdiff,
+			const uint16_t x0, const uint16_t y0,
+			const uint16_t x1, const uint16_t y1);
 };
 
 #endif
@@ -0,0 +1,277 @@
+/* Copyright (C) 2026 Kasm Technologies Corp
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+/*
+ * Compares the deflate backends on the kind of data the lossless
+ * encoders compress: palette indices of text, mono bitmaps and raw
+ * pixels, cut into rect sized pieces. Each backend compresses every
+ * piece on its own, the way watermarks and rects with reset streams are,
+ * and zlib's stream does them in sequence with a sync flush between,
+ * the way Tight does by default.
+ *
+ * A file can be given instead, which is then cut up the same way.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+
+#include <rdr/Deflater.h>
+#include <rdr/MemOutStream.h>
+#include <rdr/ZlibOutStream.h>
+
+#include <rfb/Configuration.h>
+
+#include "util.h"
+
+static rfb::IntParameter pieceSize("size", "Bytes per piece, about a rect's worth", 16384);
+static rfb::IntParameter count("count", "Number of passes over the data", 10);
+
+static const size_t dataSize = 4 * 1024 * 1024;
+
+typedef std::vector<rdr::U8> Data;
+
+// Rows of glyph-like runs in a few colours on a plain background, as
+// palette indices
+static Data makeText()
+{
+  Data data(dataSize);
+  size_t i;
+
+  srand(1);
+  for (i = 0; i < dataSize; ) {
+    size_t run;
+    rdr::U8 idx;
+
+    if (rand() % 3) {
+      idx = 0;
+      run = 1 + rand() % 12;
+    } else {
+      idx = 1 + rand() % 3;
+      run = 1 + rand() % 3;
+    }
+
+    while (run-- && i < dataSize)
+      data[i++] = idx;
+  }
+
+  return data;
+}
+
+// One bit per pixel, mostly background
+static Data makeMono()
+{
+  Data data(dataSize);
+  size_t i;
+
+  srand(2);
+  for (i = 0; i < dataSize; i++)
+    data[i] = (rand() % 4) ? 0 : rand();
+
+  return data;
+}
+
+// 24-bit gradients with some noise, as in a photo or a video frame
+static Data makeRaw()
+{
+  Data data(dataSize);
+  size_t i;
+
+  srand(3);
+  for (i = 0; i < dataSize; i += 3) {
+    rdr::U8 v = (i / 3) % 256;
+    data[i] = v + rand() % 8;
+    if (i + 1 < dataSize)
+      data[i + 1] = v / 2 + rand() % 8;
+    if (i + 2 < dataSize)
+      data[i + 2] = 255 - v;
+  }
+
+  return data;
+}
+
+static Data readFile(const char *fn)
+{
+  Data data;
+  FILE *f;
+  rdr::U8 buf[65536];
+  size_t len;
+
+  f = fopen(fn, "rb");
+  if (f == NULL) {
+    perror(fn);
+    exit(1);
+  }
+
+  while ((len = fread(buf, 1, sizeof(buf), f)) > 0)
+    data.insert(data.end(), buf, buf + len);
+
+  fclose(f);
+
+  return data;
+}
+
+static void report(const char *label, int level, size_t in, size_t out,
+                   double time)
+{
+  printf(",%s %d,%g,%g", label, level,
+         (double)in * count / (1000.0 * 1000.0) / time,
+         out ? (double)in / out : 0.0);
+}
+
+static void testDeflater(const rdr::Deflater *deflater, int level,
+                         const Data &data)
+{
+  Data out(deflater->bound(pieceSize));
+  size_t total;
+
+  startCpuCounter();
+
+  total = 0;
+  for (int pass = 0; pass < count; pass++) {
+    for (size_t pos = 0; pos < data.size(); pos += pieceSize) {
+      size_t len = data.size() - pos;
+      if (len > (size_t)pieceSize)
+        len = pieceSize;
+
+      total += deflater->compress(out.data(), out.size(),
+                                  &data[pos], len, level);
+    }
+  }
+
+  endCpuCounter();
+
+  report(deflater->name(), level, data.size(), total / count,
+         getCpuCounter());
+}
+
+static void testStream(int level, const Data &data)
+{
+  rdr::MemOutStream mos;
+  rdr::ZlibOutStream zos(NULL, level);
+  size_t total;
+
+  startCpuCounter();
+
+  total = 0;
+  for (int pass = 0; pass < count; pass++) {
+    zos.resetDeflate();
+    for (size_t pos = 0; pos < data.size(); pos += pieceSize) {
+      size_t len = data.size() - pos;
+      if (len > (size_t)pieceSize)
+        len = pieceSize;
+
+      zos.setUnderlying(&mos);
+      zos.writeBytes(&data[pos], len);
+      zos.flush();
+      zos.setUnderlying(NULL);
+
+      total += mos.length();
+      mos.clear();
+    }
+  }
+
+  endCpuCounter();
+
+  report("stream", level, data.size(), total / count, getCpuCounter());
+}
+
+static void doTests(const char *label, const Data &data)
+{
+  static const int levels[] = { 1, 6, 9 };
+
+  printf("%s", label);
+
+  for (int level : levels) {
+    for (const rdr::Deflater *deflater : rdr::Deflater::all())
+      testDeflater(deflater, level, data);
+    testStream(level, data);
+  }
+
+  printf("\n");
+}
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr, "Syntax: %s [options] [file]\n", argv0);
+  fprintf(stderr, "Options:\n");
+  rfb::Configuration::listParams(79, 14);
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  int i;
+
+  const char *fn;
+
+  time_t t;
+  char datebuffer[256];
+
+  fn = NULL;
+  for (i = 1; i < argc; i++) {
+    if (rfb::Configuration::setParam(argv[i]))
+      continue;
+
+    if (argv[i][0] == '-') {
+      if (i + 1 < argc) {
+        if (rfb::Configuration::setParam(&argv[i][1], argv[i + 1])) {
+          i++;
+          continue;
+        }
+      }
+      usage(argv[0]);
+    }
+
+    if (fn != NULL)
+      usage(argv[0]);
+
+    fn = argv[i];
+  }
+
+  if (pieceSize <= 0 || count <= 0)
+    usage(argv[0]);
+
+  time(&t);
+  strftime(datebuffer, sizeof(datebuffer), "%Y-%m-%d %H:%M UTC", gmtime(&t));
+
+  printf("# Deflate Performance Test %s\n", datebuffer);
+  printf("#\n");
+  printf("# Backends:");
+  for (const rdr::Deflater *deflater : rdr::Deflater::all())
+    printf(" %s", deflater->name());
+  printf("\n");
+  printf("# Piece size: %d bytes\n", (int)pieceSize);
+  printf("#\n");
+  printf("# Note: Results are MB/s of input, then compression ratio\n");
+  printf("#\n");
+
+  if (fn != NULL) {
+    doTests(fn, readFile(fn));
+    return 0;
+  }
+
+  doTests("text", makeText());
+  doTests("mono", makeMono());
+  doTests("raw", makeRaw());
+
+  return 0;
+}
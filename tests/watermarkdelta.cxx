@@ -0,0 +1,253 @@
+/* Copyright (C) 2026 Kasm Technologies Corp
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+/*
+ * Drives a time-stamped text watermark through the encoder for two
+ * clients, one that takes partial watermark updates and one that always
+ * gets the whole mask. Each client's updates are decoded the way a viewer
+ * would, and after every generation both masks have to be the same.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <vector>
+
+#include <rdr/MemInStream.h>
+#include <rdr/MemOutStream.h>
+
+#include <rfb/Configuration.h>
+#include <rfb/EncCache.h>
+#include <rfb/EncodeManager.h>
+#include <rfb/PixelBuffer.h>
+#include <rfb/SConnection.h>
+#include <rfb/SMsgWriter.h>
+#include <rfb/ServerCore.h>
+#include <rfb/TightConstants.h>
+#include <rfb/UpdateTracker.h>
+#include <rfb/Watermark.h>
+#include <rfb/encodings.h>
+#include <rfb/msgTypes.h>
+#include <rfb/screenTypes.h>
+
+using namespace rfb;
+
+static IntParameter width("width", "Screen width", 1920);
+static IntParameter height("height", "Screen height", 1080);
+static IntParameter generations("generations", "Number of watermark changes, one a second", 5);
+
+static const PixelFormat pf{32, 24, false, true, 0xFF, 0xFF, 0xFF, 0, 8, 16};
+
+class WatermarkClient : public SConnection {
+public:
+  WatermarkClient(bool delta) : mask(width * height), bytes(0),
+                                fullRects(0), deltaRects(0)
+  {
+    std::vector<rdr::S32> encodings = { encodingRaw };
+    if (delta)
+      encodings.push_back(pseudoEncodingWatermarkDelta);
+
+    setStreams(nullptr, &out);
+    setWriter(new SMsgWriter(&cp, &out, &udps));
+
+    cp.setPF(pf);
+    cp.width = width;
+    cp.height = height;
+    cp.setEncodings(encodings.size(), encodings.data());
+  }
+
+  void writeUpdate(const ScreenSet &layout, const PixelBuffer *pb)
+  {
+    manager.writeUpdate(UpdateInfo(), layout, pb, nullptr, false);
+    decode();
+  }
+
+  void setDesktopSize(int, int, const ScreenSet &) override {}
+  void sendStats(const bool) override {}
+  bool canChangeKasmSettings() const override { return true; }
+  void udpUpgrade(const char *, const bool) override {}
+  void udpDowngrade(const bool) override {}
+  void subscribeUnixRelay(const char *) override {}
+  void unixRelay(const char *, const rdr::U8 *, const unsigned) override {}
+  void videoEncodersRequest(const std::vector<int32_t> &) override {}
+  void handleFrameStats(rdr::U32, rdr::U32) override {}
+
+  std::vector<rdr::U8> mask;
+  size_t bytes;
+  unsigned fullRects, deltaRects;
+
+private:
+  static unsigned readCompact(rdr::InStream &is)
+  {
+    rdr::U8 b;
+    unsigned len;
+
+    b = is.readU8();
+    len = b & 0x7f;
+    if (b & 0x80) {
+      b = is.readU8();
+      len |= (b & 0x7f) << 7;
+      if (b & 0x80)
+        len |= is.readU8() << 14;
+    }
+
+    return len;
+  }
+
+  // Reads back what the encoder wrote, as a viewer would
+  void decode()
+  {
+    rdr::MemInStream is(out.data(), out.length());
+    unsigned nRects;
+
+    bytes += out.length();
+
+    if (is.readU8() != msgTypeFramebufferUpdate) {
+      fprintf(stderr, "Not a framebuffer update\n");
+      exit(1);
+    }
+    is.skip(1);
+    nRects = is.readU16();
+
+    while (nRects--) {
+      int x, y, w, h;
+      std::vector<rdr::U8> data, packed;
+      uLongf len;
+
+      x = is.readU16();
+      y = is.readU16();
+      w = is.readU16();
+      h = is.readU16();
+
+      if (is.readS32() != encodingTight || is.readU8() != tightIT << 4) {
+        fprintf(stderr, "Not a watermark rect\n");
+        exit(1);
+      }
+
+      data.resize(readCompact(is) - 4);
+      is.skip(4);
+      is.readBytes(data.data(), data.size());
+
+      len = w * h / 2 + 1;
+      packed.resize(len);
+      if (uncompress(packed.data(), &len, data.data(), data.size()) != Z_OK) {
+        fprintf(stderr, "Bad watermark data\n");
+        exit(1);
+      }
+
+      // Two pixels a byte, low nibble first, running on across rows
+      for (int i = 0; i < w * h; i++)
+        mask[(y + i / w) * width + x + i % w] = (packed[i / 2] >> (i & 1) * 4) & 0xf;
+
+      if (w == width && h == height)
+        fullRects++;
+      else
+        deltaRects++;
+    }
+
+    out.clear();
+  }
+
+  rdr::MemOutStream out, udps;
+
+  EncCache cache;
+  EncodeManager manager{this, &cache, FFmpeg::get(),
+                        video_encoders::EncoderProbe::get(FFmpeg::get(), {}, nullptr)};
+};
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr, "Syntax: %s [options]\n", argv0);
+  fprintf(stderr, "Options:\n");
+  Configuration::listParams(79, 14);
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  int i;
+
+  Configuration::setParam("DLP_WatermarkText", "%H:%M:%S");
+
+  for (i = 1; i < argc; i++) {
+    if (Configuration::setParam(argv[i]))
+      continue;
+
+    if (argv[i][0] == '-') {
+      if (i + 1 < argc) {
+        if (Configuration::setParam(&argv[i][1], argv[i + 1])) {
+          i++;
+          continue;
+        }
+      }
+    }
+
+    usage(argv[0]);
+  }
+
+  if (width <= 0 || height <= 0 || generations <= 0 ||
+      !strchr(Server::DLP_WatermarkText, '%'))
+    usage(argv[0]);
+
+  if (!watermarkInit()) {
+    fprintf(stderr, "Failed to set up the watermark\n");
+    return 1;
+  }
+
+  ManagedPixelBuffer pb(pf, width, height);
+  ScreenSet layout;
+  layout.add_screen(Screen(0, 0, 0, width, height, 0));
+
+  WatermarkClient deltaClient(true), fullClient(false);
+
+  printf("# Watermark delta test, %dx%d, \"%s\"\n", (int)width, (int)height,
+         (const char *)Server::DLP_WatermarkText);
+  printf("#\n");
+
+  for (i = 0; i < generations; i++) {
+    if (i)
+      sleep(1);
+
+    watermarkTextNeedsUpdate(true);
+    watermarkUpdate(width, height);
+
+    deltaClient.writeUpdate(layout, &pb);
+    fullClient.writeUpdate(layout, &pb);
+
+    if (deltaClient.mask != fullClient.mask) {
+      fprintf(stderr, "Masks differ after generation %u\n", watermarkGen);
+      return 1;
+    }
+  }
+
+  printf("%-8s %8s %8s %10s\n", "client", "full", "partial", "bytes");
+  printf("%-8s %8u %8u %10zu\n", "delta", deltaClient.fullRects,
+         deltaClient.deltaRects, deltaClient.bytes);
+  printf("%-8s %8u %8u %10zu\n", "full", fullClient.fullRects,
+         fullClient.deltaRects, fullClient.bytes);
+
+  if (generations > 1 && !deltaClient.deltaRects) {
+    fprintf(stderr, "No partial updates were sent\n");
+    return 1;
+  }
+
+  return 0;
+}
@@ -17,12 +17,14 @@
  */
 
 #include <getopt.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
+#include <time.h>
 #include <unistd.h>
 #include <X11/Xatom.h>
 #include <X11/Xlib.h>
@@ -32,17 +34,25 @@
 #include <X11/extensions/Xrandr.h>
 #include <X11/extensions/XShm.h>
 #include <X11/extensions/XTest.h>
+#ifdef HAVE_XDAMAGE
+#include <X11/extensions/Xdamage.h>
+#endif
 
 #include "xxhash.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Past this many damaged rects, their bounding box is copied instead
+#define MAX_RECTS 64
+// How often to look for resizes when nothing else happens
+#define IDLE_MS 1000
+
 static void help(const char name[]) {
 	printf("Usage: %s [opts]\n\n"
 		"-a --app-display disp	App display, default :0\n"
 		"-v --vnc-display disp	VNC display, default :1\n"
 		"\n"
-		"-f --fps fps		FPS, default 30\n"
+		"-f --fps fps		Max FPS, default 30\n"
 		"-r --resize		Enable resize, default disabled.\n"
 		"			Do not enable this if there's a physical screen\n"
 		"			connected to the app display.\n",
@@ -53,6 +63,86 @@ static void help(const char name[]) {
 #define CUT_MAX (16 * 1024)
 static uint8_t cutbuf[CUT_MAX];
 
+static uint8_t xerror;
+
+static int trapxerror(Display *disp, XErrorEvent *ev) {
+	xerror = 1;
+	return 0;
+}
+
+// XShmAttach() only fails once the server has processed it
+static Bool shmattach(Display *disp, XShmSegmentInfo *shm) {
+	int (*old)(Display *, XErrorEvent *);
+
+	xerror = 0;
+	old = XSetErrorHandler(trapxerror);
+	if (XShmAttach(disp, shm))
+		XSync(disp, False);
+	else
+		xerror = 1;
+	XSetErrorHandler(old);
+
+	return !xerror;
+}
+
+static uint64_t msecs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Copy rects from the app display to the VNC display. Both have the shm
+ * segment attached; each rect is read into its own part of it, packed,
+ * and put from there. The next copy reuses the segment, so wait for the
+ * VNC server to be done with it. Without vncshm, the VNC display gets
+ * the rects over the socket instead.
+ */
+static void copyrects(Display *appdisp, Window approot,
+			Display *vncdisp, Window vncroot, GC gc,
+			const XImage *img, XShmSegmentInfo *appshm,
+			XShmSegmentInfo *vncshm,
+			const XRectangle *rects, const int nrects) {
+	const unsigned size = img->bytes_per_line * img->height;
+	unsigned offset = 0;
+	int i;
+
+	for (i = 0; i < nrects; i++) {
+		const int x = rects[i].x, y = rects[i].y;
+		const int w = min(rects[i].x + rects[i].width, img->width) - x;
+		const int h = min(rects[i].y + rects[i].height, img->height) - y;
+
+		if (x < 0 || y < 0 || w <= 0 || h <= 0)
+			continue;
+
+		XImage sub = *img;
+		sub.width = w;
+		sub.height = h;
+		sub.bytes_per_line = (w * img->bits_per_pixel + img->bitmap_pad - 1) /
+					img->bitmap_pad * img->bitmap_pad / 8;
+
+		if (offset + sub.bytes_per_line * h > size) {
+			XSync(vncdisp, False);
+			offset = 0;
+		}
+
+		sub.data = img->data + offset;
+		sub.obdata = (char *) appshm;
+		XShmGetImage(appdisp, approot, &sub, x, y, AllPlanes);
+
+		if (vncshm) {
+			sub.obdata = (char *) vncshm;
+			XShmPutImage(vncdisp, vncroot, gc, &sub, 0, 0, x, y, w, h, False);
+		} else {
+			XPutImage(vncdisp, vncroot, gc, &sub, 0, 0, x, y, w, h);
+		}
+
+		offset += sub.bytes_per_line * h;
+	}
+
+	XSync(vncdisp, False);
+}
+
 static void supplyselection(Display *disp, const XEvent * const ev, const Atom xa_targets) {
 	XSelectionEvent sev;
 
@@ -187,7 +277,8 @@ int main(int argc, char **argv) {
 	GC gc = XCreateGC(vncdisp, vncroot, GCFunction | GCPlaneMask, &gcval);
 
 	XImage *img = NULL;
-	XShmSegmentInfo shminfo;
+	XShmSegmentInfo shminfo, vncshminfo;
+	uint8_t vncshm = 0;
 	unsigned imgw = 0, imgh = 0;
 
 	if (XGrabPointer(vncdisp, vncroot, False,
@@ -209,6 +300,24 @@ int main(int argc, char **argv) {
 	XFixesSelectSelectionInput(vncdisp, vncroot, XA_PRIMARY,
 					XFixesSetSelectionOwnerNotifyMask);
 
+	// Only copy what changed, and only fetch the cursor when it does
+	XFixesSelectCursorInput(appdisp, approot, XFixesDisplayCursorNotifyMask);
+
+	uint8_t hasdamage = 0;
+#ifdef HAVE_XDAMAGE
+	int damagebase = 0, damageerrbase;
+	Damage damage = None;
+	XserverRegion damageparts = None;
+	if (XDamageQueryExtension(appdisp, &damagebase, &damageerrbase)) {
+		damage = XDamageCreate(appdisp, approot, XDamageReportNonEmpty);
+		damageparts = XFixesCreateRegion(appdisp, NULL, 0);
+		hasdamage = 1;
+	} else {
+		printf("Display %s lacks DAMAGE extension, copying full frames\n",
+			appstr);
+	}
+#endif
+
 	Atom xa_targets_vnc = XInternAtom(vncdisp, "TARGETS", False);
 	Atom xa_targets_app = XInternAtom(appdisp, "TARGETS", False);
 	Window selwin = XCreateSimpleWindow(appdisp, approot, 3, 2, 1, 1, 0, 0, 0);
@@ -218,9 +327,21 @@ int main(int argc, char **argv) {
 	uint64_t cursorhash = 0;
 	Cursor xcursor = None;
 
-	const unsigned sleeptime = 1000 * 1000 / fps;
+	const unsigned frametime = 1000 / fps;
+	uint64_t lastframe = 0;
+	uint8_t damaged = 1, fullcopy = 1, cursorchanged = 1;
+
+	struct pollfd pfd[2];
+	pfd[0].fd = ConnectionNumber(appdisp);
+	pfd[0].events = POLLIN;
+	pfd[1].fd = ConnectionNumber(vncdisp);
+	pfd[1].events = POLLIN;
 
 	while (1) {
+		const uint64_t now = msecs();
+		if (now - lastframe < frametime)
+			goto events;
+
 		if (!XGetWindowAttributes(appdisp, approot, &appattr))
 			break;
 		if (!XGetWindowAttributes(vncdisp, vncroot, &vncattr))
@@ -320,6 +441,9 @@ int main(int argc, char **argv) {
 		if (w != imgw || h != imgh) {
 			if (img) {
 				XShmDetach(appdisp, &shminfo);
+				if (vncshm)
+					XShmDetach(vncdisp, &vncshminfo);
+				XSync(vncdisp, False);
 				XDestroyImage(img);
 				shmdt(shminfo.shmaddr);
 				shmctl(shminfo.shmid, IPC_RMID, NULL);
@@ -339,13 +463,87 @@ int main(int argc, char **argv) {
 			if (!XShmAttach(appdisp, &shminfo))
 				break;
 
+			// The VNC display may be unable to share memory with us,
+			// e.g. when it runs in another container
+			vncshminfo = shminfo;
+			vncshm = shmattach(vncdisp, &vncshminfo);
+			if (!vncshm)
+				printf("Cannot attach shm to display %s, using plain puts\n",
+					vncstr);
+
 			imgw = w;
 			imgh = h;
+			fullcopy = 1;
+		}
+
+		if (damaged || fullcopy) {
+			XRectangle full = { 0, 0, w, h };
+			XRectangle *rects = NULL;
+			int nrects = 0;
+
+			if (hasdamage) {
+#ifdef HAVE_XDAMAGE
+				XRectangle bounds;
+				XDamageSubtract(appdisp, damage, None, damageparts);
+				rects = XFixesFetchRegionAndBounds(appdisp, damageparts,
+									&nrects, &bounds);
+				if (nrects > MAX_RECTS && !fullcopy)
+					full = bounds;
+				damaged = 0;
+#endif
+			} else {
+				// No damage tracking, copy it all every frame
+				fullcopy = 1;
+			}
+
+			if (fullcopy || nrects > MAX_RECTS)
+				copyrects(appdisp, approot, vncdisp, vncroot, gc, img,
+						&shminfo, vncshm ? &vncshminfo : NULL,
+						&full, 1);
+			else
+				copyrects(appdisp, approot, vncdisp, vncroot, gc, img,
+						&shminfo, vncshm ? &vncshminfo : NULL,
+						rects, nrects);
+
+			if (rects)
+				XFree(rects);
+
+			fullcopy = 0;
+			lastframe = now;
 		}
 
-		XShmGetImage(appdisp, approot, img, 0, 0, 0xffffffff);
-		XPutImage(vncdisp, vncroot, gc, img, 0, 0, 0, 0, w, h);
+		// Cursors
+		if (cursorchanged) {
+			cursor = XFixesGetCursorImage(appdisp);
+			uint64_t newhash = XXH64(cursor->pixels,
+							cursor->width * cursor->height * sizeof(unsigned long),
+							0);
+			if (cursorhash != newhash) {
+				if (cursorhash)
+					XFreeCursor(vncdisp, xcursor);
+
+				XcursorImage *converted = XcursorImageCreate(cursor->width, cursor->height);
+
+				converted->xhot = cursor->xhot;
+				converted->yhot = cursor->yhot;
+				unsigned i;
+				for (i = 0; i < cursor->width * cursor->height; i++) {
+					converted->pixels[i] = cursor->pixels[i];
+				}
+
+				xcursor = XcursorImageLoadCursor(vncdisp, converted);
+				XDefineCursor(vncdisp, vncroot, xcursor);
+
+				XcursorImageDestroy(converted);
+
+				cursorhash = newhash;
+			}
+
+			XFree(cursor);
+			cursorchanged = 0;
+		}
 
+events:
 		// Handle events
 		while (XPending(vncdisp)) {
 			XEvent ev;
@@ -437,7 +635,16 @@ int main(int argc, char **argv) {
 			XEvent ev;
 			XNextEvent(appdisp, &ev);
 
-			if (ev.type == xfixesbase + XFixesSelectionNotify) {
+#ifdef HAVE_XDAMAGE
+			if (hasdamage && ev.type == damagebase + XDamageNotify) {
+				damaged = 1;
+				continue;
+			}
+#endif
+
+			if (ev.type == xfixesbase + XFixesCursorNotify) {
+				cursorchanged = 1;
+			} else if (ev.type == xfixesbase + XFixesSelectionNotify) {
 				XFixesSelectionNotifyEvent *xfe =
 					(XFixesSelectionNotifyEvent *) &ev;
 				//printf("app disp did a copy, owner %lu\n", xfe->owner);
@@ -494,35 +701,21 @@ int main(int argc, char **argv) {
 			}
 		}
 
-		// Cursors
-		cursor = XFixesGetCursorImage(appdisp);
-		uint64_t newhash = XXH64(cursor->pixels,
-						cursor->width * cursor->height * sizeof(unsigned long),
-						0);
-		if (cursorhash != newhash) {
-			if (cursorhash)
-				XFreeCursor(vncdisp, xcursor);
-
-			XcursorImage *converted = XcursorImageCreate(cursor->width, cursor->height);
-
-			converted->xhot = cursor->xhot;
-			converted->yhot = cursor->yhot;
-			unsigned i;
-			for (i = 0; i < cursor->width * cursor->height; i++) {
-				converted->pixels[i] = cursor->pixels[i];
-			}
-
-			xcursor = XcursorImageLoadCursor(vncdisp, converted);
-			XDefineCursor(vncdisp, vncroot, xcursor);
+		XFlush(appdisp);
+		XFlush(vncdisp);
 
-			XcursorImageDestroy(converted);
+		if (XPending(appdisp) || XPending(vncdisp))
+			continue;
 
-			cursorhash = newhash;
+		// Sleep until there's input to forward or something to copy.
+		// Copies are held back to the fps limit, input never is.
+		int timeout = IDLE_MS;
+		if (damaged || cursorchanged) {
+			const uint64_t since = msecs() - lastframe;
+			timeout = since < frametime ? frametime - since : 0;
 		}
 
-		XFree(cursor);
-
-		usleep(sleeptime);
+		poll(pfd, 2, timeout);
 	}
 
 	XCloseDisplay(appdisp);
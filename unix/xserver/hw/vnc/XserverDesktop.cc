@@ -24,6 +24,7 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 #include <unistd.h>
 #include <pwd.h>
@@ -34,6 +35,9 @@
 #include <fcntl.h>
 #include <sys/utsname.h>
 
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+
 #include <network/Socket.h>
 #include <rfb/Exception.h>
 #include <rfb/VNCServerST.h>
@@ -69,6 +73,12 @@ BoolParameter freeKeyMappings("FreeKeyMappings",
                               "Automatically free added keyboard mappings "
                               "when there are not enough unused keys to "
                               "map symbols to.", false);
+BoolParameter directScreenAccess("DirectScreenAccess",
+                                 "Read the screen straight from the X "
+                                 "server's memory when it is kept there, "
+                                 "instead of copying every update. The "
+                                 "X server's own software cursor then "
+                                 "ends up in the image", false);
 IntParameter queryConnectTimeout("QueryConnectTimeout",
                                  "Number of seconds to show the "
                                  "Accept Connection dialog before "
@@ -82,7 +92,7 @@ XserverDesktop::XserverDesktop(int screenIndex_,
                                void* fbptr, int stride, const video_encoders::EncoderProbe &probe)
   : screenIndex(screenIndex_),
     server(0), listeners(listeners_),
-    directFbptr(true),
+    directFbptr(true), screenMapped(false),
     queryConnectId(0), queryConnectTimer(this), resizing(false)
 {
   format = pf;
@@ -130,9 +140,11 @@ void XserverDesktop::setFramebuffer(int w, int h, void* fbptr, int stride_)
   height_ = h;
 
   if (!directFbptr) {
+    server->waitPrefetch();
     delete [] data;
     directFbptr = true;
   }
+  screenMapped = false;
 
   if (!fbptr) {
     fbptr = new rdr::U8[w * h * (format.bpp/8)];
@@ -143,6 +155,9 @@ void XserverDesktop::setFramebuffer(int w, int h, void* fbptr, int stride_)
   data = (rdr::U8*)fbptr;
   stride = stride_;
 
+  if (!directFbptr)
+    mapScreen();
+
   vncSetGlueContext(screenIndex);
   layout = ::computeScreenLayout(&outputIdMap);
 
@@ -590,23 +605,140 @@ void XserverDesktop::handleClipboardAnnounceBinary(const unsigned num, const cha
   vncHandleClipboardAnnounceBinary(num, mimes);
 }
 
+// Neighbouring rects on the same lines are fetched as one if the gap
+// between them is this small, as each fetch has a fixed cost in the X
+// server
+static const int grabMergeGap = 64;
+
+static void coalesceRects(const rfb::Region& region,
+                          std::vector<rfb::Rect>* rects)
+{
+  std::vector<rfb::Rect> in;
+  std::vector<rfb::Rect>::const_iterator i;
+
+  region.get_rects(&in);
+
+  rects->clear();
+  for (i = in.begin(); i != in.end(); i++) {
+    if (!rects->empty()) {
+      rfb::Rect& last = rects->back();
+      if ((last.tl.y == i->tl.y) && (last.br.y == i->br.y) &&
+          (i->tl.x - last.br.x <= grabMergeGap)) {
+        last.br.x = i->br.x;
+        continue;
+      }
+    }
+    rects->push_back(*i);
+  }
+}
+
 void XserverDesktop::grabRegion(const rfb::Region& region)
 {
-  if (directFbptr)
+  std::vector<rfb::Rect> rects;
+  std::vector<size_t> offsets;
+  std::vector<int> strides;
+  size_t bufferSize;
+  bool wasMapped;
+
+  // Xvnc hands us its framebuffer
+  if (directFbptr && !screenMapped)
     return;
 
-  std::vector<rfb::Rect> rects;
-  std::vector<rfb::Rect>::iterator i;
-  region.get_rects(&rects);
-  for (i = rects.begin(); i != rects.end(); i++) {
-    rdr::U8 *buffer;
-    int stride;
-
-    buffer = getBufferRW(*i, &stride);
-    vncGetScreenImage(screenIndex, i->tl.x, i->tl.y, i->width(), i->height(),
-                      (char*)buffer, stride * format.bpp/8);
-    commitBufferRW(*i);
+  wasMapped = screenMapped;
+  if (mapScreen())
+    return;
+
+  // Our copy was only just created, so it needs everything
+  if (wasMapped)
+    coalesceRects(getRect(), &rects);
+  else
+    coalesceRects(region, &rects);
+
+  // GetImage() can't write with our stride, so each rect is fetched in
+  // one call into a packed buffer and then spread out into the
+  // framebuffer. The X server isn't thread safe, so only the second
+  // part can be done in parallel.
+  offsets.resize(rects.size());
+  strides.resize(rects.size());
+  bufferSize = 0;
+  for (size_t i = 0; i < rects.size(); i++) {
+    offsets[i] = bufferSize;
+    strides[i] = vncGetScreenImageStride(screenIndex, rects[i].width());
+    bufferSize += (size_t)strides[i] * rects[i].height();
   }
+
+  if (grabBuffer.size() < bufferSize)
+    grabBuffer.resize(bufferSize);
+
+  for (size_t i = 0; i < rects.size(); i++) {
+    const rfb::Rect& r = rects[i];
+    vncGetScreenImage(screenIndex, r.tl.x, r.tl.y, r.width(), r.height(),
+                      (char*)&grabBuffer[offsets[i]], strides[i]);
+  }
+
+  tbb::parallel_for(tbb::blocked_range<size_t>(0, rects.size()),
+                    [&](const tbb::blocked_range<size_t>& range) {
+    for (size_t i = range.begin(); i != range.end(); i++) {
+      const rfb::Rect& r = rects[i];
+      const rdr::U8* src;
+      rdr::U8* dst;
+      int stride;
+
+      src = &grabBuffer[offsets[i]];
+      dst = getBufferRW(r, &stride);
+      for (int y = 0; y < r.height(); y++) {
+        memcpy(dst, src, r.width() * (format.bpp/8));
+        src += strides[i];
+        dst += stride * (format.bpp/8);
+      }
+      commitBufferRW(r);
+    }
+  });
+}
+
+// mapScreen() points the framebuffer straight at the X server's screen
+// pixmap if it can be read directly, and otherwise makes sure we have our
+// own copy to fetch updates into. Returns true if the framebuffer is the
+// screen pixmap.
+
+bool XserverDesktop::mapScreen()
+{
+  void* fbptr;
+  int strideBytes;
+
+  fbptr = NULL;
+  if (directScreenAccess)
+    fbptr = vncGetScreenBits(screenIndex, width_, height_, format.bpp,
+                             &strideBytes);
+
+  if (fbptr != NULL) {
+    if (!screenMapped)
+      vlog.info("Reading screen %d directly from the X server", screenIndex);
+
+    if (!directFbptr) {
+      // Background encoding may still be reading our copy
+      server->waitPrefetch();
+      delete [] data;
+    }
+
+    data = (rdr::U8*)fbptr;
+    stride = strideBytes / (format.bpp/8);
+    directFbptr = true;
+    screenMapped = true;
+
+    return true;
+  }
+
+  if (screenMapped) {
+    vlog.info("Copying updates from screen %d", screenIndex);
+
+    data = new rdr::U8[width_ * height_ * (format.bpp/8)];
+    stride = width_;
+    directFbptr = false;
+    screenMapped = false;
+  }
+
+  return false;
 }
 
 void XserverDesktop::keyEvent(rdr::U32 keysym, rdr::U32 keycode, bool down)
@@ -28,6 +28,7 @@
 #endif
 
 #include <map>
+#include <vector>
 
 #include <stdint.h>
 
@@ -126,12 +127,17 @@ protected:
 
   virtual bool handleTimeout(rfb::Timer* t);
 
+  bool mapScreen();
+
 private:
 
   int screenIndex;
   rfb::VNCServerST* server;
   std::list<network::SocketListener*> listeners;
   bool directFbptr;
+  // The framebuffer is the X server's screen pixmap, which can move
+  bool screenMapped;
+  std::vector<rdr::U8> grabBuffer;
 
   uint32_t queryConnectId;
   network::Socket* queryConnectSocket;
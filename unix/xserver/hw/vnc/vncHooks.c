@@ -29,6 +29,8 @@
 #include "xorg-version.h"
 
 #include "scrnintstr.h"
+#include "pixmapstr.h"
+#include "servermd.h"
 #include "windowstr.h"
 #include "cursorstr.h"
 #include "gcstruct.h"
@@ -416,28 +418,81 @@ void vncGetScreenImage(int scrIdx, int x, int y, int width, int height,
   ScreenPtr pScreen = screenInfo.screens[scrIdx];
   vncHooksScreenPtr vncHooksScreen = vncHooksScreenPrivate(pScreen);
 
+  DrawablePtr pDrawable;
   int i;
 
-  vncHooksScreen->ignoreHooks++;
-
-  // We do one line at a time since GetImage() cannot handle stride
-  for (i = y; i < y + height; i++) {
-    DrawablePtr pDrawable;
 #if XORG < 19
-    pDrawable = (DrawablePtr) WindowTable[scrIdx];
+  pDrawable = (DrawablePtr) WindowTable[scrIdx];
 #else
-    pDrawable = (DrawablePtr) pScreen->root;
+  pDrawable = (DrawablePtr) pScreen->root;
 #endif
 
-    (*pScreen->GetImage) (pDrawable, x, i, width, 1,
+  vncHooksScreen->ignoreHooks++;
+
+  // GetImage() cannot handle stride, so unless the buffer happens to be
+  // laid out the way GetImage() wants we have to do one line at a time.
+  // That is a lot more expensive if the server has to fetch the screen
+  // from the GPU for each call.
+  if (strideBytes == vncGetScreenImageStride(scrIdx, width)) {
+    (*pScreen->GetImage) (pDrawable, x, y, width, height,
                           ZPixmap, (unsigned long)~0L, buffer);
+  } else {
+    for (i = y; i < y + height; i++) {
+      (*pScreen->GetImage) (pDrawable, x, i, width, 1,
+                            ZPixmap, (unsigned long)~0L, buffer);
 
-    buffer += strideBytes;
+      buffer += strideBytes;
+    }
   }
 
   vncHooksScreen->ignoreHooks--;
 }
 
+// vncGetScreenImageStride() gives the line length in bytes that
+// vncGetScreenImage() can fill in a single call
+
+int vncGetScreenImageStride(int scrIdx, int width)
+{
+  ScreenPtr pScreen = screenInfo.screens[scrIdx];
+
+  return PixmapBytePad(width, pScreen->rootDepth);
+}
+
+// vncGetScreenBits() returns the screen pixmap's own storage if the
+// server keeps it in ordinary memory that we can read at any time, or
+// NULL if the screen has to be fetched with vncGetScreenImage(). The
+// pointer stays valid until the screen is resized or the driver moves
+// the pixmap, so it needs to be asked for again before each use.
+
+void *vncGetScreenBits(int scrIdx, int width, int height, int bpp,
+                       int *strideBytes)
+{
+  ScreenPtr pScreen = screenInfo.screens[scrIdx];
+  PixmapPtr pPixmap;
+
+  // Not there yet during server startup
+  pPixmap = (*pScreen->GetScreenPixmap) (pScreen);
+  if (pPixmap == NULL)
+    return NULL;
+
+  // Pixmaps that live on the GPU only get a CPU pointer while the
+  // server itself is accessing them
+  if (pPixmap->devPrivate.ptr == NULL)
+    return NULL;
+
+  if ((pPixmap->drawable.bitsPerPixel != bpp) ||
+      (pPixmap->drawable.width < width) ||
+      (pPixmap->drawable.height < height))
+    return NULL;
+
+  if ((pPixmap->devKind <= 0) || (pPixmap->devKind % (bpp/8) != 0))
+    return NULL;
+
+  *strideBytes = pPixmap->devKind;
+
+  return pPixmap->devPrivate.ptr;
+}
+
 /////////////////////////////////////////////////////////////////////////////
 //
 // Helper functions
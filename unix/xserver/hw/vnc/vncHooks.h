@@ -27,6 +27,10 @@ int vncHooksInit(int scrIdx);
 
 void vncGetScreenImage(int scrIdx, int x, int y, int width, int height,
                        char *buffer, int strideBytes);
+int vncGetScreenImageStride(int scrIdx, int width);
+
+void *vncGetScreenBits(int scrIdx, int width, int height, int bpp,
+                       int *strideBytes);
 
 #ifdef __cplusplus
 }